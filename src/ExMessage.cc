@@ -0,0 +1,357 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ExMessage.h"
+
+#include <algorithm>
+
+static const ExMessageLayout kExMessageLayouts[] = {
+  // cmd,                       name,                          min len, max len
+  {CMD_REGISTER_WORKER,        "CMD_REGISTER_WORKER",         EX_REGISTER_STRINGS + 2, 0xFFFFu},
+  {CMD_SUBMIT_SHARE,           "CMD_SUBMIT_SHARE",            EX_SUBMIT_TIME,          EX_SUBMIT_TIME},
+  {CMD_SUBMIT_SHARE_WITH_TIME, "CMD_SUBMIT_SHARE_WITH_TIME",  EX_SUBMIT_TIME + 4,      EX_SUBMIT_TIME + 4},
+  {CMD_UNREGISTER_WORKER,      "CMD_UNREGISTER_WORKER",       EX_UNREGISTER_SESSION_ID + 2, EX_UNREGISTER_SESSION_ID + 2},
+  {CMD_MINING_SET_DIFF,        "CMD_MINING_SET_DIFF",         EX_SET_DIFF_SESSION_IDS, 0xFFFFu},
+  {CMD_PING,                   "CMD_PING",                    EX_PING_ID + 4,          EX_PING_ID + 4},
+  {CMD_PONG,                   "CMD_PONG",                    EX_PING_ID + 4,          EX_PING_ID + 4},
+  // a group of a share: job id, count, and the share of 10 bytes at least
+  {CMD_SUBMIT_SHARES_BATCH,    "CMD_SUBMIT_SHARES_BATCH",     EX_BATCH_GROUPS + 12,    0xFFFFu}
+};
+
+const ExMessageLayout *findExMessageLayout(uint8_t cmd) {
+  const size_t n = sizeof(kExMessageLayouts) / sizeof(kExMessageLayouts[0]);
+  for (size_t i = 0; i < n; i++) {
+    if (kExMessageLayouts[i].cmd_ == cmd)
+      return &kExMessageLayouts[i];
+  }
+  return NULL;
+}
+
+
+/////////////////////////////// ExMessageWriter ///////////////////////////////
+ExMessageWriter::ExMessageWriter(struct evbuffer *buf, uint8_t cmd, uint16_t len)
+: buf_(buf), begin_(NULL), p_(NULL), end_(NULL)
+{
+  assert(len >= EX_MESSAGE_HEADER_LEN);
+
+  // one vector, the space is contiguous
+  if (evbuffer_reserve_space(buf_, len, &vec_, 1) != 1)
+    return;
+
+  begin_ = p_ = (uint8_t *)vec_.iov_base;
+  end_   = begin_ + len;
+
+  *p_++ = CMD_MAGIC_NUMBER;
+  *p_++ = cmd;
+  putUint16(len);
+}
+
+bool ExMessageWriter::commit() {
+  if (begin_ == NULL)
+    return false;
+
+  assert(p_ == end_);
+  vec_.iov_len = end_ - begin_;
+  return evbuffer_commit_space(buf_, &vec_, 1) == 0;
+}
+
+
+/////////////////////////////// ExMessageReader ///////////////////////////////
+bool ExMessageReader::isValid() const {
+  if (len_ < EX_MESSAGE_HEADER_LEN || data_[0] != CMD_MAGIC_NUMBER)
+    return false;
+
+  const ExMessageLayout *layout = findExMessageLayout(getCmd());
+  if (layout == NULL)
+    return false;
+
+  const uint16_t len = getLen();
+  return len == len_ && len >= layout->minLen_ && len <= layout->maxLen_;
+}
+
+bool ExMessageReader::getUint8(size_t offset, uint8_t *v) const {
+  if (offset + 1 > len_)
+    return false;
+  *v = data_[offset];
+  return true;
+}
+
+bool ExMessageReader::getUint16(size_t offset, uint16_t *v) const {
+  if (offset + 2 > len_)
+    return false;
+  *v = readUint16LE(data_ + offset);
+  return true;
+}
+
+bool ExMessageReader::getUint32(size_t offset, uint32_t *v) const {
+  if (offset + 4 > len_)
+    return false;
+  *v = readUint32LE(data_ + offset);
+  return true;
+}
+
+bool ExMessageReader::getVarint(size_t offset, uint32_t *v, size_t *next) const {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (offset >= len_)
+      return false;
+    const uint8_t b = data_[offset++];
+    value |= (uint32_t)(b & 0x7Fu) << shift;
+    if ((b & 0x80u) == 0) {
+      *v = value;
+      *next = offset;
+      return true;
+    }
+  }
+  return false;  // more than 5 bytes
+}
+
+bool ExMessageReader::getString(size_t offset, StringRef *s, size_t *next) const {
+  if (offset >= len_)
+    return false;
+
+  const char *begin = (const char *)data_ + offset;
+  const char *end = (const char *)memchr(begin, '\0', len_ - offset);
+  if (end == NULL)
+    return false;
+
+  *s = StringRef(begin, end - begin);
+  *next = offset + (end - begin) + 1;
+  return true;
+}
+
+
+////////////////////////////////// the frames /////////////////////////////////
+bool ExSubmitShare::encode(struct evbuffer *buf) const {
+  ExMessageWriter w(buf,
+                    hasTime_ ? CMD_SUBMIT_SHARE_WITH_TIME : CMD_SUBMIT_SHARE,
+                    hasTime_ ? EX_SUBMIT_TIME + 4 : EX_SUBMIT_TIME);
+  if (!w.isValid())
+    return false;
+
+  w.putUint8 (jobId_);
+  w.putUint16(sessionId_);
+  w.putUint32(extraNonce2_);
+  w.putUint32(nonce_);
+  if (hasTime_)
+    w.putUint32(time_);
+  return w.commit();
+}
+
+bool ExSubmitShare::decode(const ExMessageReader &r) {
+  if (!r.isValid() ||
+      (r.getCmd() != CMD_SUBMIT_SHARE && r.getCmd() != CMD_SUBMIT_SHARE_WITH_TIME))
+    return false;
+
+  hasTime_ = (r.getCmd() == CMD_SUBMIT_SHARE_WITH_TIME);
+  time_ = 0;
+  return r.getUint8 (EX_SUBMIT_JOB_ID,       &jobId_) &&
+         r.getUint16(EX_SUBMIT_SESSION_ID,   &sessionId_) &&
+         r.getUint32(EX_SUBMIT_EXTRA_NONCE2, &extraNonce2_) &&
+         r.getUint32(EX_SUBMIT_NONCE,        &nonce_) &&
+         (!hasTime_ || r.getUint32(EX_SUBMIT_TIME, &time_));
+}
+
+static bool isBatchedShareLess(const ExBatchedShare &a, const ExBatchedShare &b) {
+  if (a.jobId_ != b.jobId_)
+    return a.jobId_ < b.jobId_;
+  return a.sessionId_ < b.sessionId_;
+}
+
+bool ExSubmitSharesBatch::encode(struct evbuffer *buf, vector<ExBatchedShare> &shares) {
+  if (shares.empty() || shares.size() > kMaxShares_)
+    return false;
+  std::stable_sort(shares.begin(), shares.end(), isBatchedShareLess);
+
+  // the length first, then write it in place
+  size_t len = EX_BATCH_GROUPS;
+  for (size_t i = 0; i < shares.size(); ) {
+    size_t j = i;
+    uint16_t prevSessionId = 0;
+    for (; j < shares.size() && shares[j].jobId_ == shares[i].jobId_; j++) {
+      len += getVarintLen(shares[j].sessionId_ - prevSessionId) + 8 +
+             getVarintLen(zigzag(shares[j].timeOffset_));
+      prevSessionId = shares[j].sessionId_;
+    }
+    len += 1 + getVarintLen((uint32_t)(j - i));
+    i = j;
+  }
+
+  ExMessageWriter w(buf, CMD_SUBMIT_SHARES_BATCH, (uint16_t)len);
+  if (!w.isValid())
+    return false;
+
+  for (size_t i = 0; i < shares.size(); ) {
+    size_t j = i;
+    while (j < shares.size() && shares[j].jobId_ == shares[i].jobId_) {
+      j++;
+    }
+    w.putUint8(shares[i].jobId_);
+    w.putVarint((uint32_t)(j - i));
+
+    uint16_t prevSessionId = 0;
+    for (; i < j; i++) {
+      const ExBatchedShare &s = shares[i];
+      w.putVarint(s.sessionId_ - prevSessionId);
+      w.putUint32(s.extraNonce2_);
+      w.putUint32(s.nonce_);
+      w.putVarint(zigzag(s.timeOffset_));
+      prevSessionId = s.sessionId_;
+    }
+  }
+  return w.commit();
+}
+
+static bool decodeShareGroups(const ExMessageReader &r,
+                              vector<ExBatchedShare> *shares) {
+  size_t offset = EX_BATCH_GROUPS;
+  while (offset < r.getLen()) {
+    uint8_t jobId = 0;
+    uint32_t count = 0;
+    if (!r.getUint8(offset, &jobId) ||
+        !r.getVarint(offset + 1, &count, &offset) || count == 0)
+      return false;
+
+    uint32_t sessionId = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      ExBatchedShare s;
+      uint32_t delta = 0, time = 0;
+      if (!r.getVarint(offset, &delta, &offset) ||
+          !r.getUint32(offset,     &s.extraNonce2_) ||
+          !r.getUint32(offset + 4, &s.nonce_) ||
+          !r.getVarint(offset + 8, &time, &offset))
+        return false;
+
+      sessionId += delta;
+      if (sessionId > 0xFFFFu)
+        return false;
+      s.jobId_      = jobId;
+      s.sessionId_  = (uint16_t)sessionId;
+      s.timeOffset_ = ExSubmitSharesBatch::unzigzag(time);
+      shares->push_back(s);
+    }
+  }
+  return true;
+}
+
+bool ExSubmitSharesBatch::decode(const ExMessageReader &r,
+                                 vector<ExBatchedShare> *shares) {
+  if (!r.isValid() || r.getCmd() != CMD_SUBMIT_SHARES_BATCH)
+    return false;
+
+  const size_t size = shares->size();
+  if (!decodeShareGroups(r, shares)) {
+    shares->resize(size);
+    return false;
+  }
+  return true;
+}
+
+bool ExRegisterWorker::encode(struct evbuffer *buf) const {
+  const size_t len = EX_REGISTER_STRINGS + minerAgent_.size_ + 1 +
+                     workerName_.size_ + 1;
+  if (len > 0xFFFFu)
+    return false;
+
+  ExMessageWriter w(buf, CMD_REGISTER_WORKER, (uint16_t)len);
+  if (!w.isValid())
+    return false;
+
+  w.putUint16(sessionId_);
+  w.putString(minerAgent_.data_, minerAgent_.size_);
+  w.putString(workerName_.data_, workerName_.size_);
+  return w.commit();
+}
+
+bool ExRegisterWorker::decode(const ExMessageReader &r) {
+  if (!r.isValid() || r.getCmd() != CMD_REGISTER_WORKER)
+    return false;
+
+  size_t next = 0;
+  return r.getUint16(EX_REGISTER_SESSION_ID, &sessionId_) &&
+         r.getString(EX_REGISTER_STRINGS, &minerAgent_, &next) &&
+         r.getString(next, &workerName_, &next) &&
+         next == r.getLen();
+}
+
+bool ExUnregisterWorker::encode(struct evbuffer *buf) const {
+  ExMessageWriter w(buf, CMD_UNREGISTER_WORKER, EX_UNREGISTER_SESSION_ID + 2);
+  if (!w.isValid())
+    return false;
+
+  w.putUint16(sessionId_);
+  return w.commit();
+}
+
+bool ExUnregisterWorker::decode(const ExMessageReader &r) {
+  if (!r.isValid() || r.getCmd() != CMD_UNREGISTER_WORKER)
+    return false;
+
+  return r.getUint16(EX_UNREGISTER_SESSION_ID, &sessionId_);
+}
+
+bool ExMiningSetDiff::encode(struct evbuffer *buf, uint8_t diff2Exp,
+                             const uint16_t *sessionIds, uint16_t count) {
+  const size_t len = EX_SET_DIFF_SESSION_IDS + (size_t)count * 2;
+  if (len > 0xFFFFu)
+    return false;
+
+  ExMessageWriter w(buf, CMD_MINING_SET_DIFF, (uint16_t)len);
+  if (!w.isValid())
+    return false;
+
+  w.putUint8 (diff2Exp);
+  w.putUint16(count);
+  for (uint16_t i = 0; i < count; i++) {
+    w.putUint16(sessionIds[i]);
+  }
+  return w.commit();
+}
+
+bool ExMiningSetDiff::decode(const ExMessageReader &r) {
+  if (!r.isValid() || r.getCmd() != CMD_MINING_SET_DIFF)
+    return false;
+
+  if (!r.getUint8 (EX_SET_DIFF_2EXP,  &diff2Exp_) ||
+      !r.getUint16(EX_SET_DIFF_COUNT, &count_))
+    return false;
+
+  // the session ids must be all there
+  if (EX_SET_DIFF_SESSION_IDS + (size_t)count_ * 2 != r.getLen())
+    return false;
+
+  sessionIds_ = r.data() + EX_SET_DIFF_SESSION_IDS;
+  return true;
+}
+
+bool ExPing::encode(struct evbuffer *buf) const {
+  ExMessageWriter w(buf, isPong_ ? CMD_PONG : CMD_PING, EX_PING_ID + 4);
+  if (!w.isValid())
+    return false;
+
+  w.putUint32(id_);
+  return w.commit();
+}
+
+bool ExPing::decode(const ExMessageReader &r) {
+  if (!r.isValid() || (r.getCmd() != CMD_PING && r.getCmd() != CMD_PONG))
+    return false;
+
+  isPong_ = (r.getCmd() == CMD_PONG);
+  return r.getUint32(EX_PING_ID, &id_);
+}
@@ -0,0 +1,316 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EX_MESSAGE_H_
+#define EX_MESSAGE_H_
+
+#include "Utils.h"
+
+#include <event2/buffer.h>
+
+
+#define CMD_MAGIC_NUMBER      0x7Fu
+// types
+#define CMD_REGISTER_WORKER   0x01u             // Agent -> Pool
+#define CMD_SUBMIT_SHARE      0x02u             // Agent -> Pool, without block time
+#define CMD_SUBMIT_SHARE_WITH_TIME  0x03u       // Agent -> Pool
+#define CMD_UNREGISTER_WORKER 0x04u             // Agent -> Pool
+#define CMD_MINING_SET_DIFF   0x05u             // Pool  -> Agent
+#define CMD_PING              0x06u             // Agent -> Pool
+#define CMD_PONG              0x07u             // Pool  -> Agent, echoes the ping
+#define CMD_SUBMIT_SHARES_BATCH     0x08u       // Agent -> Pool, if negotiated
+
+// the extension of mining.configure (BIP 310) for CMD_SUBMIT_SHARES_BATCH,
+// the pool answers {"shares-batch": true} if it supports the frame
+#define EX_SHARES_BATCH_EXTENSION   "shares-batch"
+
+//
+// all the ex-messages start with the same header, the integers are little
+// endian and not aligned:
+//
+// | magic_number(1) | cmd(1) | len (2) | ...
+//
+#define EX_MESSAGE_HEADER_LEN 4u
+
+//
+// the layouts of the frames, offsets from the beginning of the frame
+//
+
+// CMD_REGISTER_WORKER
+// | header(4) | session_id(2) | clientAgent | '\0' | worker_name | '\0' |
+#define EX_REGISTER_SESSION_ID  4u
+#define EX_REGISTER_STRINGS     6u
+
+// CMD_SUBMIT_SHARE / CMD_SUBMIT_SHARE_WITH_TIME
+// | header(4) | jobId(1) | session_id(2) | extra_nonce2(4) | nNonce(4) | [nTime(4) |]
+#define EX_SUBMIT_JOB_ID        4u
+#define EX_SUBMIT_SESSION_ID    5u
+#define EX_SUBMIT_EXTRA_NONCE2  7u
+#define EX_SUBMIT_NONCE        11u
+#define EX_SUBMIT_TIME         15u
+
+// CMD_SUBMIT_SHARES_BATCH, the shares grouped by the job id, the session ids
+// are ascending in a group. the nTime offset is from the job's time, which
+// the pool knows by the job id like CMD_SUBMIT_SHARE.
+// | header(4) | group | group | ... |
+//   group: | jobId(1) | count(varint) | share | share | ... |
+//   share: | session_id delta(varint) | extra_nonce2(4) | nNonce(4) | nTime offset(zigzag varint) |
+// varint: 7 bits per byte, the lowest first, the high bit means more
+#define EX_BATCH_GROUPS         4u
+
+// CMD_UNREGISTER_WORKER
+// | header(4) | session_id(2) |
+#define EX_UNREGISTER_SESSION_ID 4u
+
+// CMD_MINING_SET_DIFF
+// | header(4) | diff_2_exp(1) | count(2) | session_id (2) ... |
+#define EX_SET_DIFF_2EXP        4u
+#define EX_SET_DIFF_COUNT       5u
+#define EX_SET_DIFF_SESSION_IDS 7u
+
+// CMD_PING / CMD_PONG
+// | header(4) | id(4) |
+#define EX_PING_ID              4u
+
+
+/////////////////////////////// ExMessageLayout ///////////////////////////////
+// the valid length range of each kind of frame
+struct ExMessageLayout {
+  uint8_t  cmd_;
+  const char *name_;
+  uint16_t minLen_;
+  uint16_t maxLen_;
+};
+
+// NULL if the cmd is unknown
+const ExMessageLayout *findExMessageLayout(uint8_t cmd);
+
+
+//////////////////////////////// little endian ////////////////////////////////
+inline void writeUint16LE(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)(v);
+  p[1] = (uint8_t)(v >> 8);
+}
+
+inline void writeUint32LE(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v);
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+inline uint16_t readUint16LE(const uint8_t *p) {
+  return (uint16_t)(p[0] | ((uint16_t)p[1] << 8));
+}
+
+inline uint32_t readUint32LE(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+         ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/////////////////////////////// ExMessageWriter ///////////////////////////////
+//
+// writes a frame straight into the reserved space of the evbuffer, nothing
+// is added to the evbuffer until commit(). the caller MUST put exactly the
+// declared length.
+//
+class ExMessageWriter {
+  struct evbuffer *buf_;
+  struct evbuffer_iovec vec_;
+  uint8_t *begin_;
+  uint8_t *p_;
+  uint8_t *end_;
+
+public:
+  ExMessageWriter(struct evbuffer *buf, uint8_t cmd, uint16_t len);
+
+  inline bool isValid() const { return begin_ != NULL; }
+
+  inline void putUint8(uint8_t v) {
+    assert(p_ + 1 <= end_);
+    *p_++ = v;
+  }
+  inline void putUint16(uint16_t v) {
+    assert(p_ + 2 <= end_);
+    writeUint16LE(p_, v);
+    p_ += 2;
+  }
+  inline void putUint32(uint32_t v) {
+    assert(p_ + 4 <= end_);
+    writeUint32LE(p_, v);
+    p_ += 4;
+  }
+  inline void putVarint(uint32_t v) {
+    while (v >= 0x80u) {
+      assert(p_ + 1 <= end_);
+      *p_++ = (uint8_t)(v | 0x80u);
+      v >>= 7;
+    }
+    assert(p_ + 1 <= end_);
+    *p_++ = (uint8_t)v;
+  }
+  // with the terminating '\0'
+  inline void putString(const char *s, size_t len) {
+    assert(p_ + len + 1 <= end_);
+    memcpy(p_, s, len);
+    p_ += len;
+    *p_++ = '\0';
+  }
+
+  bool commit();
+};
+
+
+/////////////////////////////// ExMessageReader ///////////////////////////////
+//
+// reads the fields in place, every read is bounds checked. the data MUST
+// outlive the reader.
+//
+class ExMessageReader {
+  const uint8_t *data_;
+  size_t len_;
+
+public:
+  ExMessageReader(const uint8_t *data, size_t len): data_(data), len_(len) {}
+
+  // the header and the length match the layout table
+  bool isValid() const;
+
+  inline const uint8_t *data() const { return data_; }
+  inline uint8_t  getCmd() const { return data_[1]; }
+  inline uint16_t getLen() const { return readUint16LE(data_ + 2); }
+
+  bool getUint8 (size_t offset, uint8_t  *v) const;
+  bool getUint16(size_t offset, uint16_t *v) const;
+  bool getUint32(size_t offset, uint32_t *v) const;
+  // *next is the offset after it
+  bool getVarint(size_t offset, uint32_t *v, size_t *next) const;
+  // a '\0' terminated string, *next is the offset after the '\0'
+  bool getString(size_t offset, StringRef *s, size_t *next) const;
+};
+
+
+////////////////////////////////// the frames /////////////////////////////////
+class ExSubmitShare {
+public:
+  uint8_t  jobId_;
+  uint16_t sessionId_;
+  uint32_t extraNonce2_;
+  uint32_t nonce_;
+  bool     hasTime_;
+  uint32_t time_;
+
+  ExSubmitShare(): jobId_(0), sessionId_(0), extraNonce2_(0), nonce_(0),
+  hasTime_(false), time_(0) {}
+
+  bool encode(struct evbuffer *buf) const;
+  bool decode(const ExMessageReader &r);
+};
+
+// a share of CMD_SUBMIT_SHARES_BATCH
+class ExBatchedShare {
+public:
+  uint8_t  jobId_;
+  uint16_t sessionId_;
+  uint32_t extraNonce2_;
+  uint32_t nonce_;
+  int32_t  timeOffset_;  // nTime - the job's time
+
+  ExBatchedShare(): jobId_(0), sessionId_(0), extraNonce2_(0), nonce_(0),
+  timeOffset_(0) {}
+};
+
+class ExSubmitSharesBatch {
+public:
+  // at most, so a frame is always below 64 KB
+  static const size_t kMaxShares_ = 2048;
+
+  inline static size_t getVarintLen(uint32_t v) {
+    size_t len = 1;
+    for (; v >= 0x80u; v >>= 7) {
+      len++;
+    }
+    return len;
+  }
+  inline static uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+  }
+  inline static int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+  }
+
+  // the shares are sorted by (job id, session id) in place, the order of
+  // the shares of a session is kept
+  static bool encode(struct evbuffer *buf, vector<ExBatchedShare> &shares);
+  // the shares are appended, none of them if it's false
+  static bool decode(const ExMessageReader &r, vector<ExBatchedShare> *shares);
+};
+
+class ExRegisterWorker {
+public:
+  uint16_t  sessionId_;
+  StringRef minerAgent_;
+  StringRef workerName_;
+
+  ExRegisterWorker(): sessionId_(0) {}
+
+  bool encode(struct evbuffer *buf) const;
+  bool decode(const ExMessageReader &r);
+};
+
+class ExUnregisterWorker {
+public:
+  uint16_t sessionId_;
+
+  ExUnregisterWorker(): sessionId_(0) {}
+
+  bool encode(struct evbuffer *buf) const;
+  bool decode(const ExMessageReader &r);
+};
+
+class ExMiningSetDiff {
+public:
+  uint8_t  diff2Exp_;
+  uint16_t count_;
+  const uint8_t *sessionIds_;  // in place, use getSessionId()
+
+  ExMiningSetDiff(): diff2Exp_(0), count_(0), sessionIds_(NULL) {}
+
+  inline uint16_t getSessionId(uint16_t i) const {
+    assert(i < count_);
+    return readUint16LE(sessionIds_ + i * 2);
+  }
+
+  static bool encode(struct evbuffer *buf, uint8_t diff2Exp,
+                     const uint16_t *sessionIds, uint16_t count);
+  bool decode(const ExMessageReader &r);
+};
+
+class ExPing {
+public:
+  bool     isPong_;
+  uint32_t id_;
+
+  ExPing(): isPong_(false), id_(0) {}
+
+  bool encode(struct evbuffer *buf) const;
+  bool decode(const ExMessageReader &r);
+};
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Handoff.h"
+#include "ExMessage.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+ #include <errno.h>
+ #include <sys/socket.h>
+ #include <sys/uio.h>
+#endif
+
+
+/////////////////////////////////// HandoffWriter //////////////////////////////
+void HandoffWriter::putUint8(uint8_t v) {
+  data_.push_back((char)v);
+}
+
+void HandoffWriter::putUint16(uint16_t v) {
+  uint8_t p[2];
+  writeUint16LE(p, v);
+  data_.append((const char *)p, 2);
+}
+
+void HandoffWriter::putUint32(uint32_t v) {
+  uint8_t p[4];
+  writeUint32LE(p, v);
+  data_.append((const char *)p, 4);
+}
+
+void HandoffWriter::putUint64(uint64_t v) {
+  putUint32((uint32_t)v);
+  putUint32((uint32_t)(v >> 32));
+}
+
+void HandoffWriter::putString(const char *data, size_t len) {
+  putUint32((uint32_t)len);
+  data_.append(data, len);
+}
+
+void HandoffWriter::putEvbuffers(struct evbuffer *buf1, struct evbuffer *buf2) {
+  const size_t len1 = (buf1 != NULL) ? evbuffer_get_length(buf1) : 0;
+  const size_t len2 = (buf2 != NULL) ? evbuffer_get_length(buf2) : 0;
+  putUint32((uint32_t)(len1 + len2));
+
+  const size_t pos = data_.size();
+  data_.resize(pos + len1 + len2);
+  if (len1 > 0)
+    evbuffer_copyout(buf1, &data_[pos], len1);
+  if (len2 > 0)
+    evbuffer_copyout(buf2, &data_[pos + len1], len2);
+}
+
+void HandoffWriter::putFd(evutil_socket_t fd) {
+  putUint32((uint32_t)fds_.size());
+  fds_.push_back(fd);
+}
+
+
+/////////////////////////////////// HandoffReader //////////////////////////////
+HandoffReader::HandoffReader(const string &data, vector<evutil_socket_t> &fds)
+: data_(data), fds_(fds), pos_(0), isValid_(true) {
+}
+
+HandoffReader::~HandoffReader() {
+  for (size_t i = 0; i < fds_.size(); i++) {
+    if (fds_[i] != -1) {
+      evutil_closesocket(fds_[i]);
+      fds_[i] = -1;
+    }
+  }
+}
+
+const uint8_t *HandoffReader::take(size_t len) {
+  if (!isValid_ || data_.size() - pos_ < len) {
+    isValid_ = false;
+    return NULL;
+  }
+  const uint8_t *p = (const uint8_t *)data_.data() + pos_;
+  pos_ += len;
+  return p;
+}
+
+uint8_t HandoffReader::getUint8() {
+  const uint8_t *p = take(1);
+  return p ? p[0] : 0;
+}
+
+uint16_t HandoffReader::getUint16() {
+  const uint8_t *p = take(2);
+  return p ? readUint16LE(p) : 0;
+}
+
+uint32_t HandoffReader::getUint32() {
+  const uint8_t *p = take(4);
+  return p ? readUint32LE(p) : 0;
+}
+
+uint64_t HandoffReader::getUint64() {
+  const uint64_t low = getUint32();
+  return low | ((uint64_t)getUint32() << 32);
+}
+
+string HandoffReader::getString() {
+  const uint32_t len = getUint32();
+  const uint8_t *p = take(len);
+  return p ? string((const char *)p, len) : string();
+}
+
+evutil_socket_t HandoffReader::getFd() {
+  const uint32_t idx = getUint32();
+  if (!isValid_ || idx >= fds_.size() || fds_[idx] == -1) {
+    isValid_ = false;
+    return -1;
+  }
+  const evutil_socket_t fd = fds_[idx];
+  fds_[idx] = -1;
+  return fd;
+}
+
+
+#ifndef _WIN32
+// SCM_MAX_FD of Linux is 253
+static const size_t kMaxFdsPerMsg = 128;
+
+static bool sendAll(evutil_socket_t sock, const char *p, size_t len) {
+  while (len > 0) {
+    const ssize_t n = send(sock, p, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p   += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool recvAll(evutil_socket_t sock, char *p, size_t len) {
+  while (len > 0) {
+    const ssize_t n = recv(sock, p, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p   += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool sendHandoff(evutil_socket_t sock, const string &data,
+                 const vector<evutil_socket_t> &fds) {
+  uint8_t header[8];
+  writeUint32LE(header,     (uint32_t)data.size());
+  writeUint32LE(header + 4, (uint32_t)fds.size());
+  if (!sendAll(sock, (const char *)header, sizeof(header)) ||
+      !sendAll(sock, data.data(), data.size()))
+    return false;
+
+  vector<char> control(CMSG_SPACE(sizeof(int) * kMaxFdsPerMsg));
+  for (size_t i = 0; i < fds.size(); i += kMaxFdsPerMsg) {
+    const size_t count = std::min(kMaxFdsPerMsg, fds.size() - i);
+
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len  = 1;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = &control[0];
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * count);
+    for (size_t j = 0; j < count; j++) {
+      const int fd = (int)fds[i + j];
+      memcpy(CMSG_DATA(cmsg) + sizeof(int) * j, &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+      n = sendmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) {
+      LOG(ERROR) << "handoff: send fds failure, errno: " << errno << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool recvHandoff(evutil_socket_t sock, string *data,
+                 vector<evutil_socket_t> *fds) {
+  uint8_t header[8];
+  if (!recvAll(sock, (char *)header, sizeof(header)))
+    return false;
+  const uint32_t dataLen = readUint32LE(header);
+  const uint32_t fdCount = readUint32LE(header + 4);
+
+  data->resize(dataLen);
+  if (dataLen > 0 && !recvAll(sock, &(*data)[0], dataLen))
+    return false;
+
+  vector<char> control(CMSG_SPACE(sizeof(int) * kMaxFdsPerMsg));
+  while (fds->size() < fdCount) {
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len  = 1;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = &control[0];
+    msg.msg_controllen = control.size();
+
+    ssize_t n;
+    do {
+      n = recvmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1 || (msg.msg_flags & MSG_CTRUNC)) {
+      LOG(ERROR) << "handoff: receive fds failure, errno: " << errno << std::endl;
+      return false;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t j = 0; j < count; j++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * j, sizeof(int));
+        fds->push_back(fd);
+      }
+    }
+  }
+  return fds->size() == fdCount;
+}
+#endif
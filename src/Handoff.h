@@ -0,0 +1,105 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include "Utils.h"
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+//
+// the snapshot of a running agent for the hot upgrade: the state of the
+// servers is serialized into one blob, the sockets are sent aside by
+// SCM_RIGHTS and referred to by their index in the blob.
+//
+
+// "BTCA", then the version of the layout, bumped by any change of exportState()
+#define HANDOFF_MAGIC    0x41435442u
+#define HANDOFF_VERSION  3u
+
+// the env var which carries the socket to the new process
+#define HANDOFF_FD_ENV   "BTCAGENT_HANDOFF_FD"
+
+/////////////////////////////////// HandoffWriter //////////////////////////////
+// little endian integers, the strings and buffers are length prefixed
+class HandoffWriter {
+  string data_;
+  vector<evutil_socket_t> fds_;
+
+public:
+  void putUint8 (uint8_t  v);
+  void putUint16(uint16_t v);
+  void putUint32(uint32_t v);
+  void putUint64(uint64_t v);
+  void putString(const char *data, size_t len);
+  inline void putString(const string &s) { putString(s.data(), s.size()); }
+  // all the data of the evbuffers, without draining them
+  void putEvbuffers(struct evbuffer *buf1, struct evbuffer *buf2);
+  // the fd is not owned, it's sent later
+  void putFd(evutil_socket_t fd);
+
+  inline const string &getData() const { return data_; }
+  inline const vector<evutil_socket_t> &getFds() const { return fds_; }
+};
+
+
+/////////////////////////////////// HandoffReader //////////////////////////////
+//
+// once it's out of data, all the getters return 0 or empty and isValid()
+// is false, so the caller checks it once at the end of a record.
+//
+class HandoffReader {
+  const string &data_;
+  vector<evutil_socket_t> &fds_;
+  size_t pos_;
+  bool isValid_;
+
+  const uint8_t *take(size_t len);
+
+public:
+  HandoffReader(const string &data, vector<evutil_socket_t> &fds);
+  // the fds which are not taken are closed
+  ~HandoffReader();
+
+  uint8_t  getUint8();
+  uint16_t getUint16();
+  uint32_t getUint32();
+  uint64_t getUint64();
+  string   getString();
+  // -1 if it's invalid. the caller owns it, it's taken once
+  evutil_socket_t getFd();
+
+  inline bool isValid() const { return isValid_; }
+  inline bool isEnd() const { return pos_ == data_.size(); }
+};
+
+
+#ifndef _WIN32
+//
+// blocking. the blob first, then the fds by SCM_RIGHTS in batches, each
+// one is attached to a single byte.
+//
+bool sendHandoff(evutil_socket_t sock, const string &data,
+                 const vector<evutil_socket_t> &fds);
+bool recvHandoff(evutil_socket_t sock, string *data,
+                 vector<evutil_socket_t> *fds);
+#endif
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Resolver.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <event2/dns.h>
+
+
+/////////////////////////////////// SockAddr ///////////////////////////////////
+SockAddr::SockAddr(): len_(0) {
+  memset(&addr_, 0, sizeof(addr_));
+}
+
+bool SockAddr::parse(const string &ip, uint16_t port, SockAddr *addr) {
+  struct in_addr  in;
+  struct in6_addr in6;
+
+  if (evutil_inet_pton(AF_INET, ip.c_str(), &in) == 1) {
+    *addr = fromIPv4(in, port);
+    return true;
+  }
+  if (evutil_inet_pton(AF_INET6, ip.c_str(), &in6) == 1) {
+    *addr = fromIPv6(in6, port);
+    return true;
+  }
+  return false;
+}
+
+SockAddr SockAddr::fromIPv4(const struct in_addr &in, uint16_t port) {
+  SockAddr addr;
+  struct sockaddr_in *sin = (struct sockaddr_in *)&addr.addr_;
+  sin->sin_family = AF_INET;
+  sin->sin_port   = htons(port);
+  sin->sin_addr   = in;
+  addr.len_ = sizeof(struct sockaddr_in);
+  return addr;
+}
+
+SockAddr SockAddr::fromIPv6(const struct in6_addr &in6, uint16_t port) {
+  SockAddr addr;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr.addr_;
+  sin6->sin6_family = AF_INET6;
+  sin6->sin6_port   = htons(port);
+  sin6->sin6_addr   = in6;
+  addr.len_ = sizeof(struct sockaddr_in6);
+  return addr;
+}
+
+uint16_t SockAddr::getPort() const {
+  if (addr_.ss_family == AF_INET)
+    return ntohs(((const struct sockaddr_in *)&addr_)->sin_port);
+  if (addr_.ss_family == AF_INET6)
+    return ntohs(((const struct sockaddr_in6 *)&addr_)->sin6_port);
+  return 0;
+}
+
+void SockAddr::setPort(uint16_t port) {
+  if (addr_.ss_family == AF_INET)
+    ((struct sockaddr_in *)&addr_)->sin_port = htons(port);
+  else if (addr_.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&addr_)->sin6_port = htons(port);
+}
+
+string SockAddr::toString() const {
+  char ipStr[64] = {0};
+
+  if (addr_.ss_family == AF_INET) {
+    evutil_inet_ntop(AF_INET, &((const struct sockaddr_in *)&addr_)->sin_addr,
+                     ipStr, sizeof(ipStr));
+    return Strings::Format("%s:%u", ipStr, (uint32_t)getPort());
+  }
+  if (addr_.ss_family == AF_INET6) {
+    evutil_inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)&addr_)->sin6_addr,
+                     ipStr, sizeof(ipStr));
+    return Strings::Format("[%s]:%u", ipStr, (uint32_t)getPort());
+  }
+  return "unknown";
+}
+
+bool SockAddr::operator==(const SockAddr &r) const {
+  if (len_ != r.len_ || addr_.ss_family != r.addr_.ss_family)
+    return false;
+
+  if (addr_.ss_family == AF_INET) {
+    const struct sockaddr_in *a = (const struct sockaddr_in *)&addr_;
+    const struct sockaddr_in *b = (const struct sockaddr_in *)&r.addr_;
+    return a->sin_port == b->sin_port &&
+           memcmp(&a->sin_addr, &b->sin_addr, sizeof(a->sin_addr)) == 0;
+  }
+  if (addr_.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)&addr_;
+    const struct sockaddr_in6 *b = (const struct sockaddr_in6 *)&r.addr_;
+    return a->sin6_port == b->sin6_port &&
+           memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+  }
+  return len_ == 0;
+}
+
+
+///////////////////////////////// DnsResolver //////////////////////////////////
+DnsResolver::DnsResolver(struct event_base *base, const vector<string> &nameservers)
+: base_(base), dnsBase_(NULL), minTtl_(kDefaultMinTtl_), maxTtl_(kDefaultMaxTtl_),
+queryCount_(0)
+{
+  if (nameservers.size() == 0) {
+    // resolv.conf, or the registry on Windows
+    dnsBase_ = evdns_base_new(base_, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+  } else {
+    dnsBase_ = evdns_base_new(base_, 0);
+    for (size_t i = 0; i < nameservers.size(); i++) {
+      if (evdns_base_nameserver_ip_add(dnsBase_, nameservers[i].c_str()) != 0) {
+        LOG(ERROR) << "invalid nameserver: " << nameservers[i] << std::endl;
+      }
+    }
+  }
+  assert(dnsBase_ != NULL);
+
+#ifdef _WIN32
+  const char *systemRoot = getenv("SystemRoot");
+  if (systemRoot != NULL) {
+    loadHostsFile((string(systemRoot) + "\\System32\\drivers\\etc\\hosts").c_str());
+  }
+#else
+  loadHostsFile("/etc/hosts");
+#endif
+}
+
+DnsResolver::~DnsResolver() {
+  // the pending queries are called back with DNS_ERR_SHUTDOWN
+  evdns_base_free(dnsBase_, 1);
+}
+
+void DnsResolver::setTtlRange(int32_t minTtl, int32_t maxTtl) {
+  assert(minTtl <= maxTtl);
+  minTtl_ = minTtl;
+  maxTtl_ = maxTtl;
+}
+
+void DnsResolver::loadHostsFile(const char *path) {
+  std::ifstream hosts(path);
+  string line;
+
+  while (std::getline(hosts, line)) {
+    const size_t comment = line.find('#');
+    if (comment != string::npos)
+      line.resize(comment);
+
+    std::istringstream fields(line);
+    string ip, name;
+    SockAddr addr;
+    if (!(fields >> ip) || !SockAddr::parse(ip, 0, &addr))
+      continue;
+
+    while (fields >> name) {
+      Entry &entry = entries_[name];
+      entry.addrs_.push_back(addr);
+      entry.expireTime_ = 0;
+    }
+  }
+}
+
+void DnsResolver::resolve(const string &host, ResolveCallback cb, void *ptr) {
+  vector<SockAddr> addrs;
+
+  // numeric host
+  SockAddr addr;
+  if (SockAddr::parse(host, 0, &addr)) {
+    addrs.push_back(addr);
+    cb(host, addrs, ptr);
+    return;
+  }
+
+  Entry &entry = entries_[host];
+  if (entry.expireTime_ == 0 || time(NULL) < entry.expireTime_) {
+    // copy it, the callback may change the cache
+    addrs = entry.addrs_;
+    cb(host, addrs, ptr);
+    return;
+  }
+
+  Waiter w;
+  w.cb_  = cb;
+  w.ptr_ = ptr;
+  entry.waiters_.push_back(w);
+
+  if (entry.pendingQueries_ == 0 && !startQueries(host, entry)) {
+    finishQueries(host, entry);
+  }
+}
+
+void DnsResolver::cancel(void *ptr) {
+  std::map<string, Entry>::iterator it;
+  for (it = entries_.begin(); it != entries_.end(); ++it) {
+    vector<Waiter> &waiters = it->second.waiters_;
+    for (size_t i = 0; i < waiters.size(); ) {
+      if (waiters[i].ptr_ == ptr) {
+        waiters.erase(waiters.begin() + i);
+        continue;
+      }
+      i++;
+    }
+  }
+}
+
+bool DnsResolver::startQueries(const string &host, Entry &entry) {
+  entry.newAddrs_.clear();
+  entry.newAddrs6_.clear();
+  entry.newTtl_ = -1;
+  queryCount_++;
+
+  DLOG(INFO) << "resolve host: " << host << std::endl;
+
+  // the callback could be called before evdns_base_resolve_*() returns,
+  // count them first
+  entry.pendingQueries_ = 2;
+
+  Query *q4 = new Query();
+  q4->resolver_ = this;
+  q4->host_     = host;
+  if (evdns_base_resolve_ipv4(dnsBase_, host.c_str(), 0,
+                              DnsResolver::dnsCallback, q4) == NULL) {
+    delete q4;
+    entry.pendingQueries_--;
+  }
+
+  Query *q6 = new Query();
+  q6->resolver_ = this;
+  q6->host_     = host;
+  if (evdns_base_resolve_ipv6(dnsBase_, host.c_str(), 0,
+                              DnsResolver::dnsCallback, q6) == NULL) {
+    delete q6;
+    entry.pendingQueries_--;
+  }
+
+  return entry.pendingQueries_ > 0;
+}
+
+void DnsResolver::dnsCallback(int result, char type, int count, int ttl,
+                              void *addresses, void *ptr) {
+  Query *q = static_cast<Query *>(ptr);
+  DnsResolver *resolver = q->resolver_;
+  const string host = q->host_;
+  delete q;
+
+  // the resolver is being destroyed
+  if (result == DNS_ERR_SHUTDOWN)
+    return;
+
+  Entry &entry = resolver->entries_[host];
+
+  if (result == DNS_ERR_NONE && count > 0) {
+    if (type == DNS_IPv4_A) {
+      const struct in_addr *in = (const struct in_addr *)addresses;
+      for (int i = 0; i < count; i++)
+        entry.newAddrs_.push_back(SockAddr::fromIPv4(in[i], 0));
+    }
+    else if (type == DNS_IPv6_AAAA) {
+      const struct in6_addr *in6 = (const struct in6_addr *)addresses;
+      for (int i = 0; i < count; i++)
+        entry.newAddrs6_.push_back(SockAddr::fromIPv6(in6[i], 0));
+    }
+
+    if (entry.newTtl_ < 0 || ttl < entry.newTtl_)
+      entry.newTtl_ = ttl;
+  }
+  else if (result != DNS_ERR_NONE && result != DNS_ERR_NOTEXIST) {
+    LOG(WARNING) << "resolve host: " << host << ", type: " << (int32_t)type
+    << ", err: " << evdns_err_to_string(result) << std::endl;
+  }
+
+  if (--entry.pendingQueries_ == 0)
+    resolver->finishQueries(host, entry);
+}
+
+void DnsResolver::finishQueries(const string &host, Entry &entry) {
+  const time_t now = time(NULL);
+
+  if (entry.newAddrs_.size() + entry.newAddrs6_.size() > 0) {
+    // IPv4 first, the pools and the farms are still IPv4 mostly
+    entry.addrs_.swap(entry.newAddrs_);
+    entry.addrs_.insert(entry.addrs_.end(),
+                        entry.newAddrs6_.begin(), entry.newAddrs6_.end());
+
+    int32_t ttl = entry.newTtl_;
+    if (ttl < minTtl_) ttl = minTtl_;
+    if (ttl > maxTtl_) ttl = maxTtl_;
+    entry.expireTime_ = now + ttl;
+
+    for (size_t i = 0; i < entry.addrs_.size(); i++) {
+      LOG(INFO) << "resolve host: " << host << ", ip: " << entry.addrs_[i].toString()
+      << ", ttl: " << ttl << std::endl;
+    }
+  } else {
+    // keep the last addresses if any, try again later
+    LOG(ERROR) << "resolve host failure: " << host << ", use the last "
+    << entry.addrs_.size() << " addresses" << std::endl;
+    entry.expireTime_ = now + kRetryInterval_;
+  }
+  entry.newAddrs_.clear();
+  entry.newAddrs6_.clear();
+
+  // the callbacks may resolve again or cancel, copy them out
+  vector<Waiter> waiters;
+  waiters.swap(entry.waiters_);
+  const vector<SockAddr> addrs = entry.addrs_;
+
+  for (size_t i = 0; i < waiters.size(); i++) {
+    waiters[i].cb_(host, addrs, waiters[i].ptr_);
+  }
+}
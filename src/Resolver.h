@@ -0,0 +1,146 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include "Utils.h"
+
+#ifndef _WIN32
+ #include <netinet/in.h>
+ #include <sys/socket.h>
+#endif
+
+#include <time.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include <map>
+
+struct evdns_base;
+
+/////////////////////////////////// SockAddr ///////////////////////////////////
+// an IPv4 or IPv6 address with port
+class SockAddr {
+  struct sockaddr_storage addr_;
+  ev_socklen_t len_;
+
+public:
+  SockAddr();
+
+  // numeric host only, "1.2.3.4" or "::1"
+  static bool parse(const string &ip, uint16_t port, SockAddr *addr);
+  static SockAddr fromIPv4(const struct in_addr &in, uint16_t port);
+  static SockAddr fromIPv6(const struct in6_addr &in6, uint16_t port);
+
+  inline const struct sockaddr *get() const { return (const struct sockaddr *)&addr_; }
+  inline ev_socklen_t getLength() const { return len_; }
+  inline int getFamily() const { return addr_.ss_family; }
+
+  uint16_t getPort() const;
+  void setPort(uint16_t port);
+
+  // "1.2.3.4:3333" or "[::1]:3333"
+  string toString() const;
+
+  bool operator==(const SockAddr &r) const;
+};
+
+
+/////////////////////////////////// Resolver ///////////////////////////////////
+//
+// resolves a host to all of its addresses (the ports are 0). the callback is
+// called in the event loop, maybe before resolve() returns if the answer is
+// cached. addrs is empty if failed.
+//
+typedef void (*ResolveCallback)(const string &host, const vector<SockAddr> &addrs,
+                                void *ptr);
+
+class Resolver {
+public:
+  virtual ~Resolver() {}
+
+  virtual void resolve(const string &host, ResolveCallback cb, void *ptr) = 0;
+  // drop the pending callbacks of ptr
+  virtual void cancel(void *ptr) = 0;
+};
+
+
+///////////////////////////////// DnsResolver //////////////////////////////////
+//
+// async resolver by evdns, A and AAAA are queried in parallel. the answers
+// are cached for their TTL (clamped to [minTtl, maxTtl]). when a refresh
+// fails, the last addresses are still used and retried later. numeric hosts
+// and the hosts file never hit the network.
+//
+class DnsResolver : public Resolver {
+  static const int32_t kDefaultMinTtl_ = 30;    // seconds
+  static const int32_t kDefaultMaxTtl_ = 3600;
+  static const int32_t kRetryInterval_ = 10;    // after a failure
+
+  struct Waiter {
+    ResolveCallback cb_;
+    void *ptr_;
+  };
+
+  struct Entry {
+    vector<SockAddr> addrs_;
+    time_t expireTime_;       // 0 means never, a new entry is expired
+    int32_t pendingQueries_;  // A, AAAA in flight
+    vector<SockAddr> newAddrs_;
+    vector<SockAddr> newAddrs6_;
+    int32_t newTtl_;
+    vector<Waiter> waiters_;
+
+    Entry(): expireTime_(1), pendingQueries_(0), newTtl_(-1) {}
+  };
+
+  struct Query {
+    DnsResolver *resolver_;
+    string host_;
+  };
+
+  struct event_base  *base_;
+  struct evdns_base *dnsBase_;
+  std::map<string, Entry> entries_;
+  int32_t minTtl_;
+  int32_t maxTtl_;
+  uint32_t queryCount_;
+
+  static void dnsCallback(int result, char type, int count, int ttl,
+                          void *addresses, void *ptr);
+  void loadHostsFile(const char *path);
+  bool startQueries(const string &host, Entry &entry);
+  void finishQueries(const string &host, Entry &entry);
+
+public:
+  // use the system's nameservers if nameservers is empty, otherwise
+  // "ip[:port]" of each one
+  DnsResolver(struct event_base *base, const vector<string> &nameservers);
+  virtual ~DnsResolver();
+
+  virtual void resolve(const string &host, ResolveCallback cb, void *ptr);
+  virtual void cancel(void *ptr);
+
+  void setTtlRange(int32_t minTtl, int32_t maxTtl);
+  // how many hosts are sent to the nameservers
+  inline uint32_t getQueryCount() const { return queryCount_; }
+};
+
+#endif
@@ -20,10 +20,15 @@
 
 #ifndef _WIN32
  #include <arpa/inet.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
 #endif
 
+#include <ctype.h>
 #include <time.h>
 
+#include <algorithm>
+
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -34,49 +39,24 @@
  #include <event2/thread.h>
 #endif
 
-static
-bool resolve(const string &host, struct in_addr *sin_addr) {
-  struct evutil_addrinfo *ai = NULL;
-  struct evutil_addrinfo hints_in;
-  memset(&hints_in, 0, sizeof(evutil_addrinfo));
-  // AF_INET, v4; AF_INT6, v6; AF_UNSPEC, both v4 & v6
-  hints_in.ai_family   = AF_UNSPEC;
-  hints_in.ai_socktype = SOCK_STREAM;
-  hints_in.ai_protocol = IPPROTO_TCP;
-  hints_in.ai_flags    = EVUTIL_AI_ADDRCONFIG;
-
-  // TODO: use non-blocking to resolve hostname
-  int err = evutil_getaddrinfo(host.c_str(), NULL, &hints_in, &ai);
-  if (err != 0) {
-    LOG(ERROR) << "evutil_getaddrinfo err: " << err << ", " << evutil_gai_strerror(err) << std::endl;
-    return false;
-  }
-  if (ai == NULL) {
-    LOG(ERROR) << "evutil_getaddrinfo res is null" << std::endl;
-    return false;
-  }
-
-  // only get the first record, ignore ai = ai->ai_next
-  if (ai->ai_family == AF_INET) {
-    struct sockaddr_in *sin = (struct sockaddr_in*)ai->ai_addr;
-    *sin_addr = sin->sin_addr;
+// for the timeouts and the RTT
+static int64_t nowUs() {
+  struct timeval tv;
+  evutil_gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-    char ipStr[INET_ADDRSTRLEN];
-    evutil_inet_ntop(AF_INET, &(sin->sin_addr), ipStr, INET_ADDRSTRLEN);
-    LOG(INFO) << "resolve host: " << host << ", ip: " << ipStr << std::endl;
-  } else if (ai->ai_family == AF_INET6) {
-    // not support yet
-    LOG(ERROR) << "not support ipv6 yet" << std::endl;
-    return false;
-  }
-  evutil_freeaddrinfo(ai);
-  return true;
+static int64_t nowMs() {
+  return nowUs() / 1000;
 }
 
+//
+// find the first line and make it contiguous in place, without copying it out.
+// the line is valid until the evbuffer is changed, the caller should
+// evbuffer_drain() it after handled.
+//
 static
-bool tryReadLine(string &line, struct evbuffer *inBuf) {
-  line.clear();
-
+bool tryPullupLine(struct evbuffer *inBuf, const char **line, size_t *len) {
   // find eol
   struct evbuffer_ptr loc;
   loc = evbuffer_search_eol(inBuf, NULL, NULL, EVBUFFER_EOL_LF);
@@ -84,12 +64,63 @@ bool tryReadLine(string &line, struct evbuffer *inBuf) {
     return false;  // not found
   }
 
-  // copies and removes the first datlen bytes from the front of buf
-  // into the memory at data
-  line.resize(loc.pos + 1);  // containing "\n"
-  evbuffer_remove(inBuf, (void *)line.data(), line.size());
+  *len  = loc.pos + 1;  // containing "\n"
+  *line = (const char *)evbuffer_pullup(inBuf, *len);
+  return *line != NULL;
+}
 
-  return true;
+size_t splitLines(struct evbuffer *inBuf, StringRef *lines, const size_t maxLines,
+                  size_t *bytes) {
+  const int kMaxChunks = 16;
+  struct evbuffer_iovec chunks[kMaxChunks];
+  int n = evbuffer_peek(inBuf, -1, NULL, chunks, kMaxChunks);
+  if (n > kMaxChunks)
+    n = kMaxChunks;
+
+  size_t count     = 0;
+  size_t offset    = 0;  // offset of the current chunk
+  size_t lineBegin = 0;  // offset of the current line
+  bool   crossed   = false;
+
+  for (int i = 0; i < n && count < maxLines; i++) {
+    const char *base = (const char *)chunks[i].iov_base;
+    const char *end  = base + chunks[i].iov_len;
+    const char *p    = base;
+    const char *eol  = NULL;
+
+    while (count < maxLines && (eol = findLineFeed(p, end - p)) != NULL) {
+      const size_t lineEnd = offset + (eol - base) + 1;  // containing "\n"
+      if (lineBegin < offset)
+        crossed = true;
+
+      lines[count++] = StringRef(eol + 1 - (lineEnd - lineBegin), lineEnd - lineBegin);
+      lineBegin = lineEnd;
+      p = eol + 1;
+    }
+    offset += chunks[i].iov_len;
+  }
+  *bytes = lineBegin;
+
+  if (count > 0 && crossed) {
+    // make them contiguous, the pointers in other chunks are invalid now
+    const char *base = (const char *)evbuffer_pullup(inBuf, lineBegin);
+    if (base == NULL)
+      return 0;
+
+    for (size_t i = 0, begin = 0; i < count; i++) {
+      lines[i].data_ = base + begin;
+      begin += lines[i].size_;
+    }
+  }
+  return count;
+}
+
+// the end of the input buffer is frozen, only the bufferevent reads into it
+static void addToInput(struct bufferevent *bev, const string &data) {
+  struct evbuffer *input = bufferevent_get_input(bev);
+  evbuffer_unfreeze(input, 0);
+  evbuffer_add(input, data.data(), data.size());
+  evbuffer_freeze(input, 0);
 }
 
 static
@@ -141,65 +172,500 @@ const char * StratumError::toString(int err) {
 
 
 //////////////////////////////// SessionIDManager //////////////////////////////
-SessionIDManager::SessionIDManager(): count_(0), allocIdx_(0) {
-  sessionIds_.reset();
+SessionIDManager::SessionIDManager(): count_(0),
+capacity_(AGENT_MAX_SESSION_ID + 1), allocIdx_(0) {
+  memset(sessionIds_, 0, sizeof(sessionIds_));
+  memset(fullWords_,  0, sizeof(fullWords_));
+
+  // the tail bits are out of range, mark them as used forever
+  for (uint32_t i = AGENT_MAX_SESSION_ID + 1; i < kIdsWordCount_ * 64; i++) {
+    setUsed(i);
+  }
+  for (uint32_t i = kIdsWordCount_; i < kFullWordCount_ * 64; i++) {
+    fullWords_[i / 64] |= (uint64_t)1 << (i % 64);
+  }
+}
+
+void SessionIDManager::setRange(const uint16_t minId, const uint16_t maxId) {
+  assert(count_ == 0);
+  assert(minId <= maxId && maxId <= AGENT_MAX_SESSION_ID);
+
+  // the ids out of the range are used forever
+  for (uint32_t i = 0; i < minId; i++) {
+    setUsed(i);
+  }
+  for (uint32_t i = maxId + 1; i <= AGENT_MAX_SESSION_ID; i++) {
+    setUsed(i);
+  }
+  capacity_ = maxId - minId + 1;
+  allocIdx_ = minId;
 }
 
 bool SessionIDManager::ifFull() {
-  if (count_ >= (int32_t)(AGENT_MAX_SESSION_ID + 1)) {
+  if (count_ >= capacity_) {
     return true;
   }
   return false;
 }
 
+int32_t SessionIDManager::findFirstZero(const uint64_t *words,
+                                        const uint32_t wordCount,
+                                        const uint32_t beginIdx) {
+  // find the first zero bit which index >= beginIdx, -1 if not found
+  uint32_t w = beginIdx / 64;
+  if (w >= wordCount)
+    return -1;
+
+  uint64_t bits = ~words[w] & (~(uint64_t)0 << (beginIdx % 64));
+  while (bits == 0) {
+    if (++w >= wordCount)
+      return -1;
+    bits = ~words[w];
+  }
+  return (int32_t)(w * 64 + countTrailingZeros64(bits));
+}
+
+void SessionIDManager::setUsed(const uint32_t idx) {
+  const uint32_t w = idx / 64;
+  sessionIds_[w] |= (uint64_t)1 << (idx % 64);
+  if (sessionIds_[w] == ~(uint64_t)0) {
+    fullWords_[w / 64] |= (uint64_t)1 << (w % 64);
+  }
+}
+
+void SessionIDManager::setFree(const uint32_t idx) {
+  const uint32_t w = idx / 64;
+  sessionIds_[w] &= ~((uint64_t)1 << (idx % 64));
+  fullWords_[w / 64] &= ~((uint64_t)1 << (w % 64));
+}
+
 bool SessionIDManager::allocSessionId(uint16_t *id) {
   assert(AGENT_MAX_SESSION_ID < UINT16_MAX);
 
   if (ifFull())
     return false;
 
-  const uint32_t beginIdx = allocIdx_;
-  while (sessionIds_.test(allocIdx_) == true) {
-    allocIdx_++;
-    if (allocIdx_ > AGENT_MAX_SESSION_ID) {
-      allocIdx_ = 0;
+  //
+  // round-robin: search from the last allocated one, so the recently freed
+  // ids will not be handed out straight away.
+  //
+  int32_t idx = -1;
+
+  // 1. the rest of the current word
+  const uint64_t bits = ~sessionIds_[allocIdx_ / 64] &
+                        (~(uint64_t)0 << (allocIdx_ % 64));
+  if (bits != 0) {
+    idx = (int32_t)((allocIdx_ / 64) * 64 + countTrailingZeros64(bits));
+  }
+  else {
+    // 2. the next word which is not full, wrap around if reach the end
+    int32_t w = findFirstZero(fullWords_, kFullWordCount_, allocIdx_ / 64 + 1);
+    if (w < 0 || w >= (int32_t)kIdsWordCount_) {
+      w = findFirstZero(fullWords_, kFullWordCount_, 0);
     }
 
-    // should not be here, just in case dead loop
-    if (allocIdx_ == beginIdx) {
+    // should not be here, just in case
+    if (w < 0 || w >= (int32_t)kIdsWordCount_) {
       return false;
     }
+    idx = w * 64 + countTrailingZeros64(~sessionIds_[w]);
   }
+  allocIdx_ = (uint32_t)idx;
 
   // set to true
-  sessionIds_.set(allocIdx_, true);
+  setUsed(allocIdx_);
   count_++;
 
-  assert(allocIdx_ <= UINT16_MAX);
+  assert(allocIdx_ <= AGENT_MAX_SESSION_ID);
   *id = (uint16_t)allocIdx_;
   return true;
 }
 
 void SessionIDManager::freeSessionId(const uint16_t sessionId) {
-  sessionIds_.set(sessionId, false);
+  setFree(sessionId);
   count_--;
 }
 
+void SessionIDManager::exportState(HandoffWriter &w) const {
+  w.putUint32((uint32_t)count_);
+  w.putUint32((uint32_t)capacity_);
+  w.putUint32(allocIdx_);
+  for (uint32_t i = 0; i < kIdsWordCount_; i++) {
+    w.putUint64(sessionIds_[i]);
+  }
+  for (uint32_t i = 0; i < kFullWordCount_; i++) {
+    w.putUint64(fullWords_[i]);
+  }
+}
+
+bool SessionIDManager::importState(HandoffReader &r) {
+  const int32_t  count    = (int32_t)r.getUint32();
+  const int32_t  capacity = (int32_t)r.getUint32();
+  const uint32_t allocIdx = r.getUint32();
+  if (!r.isValid() || count < 0 || count > capacity ||
+      capacity > (int32_t)(AGENT_MAX_SESSION_ID + 1) || allocIdx > AGENT_MAX_SESSION_ID)
+    return false;
+
+  count_    = count;
+  capacity_ = capacity;
+  allocIdx_ = allocIdx;
+  for (uint32_t i = 0; i < kIdsWordCount_; i++) {
+    sessionIds_[i] = r.getUint64();
+  }
+  for (uint32_t i = 0; i < kFullWordCount_; i++) {
+    fullWords_[i] = r.getUint64();
+  }
+  return r.isValid();
+}
+
+
+///////////////////////////// DuplicateShareFilter /////////////////////////////
+// the finalizer of murmur3, a bijection
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+uint64_t DuplicateShareFilter::hashShare(const uint32_t jobSeq, const Share &share) {
+  const uint64_t a = ((uint64_t)jobSeq << 32) | share.extraNonce2_;
+  const uint64_t b = ((uint64_t)share.time_ << 32) | share.nonce_;
+  const uint64_t h = mix64(a ^ mix64(b));
+  return (h != 0) ? h : 1;  // 0 is the empty slot
+}
+
+void DuplicateShareFilter::grow() {
+  vector<uint64_t> old;
+  old.swap(slots_);
+  slots_.resize(old.empty() ? kMinSlots_ : old.size() * 2, 0);
+
+  const size_t mask = slots_.size() - 1;
+  for (size_t j = 0; j < old.size(); j++) {
+    if (old[j] == 0)
+      continue;
+    size_t i = (size_t)old[j] & mask;
+    while (slots_[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = old[j];
+  }
+}
+
+bool DuplicateShareFilter::insert(const uint64_t key) {
+  assert(key != 0);
+  if (count_ >= kMaxCount_)
+    clear();
+  if ((count_ + 1) * 4 > slots_.size() * 3)
+    grow();
+
+  const size_t mask = slots_.size() - 1;
+  for (size_t i = (size_t)key & mask; ; i = (i + 1) & mask) {
+    if (slots_[i] == key)
+      return false;
+    if (slots_[i] == 0) {
+      slots_[i] = key;
+      count_++;
+      return true;
+    }
+  }
+}
+
+void DuplicateShareFilter::clear() {
+  if (count_ == 0)
+    return;
+  std::fill(slots_.begin(), slots_.end(), 0);
+  count_ = 0;
+}
+
+
+/////////////////////////////////// JobTimeRing ////////////////////////////////
+JobTimeRing::JobTimeRing(const uint32_t depth)
+:latestSeq_(0), cleanSeq_(0), depth_(std::max(1u, std::min(depth, (uint32_t)kMaxDepth_))),
+latestJobId_(0) {
+  memset(time_, 0, sizeof(time_));
+  memset(seq_,  0, sizeof(seq_));
+}
+
+void JobTimeRing::add(const uint8_t jobId, const uint32_t time, const bool isClean) {
+  time_[jobId] = time;
+  seq_[jobId]  = ++latestSeq_;
+  latestJobId_ = jobId;
+  if (isClean)
+    cleanSeq_ = latestSeq_;
+}
+
+void JobTimeRing::addTemplate(const JobTemplate &job) {
+  if (templates_.empty())
+    templates_.resize(kMaxDepth_);
+  JobTemplate &t = templates_[latestJobId_];
+  t = job;
+  t.seq_ = seq_[latestJobId_];
+}
+
+const JobTemplate *JobTimeRing::findTemplate(const uint8_t jobId) const {
+  uint32_t time;
+  if (templates_.empty() || find(jobId, &time) == -1 || seq_[jobId] < cleanSeq_ ||
+      templates_[jobId].seq_ != seq_[jobId])
+    return NULL;
+  return &templates_[jobId];
+}
+
+int32_t JobTimeRing::find(const uint8_t jobId, uint32_t *time) const {
+  if (seq_[jobId] == 0 || latestSeq_ - seq_[jobId] >= depth_)
+    return -1;
+  *time = time_[jobId];
+  return (int32_t)(latestSeq_ - seq_[jobId]);
+}
+
+void JobTimeRing::exportState(HandoffWriter &w) const {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < kMaxDepth_; i++) {
+    if (seq_[i] != 0 && latestSeq_ - seq_[i] < kMaxDepth_)
+      count++;
+  }
+  w.putUint32(count);
+  for (uint32_t i = 0; i < kMaxDepth_; i++) {
+    if (seq_[i] != 0 && latestSeq_ - seq_[i] < kMaxDepth_) {
+      w.putUint8((uint8_t)i);
+      w.putUint8((uint8_t)(latestSeq_ - seq_[i]));  // the age
+      w.putUint32(time_[i]);
+    }
+  }
+  w.putUint8(latestJobId_);
+}
+
+bool JobTimeRing::importState(HandoffReader &r) {
+  const uint32_t count = r.getUint32();
+  if (count > kMaxDepth_)
+    return false;
+
+  latestSeq_ = kMaxDepth_;
+  cleanSeq_  = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t  jobId = r.getUint8();
+    const uint8_t  age   = r.getUint8();
+    time_[jobId] = r.getUint32();
+    seq_[jobId]  = latestSeq_ - age;
+  }
+  latestJobId_ = r.getUint8();
+  return r.isValid();
+}
+
+
+//////////////////////////////////// ShareRejects ////////////////////////////
+void ShareRejects::add(const int err) {
+  switch (err) {
+    case StratumError::JOB_NOT_FOUND:  jobNotFound_++;   break;
+    case StratumError::TIME_TOO_OLD:   timeTooOld_++;    break;
+    case StratumError::TIME_TOO_NEW:   timeTooNew_++;    break;
+    case StratumError::DUPLICATE_SHARE: duplicate_++;    break;
+    case StratumError::LOW_DIFFICULTY: lowDifficulty_++; break;
+    default: break;
+  }
+}
+
+void ShareRejects::add(const ShareRejects &r) {
+  jobNotFound_   += r.jobNotFound_;
+  timeTooOld_    += r.timeTooOld_;
+  timeTooNew_    += r.timeTooNew_;
+  duplicate_     += r.duplicate_;
+  lowDifficulty_ += r.lowDifficulty_;
+}
+
+uint32_t ShareRejects::total() const {
+  return jobNotFound_ + timeTooOld_ + timeTooNew_ + duplicate_ + lowDifficulty_;
+}
+
+string ShareRejects::toString() const {
+  return Strings::Format("job not found: %u, time too old: %u, time too new: %u"
+                         ", duplicate: %u, low difficulty: %u", jobNotFound_,
+                         timeTooOld_, timeTooNew_, duplicate_, lowDifficulty_);
+}
+
+
+///////////////////////////////// JobTemplate //////////////////////////////////
+// big endian, as the hex in the coinbase
+static inline void writeUint32BE(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+JobTemplate::JobTemplate(): jobId_(0), seq_(0), time_(0), receivedTime_(0),
+hasHeader_(false) {
+  memset(header_, 0, sizeof(header_));
+}
+
+bool JobTemplate::init(const StratumJob &sjob, const uint32_t extraNonce1) {
+  jobId_     = (uint8_t)sjob.jobId_;
+  time_      = sjob.time_;
+  hasHeader_ = false;
+
+  string coinbase1, prevHash, branch;
+  if (!decodeHex(sjob.coinbase1_.data(), sjob.coinbase1_.size(), &coinbase1) ||
+      !decodeHex(sjob.coinbase2_.data(), sjob.coinbase2_.size(), &coinbase2_) ||
+      !decodeHex(sjob.prevHash_.data(), sjob.prevHash_.size(), &prevHash) ||
+      prevHash.size() != 32)
+    return false;
+
+  merkleBranches_.clear();
+  for (size_t i = 0; i < sjob.merkleBranches_.size(); i++) {
+    const string &hex = sjob.merkleBranches_[i];
+    if (!decodeHex(hex.data(), hex.size(), &branch) || branch.size() != 32)
+      return false;
+    merkleBranches_.append(branch);
+  }
+
+  uint8_t nonce1[4];
+  writeUint32BE(nonce1, extraNonce1);
+  coinbaseHead_.reset();
+  coinbaseHead_.update(coinbase1);
+  coinbaseHead_.update(nonce1, 4);
+
+  // version | prevhash | merkle root | time | bits | nonce. the words of
+  // the stratum's prevhash are byte swapped.
+  memset(header_, 0, sizeof(header_));
+  writeUint32LE(header_, (uint32_t)sjob.version_);
+  for (size_t i = 0; i < 32; i++) {
+    header_[4 + i] = (uint8_t)prevHash[(i & ~(size_t)3) + 3 - (i & 3)];
+  }
+  writeUint32LE(header_ + 72, sjob.nBits_);
+
+  hasHeader_ = true;
+  return true;
+}
+
+void JobTemplate::getHeaderHash(const uint16_t sessionId, const Share &share,
+                                uint8_t hash[32]) const {
+  // the extraNonce1 of the miner is its session id
+  uint8_t nonces[8];
+  writeUint32BE(nonces,     (uint32_t)sessionId);
+  writeUint32BE(nonces + 4, share.extraNonce2_);
+
+  Sha256 h = coinbaseHead_;
+  h.update(nonces, sizeof(nonces));
+  h.update(coinbase2_);
+
+  // the merkle root: hash | branch, sha256d of them again and again
+  uint8_t node[64];
+  h.final(node);
+  Sha256 h2;
+  h2.update(node, 32);
+  h2.final(node);
+  for (size_t i = 0; i < merkleBranches_.size(); i += 32) {
+    memcpy(node + 32, merkleBranches_.data() + i, 32);
+    sha256d(node, 64, node);
+  }
+
+  uint8_t header[80];
+  memcpy(header, header_, sizeof(header));
+  memcpy(header + 36, node, 32);
+  writeUint32LE(header + 68, share.time_);
+  writeUint32LE(header + 76, share.nonce_);
+  sha256d(header, sizeof(header), hash);
+}
+
+bool JobTemplate::isHashBelowTarget(const uint8_t hash[32], const uint64_t diff) {
+  if (diff == 0)
+    return true;
+
+  // hash * diff <= 0xFFFF * 2^208, 32 bits limbs, the lowest first
+  uint32_t h[8];
+  for (int i = 0; i < 8; i++) {
+    h[i] = readUint32LE(hash + i * 4);
+  }
+  uint32_t p[10] = {0};
+  for (int j = 0; j < 2; j++) {
+    const uint32_t d = (uint32_t)(diff >> (32 * j));
+    uint64_t carry = 0;
+    for (int i = 0; i < 8; i++) {
+      const uint64_t t = (uint64_t)h[i] * d + p[i + j] + carry;
+      p[i + j] = (uint32_t)t;
+      carry = t >> 32;
+    }
+    p[8 + j] = (uint32_t)carry;
+  }
+
+  uint32_t target[10] = {0};
+  target[6] = 0xFFFF0000u;
+  for (int i = 9; i >= 0; i--) {
+    if (p[i] != target[i])
+      return p[i] < target[i];
+  }
+  return true;
+}
+
+
+///////////////////////////////// SharedBuffer /////////////////////////////////
+SharedBuffer::SharedBuffer(const string &data): data_(data), refCount_(1) {
+}
+
+SharedBuffer::~SharedBuffer() {
+}
+
+SharedBuffer *SharedBuffer::create(const string &data) {
+  return new SharedBuffer(data);
+}
+
+void SharedBuffer::retain() {
+  refCount_++;
+}
+
+void SharedBuffer::release() {
+  assert(refCount_ > 0);
+  if (--refCount_ == 0) {
+    delete this;
+  }
+}
+
+void SharedBuffer::evbufferCleanupCallback(const void *data, size_t len,
+                                           void *ptr) {
+  // the evbuffer has sent or dropped the data
+  static_cast<SharedBuffer *>(ptr)->release();
+}
+
+bool SharedBuffer::addToEvbuffer(struct evbuffer *buf) {
+  retain();  // released by evbufferCleanupCallback()
+  if (evbuffer_add_reference(buf, data_.data(), data_.size(),
+                             SharedBuffer::evbufferCleanupCallback, this) != 0) {
+    release();
+    return false;
+  }
+  return true;
+}
+
 
 ///////////////////////////////// StratumMessage //////////////////////////////
+StratumMessage::StratumMessage(const char *content, size_t len):
+content_(content), contentLen_(len), method_(METHOD_UNKNOWN),
+isStringId_(false), r_(0), diff_(0) {
+  parse();
+}
+
 StratumMessage::StratumMessage(const string &content):
-content_(content), isStringId_(false), r_(0), diff_(0) {
+content_(content.data()), contentLen_(content.size()), method_(METHOD_UNKNOWN),
+isStringId_(false), r_(0), diff_(0) {
   parse();
 }
 StratumMessage::~StratumMessage() {
 }
 
 string StratumMessage::getJsonStr(const jsmntok_t *t) const {
-  return ::getJsonStr(content_.c_str(), t);
+  return ::getJsonStr(content_, t);
+}
+
+StringRef StratumMessage::getJsonStrRef(const jsmntok_t *t) const {
+  if (t == NULL || t->end <= t->start)
+    return StringRef();
+  return StringRef(content_ + t->start, t->end - t->start);
 }
 
 int StratumMessage::jsoneq(const jsmntok_t *tok, const char *s) const {
-  const char *json = content_.c_str();
+  const char *json = content_;
   if (tok->type == JSMN_STRING &&
       (int)strlen(s) == tok->end - tok->start &&
       strncmp(json + tok->start, s, tok->end - tok->start) == 0) {
@@ -208,25 +674,73 @@ int StratumMessage::jsoneq(const jsmntok_t *tok, const char *s) const {
   return -1;
 }
 
-string StratumMessage::findMethod() const {
-  for (int i = 1; i < r_; i++) {
-    if (jsoneq(&t_[i], "method") == 0) {
-      return getJsonStr(&t_[i+1]);
-    }
-  }
-  return "";
+uint32_t StratumMessage::getJsonHex32(const jsmntok_t *t) const {
+  uint32_t v = 0u;
+  if (t->end > t->start)
+    decodeHex32(content_ + t->start, t->end - t->start, &v);
+  return v;
 }
 
-string StratumMessage::parseId() {
-  for (int i = 1; i < r_; i++) {
+uint32_t StratumMessage::getJsonDec32(const jsmntok_t *t) const {
+  uint32_t v = 0u;
+  if (t->end > t->start)
+    decodeDec32(content_ + t->start, t->end - t->start, &v);
+  return v;
+}
+
+StratumMethod StratumMessage::findMethod() const {
+  for (int i = 1; i < r_ - 1; i++) {
+    if (jsoneq(&t_[i], "method") != 0)
+      continue;
+
+    const jsmntok_t *t = &t_[i+1];
+    if (jsoneq(t, "mining.submit") == 0)          // most of requests
+      return METHOD_MINING_SUBMIT;
+    if (jsoneq(t, "mining.notify") == 0)
+      return METHOD_MINING_NOTIFY;
+    if (jsoneq(t, "mining.set_difficulty") == 0)
+      return METHOD_MINING_SET_DIFFICULTY;
+    if (jsoneq(t, "mining.subscribe") == 0)
+      return METHOD_MINING_SUBSCRIBE;
+    if (jsoneq(t, "mining.authorize") == 0)
+      return METHOD_MINING_AUTHORIZE;
+    return METHOD_UNKNOWN;
+  }
+  return METHOD_UNKNOWN;
+}
+
+const char *StratumMessage::getMethodName(StratumMethod method) {
+  switch (method) {
+    case METHOD_MINING_SUBMIT:
+      return "mining.submit";
+    case METHOD_MINING_NOTIFY:
+      return "mining.notify";
+    case METHOD_MINING_SET_DIFFICULTY:
+      return "mining.set_difficulty";
+    case METHOD_MINING_SUBSCRIBE:
+      return "mining.subscribe";
+    case METHOD_MINING_AUTHORIZE:
+      return "mining.authorize";
+
+    case METHOD_UNKNOWN: default:
+      return "";
+  }
+}
+
+void StratumMessage::parseId() {
+  for (int i = 1; i < r_ - 1; i++) {
     if (jsoneq(&t_[i], "id") == 0) {
       i++;
 
       isStringId_ = (t_[i].type == JSMN_STRING) ? true : false;
-      id_ = getJsonStr(&t_[i]);
+      id_ = StringRef(content_ + t_[i].start, t_[i].end - t_[i].start);
+      if (isStringId_) {
+        // jsmn's string token doesn't include the quotes
+        id_.data_--;
+        id_.size_ += 2;
+      }
     }
   }
-  return "";
 }
 
 void StratumMessage::_parseMiningSubmit() {
@@ -242,16 +756,16 @@ void StratumMessage::_parseMiningSubmit() {
       i++;  // ptr move to params[0]
 
       // Job ID
-      share_.jobId_       = (uint8_t) strtoul(getJsonStr(&t_[i+1]).c_str(), NULL, 10);
+      share_.jobId_       = (uint8_t)getJsonDec32(&t_[i+1]);
       // ExtraNonce2(hex)
-      share_.extraNonce2_ = (uint32_t)strtoul(getJsonStr(&t_[i+2]).c_str(), NULL, 16);
+      share_.extraNonce2_ = getJsonHex32(&t_[i+2]);
       // nTime(hex)
-      share_.time_        = (uint32_t)strtoul(getJsonStr(&t_[i+3]).c_str(), NULL, 16);
+      share_.time_        = getJsonHex32(&t_[i+3]);
       // nonce(hex)
-      share_.nonce_       = (uint32_t)strtoul(getJsonStr(&t_[i+4]).c_str(), NULL, 16);
+      share_.nonce_       = getJsonHex32(&t_[i+4]);
 
       // set the method_
-      method_ = "mining.submit";
+      method_ = METHOD_MINING_SUBMIT;
       break;
     }
   }
@@ -275,24 +789,36 @@ void StratumMessage::_parseMiningNotify() {
     if (jsoneq(&t_[i], "params") == 0 && t_[i+1].type == JSMN_ARRAY && t_[i+1].size == 9) {
       i++;  // ptr move to params
       i++;  // ptr move to params[0]
-      sjob_.jobId_    = (uint8_t)strtoul(getJsonStr(&t_[i]).c_str(), NULL, 10);
-      sjob_.prevHash_ = getJsonStr(&t_[i+1]);
+      sjob_.jobId_     = (uint8_t)getJsonDec32(&t_[i]);
+      sjob_.prevHash_  = getJsonStr(&t_[i+1]);
+      sjob_.coinbase1_ = getJsonStr(&t_[i+2]);
+      sjob_.coinbase2_ = getJsonStr(&t_[i+3]);
 
       // list of merkle branches
       i += 4;  // ptr move to params[4]: list of merkle branches
       if (t_[i].type != JSMN_ARRAY)
         return;  // should be array
 
-      i += t_[i].size + 1;  // move to params[5]
+      const int branchCount = t_[i].size;
+      sjob_.merkleBranches_.resize(branchCount);
+      for (int j = 0; j < branchCount; j++) {
+        sjob_.merkleBranches_[j] = getJsonStr(&t_[i+1+j]);
+      }
+      i += branchCount + 1;  // move to params[5]
 
-      sjob_.version_  = (int32_t) strtoul(getJsonStr(&t_[i]).c_str(),   NULL, 16);
-      sjob_.time_     = (uint32_t)strtoul(getJsonStr(&t_[i+2]).c_str(), NULL, 16);
+      sjob_.version_  = (int32_t)getJsonHex32(&t_[i]);
+      sjob_.nBits_    = getJsonHex32(&t_[i+1]);
+      sjob_.time_     = getJsonHex32(&t_[i+2]);
 
       const string isClean = str2lower(getJsonStr(&t_[i+3]));
       sjob_.isClean_  = (isClean == "true") ? true : false;
+      if (t_[i+3].type == JSMN_PRIMITIVE) {
+        sjob_.cleanPos_ = t_[i+3].start;
+        sjob_.cleanLen_ = t_[i+3].end - t_[i+3].start;
+      }
 
       // set the method_
-      method_ = "mining.notify";
+      method_ = METHOD_MINING_NOTIFY;
       break;
     }
   }
@@ -306,12 +832,12 @@ void StratumMessage::_parseMiningSetDifficulty() {
     if (jsoneq(&t_[i], "params") == 0 && t_[i+1].type == JSMN_ARRAY && t_[i+1].size == 1) {
       i++;  // ptr move to params
       i++;  // ptr move to params[0]
-      const uint32_t diff = (uint32_t)strtoul(getJsonStr(&t_[i]).c_str(), NULL, 10);
+      const uint32_t diff = getJsonDec32(&t_[i]);
 
       if (diff > 0) {
         diff_ = diff;
         // set the method_
-        method_ = "mining.set_difficulty";
+        method_ = METHOD_MINING_SET_DIFFICULTY;
       }
       break;
     }
@@ -328,11 +854,11 @@ void StratumMessage::_parseMiningSubscribe() {
       if (t_[i+1].size >= 1) {
         i++;  // ptr move to params
         i++;  // ptr move to params[0]
-        minerAgent_ = getJsonStr(&t_[i]);
+        minerAgent_ = getJsonStrRef(&t_[i]);
       }
 
       // set the method_
-      method_ = "mining.subscribe";
+      method_ = METHOD_MINING_SUBSCRIBE;
       break;
     }
   }
@@ -346,10 +872,10 @@ void StratumMessage::_parseMiningAuthorize() {
     if (jsoneq(&t_[i], "params") == 0 && t_[i+1].type == JSMN_ARRAY && t_[i+1].size >= 1) {
       i++;  // ptr move to params
       i++;  // ptr move to params[0]
-      workerName_ = getJsonStr(&t_[i]);
+      workerName_ = getJsonStrRef(&t_[i]);
 
       // set the method_
-      method_ = "mining.authorize";
+      method_ = METHOD_MINING_AUTHORIZE;
       break;
     }
   }
@@ -359,7 +885,7 @@ void StratumMessage::parse() {
   jsmn_parser p;
   jsmn_init(&p);
 
-  r_ = jsmn_parse(&p, content_.c_str(), content_.length(), t_, sizeof(t_)/sizeof(t_[0]));
+  r_ = jsmn_parse(&p, content_, contentLen_, t_, sizeof(t_)/sizeof(t_[0]));
   if (r_ < 0) {
     LOG(ERROR) << "failed to parse JSON: " << r_ << std::endl;
     return;
@@ -372,41 +898,40 @@ void StratumMessage::parse() {
   parseId();
 
   // find method name
-  const string method = findMethod();
-  if (method == "")
-    return;
-
-  if (method == "mining.submit") {
-    _parseMiningSubmit();
-    return;
-  }
-
-  if (method == "mining.notify") {
-    _parseMiningNotify();
-    return;
-  }
-
-  if (method == "mining.set_difficulty") {
-    _parseMiningSetDifficulty();
-    return;
-  }
-
-  if (method == "mining.subscribe") {
-    _parseMiningSubscribe();
-    return;
-  }
-
-  if (method == "mining.authorize") {
-    _parseMiningAuthorize();
-    return;
+  switch (findMethod()) {
+    case METHOD_MINING_SUBMIT:
+      _parseMiningSubmit();
+      break;
+    case METHOD_MINING_NOTIFY:
+      _parseMiningNotify();
+      break;
+    case METHOD_MINING_SET_DIFFICULTY:
+      _parseMiningSetDifficulty();
+      break;
+    case METHOD_MINING_SUBSCRIBE:
+      _parseMiningSubscribe();
+      break;
+    case METHOD_MINING_AUTHORIZE:
+      _parseMiningAuthorize();
+      break;
+    case METHOD_UNKNOWN: default:
+      break;
   }
 }
 
-string StratumMessage::getMethod() const {
+StratumMethod StratumMessage::getMethod() const {
   return method_;
 }
 
 string StratumMessage::getId() const {
+  if (isStringId_)
+    return string(id_.data_ + 1, id_.size_ - 2);  // without the quotes
+  return id_.toString();
+}
+
+StringRef StratumMessage::getIdJson() const {
+  if (id_.empty())
+    return StringRef("null", 4);
   return id_;
 }
 bool StratumMessage::isStringId() const {
@@ -423,72 +948,239 @@ bool StratumMessage::getResultBoolean() const {
   return false;
 }
 
-bool StratumMessage::isValid() const {
-  // assume the top-level element is an object
-  return (r_ < 1 || t_[0].type != JSMN_OBJECT) ? false : true;
-}
+bool StratumMessage::getResultExtension(const char *name) const {
+  for (int i = 1; i < r_ - 1; i++) {
+    if (jsoneq(&t_[i], "result") != 0 || t_[i+1].type != JSMN_OBJECT)
+      continue;
 
-bool StratumMessage::parseMiningSubmit(Share &share) const {
-  if (method_ != "mining.submit")
+    // the keys and the values of the object, they are primitives or strings
+    const int end = t_[i+1].end;
+    for (int j = i + 2; j < r_ - 1 && t_[j].start < end; j++) {
+      if (t_[j].type == JSMN_STRING && jsoneq(&t_[j], name) == 0 &&
+          t_[j+1].type == JSMN_PRIMITIVE)
+        return getJsonStr(&t_[j+1]) == "true";
+    }
     return false;
-  share = share_;
-  return true;
+  }
+  return false;
 }
 
-bool StratumMessage::parseMiningSubscribe(string &minerAgent) const {
-  if (method_ != "mining.subscribe")
+//
+// helpers of the fast 'mining.submit' scanner, all of them advance p and
+// return false if they meet anything unexpected.
+//
+static inline void scanSpaces(const char *&p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+}
+
+static inline bool scanChar(const char *&p, const char *end, const char c) {
+  scanSpaces(p, end);
+  if (p == end || *p != c)
     return false;
-  minerAgent = minerAgent_;
+  p++;
   return true;
 }
 
-bool StratumMessage::parseMiningAuthorize(string &workerName) const {
-  if (method_ != "mining.authorize")
+// a json string without escapes, str doesn't include the quotes
+static bool scanString(const char *&p, const char *end, StringRef *str) {
+  if (!scanChar(p, end, '"'))
     return false;
-  workerName = workerName_;
-  return true;
 
-}
-bool StratumMessage::parseMiningNotify(StratumJob &sjob) const {
-  if (method_ != "mining.notify")
+  const char *begin = p;
+  while (p < end && *p != '"') {
+    if (*p == '\\')
+      return false;  // escaped string is unusual, leave it to jsmn
+    p++;
+  }
+  if (p == end)
     return false;
-  sjob = sjob_;
+
+  *str = StringRef(begin, p - begin);
+  p++;  // skip '"'
   return true;
 }
-bool StratumMessage::parseMiningSetDifficulty(uint32_t *diff) const {
-  if (method_ != "mining.set_difficulty")
+
+// a string or a primitive, raw includes the quotes if it's a string
+static bool scanScalar(const char *&p, const char *end, StringRef *raw) {
+  scanSpaces(p, end);
+  const char *begin = p;
+
+  if (p < end && *p == '"') {
+    StringRef str;
+    if (!scanString(p, end, &str))
+      return false;
+  } else {
+    while (p < end && (isalnum((uint8_t)*p) || *p == '-' || *p == '+' || *p == '.'))
+      p++;
+  }
+  if (p == begin)
     return false;
-  *diff = diff_;
+
+  *raw = StringRef(begin, p - begin);
   return true;
 }
 
-bool StratumMessage::getExtraNonce1AndExtraNonce2Size(uint32_t *nonce1,
-                                                      int32_t *n2size) const {
-  bool r = false;
-  for (int i = 1; i < r_; i++) {
-    //
-    // 1. Subscriptions details
-    // 2. Extranonce1 - Hex-encoded
-    // 3. Extranonce2_size
-    //
-    // {"id":1,"result":[[["mining.set_difficulty","01000002"],
-    //                    ["mining.notify","01000002"]],"01000002",8],"error":null}
-    //
-    if (jsoneq(&t_[i], "result") == 0 && t_[i+1].type == JSMN_ARRAY && t_[i+1].size == 3) {
-      i++;  // ptr move to "result"
+// a hex string with 1 ~ 8 chars, all of them must be valid
+static bool scanHex32(const char *&p, const char *end, uint32_t *value) {
+  StringRef str;
+  if (!scanString(p, end, &str) || str.size_ == 0 || str.size_ > 8)
+    return false;
+  return decodeHex32(str.data_, str.size_, value) == str.size_;
+}
 
-      //
-      // subscriptions details: 2-tuple
-      //
-      i++;  // ptr move to result[0]
-      i++;  // ptr move to result[0][0]
-      // ["mining.set_difficulty","01000002"]
-      if (!(t_[i].type == JSMN_ARRAY && t_[i].size == 2)) {
-        return false;
-      }
-      i += t_[i].size;
+//
+// [Worker Name, Job ID, ExtraNonce2(hex), nTime(hex), nonce(hex)]
+//
+static bool scanMiningSubmitParams(const char *&p, const char *end, Share *share) {
+  StringRef str;
+  uint32_t jobId = 0u;
 
-      i++;  // ptr move to result[0][1]
+  if (!scanChar(p, end, '[') ||
+      !scanString(p, end, &str) || !scanChar(p, end, ','))  // Worker Name
+    return false;
+
+  // Job ID, decimal
+  if (!scanString(p, end, &str) || str.size_ == 0 || str.size_ > 9 ||
+      decodeDec32(str.data_, str.size_, &jobId) != str.size_ ||
+      !scanChar(p, end, ','))
+    return false;
+  share->jobId_ = (uint8_t)jobId;
+
+  return scanHex32(p, end, &share->extraNonce2_) && scanChar(p, end, ',') &&
+         scanHex32(p, end, &share->time_)        && scanChar(p, end, ',') &&
+         scanHex32(p, end, &share->nonce_)       && scanChar(p, end, ']');
+}
+
+bool StratumMessage::parseMiningSubmitFast(const char *line, size_t len,
+                                           Share *share, StringRef *idStr) {
+  //
+  // {"params": ["slush.miner1", "bf", "00000001", "504e86ed", "b2957c02"],
+  //  "id": 4, "method": "mining.submit"}
+  //
+  const char *p   = line;
+  const char *end = line + len;
+  bool hasMethod = false, hasParams = false;
+  StringRef key, value;
+  Share s;
+
+  *idStr = StringRef("null", 4);
+
+  if (!scanChar(p, end, '{'))
+    return false;
+
+  while (true) {
+    if (!scanString(p, end, &key) || !scanChar(p, end, ':'))
+      return false;
+
+    if (key.equals("params")) {
+      if (!scanMiningSubmitParams(p, end, &s))
+        return false;
+      hasParams = true;
+    }
+    else if (key.equals("method")) {
+      scanSpaces(p, end);
+      if (!scanString(p, end, &value) || !value.equals("mining.submit"))
+        return false;
+      hasMethod = true;
+    }
+    else if (key.equals("id")) {
+      if (!scanScalar(p, end, idStr))
+        return false;
+    }
+    else if (!scanScalar(p, end, &value)) {  // ignore others, eg. "jsonrpc"
+      return false;
+    }
+
+    scanSpaces(p, end);
+    if (p == end)
+      return false;
+    if (*p == ',') {
+      p++;
+      continue;
+    }
+    if (*p == '}') {
+      p++;
+      break;
+    }
+    return false;
+  }
+
+  // only spaces are allowed after the object
+  scanSpaces(p, end);
+  if (p != end || !hasMethod || !hasParams)
+    return false;
+
+  *share = s;
+  return true;
+}
+
+bool StratumMessage::isValid() const {
+  // assume the top-level element is an object
+  return (r_ < 1 || t_[0].type != JSMN_OBJECT) ? false : true;
+}
+
+bool StratumMessage::parseMiningSubmit(Share &share) const {
+  if (method_ != METHOD_MINING_SUBMIT)
+    return false;
+  share = share_;
+  return true;
+}
+
+bool StratumMessage::parseMiningSubscribe(string &minerAgent) const {
+  if (method_ != METHOD_MINING_SUBSCRIBE)
+    return false;
+  minerAgent = minerAgent_.toString();
+  return true;
+}
+
+bool StratumMessage::parseMiningAuthorize(string &workerName) const {
+  if (method_ != METHOD_MINING_AUTHORIZE)
+    return false;
+  workerName = workerName_.toString();
+  return true;
+
+}
+bool StratumMessage::parseMiningNotify(StratumJob &sjob) const {
+  if (method_ != METHOD_MINING_NOTIFY)
+    return false;
+  sjob = sjob_;
+  return true;
+}
+bool StratumMessage::parseMiningSetDifficulty(uint32_t *diff) const {
+  if (method_ != METHOD_MINING_SET_DIFFICULTY)
+    return false;
+  *diff = diff_;
+  return true;
+}
+
+bool StratumMessage::getExtraNonce1AndExtraNonce2Size(uint32_t *nonce1,
+                                                      int32_t *n2size) const {
+  bool r = false;
+  for (int i = 1; i < r_; i++) {
+    //
+    // 1. Subscriptions details
+    // 2. Extranonce1 - Hex-encoded
+    // 3. Extranonce2_size
+    //
+    // {"id":1,"result":[[["mining.set_difficulty","01000002"],
+    //                    ["mining.notify","01000002"]],"01000002",8],"error":null}
+    //
+    if (jsoneq(&t_[i], "result") == 0 && t_[i+1].type == JSMN_ARRAY && t_[i+1].size == 3) {
+      i++;  // ptr move to "result"
+
+      //
+      // subscriptions details: 2-tuple
+      //
+      i++;  // ptr move to result[0]
+      i++;  // ptr move to result[0][0]
+      // ["mining.set_difficulty","01000002"]
+      if (!(t_[i].type == JSMN_ARRAY && t_[i].size == 2)) {
+        return false;
+      }
+      i += t_[i].size;
+
+      i++;  // ptr move to result[0][1]
       // ["mining.notify","01000002"]
       if (!(t_[i].type == JSMN_ARRAY && t_[i].size == 2)) {
         return false;
@@ -497,11 +1189,11 @@ bool StratumMessage::getExtraNonce1AndExtraNonce2Size(uint32_t *nonce1,
 
       // extranonce1, hex
       i++;  // ptr move to result[1]
-      *nonce1 = (uint32_t)strtoul(getJsonStr(&t_[i]).c_str(), NULL, 16);
+      *nonce1 = getJsonHex32(&t_[i]);
 
       // Extranonce2_size
       i++;  // ptr move to result[2]
-      *n2size = (int32_t)strtol(getJsonStr(&t_[i]).c_str(), NULL, 10);
+      *n2size = (int32_t)getJsonDec32(&t_[i]);
 
       r = true;
       break;
@@ -512,173 +1204,510 @@ bool StratumMessage::getExtraNonce1AndExtraNonce2Size(uint32_t *nonce1,
 
 
 ///////////////////////////////// UpStratumClient //////////////////////////////
+//
+// the kernel gives up on a pool which doesn't ack the data (TCP_USER_TIMEOUT)
+// or the keepalives in about timeoutMs. only once the pool answers the
+// pings, the others keep the defaults of the kernel.
+//
+static void setUpSocketTimeouts(evutil_socket_t fd, const int32_t timeoutMs) {
+  int val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char *)&val, sizeof(val));
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+  const int kCount = 3;
+  int idle     = std::max(timeoutMs / 2000, 1);
+  int interval = std::max(timeoutMs / 2000 / kCount, 1);
+  int count    = kCount;
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,  (const char *)&idle,     sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (const char *)&interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT,   (const char *)&count,    sizeof(count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+  unsigned int ms = (unsigned int)timeoutMs;
+  setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms));
+#endif
+}
+
 UpStratumClient::UpStratumClient(const int8_t idx, struct event_base *base,
                                  const string &userName, StratumServer *server)
-: state_(UP_INIT), idx_(idx), server_(server), poolDefaultDiff_(0)
+: shareBatchCount_(0), shareBatchBeginUs_(0), isCorked_(false),
+isPipelined_(false), isHandshakeFailed_(false), state_(UP_INIT), idx_(idx), server_(server), poolIdx_(0), poolDefaultDiff_(0),
+latestMiningNotify_(NULL), latestCleanMiningNotify_(NULL),
+jobTimes_((uint32_t)std::max(1, server->getAgentConf().jobHistoryDepth_))
 {
   bev_ = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
   assert(bev_ != NULL);
 
-  inBuf_ = evbuffer_new();
-  assert(inBuf_ != NULL);
+  shareBuf_ = evbuffer_new();
+  shareFlushEvent_ = event_new(base, -1, 0,
+                               UpStratumClient::shareFlushCallback, this);
 
   bufferevent_setcb(bev_,
-                    StratumServer::upReadCallback, NULL,
+                    StratumServer::upReadCallback,
+                    StratumServer::upWriteCallback,
                     StratumServer::upEventCallback, this);
   bufferevent_enable(bev_, EV_READ|EV_WRITE);
+  evbuffer_add_cb(bufferevent_get_output(bev_), UpStratumClient::outputCallback, this);
 
   extraNonce1_ = 0u;
   extraNonce2_ = 0u;
   userName_ = userName;
 
-  latestJobId_[0] = latestJobId_[1] = latestJobId_[2] = 0;
-  latestJobGbtTime_[0] = latestJobGbtTime_[1] = latestJobGbtTime_[2] = 0;
-
   lastJobReceivedTime_ = 0u;
 
+  lastRecvMs_      = nowMs();
+  pingId_          = 0u;
+  pingSentUs_      = 0;
+  isPongSupported_ = false;
+  isPingDisabled_  = false;
+
+  isSharesBatchSupported_ = false;
+  isConfigurePending_     = false;
+
+  isJobWindowComplete_ = true;
+
   DLOG(INFO) << "idx_: " << (int32_t)idx_ << std::endl;
 }
 
 UpStratumClient::~UpStratumClient() {
-  evbuffer_free(inBuf_);
+  if (latestMiningNotify_)
+    latestMiningNotify_->release();
+  if (latestCleanMiningNotify_)
+    latestCleanMiningNotify_->release();
+
+  event_free(shareFlushEvent_);
+  evbuffer_free(shareBuf_);
   bufferevent_free(bev_);
 }
 
-bool UpStratumClient::connect(struct sockaddr_in &sin) {
+bool UpStratumClient::connect(const SockAddr &addr) {
+  const AgentConf &conf = server_->getAgentConf();
+  isPipelined_ = conf.upPipelinedHandshake_ || conf.upTcpFastOpen_;
+
+#ifdef TCP_FASTOPEN_CONNECT
+  //
+  // connect() returns at once and the SYN goes with the first write, i.e.
+  // the handshake below. the kernel falls back to the normal connect if
+  // it has no cookie of the pool yet, or the pool doesn't support it.
+  //
+  if (conf.upTcpFastOpen_) {
+    evutil_socket_t fd = socket(addr.getFamily(), SOCK_STREAM, 0);
+    if (fd < 0)
+      return false;
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val, sizeof(val));
+    bufferevent_setfd(bev_, fd);
+  }
+#endif
+
   // bufferevent_socket_connect(): This function returns 0 if the connect
   // was successfully launched, and -1 if an error occurred.
-  int res = bufferevent_socket_connect(bev_, (struct sockaddr *)&sin, sizeof(sin));
+  int res = bufferevent_socket_connect(bev_, (struct sockaddr *)addr.get(),
+                                       addr.getLength());
   if (res == 0) {
+    poolAddr_ = addr;
     state_ = UP_CONNECTED;
+
+    // subscribe and authorize back to back, they are sent once connected
+    if (isPipelined_) {
+      sendData(getSubscribeMessage() + getAuthorizeMessage());
+      isConfigurePending_ = conf.upSharesBatch_;
+    }
     return true;
   }
   return false;
 }
 
+string UpStratumClient::getSubscribeMessage() const {
+  string s;
+  // BIP 310, right before mining.subscribe. the pools which don't know it
+  // answer an error, and they get the frame of each share as before
+  if (server_->getAgentConf().upSharesBatch_) {
+    s = "{\"id\":3,\"method\":\"mining.configure\",\"params\":[[\""
+        EX_SHARES_BATCH_EXTENSION "\"],{}]}\n";
+  }
+  Strings::Append(s, "{\"id\":1,\"method\":\"mining.subscribe\""
+                  ",\"params\":[\"%s\"]}\n", BTCCOM_MINER_AGENT);
+  return s;
+}
+
+string UpStratumClient::getAuthorizeMessage() const {
+  return Strings::Format("{\"id\": 1, \"method\": \"mining.authorize\","
+                         "\"params\": [\"%s\", \"\"]}\n", userName_.c_str());
+}
+
 void UpStratumClient::recvData(struct evbuffer *buf) {
-  // moves all data from src to the end of dst
-  evbuffer_add_buffer(inBuf_, buf);
+  lastRecvMs_ = nowMs();
 
-  while (handleMessage()) {
+  // handle the messages in the bufferevent's input buffer directly, the
+  // incomplete one is left there until more data arrives
+  while (!isHandshakeFailed_ && handleMessage(buf)) {
   }
 }
 
-bool UpStratumClient::handleMessage() {
-  const size_t evBufLen = evbuffer_get_length(inBuf_);
+bool UpStratumClient::handleMessage(struct evbuffer *inBuf) {
+  const size_t evBufLen = evbuffer_get_length(inBuf);
 
   // no matter what kind of messages, length should at least 4 bytes
   if (evBufLen < 4)
     return false;
 
   uint8_t buf[4];
-  evbuffer_copyout(inBuf_, buf, 4);
+  evbuffer_copyout(inBuf, buf, 4);
 
   // handle ex-message
   if (buf[0] == CMD_MAGIC_NUMBER) {
-    const uint16_t exMessageLen = *(uint16_t *)(buf + 2);
+    const uint16_t exMessageLen = readUint16LE(buf + 2);
 
+    if (exMessageLen < EX_MESSAGE_HEADER_LEN) {
+      // we can't find the next frame, drop all of them
+      LOG(ERROR) << "invalid ex-message, len: " << exMessageLen << std::endl;
+      evbuffer_drain(inBuf, evBufLen);
+      return false;
+    }
     if (evBufLen < exMessageLen)  // didn't received the whole message yet
       return false;
 
-    // copies and removes the first datlen bytes from the front of buf
-    // into the memory at data
-    string exMessage;
-    exMessage.resize(exMessageLen);
-    evbuffer_remove(inBuf_, (uint8_t *)exMessage.data(), exMessage.size());
+    // decode in place, usually it's in one chunk already
+    const uint8_t *p = evbuffer_pullup(inBuf, exMessageLen);
+    ExMessageReader r(p, exMessageLen);
 
     switch (buf[1]) {
       case CMD_MINING_SET_DIFF:
-        handleExMessage_MiningSetDiff(&exMessage);
+        handleExMessage_MiningSetDiff(r);
+        break;
+
+      case CMD_PONG:
+        handleExMessage_Pong(r);
         break;
 
       default:
-        LOG(ERROR) << "received unknown ex-message, type: " << buf[1]
+        LOG(ERROR) << "received unknown ex-message, type: " << (uint32_t)buf[1]
         << ", len: " << exMessageLen << std::endl;
         break;
     }
+    evbuffer_drain(inBuf, exMessageLen);
     return true;  // read message success, return true
   }
 
   // stratum message
-  string line;
-  if (tryReadLine(line, inBuf_)) {
-    handleStratumMessage(line);
+  const char *line = NULL;
+  size_t len = 0;
+  if (tryPullupLine(inBuf, &line, &len)) {
+    handleStratumMessage(line, len);
+    evbuffer_drain(inBuf, len);
     return true;
   }
 
   return false;  // read mesasge failure
 }
 
-void UpStratumClient::handleExMessage_MiningSetDiff(const string *exMessage) {
-  //
-  // CMD_MINING_SET_DIFF
-  // | magic_number(1) | cmd(1) | len (2) | diff_2_exp(1) | count(2) | session_id (2) ... |
-  //
-  const uint8_t *p = (uint8_t *)exMessage->data();
-  const uint8_t diff_2exp = *(p + 4);
-  const uint64_t diff = (uint64_t)exp2(diff_2exp);
-
-  const uint16_t count   = *(uint16_t *)(p + 5);
-  uint16_t *sessionIdPtr =  (uint16_t *)(p + 7);
+void UpStratumClient::handleExMessage_MiningSetDiff(const ExMessageReader &r) {
+  ExMiningSetDiff msg;
+  if (!msg.decode(r)) {
+    LOG(ERROR) << "up[" << (int32_t)idx_ << "] invalid CMD_MINING_SET_DIFF" << std::endl;
+    return;
+  }
+  const uint64_t diff = (uint64_t)exp2(msg.diff2Exp_);
 
-  for (size_t i = 0; i < count; i++) {
-    uint16_t sessionId = *sessionIdPtr++;
-    server_->sendMiningDifficulty(this, sessionId, diff);
+  for (uint16_t i = 0; i < msg.count_; i++) {
+    server_->sendMiningDifficulty(this, msg.getSessionId(i), diff);
   }
 
   LOG(INFO) << "up[" << (int32_t)idx_ << "] CMD_MINING_SET_DIFF, diff: "
-  << diff << ", sessions count: " << count << std::endl;
+  << diff << ", sessions count: " << msg.count_ << std::endl;
+}
+
+void UpStratumClient::handleExMessage_Pong(const ExMessageReader &r) {
+  ExPing msg;
+  if (!msg.decode(r) || !msg.isPong_) {
+    LOG(ERROR) << "up[" << (int32_t)idx_ << "] invalid CMD_PONG" << std::endl;
+    return;
+  }
+  if (pingSentUs_ == 0 || msg.id_ != pingId_)
+    return;  // not the one in flight
+
+  heartbeatRtt_.addSample(nowUs() - pingSentUs_);
+  pingSentUs_ = 0;
+  if (!isPongSupported_) {
+    isPongSupported_ = true;
+    const int32_t timeoutMs = server_->getAgentConf().upDeadTimeoutMs_;
+    if (timeoutMs > 0)
+      setUpSocketTimeouts(bufferevent_getfd(bev_), timeoutMs);
+  }
+}
+
+void UpStratumClient::sendPing() {
+  if (isPingDisabled_)
+    return;
+
+  if (pingSentUs_ != 0) {
+    const int64_t waitMs = (nowUs() - pingSentUs_) / 1000;
+    if (!isPongSupported_ && waitMs > server_->getAgentConf().upDeadTimeoutMs_) {
+      LOG(WARNING) << "up[" << (int32_t)idx_ << "] the pool doesn't answer "
+      "CMD_PING, heartbeat is off" << std::endl;
+      isPingDisabled_ = true;
+    }
+    return;  // still in flight
+  }
+
+  ExPing ping;
+  ping.id_ = ++pingId_;
+  if (ping.encode(getExMessageOutput()))
+    pingSentUs_ = nowUs();
 }
 
 void UpStratumClient::sendData(const char *data, size_t len) {
+  // keep the order, e.g. shares must arrive before unregister the worker
+  if (shareBatchCount_ > 0)
+    flushShares();
+
   // add data to a bufferevent’s output buffer
   bufferevent_write(bev_, data, len);
 //  DLOG(INFO) << "UpStratumClient send(" << len << "): " << data << std::endl;
 }
 
-void UpStratumClient::sendMiningNotify(const string &line) {
+void UpStratumClient::beginShareBatch() {
+  const AgentConf &conf = server_->getAgentConf();
+
+  struct timeval tv;
+  evutil_gettimeofday(&tv, NULL);
+  shareBatchBeginUs_ = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+  if (conf.upShareBatchDelayMs_ <= 0) {
+    // at the end of this event loop iteration
+    event_active(shareFlushEvent_, EV_TIMEOUT, 1);
+  } else {
+    tv.tv_sec  = conf.upShareBatchDelayMs_ / 1000;
+    tv.tv_usec = (conf.upShareBatchDelayMs_ % 1000) * 1000;
+    event_add(shareFlushEvent_, &tv);
+  }
+}
+
+void UpStratumClient::submitShare(const ExSubmitShare &share) {
+  if (shareBatchCount_ == 0)
+    beginShareBatch();
+
+  // keep the order of the shares, the batched ones came first
+  encodeBatchedShares();
+  share.encode(shareBuf_);
+  shareBatchCount_++;
+
+  const size_t bytes = evbuffer_get_length(shareBuf_) +
+                       batchedShares_.size() * kBatchedShareBytes_;
+  if (bytes >= (size_t)server_->getAgentConf().upShareBatchBytes_)
+    flushShares();
+}
+
+void UpStratumClient::submitShare(const ExBatchedShare &share) {
+  if (shareBatchCount_ == 0)
+    beginShareBatch();
+
+  batchedShares_.push_back(share);
+  shareBatchCount_++;
+
+  const size_t bytes = evbuffer_get_length(shareBuf_) +
+                       batchedShares_.size() * kBatchedShareBytes_;
+  if (bytes >= (size_t)server_->getAgentConf().upShareBatchBytes_ ||
+      batchedShares_.size() >= ExSubmitSharesBatch::kMaxShares_)
+    flushShares();
+}
+
+void UpStratumClient::encodeBatchedShares() {
+  if (batchedShares_.empty())
+    return;
+  ExSubmitSharesBatch::encode(shareBuf_, batchedShares_);
+  batchedShares_.clear();
+}
+
+struct evbuffer *UpStratumClient::getExMessageOutput() {
+  // keep the order, e.g. shares must arrive before unregister the worker
+  if (shareBatchCount_ > 0)
+    flushShares();
+  return bufferevent_get_output(bev_);
+}
+
+void UpStratumClient::outputCallback(struct evbuffer *buf,
+                                     const struct evbuffer_cb_info *info, void *ptr) {
+  if (info->n_added > 0)
+    static_cast<UpStratumClient *>(ptr)->server_->addUpSentBytes(info->n_added);
+}
+
+void UpStratumClient::shareFlushCallback(evutil_socket_t fd,
+                                         short events, void *ptr) {
+  static_cast<UpStratumClient *>(ptr)->flushShares();
+}
+
+void UpStratumClient::flushShares() {
+  if (shareBatchCount_ == 0)
+    return;
+  event_del(shareFlushEvent_);
+
+  struct timeval tv;
+  evutil_gettimeofday(&tv, NULL);
+  const int64_t now = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+  shareBatchSizeHist_.add(shareBatchCount_);
+  shareBatchLatencyHist_.add(now > shareBatchBeginUs_ ? now - shareBatchBeginUs_ : 0);
+  shareBatchCount_ = 0;
+
+  encodeBatchedShares();
+  server_->addShareBytes(evbuffer_get_length(shareBuf_));
+
+  // uncork in StratumServer::upWriteCallback(), when all are written
+  if (!isCorked_)
+    setCork(true);
+  bufferevent_write_buffer(bev_, shareBuf_);
+}
+
+void UpStratumClient::setCork(bool cork) {
+#ifdef TCP_CORK
+  int val = cork ? 1 : 0;
+  setsockopt(bufferevent_getfd(bev_), IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+#endif
+  isCorked_ = cork;
+}
+
+void UpStratumClient::retire() {
+  // the shares still in the batch go out before the shutdown
+  flushShares();
+
+  bufferevent_setcb(bev_, UpStratumClient::retiredReadCallback,
+                    UpStratumClient::retiredWriteCallback,
+                    UpStratumClient::retiredEventCallback, this);
+  struct timeval tv = {kRetireTimeoutSec_, 0};
+  bufferevent_set_timeouts(bev_, &tv, &tv);
+
+  if (evbuffer_get_length(bufferevent_get_output(bev_)) == 0)
+    retiredWriteCallback(bev_, this);
+}
+
+void UpStratumClient::retiredReadCallback(struct bufferevent *bev, void *ptr) {
+  struct evbuffer *inBuf = bufferevent_get_input(bev);
+  evbuffer_drain(inBuf, evbuffer_get_length(inBuf));
+}
+
+void UpStratumClient::retiredWriteCallback(struct bufferevent *bev, void *ptr) {
+  // all are written, the pool reads them before our FIN
+  UpStratumClient *up = static_cast<UpStratumClient *>(ptr);
+  if (up->isCorked_)
+    up->setCork(false);
+#ifdef _WIN32
+  shutdown(bufferevent_getfd(bev), SD_SEND);
+#else
+  shutdown(bufferevent_getfd(bev), SHUT_WR);
+#endif
+}
+
+void UpStratumClient::retiredEventCallback(struct bufferevent *bev,
+                                           short events, void *ptr) {
+  UpStratumClient *up = static_cast<UpStratumClient *>(ptr);
+  up->server_->freeRetiredUpSession(up);
+}
+
+void UpStratumClient::sendMiningNotify() {
+  // not yet in the slot, the miners are still on the old one
+  if (server_->getUpSession(idx_) != this)
+    return;
+
   // send to all down sessions
-  server_->sendMiningNotifyToAll(idx_, latestMiningNotifyStr_);
+  server_->sendMiningNotifyToAll(idx_, latestMiningNotify_);
 }
 
-void UpStratumClient::convertMiningNotifyStr(const string &line) {
-  const char *pch = splitNotify(line);
-  latestMiningNotifyStr_.clear();
+void UpStratumClient::convertMiningNotifyStr(const char *line, size_t len) {
+  const char *pch = splitNotify(line, len);
 
-  latestMiningNotifyStr_.append(line.c_str(), pch - line.c_str());
-  latestMiningNotifyStr_.append(Strings::Format("%08x", extraNonce1_));
-  latestMiningNotifyStr_.append(pch);
+  string notify;
+  notify.reserve(len + 8);
+  notify.append(line, pch - line);
+  notify.append(Strings::Format("%08x", extraNonce1_));
+  notify.append(pch, line + len - pch);
+
+  // serialize once, the buffer is shared by all the down sessions. the old
+  // one will be freed after all the down sessions have flushed it.
+  if (latestMiningNotify_)
+    latestMiningNotify_->release();
+  latestMiningNotify_ = SharedBuffer::create(notify);
+
+  if (latestCleanMiningNotify_) {
+    latestCleanMiningNotify_->release();
+    latestCleanMiningNotify_ = NULL;
+  }
+}
+
+void UpStratumClient::addJobTemplate(const StratumJob &sjob) {
+  // the jobs before it are stale, see JobTimeRing::findTemplate()
+  if (sjob.isClean_)
+    isJobWindowComplete_ = true;
+
+  JobTemplate job;
+  if (!job.init(sjob, extraNonce1_)) {
+    LOG(ERROR) << "up[" << (int32_t)idx_ << "] invalid job, jobId: "
+    << sjob.jobId_ << ", the difficulty of its shares is not checked" << std::endl;
+  }
+  job.receivedTime_ = (uint32_t)time(NULL);
+  jobTimes_.addTemplate(job);
+}
+
+const JobTemplate *UpStratumClient::findJobTemplate(const uint8_t jobId) const {
+  return jobTimes_.findTemplate(jobId);
+}
+
+SharedBuffer *UpStratumClient::getCleanMiningNotify() {
+  if (latestMiningNotify_ == NULL)
+    return NULL;
+
+  if (latestCleanMiningNotify_ == NULL) {
+    // clean_jobs where the parser found it, whatever the pool wrote there
+    string notify(latestMiningNotify_->data(), latestMiningNotify_->size());
+    StratumMessage smsg(notify);
+    StratumJob sjob;
+    if (!smsg.parseMiningNotify(sjob) || sjob.cleanPos_ < 0)
+      return NULL;
+
+    notify.replace(sjob.cleanPos_, sjob.cleanLen_, "true");
+    latestCleanMiningNotify_ = SharedBuffer::create(notify);
+  }
+  return latestCleanMiningNotify_;
 }
 
-void UpStratumClient::handleStratumMessage(const string &line) {
-  DLOG(INFO) << "UpStratumClient recv(" << line.size() << "): " << line << std::endl;
+void UpStratumClient::handleStratumMessage(const char *line, size_t len) {
+  DLOG(INFO) << "UpStratumClient recv(" << len << "): " << string(line, len) << std::endl;
 
-  StratumMessage smsg(line);
+  StratumMessage smsg(line, len);
   if (!smsg.isValid()) {
     LOG(ERROR) << "decode line fail, not a json string" << std::endl;
     return;
   }
 
-  const string method = smsg.getMethod();
   StratumJob sjob;
   uint32_t difficulty = 0u;
 
+  // the result of mining.configure, it comes before the subscribe's. only
+  // the first reply of id 3 while it's pending, nothing later is taken for it
+  if (isConfigurePending_ && state_ != UP_AUTHENTICATED &&
+      smsg.getMethod() == METHOD_UNKNOWN && smsg.getIdJson().equals("3")) {
+    isConfigurePending_ = false;
+    isSharesBatchSupported_ = smsg.getResultExtension(EX_SHARES_BATCH_EXTENSION);
+    LOG(INFO) << "up[" << (int32_t)idx_ << "] CMD_SUBMIT_SHARES_BATCH is "
+    << (isSharesBatchSupported_ ? "supported" : "not supported")
+    << " by the pool" << std::endl;
+    return;
+  }
+
   if (state_ == UP_AUTHENTICATED) {
+    const bool wasAvailable = isAvailable();
+
     if (smsg.parseMiningNotify(sjob)) {
       //
       // mining.notify
       //
-      convertMiningNotifyStr(line);  // convert mining.notify string
-      sendMiningNotify(line);        // send stratum job to all miners
-     
-      latestJobId_[0]      = latestJobId_[1];
-      latestJobGbtTime_[0] = latestJobGbtTime_[1];
-      latestJobId_[1]      = latestJobId_[2];
-      latestJobGbtTime_[1] = latestJobGbtTime_[2];
-
-      // the jobId always between [0, 9]
-      latestJobId_[2]      = (uint8_t)sjob.jobId_;
-      latestJobGbtTime_[2] = sjob.time_;
+      convertMiningNotifyStr(line, len);  // convert mining.notify string
+      jobTimes_.add((uint8_t)sjob.jobId_, sjob.time_, sjob.isClean_);
+      if (server_->getAgentConf().shareValidation_)
+        addJobTemplate(sjob);
+      sendMiningNotify();                 // send stratum job to all miners
 
       // set last job received time
       lastJobReceivedTime_ = (uint32_t)time(NULL);
@@ -698,6 +1727,10 @@ void UpStratumClient::handleStratumMessage(const string &line) {
         poolDefaultDiff_ = difficulty;
       }
     }
+
+    // it has the job and the difficulty now
+    if (!wasAvailable && isAvailable())
+      server_->upSessionAvailable(this);
   }
 
   if (state_ == UP_CONNECTED) {
@@ -707,8 +1740,11 @@ void UpStratumClient::handleStratumMessage(const string &line) {
     //
     uint32_t nonce1 = 0u;
     int32_t n2size = 0;
+    // e.g. an error, or a reply of another request. the pool is tried again
     if (!smsg.getExtraNonce1AndExtraNonce2Size(&nonce1, &n2size)) {
-      LOG(FATAL) << "get extra nonce1 and extra nonce2 failure" << std::endl;
+      LOG(ERROR) << "up[" << (int32_t)idx_ << "] get extra nonce1 and extra "
+      "nonce2 failure: " << string(line, len) << std::endl;
+      isHandshakeFailed_ = true;
       return;
     }
     extraNonce1_ = nonce1;
@@ -716,18 +1752,19 @@ void UpStratumClient::handleStratumMessage(const string &line) {
 
     // check extra nonce2's size, MUST be 8 bytes
     if (n2size != 8) {
-      LOG(FATAL) << "extra nonce2's size is NOT 8 bytes" << std::endl;
+      LOG(ERROR) << "up[" << (int32_t)idx_ << "] extra nonce2's size is NOT 8 bytes: "
+      << n2size << std::endl;
+      isHandshakeFailed_ = true;
       return;
     }
 
     // subscribe successful
     state_ = UP_SUBSCRIBED;
 
-    // do mining.authorize
-    string s = Strings::Format("{\"id\": 1, \"method\": \"mining.authorize\","
-                               "\"params\": [\"%s\", \"\"]}\n",
-                               userName_.c_str());
-    sendData(s);
+    // do mining.authorize, if it's not sent with the subscribe. its result
+    // may be right behind in the same read
+    if (!isPipelined_)
+      sendData(getAuthorizeMessage());
     return;
   }
 
@@ -739,6 +1776,9 @@ void UpStratumClient::handleStratumMessage(const string &line) {
     state_ = UP_AUTHENTICATED;  // authorize successful
     LOG(INFO) << "auth success, name: \"" << userName_
     << "\", extraNonce1: " << extraNonce1_ << std::endl;
+
+    // it may win the race of the slot
+    server_->upSessionAuthenticated(this);
     return;
   }
 }
@@ -747,7 +1787,7 @@ bool UpStratumClient::isAvailable() {
   const uint32_t kJobExpiredTime = 60 * 5;  // seconds
 
   if (state_ == UP_AUTHENTICATED &&
-      latestMiningNotifyStr_.empty() == false &&
+      latestMiningNotify_ != NULL &&
       poolDefaultDiff_ != 0 &&
       lastJobReceivedTime_ + kJobExpiredTime > (uint32_t)time(NULL)) {
     return true;
@@ -755,24 +1795,162 @@ bool UpStratumClient::isAvailable() {
   return false;
 }
 
+void UpStratumClient::exportState(HandoffWriter &w) {
+  w.putUint8((uint8_t)idx_);
+  w.putString(userName_);
+  w.putFd(bufferevent_getfd(bev_));
+
+  w.putUint8((uint8_t)state_);
+  w.putUint32(extraNonce1_);
+  w.putUint64(extraNonce2_);
+  w.putUint32(poolDefaultDiff_);
+  if (latestMiningNotify_ != NULL)
+    w.putString(latestMiningNotify_->data(), latestMiningNotify_->size());
+  else
+    w.putString(string());
+  jobTimes_.exportState(w);
+  w.putUint32(lastJobReceivedTime_);
+  w.putUint8(isSharesBatchSupported_ ? 1 : 0);
+  encodeBatchedShares();
+
+  // the partial message, and the frames not written yet. the batched
+  // shares are always newer than the output buffer.
+  w.putEvbuffers(bufferevent_get_input(bev_), NULL);
+  w.putEvbuffers(bufferevent_get_output(bev_), shareBuf_);
+}
+
+UpStratumClient *UpStratumClient::importState(HandoffReader &r,
+                                              struct event_base *base,
+                                              StratumServer *server) {
+  const int8_t idx = (int8_t)r.getUint8();
+  const string userName = r.getString();
+  const evutil_socket_t fd = r.getFd();
+  if (!r.isValid())
+    return NULL;
+
+  UpStratumClient *up = new UpStratumClient(idx, base, userName, server);
+  bufferevent_setfd(up->bev_, fd);
+  bufferevent_enable(up->bev_, EV_READ|EV_WRITE);
+
+  up->state_           = (UpStratumClientState)r.getUint8();
+  up->extraNonce1_     = r.getUint32();
+  up->extraNonce2_     = r.getUint64();
+  up->poolDefaultDiff_ = r.getUint32();
+  const string notify  = r.getString();
+  if (!notify.empty())
+    up->latestMiningNotify_ = SharedBuffer::create(notify);
+  up->jobTimes_.importState(r);
+  up->lastJobReceivedTime_ = r.getUint32();
+  up->isSharesBatchSupported_ = (r.getUint8() != 0);
+  up->isJobWindowComplete_ = false;
+
+  const string input  = r.getString();
+  const string output = r.getString();
+  if (!r.isValid() || up->state_ != UP_AUTHENTICATED) {
+    delete up;
+    return NULL;
+  }
+  addToInput(up->bev_, input);
+  up->sendData(output);
+
+  // the old process may leave it corked
+  up->setCork(false);
+
+  struct sockaddr_storage addr;
+  ev_socklen_t len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr *)&addr, &len) == 0) {
+    if (addr.ss_family == AF_INET) {
+      const struct sockaddr_in *sin = (const struct sockaddr_in *)&addr;
+      up->poolAddr_ = SockAddr::fromIPv4(sin->sin_addr, ntohs(sin->sin_port));
+    } else if (addr.ss_family == AF_INET6) {
+      const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&addr;
+      up->poolAddr_ = SockAddr::fromIPv6(sin6->sin6_addr, ntohs(sin6->sin6_port));
+    }
+  }
+  return up;
+}
+
 
 ////////////////////////////////// StratumSession //////////////////////////////
 StratumSession::StratumSession(const int8_t upSessionIdx,
                                const uint16_t sessionId,
                                struct bufferevent *bev, StratumServer *server,
                                struct in_addr saddr)
-: state_(DOWN_CONNECTED), minerAgent_(NULL), upSessionIdx_(upSessionIdx),
-sessionId_(sessionId), bev_(bev), server_(server), saddr_(saddr)
+: state_(DOWN_CONNECTED), minerAgent_(NULL), diff_(0), prevDiff_(0),
+upSessionIdx_(upSessionIdx), upDownSessionPos_(0), isFlushPending_(false),
+sessionId_(sessionId), bev_(bev),
+server_(server), saddr_(saddr), isRegistered_(false), shareFilterSeq_(0)
 {
-  inBuf_ = evbuffer_new();
-  assert(inBuf_ != NULL);
+  outBuf_ = evbuffer_new();
+  assert(outBuf_ != NULL);
 }
 
 StratumSession::~StratumSession() {
-  evbuffer_free(inBuf_);
+  if (minerAgent_)
+    free(minerAgent_);
+  evbuffer_free(outBuf_);
   bufferevent_free(bev_);
 }
 
+void StratumSession::exportState(HandoffWriter &w) {
+  w.putFd(bufferevent_getfd(bev_));
+  w.putUint16(sessionId_);
+  w.putUint8((uint8_t)upSessionIdx_);
+  w.putUint8((uint8_t)state_);
+  w.putUint8(minerAgent_ != NULL ? 1 : 0);
+  w.putString(minerAgent_ != NULL ? minerAgent_ : "");
+  w.putString(workerName_);
+  w.putUint32((uint32_t)saddr_.s_addr);  // network order
+  w.putUint8(isRegistered_ ? 1 : 0);
+
+  // the partial line, and the responses not written yet
+  w.putEvbuffers(bufferevent_get_input(bev_), NULL);
+  w.putEvbuffers(bufferevent_get_output(bev_), outBuf_);
+}
+
+StratumSession *StratumSession::importState(HandoffReader &r, StratumServer *server) {
+  const evutil_socket_t fd = r.getFd();
+  const uint16_t sessionId = r.getUint16();
+  const int8_t upSessionIdx = (int8_t)r.getUint8();
+  const uint8_t state = r.getUint8();
+  const bool hasMinerAgent = r.getUint8() != 0;
+  const string minerAgent = r.getString();
+  const string workerName = r.getString();
+  struct in_addr saddr;
+  saddr.s_addr = r.getUint32();
+  const bool isRegistered = r.getUint8() != 0;
+  const string input  = r.getString();
+  const string output = r.getString();
+
+  if (!r.isValid() || state > DOWN_AUTHENTICATED) {
+    if (fd != -1)
+      evutil_closesocket(fd);
+    return NULL;
+  }
+
+  struct bufferevent *bev = bufferevent_socket_new(server->getEventBase(), fd,
+                                                   BEV_OPT_CLOSE_ON_FREE);
+  if (bev == NULL) {
+    evutil_closesocket(fd);
+    return NULL;
+  }
+
+  StratumSession *conn = new StratumSession(upSessionIdx, sessionId, bev, server, saddr);
+  conn->state_        = (StratumSessionState)state;
+  conn->workerName_   = workerName;
+  conn->isRegistered_ = isRegistered;
+  if (hasMinerAgent)
+    conn->minerAgent_ = strdup(minerAgent.c_str());
+
+  bufferevent_setcb(bev,
+                    StratumServer::downReadCallback, NULL,
+                    StratumServer::downEventCallback, (void*)conn);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  addToInput(bev, input);
+  bufferevent_write(bev, output.data(), output.size());
+  return conn;
+}
+
 void StratumSession::setReadTimeout(const int32_t timeout) {
   // clear it
   bufferevent_set_timeouts(bev_, NULL, NULL);
@@ -784,41 +1962,70 @@ void StratumSession::setReadTimeout(const int32_t timeout) {
 }
 
 void StratumSession::sendData(const char *data, size_t len) {
-  // add data to a bufferevent’s output buffer
-  bufferevent_write(bev_, data, len);
-  DLOG(INFO) << "send(" << len << "): " << data << std::endl;
+  // stage it, will be written to the bufferevent with others
+  evbuffer_add(outBuf_, data, len);
+  server_->scheduleDownFlush(this);
+  DLOG(INFO) << "send(" << len << "): " << string(data, len) << std::endl;
+}
+
+void StratumSession::sendData(SharedBuffer *buf) {
+  // add by reference, the data won't be copied
+  buf->addToEvbuffer(outBuf_);
+  server_->scheduleDownFlush(this);
+  DLOG(INFO) << "send shared(" << buf->size() << ")" << std::endl;
+}
+
+void StratumSession::flush() {
+  isFlushPending_ = false;
+  if (evbuffer_get_length(outBuf_) == 0)
+    return;
+
+  // moves all the chains, one writev() will carry everything
+  bufferevent_write_buffer(bev_, outBuf_);
 }
 
 void StratumSession::recvData(struct evbuffer *buf) {
-  // moves all data from src to the end of dst
-  evbuffer_add_buffer(inBuf_, buf);
+  //
+  // frame the bufferevent's input buffer directly, miners may pipeline
+  // several submits in one TCP segment, they are handled in a single pass.
+  // the incomplete line is left there until more data arrives.
+  //
+  StringRef lines[kMaxLinesPerBatch_];
+  size_t bytes = 0;
+  size_t count = 0;
+
+  while ((count = splitLines(buf, lines, kMaxLinesPerBatch_, &bytes)) > 0) {
+    handleStratumMessages(lines, count);
+    evbuffer_drain(buf, bytes);
+  }
+}
 
-  string line;
-  while (tryReadLine(line, inBuf_)) {
-    handleStratumMessage(line);
+void StratumSession::handleStratumMessages(const StringRef *lines, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    handleStratumMessage(lines[i].data_, lines[i].size_);
   }
 }
 
-void StratumSession::handleStratumMessage(const string &line) {
-  DLOG(INFO) << "recv(" << line.size() << "): " << line << std::endl;
+void StratumSession::handleStratumMessage(const char *line, size_t len) {
+  DLOG(INFO) << "recv(" << len << "): " << string(line, len) << std::endl;
+
+  // most of requests are 'mining.submit', try the fast path first
+  Share share;
+  StringRef idStr;
+  if (StratumMessage::parseMiningSubmitFast(line, len, &share, &idStr)) {
+    handleRequest_Submit(idStr, share);
+    return;
+  }
 
-  StratumMessage smsg(line);
+  StratumMessage smsg(line, len);
   if (!smsg.isValid()) {
     LOG(ERROR) << "decode line fail, not a json string" << std::endl;
     return;
   }
 
-  string idStr;
-  if (smsg.isStringId()) {
-    idStr = "\"" + smsg.getId() + "\"";
-  } else {
-    idStr = smsg.getId();
-  }
-  if (idStr.empty()) {
-    idStr = "null";
-  }
+  idStr = smsg.getIdJson();
 
-  if (!smsg.getMethod().empty()) {
+  if (smsg.getMethod() != METHOD_UNKNOWN) {
     handleRequest(idStr, smsg);
     return;
   }
@@ -827,41 +2034,68 @@ void StratumSession::handleStratumMessage(const string &line) {
   responseError(idStr, StratumError::ILLEGAL_PARARMS);
 }
 
-void StratumSession::responseError(const string &idStr, int errCode) {
+void StratumSession::responseError(const StringRef &idStr, int errCode) {
   //
   // {"id": 10, "result": null, "error":[21, "Job not found", null]}
   //
-  char buf[128];
-  int len = snprintf(buf, sizeof(buf),
-                     "{\"id\":%s,\"result\":null,\"error\":[%d,\"%s\",null]}\n",
-                     idStr.empty() ? "null" : idStr.c_str(),
+  const char *fmt = "{\"id\":%.*s,\"result\":null,\"error\":[%d,\"%s\",null]}\n";
+  const StringRef id = idStr.empty() ? StringRef("null", 4) : idStr;
+
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf), fmt, (int)id.size_, id.data_,
                      errCode, StratumError::toString(errCode));
+  if (len >= (int)sizeof(buf)) {
+    // very long id, rarely happens
+    sendData(Strings::Format(fmt, (int)id.size_, id.data_,
+                             errCode, StratumError::toString(errCode)));
+    return;
+  }
   sendData(buf, len);
 }
 
-void StratumSession::responseTrue(const string &idStr) {
-  const string s = "{\"id\":" + idStr + ",\"result\":true,\"error\":null}\n";
-  sendData(s);
+void StratumSession::responseTrue(const StringRef &idStr) {
+  const char *fmt = "{\"id\":%.*s,\"result\":true,\"error\":null}\n";
+
+  char buf[128];
+  int len = snprintf(buf, sizeof(buf), fmt, (int)idStr.size_, idStr.data_);
+  if (len >= (int)sizeof(buf)) {
+    // very long id, rarely happens
+    sendData(Strings::Format(fmt, (int)idStr.size_, idStr.data_));
+    return;
+  }
+  sendData(buf, len);
 }
 
-void StratumSession::handleRequest(const string &idStr,
+void StratumSession::handleRequest(const StringRef &idStr,
                                    const StratumMessage &smsg) {
-  const string method = smsg.getMethod();
-  if (method == "mining.submit") {  // most of requests are 'mining.submit'
-    handleRequest_Submit(idStr, smsg);
-  }
-  else if (method == "mining.subscribe") {
-    handleRequest_Subscribe(idStr, smsg);
-  }
-  else if (method == "mining.authorize") {
-    handleRequest_Authorize(idStr, smsg);
-  } else {
-    // unrecognised method, just ignore it
-    LOG(WARNING) << "unrecognised method: \"" << method << "\"" << std::endl;
+  Share share;
+
+  switch (smsg.getMethod()) {
+    case METHOD_MINING_SUBMIT:  // most of requests are 'mining.submit'
+      if (!smsg.parseMiningSubmit(share)) {
+        responseError(idStr, StratumError::ILLEGAL_PARARMS);
+        return;
+      }
+      handleRequest_Submit(idStr, share);
+      break;
+
+    case METHOD_MINING_SUBSCRIBE:
+      handleRequest_Subscribe(idStr, smsg);
+      break;
+
+    case METHOD_MINING_AUTHORIZE:
+      handleRequest_Authorize(idStr, smsg);
+      break;
+
+    default:
+      // unrecognised method, just ignore it
+      LOG(WARNING) << "unrecognised method: \""
+      << StratumMessage::getMethodName(smsg.getMethod()) << "\"" << std::endl;
+      break;
   }
 }
 
-void StratumSession::handleRequest_Subscribe(const string &idStr,
+void StratumSession::handleRequest_Subscribe(const StringRef &idStr,
                                              const StratumMessage &smsg) {
   if (state_ != DOWN_CONNECTED) {
     responseError(idStr, StratumError::UNKNOWN);
@@ -895,14 +2129,14 @@ void StratumSession::handleRequest_Subscribe(const string &idStr,
   //
   assert(kExtraNonce2Size_ == 4);
   const uint32_t extraNonce1 = (uint32_t)sessionId_;
-  const string s = Strings::Format("{\"id\":%s,\"result\":[[[\"mining.set_difficulty\",\"%08x\"]"
+  const string s = Strings::Format("{\"id\":%.*s,\"result\":[[[\"mining.set_difficulty\",\"%08x\"]"
                                    ",[\"mining.notify\",\"%08x\"]],\"%08x\",%d],\"error\":null}\n",
-                                   idStr.c_str(), extraNonce1, extraNonce1,
+                                   (int)idStr.size_, idStr.data_, extraNonce1, extraNonce1,
                                    extraNonce1, kExtraNonce2Size_);
   sendData(s);
 }
 
-void StratumSession::handleRequest_Authorize(const string &idStr,
+void StratumSession::handleRequest_Authorize(const StringRef &idStr,
                                              const StratumMessage &smsg) {
   if (state_ != DOWN_SUBSCRIBED) {
     responseError(idStr, StratumError::NOT_SUBSCRIBED);
@@ -929,24 +2163,15 @@ void StratumSession::handleRequest_Authorize(const string &idStr,
   responseTrue(idStr);
   state_ = DOWN_AUTHENTICATED;
 
-  // sent sessionId, minerAgent_, workerName to server_
-  server_->registerWorker(this, minerAgent_, workerName);
-
-  // minerAgent_ will not use anymore
-  if (minerAgent_) {
-    free(minerAgent_);
-    minerAgent_ = NULL;
-  }
-
-  // send mining.set_difficulty
-  server_->sendDefaultMiningDifficulty(this);
-
-  // send latest stratum job
-  server_->sendMiningNotify(this);
+  // minerAgent_ and workerName are sent to the pool by server_, then the
+  // difficulty and the latest job. they are kept to register again if it's
+  // moved to another up session
+  workerName_ = workerName;
+  server_->downSessionAuthenticated(this);
 }
 
-void StratumSession::handleRequest_Submit(const string &idStr,
-                                          const StratumMessage &smsg) {
+void StratumSession::handleRequest_Submit(const StringRef &idStr,
+                                          const Share &share) {
   if (state_ != DOWN_AUTHENTICATED) {
     responseError(idStr, StratumError::UNAUTHORIZED);
     // there must be something wrong, send reconnect command
@@ -960,26 +2185,51 @@ void StratumSession::handleRequest_Submit(const string &idStr,
   //  params[2] = ExtraNonce 2
   //  params[3] = nTime
   //  params[4] = nonce
-  Share share;
-  if (!smsg.parseMiningSubmit(share)) {
-    responseError(idStr, StratumError::ILLEGAL_PARARMS);
+
+  const int err = server_->checkShare(share, this);
+  if (err != StratumError::NO_ERROR) {
+    responseError(idStr, err);
     return;
   }
 
   // submit share
   server_->submitShare(share, this);
 
-  responseTrue(idStr);  // we assume shares are valid
+  responseTrue(idStr);  // valid, or the pool will tell
+}
+
+void StratumSession::setDifficulty(const uint64_t diff) {
+  if (diff == diff_)
+    return;
+  prevDiff_ = diff_;
+  diff_     = diff;
 }
 
 
 
 /////////////////////////////////// StratumServer //////////////////////////////
 StratumServer::StratumServer(const string &listenIP, const uint16_t listenPort)
-:running_ (true), listenIP_(listenIP), listenPort_(listenPort), base_(NULL)
+:upSessionCount_(kDefaultUpSessionCount_),
+activeUpSessionCount_(kDefaultUpSessionCount_), running_ (true), reusePort_(false),
+isStarting_(false), startupBeginMs_(0),
+listenIP_(listenIP), listenPort_(listenPort),
+downFlushEvent_(NULL), downWriteCount_(0), downFlushCount_(0),
+lastDownWriteCount_(0), lastDownFlushCount_(0), lastStatsTime_(time(NULL)),
+shareCount_(0), shareBytes_(0), shareNoTimeCount_(0), shareBytesSaved_(0), cmdEvent_(NULL), handshakingCount_(0), isListenerPaused_(false),
+admissionTimer_(NULL), reconnectCount_(0), resolver_(NULL), isResolverOwned_(false),
+probeTimer_(NULL), minUpSessionCount_(kDefaultUpSessionCount_),
+maxUpSessionCount_(kDefaultUpSessionCount_), upSentBytes_(0),
+lastScaleSentBytes_(0), lastScaleMs_(0), scaleTimer_(NULL), heartbeatTimer_(NULL),
+base_(NULL), signal_event_(NULL), listener_(NULL)
 {
-  upSessions_    .resize(kUpSessionCount_, NULL);
-  upSessionCount_.resize(kUpSessionCount_, 0);
+  // the slots are added at runtime in auto mode, never reallocate the
+  // vectors of down sessions
+  upSessions_    .reserve(kMaxUpSessionCount_);
+  upDownSessions_.reserve(kMaxUpSessionCount_);
+  upSessions_    .resize(upSessionCount_, NULL);
+  upDownSessions_.resize(upSessionCount_);
+
+  cmdFds_[0] = cmdFds_[1] = -1;
 
   upEvTimer_ = NULL;
   downSessions_.resize(AGENT_MAX_SESSION_ID + 1, NULL);
@@ -997,11 +2247,55 @@ StratumServer::~StratumServer() {
     removeUpConnection(upsession);
   }
 
+  for (size_t i = 0; i < retiredUpSessions_.size(); i++) {
+    delete retiredUpSessions_[i];
+  }
+
+  for (size_t i = 0; i < upSessionRaces_.size(); i++) {
+    if (upSessionRaces_[i] == NULL)
+      continue;
+    finishUpSessionRace(upSessionRaces_[i]);
+    event_free(upSessionRaces_[i]->staggerTimer_);
+    delete upSessionRaces_[i];
+  }
+  for (size_t i = 0; i < poolProbes_.size(); i++) {
+    if (poolProbes_[i]->isResolving_)
+      resolver_->cancel(poolProbes_[i]);
+    if (poolProbes_[i]->bev_ != NULL)
+      bufferevent_free(poolProbes_[i]->bev_);
+    delete poolProbes_[i];
+  }
+  if (probeTimer_)
+    event_free(probeTimer_);
+  if (scaleTimer_)
+    event_free(scaleTimer_);
+  if (heartbeatTimer_)
+    event_free(heartbeatTimer_);
+  if (admissionTimer_)
+    event_free(admissionTimer_);
+  for (size_t i = 0; i < pendingAccepts_.size(); i++) {
+    evutil_closesocket(pendingAccepts_[i].fd_);
+  }
+
+  // evdns needs the event base
+  if (isResolverOwned_)
+    delete resolver_;
+
   if (signal_event_)
     event_free(signal_event_);
 
   if (upEvTimer_)
-    event_del(upEvTimer_);
+    event_free(upEvTimer_);
+
+  if (downFlushEvent_)
+    event_free(downFlushEvent_);
+
+  if (cmdEvent_)
+    event_free(cmdEvent_);
+  for (int i = 0; i < 2; i++) {
+    if (cmdFds_[i] != -1)
+      evutil_closesocket(cmdFds_[i]);
+  }
 
   if (listener_)
     evconnlistener_free(listener_);
@@ -1019,6 +2313,95 @@ void StratumServer::stop() {
   event_base_loopexit(base_, NULL);
 }
 
+void StratumServer::setAgentConf(const AgentConf &conf) {
+  conf_ = conf;
+}
+
+void StratumServer::setUpSessionCount(const int8_t count) {
+  assert(base_ == NULL && count > 0);
+  upSessionCount_       = count;
+  activeUpSessionCount_ = count;
+  minUpSessionCount_    = count;
+  if (maxUpSessionCount_ < count)
+    maxUpSessionCount_ = count;
+  upSessions_    .resize(upSessionCount_, NULL);
+  upDownSessions_.resize(upSessionCount_);
+}
+
+void StratumServer::setMaxUpSessionCount(const int8_t count) {
+  assert(base_ == NULL && count > 0);
+  maxUpSessionCount_ = std::max(count, minUpSessionCount_);
+}
+
+void StratumServer::setSessionIdRange(const uint16_t minId, const uint16_t maxId) {
+  sessionIDManager_.setRange(minId, maxId);
+}
+
+void StratumServer::setReusePort(const bool reusePort) {
+  reusePort_ = reusePort;
+}
+
+void StratumServer::setResolver(Resolver *resolver) {
+  assert(resolver_ == NULL);
+  resolver_ = resolver;
+  isResolverOwned_ = false;
+}
+
+bool StratumServer::postCommand(const int32_t cmd) {
+  if (!cmdQueue_.push(cmd))
+    return false;
+
+  // wake up the event loop, write() is async-signal-safe
+  const char c = 0;
+  send(cmdFds_[1], &c, 1, 0);
+  return true;
+}
+
+void StratumServer::cmdCallback(evutil_socket_t fd, short events, void *ptr) {
+  StratumServer *server = static_cast<StratumServer *>(ptr);
+
+  char buf[64];
+  while (recv(fd, buf, sizeof(buf), 0) > 0) {
+  }
+
+  int32_t cmd;
+  while (server->cmdQueue_.pop(&cmd)) {
+    switch (cmd) {
+      case SERVER_CMD_STOP:
+        server->stop();
+        break;
+      case SERVER_CMD_STATS:
+        if (!server->statsQueue_.push(server->getStats())) {
+          LOG(WARNING) << "stats queue is full" << std::endl;
+        }
+        break;
+      default:
+        LOG(ERROR) << "unknown server command: " << cmd << std::endl;
+        break;
+    }
+  }
+}
+
+ServerStats StratumServer::getStats() const {
+  ServerStats stats;
+  for (size_t i = 0; i < upDownSessions_.size(); i++) {
+    stats.downSessionCount_ += (uint32_t)upDownSessions_[i].size();
+  }
+  stats.downWriteCount_ = downWriteCount_;
+  stats.downFlushCount_ = downFlushCount_;
+  stats.shareCount_     = shareCount_;
+  stats.shareBytes_       = shareBytes_;
+  stats.shareNoTimeCount_ = shareNoTimeCount_;
+  stats.shareBytesSaved_  = shareBytesSaved_;
+  stats.shareRejects_   = shareRejects_;
+  for (size_t i = 0; i < upSessions_.size(); i++) {
+    if (upSessions_[i] != NULL && upSessions_[i]->isPongSupported_)
+      stats.upRttMaxUs_ = std::max(stats.upRttMaxUs_,
+                                   upSessions_[i]->heartbeatRtt_.getSrtt());
+  }
+  return stats;
+}
+
 void StratumServer::addUpPool(const string &host, const uint16_t port,
                               const string &upPoolUserName) {
   upPoolHost_    .push_back(host);
@@ -1028,169 +2411,1008 @@ void StratumServer::addUpPool(const string &host, const uint16_t port,
   LOG(INFO) << "add pool: " << host << ":" << port << ", username: " << upPoolUserName << std::endl;
 }
 
-UpStratumClient *StratumServer::createUpSession(const int8_t idx) {
-  for (size_t i = 0; i < upPoolHost_.size(); i++) {
-    struct sockaddr_in sin;
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_port   = htons(upPoolPort_[i]);
-    if (!resolve(upPoolHost_[i], &sin.sin_addr)) {
+bool StratumServer::createUpSession(const int8_t idx) {
+  return startUpSessionRace(idx, -1);
+}
+
+bool StratumServer::startUpSessionRace(const int8_t idx, const int32_t poolIdx) {
+  if (upSessionRaces_.size() < (size_t)upSessionCount_)
+    upSessionRaces_.resize(upSessionCount_, NULL);
+
+  UpSessionRace *race = upSessionRaces_[idx];
+  if (race == NULL) {
+    race = new UpSessionRace();
+    race->server_    = this;
+    race->idx_       = idx;
+    race->poolIdx_   = -1;
+    race->isPending_ = false;
+    race->beginMs_   = 0;
+    race->resolves_.resize(upPoolHost_.size());
+    for (size_t i = 0; i < race->resolves_.size(); i++) {
+      race->resolves_[i].race_        = race;
+      race->resolves_[i].poolIdx_     = i;
+      race->resolves_[i].isResolving_ = false;
+    }
+    race->staggerTimer_ = event_new(base_, -1, EV_PERSIST,
+                                    StratumServer::upSessionStaggerCallback, race);
+    upSessionRaces_[idx] = race;
+  }
+  if (race->isPending_)
+    return false;
+
+  race->isPending_ = true;
+  race->poolIdx_   = poolIdx;
+  race->beginMs_   = nowMs();
+  struct timeval tv = {0, kConnectStaggerMs_ * 1000};
+  event_add(race->staggerTimer_, &tv);
+
+  // the callbacks may be called right now if the hosts are cached
+  for (size_t i = 0; i < race->resolves_.size(); i++) {
+    race->resolves_[i].isResolving_ = (poolIdx == -1 || (size_t)poolIdx == i);
+  }
+  for (size_t i = 0; i < race->resolves_.size() && race->isPending_; i++) {
+    if (!race->resolves_[i].isResolving_)
+      continue;
+    resolver_->resolve(upPoolHost_[i], StratumServer::upPoolResolveCallback,
+                       &race->resolves_[i]);
+  }
+  return true;
+}
+
+bool StratumServer::isUpSessionPending(const int8_t idx) const {
+  return (size_t)idx < upSessionRaces_.size() &&
+         upSessionRaces_[idx] != NULL && upSessionRaces_[idx]->isPending_;
+}
+
+void StratumServer::upPoolResolveCallback(const string &host,
+                                          const vector<SockAddr> &addrs,
+                                          void *ptr) {
+  UpPoolResolve *resolve = static_cast<UpPoolResolve *>(ptr);
+  UpSessionRace *race = resolve->race_;
+
+  resolve->isResolving_ = false;
+  race->server_->addUpPoolAddresses(race, resolve->poolIdx_, addrs);
+}
+
+void StratumServer::addUpPoolAddresses(UpSessionRace *race, const size_t poolIdx,
+                                       const vector<SockAddr> &addrs) {
+  if (addrs.size() == 0) {
+    LOG(ERROR) << "resolve pool failure: " << upPoolHost_[poolIdx] << std::endl;
+  }
+
+  // keep the pools' order, the primary pool is tried first
+  size_t pos = 0;
+  while (pos < race->addrs_.size() && race->addrs_[pos].poolIdx_ <= poolIdx)
+    pos++;
+
+  vector<UpPoolAddress> poolAddrs(addrs.size());
+  for (size_t i = 0; i < addrs.size(); i++) {
+    poolAddrs[i].poolIdx_ = poolIdx;
+    poolAddrs[i].addr_    = addrs[i];
+    poolAddrs[i].addr_.setPort(upPoolPort_[poolIdx]);
+  }
+  race->addrs_.insert(race->addrs_.begin() + pos, poolAddrs.begin(), poolAddrs.end());
+
+  // nothing is in flight, don't wait for the next stagger
+  if (race->attempts_.size() == 0)
+    startUpSessionAttempt(race);
+
+  checkUpSessionRace(race);
+}
+
+bool StratumServer::startUpSessionAttempt(UpSessionRace *race) {
+  while (race->addrs_.size() > 0) {
+    const UpPoolAddress a = race->addrs_.front();
+    race->addrs_.erase(race->addrs_.begin());
+
+    UpStratumClient *up = new UpStratumClient(race->idx_, base_,
+                                              upPoolUserName_[a.poolIdx_], this);
+    up->poolIdx_ = a.poolIdx_;
+    if (!up->connect(a.addr_)) {
+      delete up;
+      continue;
+    }
+    DLOG(INFO) << "up session[" << (int32_t)race->idx_ << "] try "
+    << upPoolHost_[a.poolIdx_] << " (" << a.addr_.toString() << ")" << std::endl;
+
+    race->attempts_.push_back(up);
+    return true;
+  }
+  return false;
+}
+
+void StratumServer::upSessionStaggerCallback(evutil_socket_t fd,
+                                             short events, void *ptr) {
+  UpSessionRace *race = static_cast<UpSessionRace *>(ptr);
+  StratumServer *server = race->server_;
+
+  if (nowMs() - race->beginMs_ > kConnectRaceTimeoutMs_) {
+    LOG(ERROR) << "up session[" << (int32_t)race->idx_ << "] timeout, "
+    << race->attempts_.size() << " attempts in flight" << std::endl;
+    server->finishUpSessionRace(race);
+    server->checkStartup();
+    return;
+  }
+  server->startUpSessionAttempt(race);
+}
+
+void StratumServer::checkUpSessionRace(UpSessionRace *race) {
+  if (!race->isPending_ || race->attempts_.size() > 0 || race->addrs_.size() > 0)
+    return;
+
+  for (size_t i = 0; i < race->resolves_.size(); i++) {
+    if (race->resolves_[i].isResolving_)
+      return;
+  }
+
+  LOG(ERROR) << "all the pools are unavailable, up session: "
+  << (int32_t)race->idx_ << std::endl;
+  finishUpSessionRace(race);
+  checkStartup();
+}
+
+void StratumServer::cancelUpSessionAttempts(UpSessionRace *race) {
+  for (size_t i = 0; i < race->attempts_.size(); i++) {
+    delete race->attempts_[i];
+  }
+  race->attempts_.clear();
+  race->addrs_.clear();
+
+  for (size_t i = 0; i < race->resolves_.size(); i++) {
+    if (!race->resolves_[i].isResolving_)
+      continue;
+    resolver_->cancel(&race->resolves_[i]);
+    race->resolves_[i].isResolving_ = false;
+  }
+}
+
+void StratumServer::finishUpSessionRace(UpSessionRace *race) {
+  event_del(race->staggerTimer_);
+  cancelUpSessionAttempts(race);
+  race->isPending_ = false;
+}
+
+StratumServer::UpSessionRace *StratumServer::findUpSessionRace(UpStratumClient *up) {
+  if ((size_t)up->idx_ >= upSessionRaces_.size() || upSessionRaces_[up->idx_] == NULL)
+    return NULL;
+
+  UpSessionRace *race = upSessionRaces_[up->idx_];
+  if (std::find(race->attempts_.begin(), race->attempts_.end(), up) == race->attempts_.end())
+    return NULL;
+  return race;
+}
+
+void StratumServer::upSessionAuthenticated(UpStratumClient *up) {
+  UpSessionRace *race = findUpSessionRace(up);
+  if (race == NULL)
+    return;
+
+  // the winner, close the others
+  race->attempts_.erase(std::find(race->attempts_.begin(), race->attempts_.end(), up));
+  cancelUpSessionAttempts(race);
+
+  LOG(INFO) << "success connect[" << (int32_t)up->idx_ << "]: "
+  << upPoolHost_[up->poolIdx_] << ":" << upPoolPort_[up->poolIdx_]
+  << " (" << up->poolAddr_.toString() << "), username: "
+  << upPoolUserName_[up->poolIdx_] << ", in " << (nowMs() - race->beginMs_)
+  << " ms" << std::endl;
+
+  // moved to another pool, the old one keeps the slot and its miners until
+  // the new one has the job and the difficulty, see upSessionAvailable().
+  // it's given up if that takes longer than the race's timeout.
+  if (upSessions_[up->idx_] != NULL) {
+    race->attempts_.push_back(up);
+    return;
+  }
+  finishUpSessionRace(race);
+  addUpConnection(up);
+
+  const vector<StratumSession *> &sessions = upDownSessions_[up->idx_];
+  for (size_t i = 0; i < sessions.size(); i++) {
+    resumeDownSession(sessions[i]);
+  }
+}
+
+void StratumServer::upSessionAvailable(UpStratumClient *up) {
+  UpSessionRace *race = findUpSessionRace(up);
+  if (race != NULL) {
+    race->attempts_.erase(std::find(race->attempts_.begin(), race->attempts_.end(), up));
+    finishUpSessionRace(race);
+
+    // the slot's miners go on with the new one's job and extraNonce1
+    UpStratumClient *old = upSessions_[up->idx_];
+    upSessions_[up->idx_] = NULL;
+    if (old != NULL)
+      retireUpSession(old);
+    addUpConnection(up);
+
+    const vector<StratumSession *> &sessions = upDownSessions_[up->idx_];
+    for (size_t i = 0; i < sessions.size(); i++) {
+      resumeDownSession(sessions[i]);
+    }
+  }
+
+  if (upSessions_[up->idx_] != up)
+    return;
+  checkStartup();
+}
+
+int32_t StratumServer::selectPreferredPool(const vector<RttEstimator> &rtts) {
+  int32_t best = -1;
+  for (size_t i = 0; i < rtts.size(); i++) {
+    if (!rtts[i].isHealthy())
       continue;
+    if (best == -1 || rtts[i].getScore() < rtts[best].getScore())
+      best = (int32_t)i;
+  }
+  if (best == -1)
+    return -1;
+
+  // the first one which is close enough to the best, so it fails back to
+  // the primary, and doesn't flap between the similar pools
+  const int64_t bestScore = rtts[best].getScore();
+  int64_t margin = bestScore / 5;
+  if (margin < kPoolScoreMarginUs_)
+    margin = kPoolScoreMarginUs_;
+
+  for (size_t i = 0; i < rtts.size(); i++) {
+    if (rtts[i].isHealthy() && rtts[i].getScore() <= bestScore + margin)
+      return (int32_t)i;
+  }
+  return best;
+}
+
+void StratumServer::probeTimerCallback(evutil_socket_t fd, short events, void *ptr) {
+  StratumServer *server = static_cast<StratumServer *>(ptr);
+  server->rebalanceUpSessions();
+  server->startProbes();
+}
+
+void StratumServer::startProbes() {
+  if (poolProbes_.size() == 0) {
+    poolRtts_.resize(upPoolHost_.size());
+    for (size_t i = 0; i < upPoolHost_.size(); i++) {
+      PoolProbe *probe = new PoolProbe();
+      probe->server_  = this;
+      probe->poolIdx_ = i;
+      probe->bev_     = NULL;
+      probe->isResolving_ = false;
+      probe->beginUs_ = 0;
+      poolProbes_.push_back(probe);
+    }
+  }
+
+  for (size_t i = 0; i < poolProbes_.size(); i++) {
+    PoolProbe *probe = poolProbes_[i];
+
+    // no answer in the whole interval
+    if (probe->isResolving_ || probe->bev_ != NULL) {
+      finishProbe(probe, -1);
     }
 
-    UpStratumClient *up = new UpStratumClient(idx, base_, upPoolUserName_[i], this);
-    if (!up->connect(sin)) {
-      delete up;
+    // cached mostly, the callback may be called right now
+    probe->isResolving_ = true;
+    resolver_->resolve(upPoolHost_[i], StratumServer::probeResolveCallback, probe);
+  }
+}
+
+void StratumServer::probeResolveCallback(const string &host,
+                                         const vector<SockAddr> &addrs,
+                                         void *ptr) {
+  PoolProbe *probe = static_cast<PoolProbe *>(ptr);
+  StratumServer *server = probe->server_;
+  probe->isResolving_ = false;
+
+  if (addrs.size() == 0) {
+    server->finishProbe(probe, -1);
+    return;
+  }
+
+  SockAddr addr = addrs[0];
+  addr.setPort(server->upPoolPort_[probe->poolIdx_]);
+
+  probe->bev_ = bufferevent_socket_new(server->base_, -1, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_setcb(probe->bev_, StratumServer::probeReadCallback, NULL,
+                    StratumServer::probeEventCallback, probe);
+  bufferevent_enable(probe->bev_, EV_READ|EV_WRITE);
+
+  if (bufferevent_socket_connect(probe->bev_, (struct sockaddr *)addr.get(),
+                                 addr.getLength()) != 0) {
+    server->finishProbe(probe, -1);
+  }
+}
+
+void StratumServer::probeEventCallback(struct bufferevent *bev,
+                                       short events, void *ptr) {
+  PoolProbe *probe = static_cast<PoolProbe *>(ptr);
+
+  if (events & BEV_EVENT_CONNECTED) {
+    // the pool answers the subscribe from its event loop, it's a better
+    // measure than the TCP handshake which is done by the kernel
+    const string s = Strings::Format("{\"id\":1,\"method\":\"mining.subscribe\""
+                                     ",\"params\":[\"%s\"]}\n", BTCCOM_MINER_AGENT);
+    probe->beginUs_ = nowUs();
+    bufferevent_write(bev, s.data(), s.size());
+    return;
+  }
+
+  probe->server_->finishProbe(probe, -1);
+}
+
+void StratumServer::probeReadCallback(struct bufferevent *bev, void *ptr) {
+  PoolProbe *probe = static_cast<PoolProbe *>(ptr);
+
+  struct evbuffer_ptr loc = evbuffer_search_eol(bufferevent_get_input(bev),
+                                                NULL, NULL, EVBUFFER_EOL_LF);
+  if (loc.pos == -1)
+    return;  // wait for the whole line
+
+  probe->server_->finishProbe(probe, nowUs() - probe->beginUs_);
+}
+
+void StratumServer::finishProbe(PoolProbe *probe, const int64_t rttUs) {
+  if (probe->isResolving_) {
+    resolver_->cancel(probe);
+    probe->isResolving_ = false;
+  }
+  if (probe->bev_ != NULL) {
+    bufferevent_free(probe->bev_);
+    probe->bev_ = NULL;
+  }
+
+  RttEstimator &rtt = poolRtts_[probe->poolIdx_];
+  if (rttUs < 0) {
+    rtt.addFailure();
+    LOG(WARNING) << "probe pool failure: " << upPoolHost_[probe->poolIdx_] << ":"
+    << upPoolPort_[probe->poolIdx_] << ", " << rtt.getFailures()
+    << " times in a row" << std::endl;
+  } else {
+    rtt.addSample(rttUs);
+  }
+}
+
+void StratumServer::rebalanceUpSessions() {
+  const int32_t preferred = selectPreferredPool(poolRtts_);
+  if (preferred == -1)
+    return;
+
+  // one at a time
+  for (int8_t i = 0; i < upSessionCount_; i++) {
+    if (isUpSessionPending(i))
+      return;
+  }
+
+  for (int8_t i = 0; i < activeUpSessionCount_; i++) {
+    UpStratumClient *up = upSessions_[i];
+    if (up == NULL || !up->isAvailable() || up->poolIdx_ == (size_t)preferred)
+      continue;
+
+    LOG(INFO) << "move up session[" << (int32_t)i << "] from "
+    << upPoolHost_[up->poolIdx_] << ":" << upPoolPort_[up->poolIdx_] << " to "
+    << upPoolHost_[preferred] << ":" << upPoolPort_[preferred] << ", srtt: "
+    << poolRtts_[up->poolIdx_].getSrtt() << " -> " << poolRtts_[preferred].getSrtt()
+    << " us" << std::endl;
+
+    startUpSessionRace(i, preferred);
+    return;
+  }
+}
+
+void StratumServer::retireUpSession(UpStratumClient *up) {
+  LOG(INFO) << "retire up session[" << (int32_t)up->idx_ << "]: "
+  << upPoolHost_[up->poolIdx_] << ":" << upPoolPort_[up->poolIdx_] << std::endl;
+
+  retiredUpSessions_.push_back(up);
+  up->retire();
+}
+
+void StratumServer::freeRetiredUpSession(UpStratumClient *up) {
+  retiredUpSessions_.erase(std::find(retiredUpSessions_.begin(),
+                                     retiredUpSessions_.end(), up));
+  delete up;
+}
+
+void StratumServer::scaleTimerCallback(evutil_socket_t fd, short events, void *ptr) {
+  static_cast<StratumServer *>(ptr)->autoScaleUpSessions();
+}
+
+// how many up sessions could keep the load below ratio of the targets
+static int32_t upSessionsForLoad(const AgentConf &conf, const size_t miners,
+                                 const double bytesPerSec, const double ratio) {
+  int32_t count = 0;
+  if (conf.upSessionMaxMiners_ > 0) {
+    count = std::max(count, (int32_t)ceil(miners / (conf.upSessionMaxMiners_ * ratio)));
+  }
+  if (conf.upSessionMaxBytesPerSec_ > 0) {
+    count = std::max(count, (int32_t)ceil(bytesPerSec / (conf.upSessionMaxBytesPerSec_ * ratio)));
+  }
+  return count;
+}
+
+void StratumServer::autoScaleUpSessions() {
+  const int64_t now = nowMs();
+  const double seconds = (now - lastScaleMs_) / 1000.0;
+  const double bytesPerSec = seconds > 0 ? (upSentBytes_ - lastScaleSentBytes_) / seconds : 0;
+  lastScaleMs_ = now;
+  lastScaleSentBytes_ = upSentBytes_;
+
+  size_t miners = 0;
+  for (size_t i = 0; i < upDownSessions_.size(); i++) {
+    miners += upDownSessions_[i].size();
+  }
+
+  int32_t count = upSessionsForLoad(conf_, miners, bytesPerSec, 1.0);
+  count = std::min(std::max(count, (int32_t)minUpSessionCount_),
+                   (int32_t)maxUpSessionCount_);
+
+  if (count > activeUpSessionCount_) {
+    LOG(INFO) << "scale up sessions: " << (int32_t)activeUpSessionCount_ << " -> "
+    << count << ", miners: " << miners << ", sent: " << (uint64_t)bytesPerSec
+    << " bytes/s" << std::endl;
+    addUpSessionSlots((int8_t)count);
+  }
+  else if (activeUpSessionCount_ > minUpSessionCount_ &&
+           upSessionsForLoad(conf_, miners, bytesPerSec, 0.75) < activeUpSessionCount_) {
+    // one at a time, the last one drains
+    activeUpSessionCount_--;
+    LOG(INFO) << "scale up sessions: " << (int32_t)activeUpSessionCount_ + 1
+    << " -> " << (int32_t)activeUpSessionCount_ << ", miners: " << miners
+    << ", sent: " << (uint64_t)bytesPerSec << " bytes/s" << std::endl;
+  }
+
+  retireUpSessionSlots();
+}
+
+void StratumServer::addUpSessionSlots(const int8_t count) {
+  // the draining ones are taken back first
+  while (upSessionCount_ < count) {
+    upSessions_    .push_back(NULL);
+    upDownSessions_.push_back(vector<StratumSession *>());
+    upSessionCount_++;
+  }
+  for (int8_t i = activeUpSessionCount_; i < count; i++) {
+    if (upSessions_[i] == NULL)
+      createUpSession(i);  // async, it takes miners when it's available
+  }
+  activeUpSessionCount_ = count;
+}
+
+void StratumServer::retireUpSessionSlots() {
+  // from the end, so the slots are always [0, upSessionCount_)
+  while (upSessionCount_ > activeUpSessionCount_) {
+    const int8_t idx = upSessionCount_ - 1;
+    if (!upDownSessions_[idx].empty())
+      return;
+
+    if (isUpSessionPending(idx))
+      finishUpSessionRace(upSessionRaces_[idx]);
+    if (upSessions_[idx] != NULL)
+      removeUpConnection(upSessions_[idx]);
+
+    upSessions_    .pop_back();
+    upDownSessions_.pop_back();
+    upSessionCount_--;
+    LOG(INFO) << "retire up session[" << (int32_t)idx << "]" << std::endl;
+  }
+}
+
+bool StratumServer::setup() {
+  if (upPoolHost_.size() == 0)
+    return false;
+
+  if (!initEventBase())
+    return false;
+
+  //
+  // the listener is opened as soon as one up session is available, the
+  // others keep racing in the background and take miners when they are
+  // ready. checkStartup() breaks the loop below.
+  //
+  startupBeginMs_ = nowMs();
+  for (int8_t i = 0; i < upSessionCount_; i++) {
+    createUpSession(i);
+  }
+  isStarting_ = true;
+  checkStartup();  // they may have failed already
+  if (running_)
+    event_base_dispatch(base_);
+  isStarting_ = false;
+
+  // all the pools failed
+  if (!running_) {
+    return false;
+  }
+
+  setupTimers();
+  return setupListener();
+}
+
+bool StratumServer::initEventBase() {
+#ifdef _WIN32
+  WSADATA wsa_data;
+
+  if (WSAStartup(0x202, &wsa_data) == SOCKET_ERROR) {
+      LOG(ERROR) << "WSAStartup failed: " << WSAGetLastError() << std::endl;
+      return false;
+  }
+
+  #ifdef USE_IOCP
+    // use IOCP for Windows
+    evthread_use_windows_threads();
+    struct event_config *cfg = event_config_new();
+    event_config_set_flag(cfg, EVENT_BASE_FLAG_STARTUP_IOCP);
+    base_ = event_base_new_with_config(cfg);
+  #else
+    // use select() by default
+    base_ = event_base_new();
+  #endif
+#else
+  base_ = event_base_new();
+#endif
+
+  if(!base_) {
+    LOG(ERROR) << "server: cannot create event base" << std::endl;
+    return false;
+  }
+
+  // flush the staged writes of down sessions
+  downFlushEvent_ = event_new(base_, -1, 0,
+                              StratumServer::downFlushCallback, this);
+
+  // commands from the other threads
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, cmdFds_) != 0) {
+    LOG(ERROR) << "server: cannot create socketpair" << std::endl;
+    return false;
+  }
+  evutil_make_socket_nonblocking(cmdFds_[0]);
+  evutil_make_socket_nonblocking(cmdFds_[1]);
+  cmdEvent_ = event_new(base_, cmdFds_[0], EV_READ|EV_PERSIST,
+                        StratumServer::cmdCallback, this);
+  event_add(cmdEvent_, NULL);
+
+  if (resolver_ == NULL) {
+    resolver_ = new DnsResolver(base_, vector<string>());
+    isResolverOwned_ = true;
+  }
+
+  // one second of burst
+  acceptBucket_  .setRate(conf_.acceptRatePerSec_,   conf_.acceptRatePerSec_);
+  registerBucket_.setRate(conf_.registerRatePerSec_, conf_.registerRatePerSec_);
+  admissionTimer_ = event_new(base_, -1, 0, StratumServer::admissionTimerCallback, this);
+  return true;
+}
+
+void StratumServer::setupTimers() {
+  // setup up sessions watcher
+  upEvTimer_ = event_new(base_, -1, EV_PERSIST,
+                         StratumServer::upWatcherCallback, this);
+  // every 15 seconds to check if up session's available
+  struct timeval tenSec = {15, 0};
+  event_add(upEvTimer_, &tenSec);
+
+  lastScaleMs_ = nowMs();
+  lastScaleSentBytes_ = upSentBytes_;
+  if (conf_.upSessionsAuto_ && maxUpSessionCount_ > minUpSessionCount_) {
+    scaleTimer_ = event_new(base_, -1, EV_PERSIST,
+                            StratumServer::scaleTimerCallback, this);
+    struct timeval tv = {kAutoScaleIntervalSec_, 0};
+    event_add(scaleTimer_, &tv);
+  }
+
+  if (conf_.upHeartbeatIntervalMs_ > 0) {
+    heartbeatTimer_ = event_new(base_, -1, EV_PERSIST,
+                                StratumServer::heartbeatTimerCallback, this);
+    struct timeval tv;
+    tv.tv_sec  = conf_.upHeartbeatIntervalMs_ / 1000;
+    tv.tv_usec = (conf_.upHeartbeatIntervalMs_ % 1000) * 1000;
+    event_add(heartbeatTimer_, &tv);
+  }
+
+  // nothing to choose from with only one pool
+  if (conf_.poolProbeIntervalMs_ > 0 && upPoolHost_.size() > 1) {
+    probeTimer_ = event_new(base_, -1, EV_PERSIST,
+                            StratumServer::probeTimerCallback, this);
+    struct timeval tv;
+    tv.tv_sec  = conf_.poolProbeIntervalMs_ / 1000;
+    tv.tv_usec = (conf_.poolProbeIntervalMs_ % 1000) * 1000;
+    event_add(probeTimer_, &tv);
+    startProbes();
+  }
+}
+
+bool StratumServer::setupListener() {
+  // set up ev listener
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port   = htons(listenPort_);
+  sin.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (evutil_inet_pton(AF_INET, listenIP_.c_str(), &sin.sin_addr) == 0) {
+    LOG(ERROR) << "invalid ip: " << listenIP_ << std::endl;
+    return false;
+  }
+
+  if (!createListener(sin)) {
+    LOG(ERROR) << "cannot create listener: " << listenIP_ << ":" << listenPort_ << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool StratumServer::createListener(const struct sockaddr_in &sin) {
+  if (!reusePort_) {
+    listener_ = evconnlistener_new_bind(base_,
+                                        StratumServer::listenerCallback,
+                                        (void*)this,
+                                        LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE,
+                                        // the miners wait here while paused
+                                        kListenBacklog_,
+                                        (struct sockaddr*)&sin, sizeof(sin));
+    return listener_ != NULL;
+  }
+
+#ifdef SO_REUSEPORT
+  // each thread has its own listen socket on the same port, the kernel
+  // balances the new connections between them
+  evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+
+  int one = 1;
+  evutil_make_listen_socket_reuseable(fd);
+  evutil_make_socket_nonblocking(fd);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+      bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    LOG(ERROR) << "bind with SO_REUSEPORT failure, errno: " << errno << std::endl;
+    evutil_closesocket(fd);
+    return false;
+  }
+
+  listener_ = evconnlistener_new(base_, StratumServer::listenerCallback,
+                                 (void*)this, LEV_OPT_CLOSE_ON_FREE,
+                                 kListenBacklog_, fd);
+  if (listener_ == NULL) {
+    evutil_closesocket(fd);
+    return false;
+  }
+  return true;
+#else
+  LOG(ERROR) << "SO_REUSEPORT is not supported" << std::endl;
+  return false;
+#endif
+}
+
+void StratumServer::exportState(HandoffWriter &w) {
+  w.putUint8((uint8_t)upSessionCount_);
+  w.putUint8((uint8_t)activeUpSessionCount_);
+  w.putFd(evconnlistener_get_fd(listener_));
+
+  // the racing ones are dropped, they are raced again in the new process
+  uint32_t upCount = 0;
+  for (size_t i = 0; i < upSessions_.size(); i++) {
+    if (upSessions_[i] != NULL)
+      upCount++;
+  }
+  w.putUint32(upCount);
+  for (size_t i = 0; i < upSessions_.size(); i++) {
+    UpStratumClient *up = upSessions_[i];
+    if (up == NULL)
       continue;
+    // the pools may be reordered in the new config
+    w.putString(upPoolHost_[up->poolIdx_]);
+    w.putUint16(upPoolPort_[up->poolIdx_]);
+    up->exportState(w);
+  }
+
+  uint32_t downCount = 0;
+  for (size_t i = 0; i < upDownSessions_.size(); i++) {
+    downCount += (uint32_t)upDownSessions_[i].size();
+  }
+  w.putUint32(downCount);
+  for (size_t i = 0; i < upDownSessions_.size(); i++) {
+    const vector<StratumSession *> &sessions = upDownSessions_[i];
+    for (size_t j = 0; j < sessions.size(); j++) {
+      sessions[j]->exportState(w);
     }
-    LOG(INFO) << "success connect[" << (int32_t)up->idx_ << "]: " << upPoolHost_[i] << ":"
-    << upPoolPort_[i] << ", username: " << upPoolUserName_[i] << std::endl;
+  }
 
-    return up;  // connect success
+  w.putUint32((uint32_t)pendingAccepts_.size());
+  for (size_t i = 0; i < pendingAccepts_.size(); i++) {
+    w.putFd(pendingAccepts_[i].fd_);
+    w.putUint32((uint32_t)pendingAccepts_[i].saddr_.s_addr);
   }
 
-  return NULL;
+  sessionIDManager_.exportState(w);
+
+  LOG(INFO) << "handoff: " << upCount << " up sessions, " << downCount
+  << " miners, " << pendingAccepts_.size() << " pending accepts" << std::endl;
 }
 
-bool StratumServer::setup() {
-  if (upPoolHost_.size() == 0)
+bool StratumServer::setupFromHandoff(HandoffReader &r) {
+  if (upPoolHost_.size() == 0 || !initEventBase())
     return false;
 
-#ifdef _WIN32
-  WSADATA wsa_data;
-
-  if (WSAStartup(0x202, &wsa_data) == SOCKET_ERROR) {
-      LOG(ERROR) << "WSAStartup failed: " << WSAGetLastError() << std::endl;
-      return false;
+  const int8_t upSessionCount       = (int8_t)r.getUint8();
+  const int8_t activeUpSessionCount = (int8_t)r.getUint8();
+  const evutil_socket_t listenFd    = r.getFd();
+  if (!r.isValid() || upSessionCount <= 0 || upSessionCount > kMaxUpSessionCount_ ||
+      activeUpSessionCount <= 0 || activeUpSessionCount > upSessionCount) {
+    if (listenFd != -1)
+      evutil_closesocket(listenFd);
+    return false;
   }
 
-  #ifdef USE_IOCP
-    // use IOCP for Windows
-    evthread_use_windows_threads();
-    struct event_config *cfg = event_config_new();
-    event_config_set_flag(cfg, EVENT_BASE_FLAG_STARTUP_IOCP);
-    base_ = event_base_new_with_config(cfg);
-  #else
-    // use select() by default
-    base_ = event_base_new();
-  #endif
-#else
-  base_ = event_base_new();
-#endif
+  // the slots of the old process, the auto mode resizes them later
+  upSessionCount_       = upSessionCount;
+  activeUpSessionCount_ = activeUpSessionCount;
+  maxUpSessionCount_    = std::max(maxUpSessionCount_, upSessionCount);
+  upSessions_    .resize(upSessionCount_, NULL);
+  upDownSessions_.resize(upSessionCount_);
 
-  if(!base_) {
-    LOG(ERROR) << "server: cannot create event base" << std::endl;
+  // it's listening already, the backlog is kept
+  listener_ = evconnlistener_new(base_, StratumServer::listenerCallback,
+                                 (void*)this, LEV_OPT_CLOSE_ON_FREE, 0, listenFd);
+  if (listener_ == NULL) {
+    evutil_closesocket(listenFd);
     return false;
   }
 
-  // create up sessions
-  for (int8_t i = 0; i < kUpSessionCount_; i++) {
-    UpStratumClient *up = createUpSession(i);
+  const uint32_t upCount = r.getUint32();
+  for (uint32_t i = 0; i < upCount && r.isValid(); i++) {
+    const string   host = r.getString();
+    const uint16_t port = r.getUint16();
+    UpStratumClient *up = UpStratumClient::importState(r, base_, this);
     if (up == NULL)
       return false;
+    if (up->idx_ < 0 || up->idx_ >= upSessionCount_ || upSessions_[up->idx_] != NULL) {
+      delete up;
+      return false;
+    }
 
-    assert(up->idx_ == i);
+    for (size_t j = 0; j < upPoolHost_.size(); j++) {
+      if (upPoolHost_[j] == host && upPoolPort_[j] == port)
+        up->poolIdx_ = j;
+    }
     addUpConnection(up);
   }
 
-  // wait util all up session available
-  {
-    struct event *checkTimer;
-    checkTimer = event_new(base_, -1, EV_PERSIST,
-                           StratumServer::upSesssionCheckCallback, this);
-    struct timeval oneSec = {1, 0};
-    event_add(checkTimer, &oneSec);
+  vector<StratumSession *> unregistered;
+  const uint32_t downCount = r.getUint32();
+  for (uint32_t i = 0; i < downCount && r.isValid(); i++) {
+    StratumSession *conn = StratumSession::importState(r, this);
+    if (conn == NULL)
+      return false;
+    if (conn->upSessionIdx_ < 0 || conn->upSessionIdx_ >= upSessionCount_ ||
+        conn->sessionId_ > AGENT_MAX_SESSION_ID ||
+        downSessions_[conn->sessionId_] != NULL) {
+      delete conn;
+      return false;
+    }
+    addDownConnection(conn);
 
-    // run event dispatch, it will break util all up sessions are available
-    event_base_dispatch(base_);
+    if (!conn->isRegistered_) {
+      struct timeval handshakeTv = {kHandshakeTimeoutSec_, 0};
+      bufferevent_set_timeouts(conn->bev_, &handshakeTv, NULL);
+      handshakingCount_++;
+      unregistered.push_back(conn);
+    }
+  }
 
-    // get here means: all up sessions are available
-    event_del(checkTimer);
-    event_free(checkTimer);
+  vector<PendingAccept> accepts;
+  const uint32_t acceptCount = r.getUint32();
+  for (uint32_t i = 0; i < acceptCount && r.isValid(); i++) {
+    PendingAccept pending;
+    pending.fd_ = r.getFd();
+    pending.saddr_.s_addr = r.getUint32();
+    if (pending.fd_ != -1)
+      accepts.push_back(pending);
   }
 
-  // if one of upsessions init failure, it'll stop the server.
-  if (!running_) {
+  if (!sessionIDManager_.importState(r)) {
+    for (size_t i = 0; i < accepts.size(); i++) {
+      evutil_closesocket(accepts[i].fd_);
+    }
     return false;
   }
 
-  // setup up sessions watcher
-  upEvTimer_ = event_new(base_, -1, EV_PERSIST,
-                         StratumServer::upWatcherCallback, this);
-  // every 15 seconds to check if up session's available
-  struct timeval tenSec = {15, 0};
-  event_add(upEvTimer_, &tenSec);
-
-  // set up ev listener
-  struct sockaddr_in sin;
-  memset(&sin, 0, sizeof(sin));
-  sin.sin_family = AF_INET;
-  sin.sin_port   = htons(listenPort_);
-  sin.sin_addr.s_addr = htonl(INADDR_ANY);
-  if (evutil_inet_pton(AF_INET, listenIP_.c_str(), &sin.sin_addr) == 0) {
-    LOG(ERROR) << "invalid ip: " << listenIP_ << std::endl;
-    return false;
+  // the admission goes on: the ones waiting for registration, then the
+  // accepted ones in order
+  for (size_t i = 0; i < unregistered.size(); i++) {
+    if (unregistered[i]->isAuthenticated())
+      downSessionAuthenticated(unregistered[i]);
+  }
+  for (size_t i = 0; i < accepts.size(); i++) {
+    handleAccept(accepts[i].fd_, accepts[i].saddr_);
   }
 
-  listener_ = evconnlistener_new_bind(base_,
-                                      StratumServer::listenerCallback,
-                                      (void*)this,
-                                      LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE,
-                                      // backlog, Set to -1 for a reasonable default
-                                      -1,
-                                      (struct sockaddr*)&sin, sizeof(sin));
-  if(!listener_) {
-    LOG(ERROR) << "cannot create listener: " << listenIP_ << ":" << listenPort_ << std::endl;
-    return false;
+  // the slots which were racing
+  for (int8_t i = 0; i < activeUpSessionCount_; i++) {
+    if (upSessions_[i] == NULL)
+      createUpSession(i);
   }
-  return true;
-}
 
-void StratumServer::upSesssionCheckCallback(evutil_socket_t fd,
-                                            short events, void *ptr) {
-  StratumServer *server = static_cast<StratumServer *>(ptr);
-  server->waitUtilAllUpSessionsAvailable();
+  setupTimers();
+
+  LOG(INFO) << "handoff: took over " << upCount << " up sessions, "
+  << downCount << " miners" << std::endl;
+  return true;
 }
 
-void StratumServer::waitUtilAllUpSessionsAvailable() {
-  for (int8_t i = 0; i < kUpSessionCount_; i++) {
+void StratumServer::checkStartup() {
+  if (!isStarting_)
+    return;
 
-    // lost upsession when init, we should stop server
-    if (upSessions_[i] == NULL) {
-      stop();
+  bool isPending = false;
+  for (int8_t i = 0; i < upSessionCount_; i++) {
+    if (upSessions_[i] != NULL && upSessions_[i]->isAvailable()) {
+      LOG(INFO) << "up session[" << (int32_t)i << "] is ready in "
+      << (nowMs() - startupBeginMs_) << " ms, start listening" << std::endl;
+      event_base_loopbreak(base_);
       return;
     }
-
-    if (upSessions_[i]->isAvailable() == false) {
-      return;  // someone is not ready yet
-    }
+    if (upSessions_[i] != NULL || isUpSessionPending(i))
+      isPending = true;
   }
 
-  // if we get here, means all up session is available, break event loop
-  event_base_loopbreak(base_);
+  // lost all the up sessions when init, we should stop server
+  if (!isPending) {
+    LOG(ERROR) << "no up session is available, stop" << std::endl;
+    stop();
+  }
 }
 
 void StratumServer::upWatcherCallback(evutil_socket_t fd,
                                       short events, void *ptr) {
   StratumServer *server = static_cast<StratumServer *>(ptr);
   server->checkUpSessions();
+  server->logStats();
+}
+
+void StratumServer::logStats() {
+  const time_t now = time(NULL);
+  if (now <= lastStatsTime_)
+    return;
+
+  const uint64_t writes  = downWriteCount_ - lastDownWriteCount_;
+  const uint64_t flushes = downFlushCount_ - lastDownFlushCount_;
+  const double seconds = (double)(now - lastStatsTime_);
+
+  LOG(INFO) << "down writes: " << (uint64_t)(writes / seconds) << "/s, flushes: "
+  << (uint64_t)(flushes / seconds) << "/s, syscalls saved: "
+  << (uint64_t)((writes - flushes) / seconds) << "/s" << std::endl;
+  if (shareRejects_.total() > 0)
+    LOG(INFO) << "rejected shares, " << shareRejects_.toString() << std::endl;
+  if (shareCount_ > 0)
+    LOG(INFO) << "shares without nTime: " << shareNoTimeCount_ << " of "
+    << shareCount_ << ", bytes saved by the job history: " << shareBytesSaved_
+    << ", bytes/share: " << (double)shareBytes_ / shareCount_ << std::endl;
+
+  for (size_t i = 0; i < upSessions_.size(); i++) {
+    if (upSessions_[i] == NULL)
+      continue;
+    LOG(INFO) << "up[" << i << "] share batch size: "
+    << upSessions_[i]->shareBatchSizeHist_.toString() << std::endl;
+    LOG(INFO) << "up[" << i << "] share batch latency(us): "
+    << upSessions_[i]->shareBatchLatencyHist_.toString() << std::endl;
+    if (upSessions_[i]->isPongSupported_) {
+      LOG(INFO) << "up[" << i << "] heartbeat srtt: "
+      << upSessions_[i]->heartbeatRtt_.getSrtt() << " us, jitter: "
+      << upSessions_[i]->heartbeatRtt_.getJitter() << " us" << std::endl;
+    }
+  }
+
+  for (size_t i = 0; i < poolRtts_.size(); i++) {
+    LOG(INFO) << "pool[" << i << "] " << upPoolHost_[i] << ":" << upPoolPort_[i]
+    << " srtt: " << poolRtts_[i].getSrtt() << " us, jitter: "
+    << poolRtts_[i].getJitter() << " us, "
+    << (poolRtts_[i].isHealthy() ? "healthy" : "unhealthy") << std::endl;
+  }
+
+  lastDownWriteCount_ = downWriteCount_;
+  lastDownFlushCount_ = downFlushCount_;
+  lastStatsTime_ = now;
+}
+
+void StratumServer::scheduleDownFlush(StratumSession *downSession) {
+  downWriteCount_++;
+  if (downSession->isFlushPending_)
+    return;  // it will be flushed with others
+
+  // no event loop yet, just flush it
+  if (downFlushEvent_ == NULL) {
+    downFlushCount_++;
+    downSession->flush();
+    return;
+  }
+
+  downSession->isFlushPending_ = true;
+  pendingFlushSessions_.push_back(downSession->sessionId_);
+
+  if (pendingFlushSessions_.size() == 1) {
+    if (conf_.downFlushDelayMs_ <= 0) {
+      // runs after the other active events of this loop iteration
+      event_active(downFlushEvent_, EV_TIMEOUT, 1);
+    } else {
+      struct timeval tv;
+      tv.tv_sec  = conf_.downFlushDelayMs_ / 1000;
+      tv.tv_usec = (conf_.downFlushDelayMs_ % 1000) * 1000;
+      event_add(downFlushEvent_, &tv);
+    }
+  }
+}
+
+void StratumServer::downFlushCallback(evutil_socket_t fd,
+                                      short events, void *ptr) {
+  static_cast<StratumServer *>(ptr)->flushDownSessions();
+}
+
+void StratumServer::flushDownSessions() {
+  vector<uint16_t> sessionIds;
+  sessionIds.swap(pendingFlushSessions_);
+
+  for (size_t i = 0; i < sessionIds.size(); i++) {
+    // the session may be removed, or it's a new one with the same id
+    StratumSession *s = downSessions_[sessionIds[i]];
+    if (s == NULL || !s->isFlushPending_)
+      continue;
+
+    s->flush();
+    downFlushCount_++;
+  }
+
+  // reuse the memory
+  if (pendingFlushSessions_.empty()) {
+    sessionIds.clear();
+    pendingFlushSessions_.swap(sessionIds);
+  }
+}
+
+void StratumServer::heartbeatTimerCallback(evutil_socket_t fd,
+                                           short events, void *ptr) {
+  static_cast<StratumServer *>(ptr)->checkHeartbeats();
+}
+
+void StratumServer::checkHeartbeats() {
+  const int64_t now = nowMs();
+  for (int8_t i = 0; i < upSessionCount_; i++) {
+    UpStratumClient *up = upSessions_[i];
+    if (up == NULL || up->state_ != UP_AUTHENTICATED)
+      continue;
+
+    const int64_t silentMs = now - up->lastRecvMs_;
+    if (up->isPongSupported_ && conf_.upDeadTimeoutMs_ > 0 &&
+        silentMs > conf_.upDeadTimeoutMs_) {
+      LOG(ERROR) << "up[" << (int32_t)i << "] nothing from the pool in "
+      << silentMs << " ms, it's dead" << std::endl;
+      migrateDownSessions(i);
+      removeUpConnection(up);
+      if (i < activeUpSessionCount_)
+        createUpSession(i);
+      continue;
+    }
+    up->sendPing();
+  }
 }
 
 void StratumServer::checkUpSessions() {
   // check up sessions
-  for (int8_t i = 0; i < kUpSessionCount_; i++)
+  for (int8_t i = 0; i < upSessionCount_; i++)
   {
     // if upsession's socket error, it'll be removed and set to NULL
     if (upSessions_[i] != NULL) {
       if (upSessions_[i]->isAvailable() == true)
         continue;
-      else
-        removeUpConnection(upSessions_[i]);
+
+      migrateDownSessions(i);
+      removeUpConnection(upSessions_[i]);
     }
 
-    UpStratumClient *up = createUpSession(i);
-    if (up != NULL)
-      addUpConnection(up);
+    // a draining one is not reconnected
+    if (i >= activeUpSessionCount_)
+      continue;
+
+    // async, the loop goes on while racing
+    createUpSession(i);
   }
 }
 
@@ -1199,46 +3421,67 @@ void StratumServer::listenerCallback(struct evconnlistener *listener,
                                      struct sockaddr *saddr,
                                      int socklen, void *ptr) {
   StratumServer *server = static_cast<StratumServer *>(ptr);
-  struct event_base  *base = (struct event_base*)server->base_;
-  struct bufferevent *bev;
+  server->handleAccept(fd, ((struct sockaddr_in *)saddr)->sin_addr);
+}
 
-  // can't alloc session Id
-  if (server->sessionIDManager_.ifFull()) {
+bool StratumServer::tryAdmit(const int64_t now) {
+  if (conf_.maxHandshakingSessions_ > 0 &&
+      handshakingCount_ >= conf_.maxHandshakingSessions_)
+    return false;
+  return acceptBucket_.consume(now);
+}
 
-#ifdef _WIN32
-    closesocket(fd);
-#else
-    close(fd);
-#endif
+void StratumServer::handleAccept(evutil_socket_t fd, const struct in_addr &saddr) {
+  // keep the order, the earlier ones first
+  if (pendingAccepts_.empty() && tryAdmit(nowUs())) {
+    createDownSession(fd, saddr);
+    return;
+  }
 
+  if (conf_.acceptOverflowReconnect_ || pendingAccepts_.size() >= kMaxPendingAccepts_) {
+    rejectConnection(fd);
     return;
   }
 
-  bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
-  if(bev == NULL) {
-    LOG(ERROR) << "bufferevent_socket_new fail" << std::endl;
-    server->stop();
+  PendingAccept pending;
+  pending.fd_    = fd;
+  pending.saddr_ = saddr;
+  pendingAccepts_.push_back(pending);
+
+  // the others wait in the kernel backlog
+  if (!isListenerPaused_) {
+    evconnlistener_disable(listener_);
+    isListenerPaused_ = true;
+    LOG(INFO) << "pause accepting, handshaking sessions: " << handshakingCount_ << std::endl;
+  }
+  processAdmission();
+}
+
+void StratumServer::createDownSession(evutil_socket_t fd, const struct in_addr &saddr) {
+  // can't alloc session Id
+  if (sessionIDManager_.ifFull()) {
+    evutil_closesocket(fd);
     return;
   }
 
-  const int8_t upSessionIdx = server->findUpSessionIdx();
+  const int8_t upSessionIdx = findUpSessionIdx();
   if (upSessionIdx == -1) {
     LOG(ERROR) << "no available up session" << std::endl;
+    evutil_closesocket(fd);
+    return;
+  }
 
-#ifdef _WIN32
-    closesocket(fd);
-#else
-    close(fd);
-#endif
-
+  struct bufferevent *bev = bufferevent_socket_new(base_, fd, BEV_OPT_CLOSE_ON_FREE);
+  if(bev == NULL) {
+    LOG(ERROR) << "bufferevent_socket_new fail" << std::endl;
+    stop();
     return;
   }
 
   uint16_t sessionId = 0u;
-  server->sessionIDManager_.allocSessionId(&sessionId);
+  sessionIDManager_.allocSessionId(&sessionId);
 
-  StratumSession *conn = new StratumSession(upSessionIdx, sessionId, bev, server,
-                                            ((struct sockaddr_in *)saddr)->sin_addr);
+  StratumSession *conn = new StratumSession(upSessionIdx, sessionId, bev, this, saddr);
   bufferevent_setcb(bev,
                     StratumServer::downReadCallback, NULL,
                     StratumServer::downEventCallback, (void*)conn);
@@ -1246,15 +3489,148 @@ void StratumServer::listenerCallback(struct evconnlistener *listener,
   // By default, a newly created bufferevent has writing enabled.
   bufferevent_enable(bev, EV_READ|EV_WRITE);
 
-  server->addDownConnection(conn);
-  
+  // it must be registered in time, or it holds a handshake slot forever
+  struct timeval handshakeTv = {kHandshakeTimeoutSec_, 0};
+  bufferevent_set_timeouts(bev, &handshakeTv, NULL);
+
+  addDownConnection(conn);
+  handshakingCount_++;
+
   // get source IP address
   char saddrBuffer[INET_ADDRSTRLEN];
   evutil_inet_ntop(AF_INET, &conn->saddr_, saddrBuffer, INET_ADDRSTRLEN);
-  
+
   LOG(INFO) << "miner connected, sessionId: " << conn->sessionId_ << ", IP: " << saddrBuffer << std::endl;
 }
 
+void StratumServer::rejectConnection(evutil_socket_t fd) {
+  //
+  // come back to the same address later, the wait is random so they don't
+  // come back all together:
+  // {"id":null,"method":"client.reconnect","params":["host",port,wait]}
+  //
+  struct sockaddr_in local;
+  ev_socklen_t len = sizeof(local);
+  char ip[INET_ADDRSTRLEN] = {0};
+  uint16_t port = listenPort_;
+  if (getsockname(fd, (struct sockaddr *)&local, &len) == 0) {
+    evutil_inet_ntop(AF_INET, &local.sin_addr, ip, sizeof(ip));
+    port = ntohs(local.sin_port);
+  }
+  const int32_t maxWait = std::max(conf_.reconnectMaxWaitSec_, 1);
+  const int32_t wait = 1 + rand() % maxWait;
+
+  struct bufferevent *bev = bufferevent_socket_new(base_, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (bev == NULL) {
+    evutil_closesocket(fd);
+    return;
+  }
+  // closed when it's written, the requests from the miner are dropped
+  bufferevent_setcb(bev, StratumServer::rejectReadCallback,
+                    StratumServer::rejectWriteCallback,
+                    StratumServer::rejectEventCallback, NULL);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  struct timeval tv = {kHandshakeTimeoutSec_, 0};
+  bufferevent_set_timeouts(bev, &tv, &tv);
+
+  const string s = Strings::Format("{\"id\":null,\"method\":\"client.reconnect\","
+                                   "\"params\":[\"%s\",%u,%d]}\n",
+                                   ip, (uint32_t)port, wait);
+  bufferevent_write(bev, s.data(), s.size());
+  reconnectCount_++;
+}
+
+void StratumServer::rejectReadCallback(struct bufferevent *bev, void *ptr) {
+  struct evbuffer *inBuf = bufferevent_get_input(bev);
+  evbuffer_drain(inBuf, evbuffer_get_length(inBuf));
+}
+
+void StratumServer::rejectWriteCallback(struct bufferevent *bev, void *ptr) {
+  bufferevent_free(bev);
+}
+
+void StratumServer::rejectEventCallback(struct bufferevent *bev, short events, void *ptr) {
+  bufferevent_free(bev);
+}
+
+void StratumServer::downSessionAuthenticated(StratumSession *downSession) {
+  if (pendingRegisters_.empty() && registerBucket_.consume(nowUs())) {
+    startDownSession(downSession);
+    return;
+  }
+  pendingRegisters_.push_back(downSession->sessionId_);
+  processAdmission();
+}
+
+void StratumServer::startDownSession(StratumSession *downSession) {
+  registerWorker(downSession, downSession->getMinerAgent(),
+                 downSession->getRegisteredWorkerName());
+  downSession->isRegistered_ = true;
+  bufferevent_set_timeouts(downSession->bev_, NULL, NULL);
+
+  // send mining.set_difficulty
+  sendDefaultMiningDifficulty(downSession);
+  // send latest stratum job
+  sendMiningNotify(downSession);
+
+  // room for another one
+  handshakingCount_--;
+  if (isListenerPaused_)
+    event_active(admissionTimer_, EV_TIMEOUT, 1);
+}
+
+void StratumServer::admissionTimerCallback(evutil_socket_t fd, short events, void *ptr) {
+  static_cast<StratumServer *>(ptr)->processAdmission();
+}
+
+void StratumServer::processAdmission() {
+  const int64_t now = nowUs();
+
+  while (!pendingRegisters_.empty()) {
+    // it may be gone, or the id is taken by a new one
+    StratumSession *downSession = downSessions_[pendingRegisters_.front()];
+    if (downSession != NULL && downSession->isAuthenticated() &&
+        !downSession->isRegistered_) {
+      if (!registerBucket_.consume(now))
+        break;
+      startDownSession(downSession);
+    }
+    pendingRegisters_.pop_front();
+  }
+
+  while (!pendingAccepts_.empty() && tryAdmit(now)) {
+    const PendingAccept pending = pendingAccepts_.front();
+    pendingAccepts_.pop_front();
+    createDownSession(pending.fd_, pending.saddr_);
+  }
+
+  // when the next token is there. if it's the handshakes, one of them wakes
+  // us up when it's registered or closed
+  int64_t waitUs = -1;
+  if (!pendingRegisters_.empty())
+    waitUs = registerBucket_.getWaitUs(now);
+
+  if (isListenerPaused_) {
+    const int64_t acceptWaitUs = acceptBucket_.getWaitUs(now);
+    const bool hasRoom = (conf_.maxHandshakingSessions_ <= 0 ||
+                          handshakingCount_ < conf_.maxHandshakingSessions_);
+
+    if (pendingAccepts_.empty() && hasRoom && acceptWaitUs == 0) {
+      evconnlistener_enable(listener_);
+      isListenerPaused_ = false;
+      LOG(INFO) << "resume accepting, handshaking sessions: " << handshakingCount_ << std::endl;
+    }
+    else if (hasRoom && (waitUs == -1 || acceptWaitUs < waitUs)) {
+      waitUs = acceptWaitUs;
+    }
+  }
+
+  if (waitUs >= 0) {
+    struct timeval tv = {(long)(waitUs / 1000000), (long)(waitUs % 1000000)};
+    event_add(admissionTimer_, &tv);
+  }
+}
+
 void StratumServer::downReadCallback(struct bufferevent *bev, void *ptr) {
   static_cast<StratumSession *>(ptr)->recvData(bufferevent_get_input(bev));
 }
@@ -1293,28 +3669,67 @@ void StratumServer::addDownConnection(StratumSession *conn) {
   assert(downSessions_.size() >= (size_t)(conn->sessionId_ + 1));
 
   assert(downSessions_[conn->sessionId_] == NULL);
-  downSessions_  [conn->sessionId_] = conn;
-  upSessionCount_[conn->upSessionIdx_]++;
+  downSessions_[conn->sessionId_] = conn;
+
+  vector<StratumSession *> &sessions = upDownSessions_[conn->upSessionIdx_];
+  conn->upDownSessionPos_ = (uint32_t)sessions.size();
+  sessions.push_back(conn);
 }
 
 void StratumServer::removeDownConnection(StratumSession *downconn) {
   // unregister worker
   unRegisterWorker(downconn);
+  freeDownConnection(downconn);
+}
+
+void StratumServer::freeDownConnection(StratumSession *downconn) {
+  if (downconn->shareRejects_.total() > 0) {
+    LOG(INFO) << "worker " << downconn->getRegisteredWorkerName()
+    << " (session " << downconn->sessionId_ << ") is closed, rejected shares: "
+    << downconn->shareRejects_.toString() << std::endl;
+  }
+
+  // room for another one
+  if (!downconn->isRegistered_) {
+    handshakingCount_--;
+    if (isListenerPaused_)
+      event_active(admissionTimer_, EV_TIMEOUT, 1);
+  }
 
   // clear resources
   sessionIDManager_.freeSessionId(downconn->sessionId_);
-  downSessions_  [downconn->sessionId_] = NULL;
-  upSessionCount_[downconn->upSessionIdx_]--;
+  downSessions_[downconn->sessionId_] = NULL;
+
+  // swap with the last one and pop it
+  vector<StratumSession *> &sessions = upDownSessions_[downconn->upSessionIdx_];
+  assert(sessions[downconn->upDownSessionPos_] == downconn);
+  StratumSession *last = sessions.back();
+  sessions[downconn->upDownSessionPos_] = last;
+  last->upDownSessionPos_ = downconn->upDownSessionPos_;
+  sessions.pop_back();
+
   delete downconn;
 }
 
 void StratumServer::run() {
   assert(base_ != NULL);
+  running_ = true;  // it may run again after a failed hot upgrade
   event_base_dispatch(base_);
 }
 
 void StratumServer::upReadCallback(struct bufferevent *bev, void *ptr) {
-  static_cast<UpStratumClient *>(ptr)->recvData(bufferevent_get_input(bev));
+  UpStratumClient *up = static_cast<UpStratumClient *>(ptr);
+  up->recvData(bufferevent_get_input(bev));
+
+  if (up->isHandshakeFailed())
+    up->server_->upSessionLost(up);
+}
+
+void StratumServer::upWriteCallback(struct bufferevent *bev, void *ptr) {
+  // the output buffer is drained, push out the last partial segment
+  UpStratumClient *up = static_cast<UpStratumClient *>(ptr);
+  if (up->isCorked())
+    up->setCork(false);
 }
 
 void StratumServer::addUpConnection(UpStratumClient *conn) {
@@ -1343,18 +3758,14 @@ void StratumServer::removeUpConnection(UpStratumClient *upconn) {
   }
 
   // remove down session which belong to this up connection
-  for (size_t i = 0; i < downSessions_.size(); i++) {
-    StratumSession *s = downSessions_[i];
-    if (s == NULL)
-      continue;
-
-    if (s->upSessionIdx_ == upconn->idx_)
-      removeDownConnection(s);
+  vector<StratumSession *> &sessions = upDownSessions_[upconn->idx_];
+  while (!sessions.empty()) {
+    freeDownConnection(sessions.back());
   }
 
-  upSessions_    [upconn->idx_] = NULL;
-  upSessionCount_[upconn->idx_] = 0;
+  upSessions_[upconn->idx_] = NULL;
   delete upconn;
+  checkStartup();
 }
 
 void StratumServer::upEventCallback(struct bufferevent *bev,
@@ -1365,10 +3776,11 @@ void StratumServer::upEventCallback(struct bufferevent *bev,
   if (events & BEV_EVENT_CONNECTED) {
     up->state_ = UP_CONNECTED;
 
-    // do subscribe
-    string s = Strings::Format("{\"id\":1,\"method\":\"mining.subscribe\""
-                               ",\"params\":[\"%s\"]}\n", BTCCOM_MINER_AGENT);
-    up->sendData(s);
+    // do subscribe, the pipelined one is in the output buffer already
+    if (!up->isPipelined()) {
+      up->sendData(up->getSubscribeMessage());
+      up->isConfigurePending_ = server->getAgentConf().upSharesBatch_;
+    }
     return;
   }
 
@@ -1386,25 +3798,37 @@ void StratumServer::upEventCallback(struct bufferevent *bev,
     LOG(ERROR) << "unhandled events from pool server: " << events << std::endl;
   }
 
-  server->removeUpConnection(up);
+  server->upSessionLost(up);
 }
 
-void StratumServer::sendMiningNotifyToAll(const int8_t idx, const string &notify) {
-  for (size_t i = 0; i < downSessions_.size(); i++) {
-    StratumSession *s = downSessions_[i];
-    if (s == NULL || s->upSessionIdx_ != idx)
-      continue;
+void StratumServer::upSessionLost(UpStratumClient *up) {
+  // lost an attempt of the race, try the next address at once
+  UpSessionRace *race = findUpSessionRace(up);
+  if (race != NULL) {
+    race->attempts_.erase(std::find(race->attempts_.begin(), race->attempts_.end(), up));
+    delete up;
+    startUpSessionAttempt(race);
+    checkUpSessionRace(race);
+    return;
+  }
+
+  migrateDownSessions(up->idx_);
+  removeUpConnection(up);
+}
 
-    s->sendData(notify);
+void StratumServer::sendMiningNotifyToAll(const int8_t idx, SharedBuffer *notify) {
+  const vector<StratumSession *> &sessions = upDownSessions_[idx];
+  for (size_t i = 0; i < sessions.size(); i++) {
+    sessions[i]->sendData(notify);
   }
 }
 
 void StratumServer::sendMiningNotify(StratumSession *downSession) {
   UpStratumClient *up = upSessions_[downSession->upSessionIdx_];
-  if (up == NULL || up->latestMiningNotifyStr_.length() == 0)
+  if (up == NULL || up->latestMiningNotify_ == NULL)
     return;
 
-  downSession->sendData(up->latestMiningNotifyStr_);
+  downSession->sendData(up->latestMiningNotify_);
 }
 
 void StratumServer::sendDefaultMiningDifficulty(StratumSession *downSession) {
@@ -1416,163 +3840,205 @@ void StratumServer::sendDefaultMiningDifficulty(StratumSession *downSession) {
                                    ",\"params\":[%" PRIu32"]}\n",
                                    up->poolDefaultDiff_);
   downSession->sendData(s);
+  downSession->setDifficulty(up->poolDefaultDiff_);
 }
 
 void StratumServer::sendMiningDifficulty(UpStratumClient *upconn,
                                          uint16_t sessionId, uint64_t diff) {
   StratumSession *downSession = downSessions_[sessionId];
-  if (downSession == NULL)
-    return;
+  if (downSession == NULL || upSessions_[downSession->upSessionIdx_] != upconn)
+    return;  // not the miner of this up session
 
   const string s = Strings::Format("{\"id\":null,\"method\":\"mining.set_difficulty\""
                                    ",\"params\":[%" PRIu64"]}\n", diff);
   downSession->sendData(s);
+  downSession->setDifficulty(diff);
 }
 
-int8_t StratumServer::findUpSessionIdx() {
+int8_t StratumServer::findUpSessionIdx(const int8_t exceptIdx) {
   int32_t count = -1;
   int8_t idx = -1;
 
-  for (size_t i = 0; i < upSessions_.size(); i++) {
-    if (upSessions_[i] == NULL || !upSessions_[i]->isAvailable())
+  // the draining ones take no new miners
+  for (size_t i = 0; i < (size_t)activeUpSessionCount_; i++) {
+    if ((int8_t)i == exceptIdx ||
+        upSessions_[i] == NULL || !upSessions_[i]->isAvailable())
       continue;
 
+    const int32_t downCount = (int32_t)upDownSessions_[i].size();
     if (count == -1) {
       idx = i;
-      count = upSessionCount_[i];
+      count = downCount;
     }
-    else if (upSessionCount_[i] < count) {
+    else if (downCount < count) {
       idx = i;
-      count = upSessionCount_[i];
+      count = downCount;
     }
   }
   return idx;
 }
 
+int StratumServer::checkShare(const Share &share,
+                              StratumSession *downSession) {
+  if (!conf_.shareValidation_)
+    return StratumError::NO_ERROR;
+
+  UpStratumClient *up = upSessions_[downSession->upSessionIdx_];
+  if (up == NULL)
+    return StratumError::NO_ERROR;
+
+  const JobTemplate *job = up->findJobTemplate((uint8_t)share.jobId_);
+  const uint64_t diff = downSession->getShareDifficulty();
+  const int64_t jobAge = (job != NULL) ?
+                         std::max((int64_t)time(NULL) - (int64_t)job->receivedTime_, (int64_t)0) : 0;
+  int err = StratumError::NO_ERROR;
+
+  if (job == NULL) {
+    // stale, or it may be a job before the hot upgrade
+    if (up->isJobWindowComplete_)
+      err = StratumError::JOB_NOT_FOUND;
+  }
+  else if ((int64_t)share.time_ + kShareTimeDriftSec_ < (int64_t)job->time_) {
+    err = StratumError::TIME_TOO_OLD;
+  }
+  else if ((int64_t)share.time_ > (int64_t)job->time_ + jobAge + kShareTimeDriftSec_) {
+    err = StratumError::TIME_TOO_NEW;
+  }
+  else {
+    // the shares before the clean job are all stale
+    DuplicateShareFilter &filter = downSession->shareFilter_;
+    if (downSession->shareFilterSeq_ != up->jobTimes_.getCleanSeq()) {
+      filter.clear();
+      downSession->shareFilterSeq_ = up->jobTimes_.getCleanSeq();
+    }
+
+    if (!filter.insert(DuplicateShareFilter::hashShare(job->seq_, share))) {
+      err = StratumError::DUPLICATE_SHARE;
+    }
+    else if (job->hasHeader_ && diff != 0) {
+      uint8_t hash[32];
+      job->getHeaderHash(downSession->sessionId_, share, hash);
+      if (!JobTemplate::isHashBelowTarget(hash, diff))
+        err = StratumError::LOW_DIFFICULTY;
+    }
+  }
+
+  if (err != StratumError::NO_ERROR) {
+    shareRejects_.add(err);
+    downSession->shareRejects_.add(err);
+  }
+  return err;
+}
+
 void StratumServer::submitShare(const Share &share,
                                 StratumSession *downSession) {
+  shareCount_++;
   UpStratumClient *up = upSessions_[downSession->upSessionIdx_];
 
-  bool isTimeChanged = true;
-  if ((share.jobId_ == up->latestJobId_[2] && share.time_ == up->latestJobGbtTime_[2]) ||
-      (share.jobId_ == up->latestJobId_[1] && share.time_ == up->latestJobGbtTime_[1]) ||
-      (share.jobId_ == up->latestJobId_[0] && share.time_ == up->latestJobGbtTime_[0])) {
-    isTimeChanged = false;
+  uint32_t jobTime = 0u;
+  const int32_t age = up->jobTimes_.find((uint8_t)share.jobId_, &jobTime);
+
+  // the nTime is an offset from the job's time, the pool knows the job
+  if (up->isSharesBatchSupported_ && age != -1) {
+    ExBatchedShare msg;
+    msg.jobId_       = (uint8_t)share.jobId_;
+    msg.sessionId_   = downSession->sessionId_;
+    msg.extraNonce2_ = share.extraNonce2_;
+    msg.nonce_       = share.nonce_;
+    msg.timeOffset_  = (int32_t)(share.time_ - jobTime);
+    up->submitShare(msg);
+    return;
   }
 
-  //
-  // | magic_number(1) | cmd(1) | len (2) | jobId (uint8_t) | session_id (uint16_t) |
-  // | extra_nonce2 (uint32_t) | nNonce (uint32_t) | [nTime (uint32_t) |]
-  //
-  string buf;
-  const uint16_t len = isTimeChanged ? 19 : 15;  // fixed 19 or 15 bytes
-  buf.resize(len, 0);
-  uint8_t *p = (uint8_t *)buf.data();
+  const bool isTimeChanged = (age == -1 || share.time_ != jobTime);
+  if (!isTimeChanged) {
+    shareNoTimeCount_++;
+    if (age >= kShortJobHistory_)
+      shareBytesSaved_ += 4;
+  }
 
-  // cmd
-  *p++ = CMD_MAGIC_NUMBER;
-  *p++ = isTimeChanged ? CMD_SUBMIT_SHARE_WITH_TIME : CMD_SUBMIT_SHARE;
+  ExSubmitShare msg;
+  msg.jobId_       = (uint8_t)share.jobId_;
+  msg.sessionId_   = downSession->sessionId_;
+  msg.extraNonce2_ = share.extraNonce2_;
+  msg.nonce_       = share.nonce_;
+  msg.hasTime_     = isTimeChanged;
+  msg.time_        = share.time_;
 
-  // len
-  *(uint16_t *)p = len;
-  p += 2;
+  // batched, see UpStratumClient::submitShare()
+  up->submitShare(msg);
+}
+
+void StratumServer::migrateDownSessions(const int8_t idx) {
+  vector<StratumSession *> &sessions = upDownSessions_[idx];
+  const size_t total = sessions.size();
+  size_t moved = 0;
 
-  // jobId
-  *p++ = (uint8_t)share.jobId_;
+  while (!sessions.empty()) {
+    const int8_t newIdx = findUpSessionIdx(idx);
+    if (newIdx == -1)
+      break;  // the rest are closed with the up session
 
-  // session Id
-  *(uint16_t *)p = downSession->sessionId_;
-  p += 2;
+    StratumSession *downSession = sessions.back();
+    sessions.pop_back();
 
-  // extra_nonce2
-  *(uint32_t *)p = share.extraNonce2_;
-  p += 4;
+    vector<StratumSession *> &newSessions = upDownSessions_[newIdx];
+    downSession->upSessionIdx_     = newIdx;
+    downSession->upDownSessionPos_ = (uint32_t)newSessions.size();
+    newSessions.push_back(downSession);
 
-  // nonce
-  *(uint32_t *)p = share.nonce_;
-  p += 4;
+    resumeDownSession(downSession);
+    moved++;
+  }
 
-  // ntime
-  if (isTimeChanged) {
-    *(uint32_t *)p = share.time_;
-    p += 4;
+  if (total > 0) {
+    LOG(INFO) << "up session[" << (int32_t)idx << "] is lost, moved " << moved
+    << " of " << total << " miners to the others" << std::endl;
   }
-  assert(p - (uint8_t *)buf.data() == (int64_t)buf.size());
+}
 
-  // send buf
-  up->sendData(buf);
+void StratumServer::resumeDownSession(StratumSession *downSession) {
+  // the job seqs are of the old up session
+  downSession->shareFilter_.clear();
+
+  // not registered yet, it'll be registered to the new one then
+  if (!downSession->isRegistered_)
+    return;
+
+  // the frames are queued in the output buffer, the new up session gets all
+  // of them in a few writes
+  registerWorker(downSession, downSession->getMinerAgent(),
+                 downSession->getRegisteredWorkerName());
+  sendDefaultMiningDifficulty(downSession);
+
+  UpStratumClient *up = upSessions_[downSession->upSessionIdx_];
+  SharedBuffer *notify = up->getCleanMiningNotify();
+  if (notify != NULL)
+    downSession->sendData(notify);
 }
 
 void StratumServer::registerWorker(StratumSession *downSession,
                                    const char *minerAgent,
                                    const string &workerName) {
-  //
-  // | magic_number(1) | cmd(1) | len (2) | session_id(2) | clientAgent | worker_name |
-  //
-  uint16_t len = 0;
-  len += (1+1+2+2); // magic_num, cmd, len, session_id
-  // client agent
-  len += (minerAgent != NULL) ? strlen(minerAgent) : 0;
-  len += 1; // '\0'
-  len += workerName.length() + 1;  // worker name and '\0'
-
-  string buf;
-  buf.resize(len, 0);
-  uint8_t *p = (uint8_t *)buf.data();
-
-  // cmd
-  *p++ = CMD_MAGIC_NUMBER;
-  *p++ = CMD_REGISTER_WORKER;
-
-  // len
-  *(uint16_t *)p = len;
-  p += 2;
-
-  // session Id
-  *(uint16_t *)p = downSession->sessionId_;
-  p += 2;
-
-  // miner agent
-  if (minerAgent != NULL) {
-    // strcpy: including the terminating null byte
-    strcpy((char *)p, minerAgent);
-    p += strlen(minerAgent) + 1;
-  } else {
-    *p++ = '\0';
-  }
-
-  // worker name
-  strcpy((char *)p, workerName.c_str());
-  p += workerName.length() + 1;
-  assert(p - (uint8_t *)buf.data() == (int64_t)buf.size());
+  ExRegisterWorker msg;
+  msg.sessionId_  = downSession->sessionId_;
+  if (minerAgent != NULL)
+    msg.minerAgent_ = StringRef(minerAgent, strlen(minerAgent));
+  msg.workerName_ = StringRef(workerName.data(), workerName.size());
 
   UpStratumClient *up = upSessions_[downSession->upSessionIdx_];
-  up->sendData(buf);
+  if (!msg.encode(up->getExMessageOutput())) {
+    LOG(ERROR) << "encode CMD_REGISTER_WORKER failure, worker: " << workerName << std::endl;
+  }
 }
 
 void StratumServer::unRegisterWorker(StratumSession *downSession) {
-  //
-  // CMD_UNREGISTER_WORKER:
-  // | magic_number(1) | cmd(1) | len (2) | session_id(2) |
-  //
-  const uint16_t len = 6;
-  string buf;
-  buf.resize(len, 0);
-  uint8_t *p = (uint8_t *)buf.data();
-
-  // cmd
-  *p++ = CMD_MAGIC_NUMBER;
-  *p++ = CMD_UNREGISTER_WORKER;
-
-  // len
-  *(uint16_t *)p = len;
-  p += 2;
+  if (!downSession->isRegistered_)
+    return;
 
-  // session Id
-  *(uint16_t *)p = downSession->sessionId_;
-  p += 2;
-  assert(p - (uint8_t *)buf.data() == (int64_t)buf.size());
+  ExUnregisterWorker msg;
+  msg.sessionId_ = downSession->sessionId_;
 
   UpStratumClient *up = upSessions_[downSession->upSessionIdx_];
-  up->sendData(buf);
+  msg.encode(up->getExMessageOutput());
 }
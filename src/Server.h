@@ -20,6 +20,10 @@
 #define SERVER_H_
 
 #include "Utils.h"
+#include "ExMessage.h"
+#include "Handoff.h"
+#include "Resolver.h"
+#include "Sha256.h"
 #include "jsmn.h"
 
 #include <event2/event.h>
@@ -27,19 +31,11 @@
 #include <event2/bufferevent.h>
 #include <event2/listener.h>
 
-#include <bitset>
+#include <deque>
 #include <map>
 #include <set>
 
 
-#define CMD_MAGIC_NUMBER      0x7Fu
-// types
-#define CMD_REGISTER_WORKER   0x01u             // Agent -> Pool
-#define CMD_SUBMIT_SHARE      0x02u             // Agent -> Pool, without block time
-#define CMD_SUBMIT_SHARE_WITH_TIME  0x03u       // Agent -> Pool
-#define CMD_UNREGISTER_WORKER 0x04u             // Agent -> Pool
-#define CMD_MINING_SET_DIFF   0x05u             // Pool  -> Agent
-
 // agent, DO NOT CHANGE
 #define AGENT_MAX_SESSION_ID   0xFFFEu  // 0xFFFEu = 65534
 
@@ -49,14 +45,24 @@
 class StratumSession;
 class StratumServer;
 class UpStratumClient;
+class SharedBuffer;
+
+//
+// scan each contiguous chunk of the evbuffer once for all the '\n', and get a
+// batch of complete lines. the lines are pulled up in place only if one of
+// them crosses chunks. the lines are valid until the evbuffer is changed, the
+// caller should evbuffer_drain() *bytes after handled.
+//
+size_t splitLines(struct evbuffer *inBuf, StringRef *lines, const size_t maxLines,
+                  size_t *bytes);
 
 
 //////////////////////////////// StratumError ////////////////////////////////
 class StratumError {
 
-// Win32 #define NO_ERROR as well. There is the same value, so #undef NO_ERROR first.
-#ifdef _WIN32
- #undef NO_ERROR
+// Win32 #define NO_ERROR as well. There is the same value, so #undef NO_ERROR first.
+#ifdef _WIN32
+ #undef NO_ERROR
 #endif
 
 public:
@@ -84,16 +90,39 @@ public:
 
 //////////////////////////////// SessionIDManager //////////////////////////////
 class SessionIDManager {
-  std::bitset<AGENT_MAX_SESSION_ID + 1> sessionIds_;
+  //
+  // two-level bitmap. a bit of sessionIds_ is set if the session id is in use,
+  // a bit of fullWords_ is set if all the 64 ids of that word are in use, so
+  // we could find a free id by a few count-trailing-zeros.
+  //
+  static const uint32_t kIdsWordCount_  = (AGENT_MAX_SESSION_ID + 1 + 63) / 64;
+  static const uint32_t kFullWordCount_ = (kIdsWordCount_ + 63) / 64;
+
+  uint64_t sessionIds_[kIdsWordCount_];
+  uint64_t fullWords_[kFullWordCount_];
   int32_t count_;
+  int32_t capacity_;
   uint32_t allocIdx_;
 
+  static int32_t findFirstZero(const uint64_t *words, const uint32_t wordCount,
+                               const uint32_t beginIdx);
+  void setUsed(const uint32_t idx);
+  void setFree(const uint32_t idx);
+
 public:
   SessionIDManager();
 
+  // only hand out the ids in [minId, maxId], call it before any allocation.
+  // the threads have disjoint ranges, so there is no lock.
+  void setRange(const uint16_t minId, const uint16_t maxId);
+
   bool ifFull();
   bool allocSessionId(uint16_t *sessionId);  // range: [0, AGENT_MAX_SESSION_ID]
   void freeSessionId(const uint16_t sessionId);
+
+  // the bitmaps and the round-robin position, for the hot upgrade
+  void exportState(HandoffWriter &w) const;
+  bool importState(HandoffReader &r);
 };
 
 
@@ -120,27 +149,118 @@ class StratumJob {
 public:
   uint32_t jobId_;
   string prevHash_;
+  string coinbase1_;   // hex
+  string coinbase2_;
+  vector<string> merkleBranches_;
   int32_t  version_;
+  uint32_t nBits_;
   uint32_t time_;      // block time or stratum job time
   bool  isClean_;
+  // where is_clean is in the line, -1 if it's not a JSON primitive
+  int32_t cleanPos_;
+  int32_t cleanLen_;
 
-  StratumJob(): jobId_(0), version_(0), time_(0), isClean_(false) {}
+  StratumJob(): jobId_(0), version_(0), nBits_(0), time_(0), isClean_(false),
+  cleanPos_(-1), cleanLen_(0) {}
   StratumJob(const StratumJob &r) {
-    jobId_    = r.jobId_;
-    prevHash_ = r.prevHash_;
-    version_  = r.version_;
-    time_     = r.time_;
-    isClean_  = r.isClean_;
+    jobId_     = r.jobId_;
+    prevHash_  = r.prevHash_;
+    coinbase1_ = r.coinbase1_;
+    coinbase2_ = r.coinbase2_;
+    merkleBranches_ = r.merkleBranches_;
+    version_   = r.version_;
+    nBits_     = r.nBits_;
+    time_      = r.time_;
+    isClean_   = r.isClean_;
+    cleanPos_  = r.cleanPos_;
+    cleanLen_  = r.cleanLen_;
   }
 };
 
 
+///////////////////////////////// JobTemplate //////////////////////////////////
+//
+// a job of an up session in binary, to rebuild the block header of a share.
+// the coinbase is coinbase1 | extraNonce1 of the up session | session id |
+// extraNonce2 | coinbase2, the sha256 of the first two is kept (midstate).
+//
+class JobTemplate {
+  Sha256  coinbaseHead_;
+  string  coinbase2_;
+  string  merkleBranches_;  // 32 bytes each
+  uint8_t header_[80];      // the merkle root, time and nonce are per share
+
+public:
+  uint8_t  jobId_;
+  uint32_t seq_;           // of the up session, unlike the job id it's unique
+  uint32_t time_;          // nTime of the job
+  uint32_t receivedTime_;  // local time
+  bool     hasHeader_;     // false if it couldn't be decoded, not hashed
+
+  JobTemplate();
+  // hasHeader_ is false if it returns false, the others are set anyway
+  bool init(const StratumJob &sjob, const uint32_t extraNonce1);
+
+  // sha256d of the share's block header
+  void getHeaderHash(const uint16_t sessionId, const Share &share,
+                     uint8_t hash[32]) const;
+  // hash (little endian) <= the target of the difficulty, i.e.
+  // 0xFFFF * 2^208 / diff, in integers without the division
+  static bool isHashBelowTarget(const uint8_t hash[32], const uint64_t diff);
+};
+
+
+///////////////////////////////// SharedBuffer /////////////////////////////////
+//
+// immutable and reference-counted buffer. it's added to evbuffers by reference
+// (no copy), so one mining.notify could be shared by all the down sessions.
+// it will be freed when the last evbuffer has flushed it.
+//
+class SharedBuffer {
+  string  data_;
+  int32_t refCount_;
+
+  SharedBuffer(const string &data);
+  ~SharedBuffer();
+
+  static void evbufferCleanupCallback(const void *data, size_t len, void *ptr);
+
+public:
+  // the reference count of the new buffer is 1
+  static SharedBuffer *create(const string &data);
+
+  void retain();
+  void release();
+
+  inline const char *data() const { return data_.data(); }
+  inline size_t size() const { return data_.size(); }
+
+  // append to the evbuffer without copying the data
+  bool addToEvbuffer(struct evbuffer *buf);
+};
+
+
 ///////////////////////////////// StratumMessage ///////////////////////////////
+enum StratumMethod {
+  METHOD_UNKNOWN               = 0,
+  METHOD_MINING_SUBMIT         = 1,
+  METHOD_MINING_NOTIFY         = 2,
+  METHOD_MINING_SET_DIFFICULTY = 3,
+  METHOD_MINING_SUBSCRIBE      = 4,
+  METHOD_MINING_AUTHORIZE      = 5
+};
+
+//
+// StratumMessage doesn't own the content, it parses over the view of the
+// input (eg. the line pulled up in the evbuffer), so the content MUST be
+// alive while using the message.
+//
 class StratumMessage {
-  string content_;
+  const char *content_;
+  size_t contentLen_;
 
-  string method_;      // if it's invalid json string, you can't get the method
-  string id_;          // "id"
+  StratumMethod method_;  // if it's invalid json string, you can't get the method
+  StringRef id_;       // "id", the raw json, with the quotes if it's a string
   bool   isStringId_;  // "id" is string or not
 
   // json
@@ -149,16 +269,18 @@ class StratumMessage {
 
   Share      share_;    // mining.submit
   StratumJob sjob_;     // mining.notify
-  string minerAgent_;   // mining.subscribe
-  string workerName_;   // mining.authorize
-  string password_;
-  uint32_t diff_;       // mining.set_difficulty
+  StringRef minerAgent_;  // mining.subscribe
+  StringRef workerName_;  // mining.authorize
+  uint32_t diff_;         // mining.set_difficulty
 
   string getJsonStr(const jsmntok_t *t) const;
+  StringRef getJsonStrRef(const jsmntok_t *t) const;
   int jsoneq(const jsmntok_t *tok, const char *s) const;
+  uint32_t getJsonHex32(const jsmntok_t *t) const;
+  uint32_t getJsonDec32(const jsmntok_t *t) const;
 
-  string findMethod() const;
-  string parseId();
+  StratumMethod findMethod() const;
+  void parseId();
   void parse();
 
   void _parseMiningSubmit();
@@ -168,13 +290,27 @@ class StratumMessage {
   void _parseMiningAuthorize();
 
 public:
+  StratumMessage(const char *content, size_t len);
   StratumMessage(const string &content);
   ~StratumMessage();
 
+  //
+  // single-pass scanner for the common form of 'mining.submit', without jsmn
+  // and temporary strings. idStr is the raw json of "id" (with the quotes if
+  // it's a string). return false if the line is unusual, then use the
+  // generic parser.
+  //
+  static bool parseMiningSubmitFast(const char *line, size_t len,
+                                    Share *share, StringRef *idStr);
+  static const char *getMethodName(StratumMethod method);
+
   bool isValid() const;
-  string getMethod() const;
+  StratumMethod getMethod() const;
   bool getResultBoolean() const;
+  // the result is an object and its `name` is true, e.g. of mining.configure
+  bool getResultExtension(const char *name) const;
   string getId() const;
+  StringRef getIdJson() const;  // raw json of "id", "null" if it's absent
   bool isStringId() const;
 
   bool parseMiningSubmit(Share &share) const;
@@ -187,6 +323,130 @@ public:
 };
 
 
+///////////////////////////// DuplicateShareFilter /////////////////////////////
+//
+// the shares of a session since the last clean job, to find the duplicates.
+// an exact set of the 64 bits hashes of (job seq, extraNonce2, nTime, nonce),
+// open addressing with linear probing, at most 3/4 full. it's allocated by
+// the first share (16 slots) and doubled when it's full, cleared but not
+// shrunk by a clean job. at 6 shares per minute and a block every 10
+// minutes, it's 128 slots, i.e. 1 KB per miner, 10 MB per 10k miners. at
+// most 2048 slots (16 KB).
+//
+class DuplicateShareFilter {
+  static const uint32_t kMinSlots_ = 16;
+  static const uint32_t kMaxCount_ = 1024;  // cleared when it's reached
+
+  vector<uint64_t> slots_;  // 0 is empty
+  uint32_t count_;
+
+  void grow();
+
+public:
+  DuplicateShareFilter(): count_(0) {}
+
+  static uint64_t hashShare(const uint32_t jobSeq, const Share &share);
+  // false if it's there already
+  bool insert(const uint64_t key);
+  void clear();
+
+  inline uint32_t size() const { return count_; }
+  inline size_t getMemorySize() const { return slots_.capacity() * sizeof(uint64_t); }
+};
+
+
+/////////////////////////////////// JobTimeRing ////////////////////////////////
+//
+// the GBT time of the latest jobs of an up session, indexed by the 8 bits job
+// id. a share of one of them with the job's nTime is sent without the nTime
+// (CMD_SUBMIT_SHARE), the pool knows it. like the pool, a newer job with the
+// same id replaces the older one. with AgentConf::shareValidation_ it keeps
+// the jobs' templates as well, the shares are checked against the same
+// `depth_` jobs.
+//
+class JobTimeRing {
+  uint32_t time_[256];
+  uint32_t seq_[256];   // 0 if never seen
+  uint32_t latestSeq_;
+  uint32_t cleanSeq_;   // of the latest clean job, 0 if none
+  uint32_t depth_;
+  uint8_t  latestJobId_;
+  // by the job id as well, empty until the first addTemplate()
+  vector<JobTemplate> templates_;
+
+public:
+  static const uint32_t kMaxDepth_ = 256;
+
+  explicit JobTimeRing(const uint32_t depth);
+
+  // the jobs before a clean one are stale
+  void add(const uint8_t jobId, const uint32_t time, const bool isClean = false);
+  // of the latest add(), its seq_ is set here
+  void addTemplate(const JobTemplate &job);
+  // how many jobs ago, 0 is the latest one. -1 if it's not one of the
+  // latest `depth_` jobs.
+  int32_t find(const uint8_t jobId, uint32_t *time) const;
+  // NULL if it's not one of the latest `depth_` jobs, it's before the
+  // latest clean job or it has no template
+  const JobTemplate *findTemplate(const uint8_t jobId) const;
+
+  inline uint8_t  getLatestJobId() const { return latestJobId_; }
+  inline uint32_t getLatestTime() const { return time_[latestJobId_]; }
+  inline uint32_t getDepth() const { return depth_; }
+  inline uint32_t getCleanSeq() const { return cleanSeq_; }
+
+  // the jobs are kept by the hot upgrade, the depth is of the new config
+  void exportState(HandoffWriter &w) const;
+  bool importState(HandoffReader &r);
+};
+
+
+//////////////////////////////////// ShareRejects ////////////////////////////
+// the shares rejected by StratumServer::checkShare(), by the error
+class ShareRejects {
+public:
+  uint32_t jobNotFound_;
+  uint32_t timeTooOld_;
+  uint32_t timeTooNew_;
+  uint32_t duplicate_;
+  uint32_t lowDifficulty_;
+
+  ShareRejects(): jobNotFound_(0), timeTooOld_(0), timeTooNew_(0),
+  duplicate_(0), lowDifficulty_(0) {}
+
+  void add(const int err);
+  void add(const ShareRejects &r);
+  uint32_t total() const;
+  string toString() const;
+};
+
+
+//////////////////////////////////// ServerStats /////////////////////////////
+// a snapshot of the counters of a StratumServer, passed between threads
+class ServerStats {
+public:
+  uint32_t downSessionCount_;
+  uint64_t downWriteCount_;
+  uint64_t downFlushCount_;
+  uint64_t shareCount_;
+  uint64_t shareBytes_;         // of the submit frames to the pool
+  uint64_t shareNoTimeCount_;   // sent without the nTime
+  uint64_t shareBytesSaved_;    // by the job ids older than the latest 3
+  ShareRejects shareRejects_;
+  int64_t  upRttMaxUs_;  // the max heartbeat srtt of the up sessions
+
+  ServerStats(): downSessionCount_(0), downWriteCount_(0), downFlushCount_(0),
+  shareCount_(0), shareBytes_(0), shareNoTimeCount_(0), shareBytesSaved_(0),
+  upRttMaxUs_(0) {}
+};
+
+// commands to a StratumServer from another thread
+enum ServerCommand {
+  SERVER_CMD_STOP  = 1,
+  SERVER_CMD_STATS = 2   // reply a ServerStats, see StratumServer::popStats()
+};
+
+
 /////////////////////////////////// StratumServer //////////////////////////////
 class StratumServer {
   //
@@ -196,8 +456,15 @@ class StratumServer {
   // disconnect, just some miners which belong to this connection(UpStratumClient)
   // will reconnect instead of all miners reconnect to the Agent.
   //
-  static const int8_t kUpSessionCount_ = 5;  // MAX is 127
+  static const int8_t kDefaultUpSessionCount_ = 5;
+  static const int8_t kMaxUpSessionCount_ = 127;
+  int8_t upSessionCount_;        // slots in use, MAX is 127
+  int8_t activeUpSessionCount_;  // the first ones, new miners only go there
   bool running_;
+  bool reusePort_;  // SO_REUSEPORT, the threads share the listen port
+  // in setup(), until the first up session is available
+  bool isStarting_;
+  int64_t startupBeginMs_;
 
   string   listenIP_;
   uint16_t listenPort_;
@@ -208,19 +475,235 @@ class StratumServer {
 
   // up stream connnections
   vector<UpStratumClient *> upSessions_;
-  vector<int32_t> upSessionCount_;
+  // down sessions of each up session, dense array with swap-remove, so
+  // fan-out and teardown only cost O(miners on that up session)
+  vector<vector<StratumSession *> > upDownSessions_;
   struct event *upEvTimer_;
 
   // down stream connections
   vector<StratumSession *> downSessions_;
 
+  AgentConf conf_;
+
+  // down sessions which have staged data, flushed at the end of the event
+  // loop iteration (or after conf_.downFlushDelayMs_)
+  vector<uint16_t> pendingFlushSessions_;
+  struct event *downFlushEvent_;
+
+  // counters, to show how many syscalls are saved
+  uint64_t downWriteCount_;   // times of StratumSession::sendData()
+  uint64_t downFlushCount_;   // times of writing to bufferevents
+  uint64_t lastDownWriteCount_;
+  uint64_t lastDownFlushCount_;
+  time_t   lastStatsTime_;
+
+  uint64_t shareCount_;
+  uint64_t shareBytes_;        // of the submit frames, see UpStratumClient::flushShares()
+  ShareRejects shareRejects_;  // by checkShare()
+
+  // the shares sent without the nTime (CMD_SUBMIT_SHARE, 4 bytes less), and
+  // the bytes saved by the job ids older than the latest 3 jobs, i.e. more
+  // than a fixed window of 3 jobs would do. see AgentConf::jobHistoryDepth_.
+  uint64_t shareNoTimeCount_;
+  uint64_t shareBytesSaved_;
+  static const int32_t kShortJobHistory_ = 3;
+
+  //
+  // the pools reject the shares with the nTime before the job's, or too far
+  // after it. the window here is wider by kShareTimeDriftSec_ on both sides,
+  // [job time - drift, job time + job's age + drift], only the absurd ones
+  // are rejected locally.
+  //
+  static const uint32_t kShareTimeDriftSec_ = 600;
+
+  // commands from another thread, see postCommand()
+  SpscQueue<int32_t, 16> cmdQueue_;
+  evutil_socket_t cmdFds_[2];  // socketpair, to wake up the event loop
+  struct event *cmdEvent_;
+  // replies of SERVER_CMD_STATS
+  SpscQueue<ServerStats, 16> statsQueue_;
+
+  static void cmdCallback(evutil_socket_t fd, short events, void *ptr);
+  bool createListener(const struct sockaddr_in &sin);
+
+  //
+  // admission control, see AgentConf::acceptRatePerSec_. a new connection
+  // takes a token of acceptBucket_, and it's handshaking until its worker is
+  // registered to the pool. when it's over the limits the listener is
+  // disabled, so the miners wait in the kernel backlog. a few may be
+  // accepted before that, they wait in pendingAccepts_. the registers wait
+  // for the tokens of registerBucket_ in pendingRegisters_.
+  //
+  static const int32_t kListenBacklog_ = 4096;
+  static const size_t  kMaxPendingAccepts_ = 256;
+  static const int32_t kHandshakeTimeoutSec_ = 60;  // closed if not registered
+
+  struct PendingAccept {
+    evutil_socket_t fd_;
+    struct in_addr  saddr_;
+  };
+  TokenBucket acceptBucket_;
+  TokenBucket registerBucket_;
+  int32_t handshakingCount_;
+  bool    isListenerPaused_;
+  std::deque<PendingAccept> pendingAccepts_;
+  std::deque<uint16_t> pendingRegisters_;  // session ids
+  struct event *admissionTimer_;
+  uint64_t reconnectCount_;  // told to come back later
+
+  static void admissionTimerCallback(evutil_socket_t fd, short events, void *ptr);
+  static void rejectReadCallback (struct bufferevent *bev, void *ptr);
+  static void rejectWriteCallback(struct bufferevent *bev, void *ptr);
+  static void rejectEventCallback(struct bufferevent *bev, short events, void *ptr);
+  bool tryAdmit(const int64_t now);
+  void handleAccept(evutil_socket_t fd, const struct in_addr &saddr);
+  void createDownSession(evutil_socket_t fd, const struct in_addr &saddr);
+  void rejectConnection(evutil_socket_t fd);
+  void startDownSession(StratumSession *downSession);
+  void processAdmission();
+
+  // resolves the pools' hosts without blocking the event loop
+  Resolver *resolver_;
+  bool isResolverOwned_;
+
+  //
+  // each up session slot races the connections to all the pools and all
+  // their addresses, a new attempt is started every kConnectStaggerMs_ (or
+  // at once if one fails). the first one reaches UP_AUTHENTICATED wins and
+  // the others are closed.
+  //
+  static const int32_t kConnectStaggerMs_ = 250;
+  static const int32_t kConnectRaceTimeoutMs_ = 30000;
+
+  struct UpSessionRace;
+  struct UpPoolResolve {
+    UpSessionRace *race_;
+    size_t poolIdx_;
+    bool   isResolving_;
+  };
+  struct UpPoolAddress {
+    size_t   poolIdx_;
+    SockAddr addr_;
+  };
+  struct UpSessionRace {
+    StratumServer *server_;
+    int8_t  idx_;
+    int32_t poolIdx_;     // only race this pool, -1 means all of them
+    bool    isPending_;
+    int64_t beginMs_;
+    vector<UpPoolResolve> resolves_;     // one for each pool
+    vector<UpPoolAddress> addrs_;        // not tried yet, in the pools' order
+    vector<UpStratumClient *> attempts_; // connecting or handshaking
+    struct event *staggerTimer_;
+  };
+  vector<UpSessionRace *> upSessionRaces_;
+
+  static void upPoolResolveCallback(const string &host,
+                                    const vector<SockAddr> &addrs, void *ptr);
+  bool startUpSessionRace(const int8_t idx, const int32_t poolIdx);
+  static void upSessionStaggerCallback(evutil_socket_t fd, short events, void *ptr);
+  void addUpPoolAddresses(UpSessionRace *race, const size_t poolIdx,
+                          const vector<SockAddr> &addrs);
+  bool startUpSessionAttempt(UpSessionRace *race);
+  void checkUpSessionRace(UpSessionRace *race);
+  // close the attempts in flight, the race goes on
+  void cancelUpSessionAttempts(UpSessionRace *race);
+  void finishUpSessionRace(UpSessionRace *race);
+  UpSessionRace *findUpSessionRace(UpStratumClient *up);
+
+  //
+  // every AgentConf::poolProbeIntervalMs_, each pool is probed by a new
+  // connection: the RTT is from the mining.subscribe to its response. then
+  // at most one up session is moved to the preferred pool per interval, the
+  // new connection is made before the old one is closed: the winner of the
+  // race waits in it until it's available, then it takes over the slot and
+  // the old one is retired.
+  //
+  static const int64_t kPoolScoreMarginUs_ = 5000;
+
+  struct PoolProbe {
+    StratumServer *server_;
+    size_t  poolIdx_;
+    struct bufferevent *bev_;  // NULL if it's idle
+    bool    isResolving_;
+    int64_t beginUs_;          // when the subscribe is sent
+  };
+  vector<PoolProbe *> poolProbes_;
+  vector<RttEstimator> poolRtts_;
+  struct event *probeTimer_;
+
+  static void probeTimerCallback(evutil_socket_t fd, short events, void *ptr);
+  static void probeResolveCallback(const string &host,
+                                   const vector<SockAddr> &addrs, void *ptr);
+  static void probeReadCallback (struct bufferevent *bev, void *ptr);
+  static void probeEventCallback(struct bufferevent *bev, short events, void *ptr);
+  void startProbes();
+  void finishProbe(PoolProbe *probe, const int64_t rttUs);  // failure if < 0
+  void rebalanceUpSessions();
+
+  // the moved ones, see UpStratumClient::retire()
+  vector<UpStratumClient *> retiredUpSessions_;
+  void retireUpSession(UpStratumClient *up);
+
+  //
+  // live migration: when an up session is lost, its miners are moved to the
+  // other ones instead of being disconnected. each one is registered to the
+  // new up session, then gets its difficulty and a clean job (with the new
+  // extraNonce1 in the coinbase), the miner's connection is kept.
+  //
+  void migrateDownSessions(const int8_t idx);
+  void resumeDownSession(StratumSession *downSession);
+  // close it without CMD_UNREGISTER_WORKER, its up session is gone
+  void freeDownConnection(StratumSession *downSession);
+
+  //
+  // auto mode (AgentConf::upSessionsAuto_): every kAutoScaleIntervalSec_,
+  // open more up sessions (up to maxUpSessionCount_) if the miners or the
+  // bytes sent per up session are over the targets. it shrinks one at a time
+  // when the load is below 75% of the targets: the last slot stops taking
+  // new miners (draining), and it's closed when its miners are gone.
+  //
+  static const int32_t kAutoScaleIntervalSec_ = 5;
+
+  int8_t   minUpSessionCount_;
+  int8_t   maxUpSessionCount_;
+  uint64_t upSentBytes_;  // to the pools
+  uint64_t lastScaleSentBytes_;
+  int64_t  lastScaleMs_;
+  struct event *scaleTimer_;
+
+  static void scaleTimerCallback(evutil_socket_t fd, short events, void *ptr);
+  void addUpSessionSlots(const int8_t count);
+  void retireUpSessionSlots();
+
+  //
+  // heartbeat: every AgentConf::upHeartbeatIntervalMs_ each up session sends
+  // a CMD_PING, the pool echoes it by CMD_PONG, which gives the RTT. once the
+  // pool has answered one, an up session which received nothing for
+  // AgentConf::upDeadTimeoutMs_ is dead, like a half-open connection: its
+  // miners are moved and it reconnects. for the pools which don't answer,
+  // it's the job expiry of checkUpSessions() as before.
+  //
+  struct event *heartbeatTimer_;
+
+  static void heartbeatTimerCallback(evutil_socket_t fd, short events, void *ptr);
+  void checkHeartbeats();
+
   // libevent2
   struct event_base *base_;
   struct event *signal_event_;
   struct evconnlistener *listener_;
 
+  bool initEventBase();
+  void setupTimers();
+  bool setupListener();
+
   void checkUpSessions();
-  void waitUtilAllUpSessionsAvailable();
+  // break the startup loop if one up session is available, or stop if
+  // all of them failed
+  void checkStartup();
+  void flushDownSessions();
+  void logStats();
 
 public:
   SessionIDManager sessionIDManager_;
@@ -230,10 +713,60 @@ public:
   StratumServer(const string &listenIP, const uint16_t listenPort);
   ~StratumServer();
 
-  UpStratumClient *createUpSession(const int8_t idx);
+  //
+  // start to race the pools for the slot, never blocks. the winner is added
+  // to the slot when it's authenticated, or the slot stays NULL if all the
+  // pools failed. false if it's in progress already.
+  //
+  bool createUpSession(const int8_t idx);
+  bool isUpSessionPending(const int8_t idx) const;
+  // called by the UpStratumClient
+  void upSessionAuthenticated(UpStratumClient *up);
+  // it has got the first job and the difficulty
+  void upSessionAvailable(UpStratumClient *up);
+  // the retired one is closed
+  void freeRetiredUpSession(UpStratumClient *up);
+  // called by the StratumSession, its worker is registered when the pacing
+  // allows, then it gets the difficulty and the job
+  void downSessionAuthenticated(StratumSession *downSession);
+
+  // the pool which the up sessions should be on, -1 if none is healthy. the
+  // first pool (in the config order) is preferred unless another one is
+  // faster by more than max(20%, kPoolScoreMarginUs_).
+  static int32_t selectPreferredPool(const vector<RttEstimator> &rtts);
+  inline const RttEstimator &getPoolRtt(size_t i) const { return poolRtts_[i]; }
 
   void addUpPool(const string &host, const uint16_t port,
                  const string &upPoolUserName);
+  void setAgentConf(const AgentConf &conf);
+  // call them before setup(). it's the minimum if the auto mode is on
+  void setUpSessionCount(const int8_t count);
+  void setMaxUpSessionCount(const int8_t count);
+  void setSessionIdRange(const uint16_t minId, const uint16_t maxId);
+  void setReusePort(const bool reusePort);
+  // not owned, the default is a DnsResolver with the system's nameservers
+  void setResolver(Resolver *resolver);
+
+  // thread-safe for one producer thread, async-signal-safe
+  bool postCommand(const int32_t cmd);
+  // consumer side of the SERVER_CMD_STATS replies
+  inline bool popStats(ServerStats *stats) { return statsQueue_.pop(stats); }
+  ServerStats getStats() const;
+
+  inline struct event_base *getEventBase() { return base_; }
+  inline uint64_t getDownWriteCount() const { return downWriteCount_; }
+  inline uint64_t getDownFlushCount() const { return downFlushCount_; }
+  inline int32_t getHandshakingCount() const { return handshakingCount_; }
+  inline uint64_t getReconnectCount() const { return reconnectCount_; }
+  inline const AgentConf &getAgentConf() const { return conf_; }
+  inline UpStratumClient *getUpSession(int8_t idx) { return upSessions_[idx]; }
+  inline int8_t getUpSessionCount() const { return upSessionCount_; }
+  inline int8_t getActiveUpSessionCount() const { return activeUpSessionCount_; }
+  inline void addUpSentBytes(const size_t bytes) { upSentBytes_ += bytes; }
+  inline void addShareBytes(const size_t bytes) { shareBytes_ += bytes; }
+
+  // resize the up sessions by the load, see AgentConf::upSessionsAuto_
+  void autoScaleUpSessions();
 
   void addDownConnection   (StratumSession *conn);
   void removeDownConnection(StratumSession *conn);
@@ -250,18 +783,33 @@ public:
 
   static void upReadCallback (struct bufferevent *, void *ptr);
   static void upEventCallback(struct bufferevent *, short, void *ptr);
+  static void upWriteCallback(struct bufferevent *, void *ptr);
+  // closed by the pool or a failed handshake, see upEventCallback()
+  void upSessionLost(UpStratumClient *up);
 
   static void upWatcherCallback(evutil_socket_t fd, short events, void *ptr);
-  static void upSesssionCheckCallback(evutil_socket_t fd, short events, void *ptr);
+  static void downFlushCallback(evutil_socket_t fd, short events, void *ptr);
+
+  // flush the session's staged data later, coalesce into one write
+  void scheduleDownFlush(StratumSession *downSession);
 
-  void sendMiningNotifyToAll(const int8_t idx, const string &notify);
+  void sendMiningNotifyToAll(const int8_t idx, SharedBuffer *notify);
   void sendMiningNotify(StratumSession *downSession);
   void sendDefaultMiningDifficulty(StratumSession *downSession);
   void sendMiningDifficulty(UpStratumClient *upconn,
                             uint16_t sessionId, uint64_t diff);
 
-  int8_t findUpSessionIdx();
+  // the least loaded one, except exceptIdx
+  int8_t findUpSessionIdx(const int8_t exceptIdx = -1);
 
+  //
+  // the share is checked locally if AgentConf::shareValidation_: its job
+  // is still there, its nTime, it's not a duplicate and its difficulty, in
+  // that order, the cheap ones first. the error is replied to
+  // the miner and it's not sent to the pool. NO_ERROR if it can't be
+  // checked, e.g. the jobs before a hot upgrade.
+  //
+  int checkShare(const Share &share, StratumSession *downSession);
   void submitShare(const Share &share, StratumSession *downSession);
   void registerWorker  (StratumSession *downSession, const char *minerAgent,
                         const string &workerName);
@@ -270,6 +818,16 @@ public:
   bool setup();
   void run();
   void stop();
+
+  //
+  // hot upgrade, see StratumServerGroup::hotUpgrade(). exportState() runs
+  // while the event loop is stopped, it takes the listener, the up sessions,
+  // the down sessions and their unsent / partial data. setupFromHandoff()
+  // takes the place of setup() in the new process, nothing is sent to the
+  // miners or the pools. the pending up session races are started again.
+  //
+  void exportState(HandoffWriter &w);
+  bool setupFromHandoff(HandoffReader &r);
 };
 
 
@@ -283,39 +841,100 @@ enum UpStratumClientState {
 
 class UpStratumClient {
   struct bufferevent *bev_;
-  struct evbuffer *inBuf_;
   uint64_t extraNonce2_;
   string userName_;
 
-  bool handleMessage();
-  void handleStratumMessage(const string &line);
-  void handleExMessage_MiningSetDiff(const string *exMessage);
-
-  void convertMiningNotifyStr(const string &line);
+  // share batcher, the submit frames are flushed together when reach
+  // AgentConf::upShareBatchBytes_ or after AgentConf::upShareBatchDelayMs_
+  struct evbuffer *shareBuf_;
+  struct event *shareFlushEvent_;
+  uint32_t shareBatchCount_;
+  int64_t  shareBatchBeginUs_;  // when the first share of the batch arrived
+  bool     isCorked_;
+  // the shares of CMD_SUBMIT_SHARES_BATCH, encoded into one frame by
+  // flushShares(), or before the next share of another frame so the pool
+  // gets them in order. the others are in shareBuf_ already
+  vector<ExBatchedShare> batchedShares_;
+  // about a batched share, to compare with AgentConf::upShareBatchBytes_
+  static const size_t kBatchedShareBytes_ = 11;
+
+  // subscribe and authorize are sent together, AgentConf::upPipelinedHandshake_
+  bool     isPipelined_;
+  // the subscribe result can't be used, it's closed after this read
+  bool     isHandshakeFailed_;
+
+  static void shareFlushCallback(evutil_socket_t fd, short events, void *ptr);
+  // counts the bytes sent to the pool
+  static void outputCallback(struct evbuffer *buf,
+                             const struct evbuffer_cb_info *info, void *ptr);
+
+  bool handleMessage(struct evbuffer *inBuf);
+  void handleStratumMessage(const char *line, size_t len);
+  void handleExMessage_MiningSetDiff(const ExMessageReader &r);
+  void handleExMessage_Pong(const ExMessageReader &r);
+  void beginShareBatch();
+  void encodeBatchedShares();
+
+  static const int32_t kRetireTimeoutSec_ = 5;
+  static void retiredReadCallback (struct bufferevent *bev, void *ptr);
+  static void retiredWriteCallback(struct bufferevent *bev, void *ptr);
+  static void retiredEventCallback(struct bufferevent *bev, short events, void *ptr);
+
+  void convertMiningNotifyStr(const char *line, size_t len);
 
 public:
   UpStratumClientState state_;
   int8_t idx_;
   StratumServer *server_;
 
+  size_t   poolIdx_;   // of StratumServer::upPoolHost_
+  SockAddr poolAddr_;
+
   uint32_t poolDefaultDiff_;
   uint32_t extraNonce1_;  // session ID
 
-  string   latestMiningNotifyStr_;
-  // latest there job Id & time, use to check if send nTime
-  uint8_t  latestJobId_[3];
-  uint32_t latestJobGbtTime_[3];
+  // shared by all the down sessions, NULL if not received yet
+  SharedBuffer *latestMiningNotify_;
+  // the same job with clean_jobs = true, for the moved miners, built lazily
+  SharedBuffer *latestCleanMiningNotify_;
+  // the latest jobs' time, use to check if send nTime. and the jobs which
+  // the shares could be of, if AgentConf::shareValidation_
+  JobTimeRing jobTimes_;
+
+  // the templates are not kept by the hot upgrade, so it's incomplete until
+  // the next clean job, the shares of the unknown jobs are not rejected then
+  bool isJobWindowComplete_;
 
   // last stratum job received from pool
   uint32_t lastJobReceivedTime_;
 
+  Histogram shareBatchSizeHist_;     // shares per batch
+  Histogram shareBatchLatencyHist_;  // microseconds, the first share waited
+
+  // heartbeat, see StratumServer::checkHeartbeats()
+  int64_t  lastRecvMs_;       // anything from the pool
+  uint32_t pingId_;
+  int64_t  pingSentUs_;       // 0 if no ping is in flight
+  bool     isPongSupported_;  // the pool has answered a ping
+  bool     isPingDisabled_;   // the pool doesn't answer
+  RttEstimator heartbeatRtt_;
+
+  // the pool has agreed to CMD_SUBMIT_SHARES_BATCH by mining.configure, see
+  // AgentConf::upSharesBatch_
+  bool     isSharesBatchSupported_;
+  bool     isConfigurePending_;  // mining.configure is sent, no result yet
+
 public:
   UpStratumClient(const int8_t idx,
                   struct event_base *base, const string &userName,
                   StratumServer *server);
   ~UpStratumClient();
 
-  bool connect(struct sockaddr_in &sin);
+  bool connect(const SockAddr &addr);
+  string getSubscribeMessage() const;
+  string getAuthorizeMessage() const;
+  inline bool isPipelined() const { return isPipelined_; }
+  inline bool isHandshakeFailed() const { return isHandshakeFailed_; }
 
   void recvData(struct evbuffer *buf);
   void sendData(const char *data, size_t len);
@@ -323,13 +942,42 @@ public:
     sendData(str.data(), str.size());
   }
 
-  void sendMiningNotify(const string &line);
+  void sendMiningNotify();
+  void addJobTemplate(const StratumJob &sjob);
+  // the newest one of the job id, NULL if not found
+  const JobTemplate *findJobTemplate(const uint8_t jobId) const;
+  // the latest job, but the miners must drop their work. NULL if no job yet,
+  // or its clean_jobs is not a JSON primitive
+  SharedBuffer *getCleanMiningNotify();
 
   // means auth success and got at least stratum job
   bool isAvailable();
 
-  void submitShare();
+  // a CMD_PING if none is in flight
+  void sendPing();
+
+  // add a submit frame to the batch
+  void submitShare(const ExSubmitShare &share);
+  // add a share to the CMD_SUBMIT_SHARES_BATCH of the batch
+  void submitShare(const ExBatchedShare &share);
+  // to encode other ex-messages, the batched shares are flushed first
+  struct evbuffer *getExMessageOutput();
+  void flushShares();
+  // TCP_CORK, hold the partial frames until the whole batch is written
+  void setCork(bool cork);
+  inline bool isCorked() const { return isCorked_; }
+
   void submitWorkerInfo();
+
+  // it's out of the slot: the shares not sent yet are written out, then
+  // it's shut down and closed once the pool closes it too, or after
+  // kRetireTimeoutSec_. nothing from the pool is handled any more.
+  void retire();
+
+  // see StratumServer::exportState()
+  void exportState(HandoffWriter &w);
+  static UpStratumClient *importState(HandoffReader &r, struct event_base *base,
+                                      StratumServer *server);
 };
 
 
@@ -342,29 +990,48 @@ enum StratumSessionState {
 
 class StratumSession {
   //----------------------
-  struct evbuffer *inBuf_;
   static const int32_t kExtraNonce2Size_ = 4;
+  static const size_t  kMaxLinesPerBatch_ = 64;
   StratumSessionState state_;
+
+  // staged output of one event loop iteration, see StratumServer::scheduleDownFlush()
+  struct evbuffer *outBuf_;
   char *minerAgent_;
+  string workerName_;  // registered to the up session
+
+  // sent to the miner, and the one before it: the shares of the jobs before
+  // the change are checked against the lower one. 0 if not sent yet
+  uint64_t diff_;
+  uint64_t prevDiff_;
 
   void setReadTimeout(const int32_t timeout);
 
-  void handleStratumMessage(const string &line);
+  void handleStratumMessages(const StringRef *lines, size_t count);
+  void handleStratumMessage(const char *line, size_t len);
 
-  void handleRequest(const string &idStr, const StratumMessage &smsg);
-  void handleRequest_Subscribe(const string &idStr, const StratumMessage &smsg);
-  void handleRequest_Authorize(const string &idStr, const StratumMessage &smsg);
-  void handleRequest_Submit   (const string &idStr, const StratumMessage &smsg);
+  // idStr: the raw json of the request's "id"
+  void handleRequest(const StringRef &idStr, const StratumMessage &smsg);
+  void handleRequest_Subscribe(const StringRef &idStr, const StratumMessage &smsg);
+  void handleRequest_Authorize(const StringRef &idStr, const StratumMessage &smsg);
+  void handleRequest_Submit   (const StringRef &idStr, const Share &share);
 
-  void responseError(const string &idStr, int code);
-  void responseTrue(const string &idStr);
+  void responseError(const StringRef &idStr, int code);
+  void responseTrue(const StringRef &idStr);
 
 public:
   int8_t  upSessionIdx_;
+  uint32_t upDownSessionPos_;  // position in StratumServer::upDownSessions_
+  bool     isFlushPending_;    // in StratumServer::pendingFlushSessions_
   uint16_t sessionId_;
   struct bufferevent *bev_;
   StratumServer *server_;
   struct in_addr saddr_;
+  bool isRegistered_;  // CMD_REGISTER_WORKER is sent to its up session
+  ShareRejects shareRejects_;
+  // cleared if the clean seq of its up session isn't shareFilterSeq_, or
+  // it's moved to another up session
+  DuplicateShareFilter shareFilter_;
+  uint32_t shareFilterSeq_;
 
 
 public:
@@ -378,6 +1045,22 @@ public:
   inline void sendData(const string &str) {
     sendData(str.data(), str.size());
   }
+  void sendData(SharedBuffer *buf);
+
+  // write the staged data to the bufferevent
+  void flush();
+
+  inline bool isAuthenticated() const { return state_ == DOWN_AUTHENTICATED; }
+  void setDifficulty(const uint64_t diff);
+  inline uint64_t getShareDifficulty() const {
+    return (prevDiff_ != 0 && prevDiff_ < diff_) ? prevDiff_ : diff_;
+  }
+  inline const char *getMinerAgent() const { return minerAgent_; }
+  inline const string &getRegisteredWorkerName() const { return workerName_; }
+
+  // see StratumServer::exportState()
+  void exportState(HandoffWriter &w);
+  static StratumSession *importState(HandoffReader &r, StratumServer *server);
 };
 
 #endif
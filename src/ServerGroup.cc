@@ -0,0 +1,365 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ServerGroup.h"
+
+#include <time.h>
+#include <algorithm>
+
+#ifndef _WIN32
+ #include <fcntl.h>
+ #include <sys/resource.h>
+ #include <sys/socket.h>
+ #include <sys/wait.h>
+#endif
+
+#if defined(__linux__)
+ #include <sched.h>
+#endif
+
+////////////////////////////// StratumServerGroup //////////////////////////////
+StratumServerGroup::StratumServerGroup(const string &listenIP,
+                                       const uint16_t listenPort,
+                                       const AgentConf &conf)
+: listenIP_(listenIP), listenPort_(listenPort), conf_(conf), running_(1),
+isUpgrading_(0), lastShareCount_(0)
+{
+}
+
+StratumServerGroup::~StratumServerGroup() {
+  clearServers();
+}
+
+void StratumServerGroup::clearServers() {
+  for (size_t i = 0; i < servers_.size(); i++) {
+    delete servers_[i];
+  }
+  servers_.clear();
+  stats_.clear();
+}
+
+void StratumServerGroup::addUpPool(const string &host, const uint16_t port,
+                                   const string &upPoolUserName) {
+  PoolConf conf;
+  conf.host_ = host;
+  conf.port_ = port;
+  conf.upPoolUserName_ = upPoolUserName;
+  pools_.push_back(conf);
+}
+
+int8_t StratumServerGroup::splitUpSessions(int32_t count, const int32_t threads,
+                                           const int32_t idx) {
+  if (count < 1)
+    count = 1;
+  if (count > kMaxUpSessionCount_)
+    count = kMaxUpSessionCount_;
+  const int32_t part = count / threads + (idx < count % threads ? 1 : 0);
+  return (int8_t)(part < 1 ? 1 : part);  // each thread needs one at least
+}
+
+int32_t StratumServerGroup::splitLimit(const int32_t limit, const int32_t threads,
+                                       const int32_t idx) {
+  if (limit <= 0)
+    return limit;  // no limit
+  const int32_t part = limit / threads + (idx < limit % threads ? 1 : 0);
+  return part < 1 ? 1 : part;  // 0 would mean no limit
+}
+
+bool StratumServerGroup::setup() {
+  int32_t threads = conf_.threads_;
+  if (threads < 1)
+    threads = 1;
+  if (threads > kMaxThreads_)
+    threads = kMaxThreads_;
+
+#if defined(_WIN32) || !defined(SO_REUSEPORT)
+  if (threads > 1) {
+    LOG(WARNING) << "multi-thread mode is not supported, use 1 thread" << std::endl;
+    threads = 1;
+  }
+#endif
+
+  return setupServers(threads, NULL);
+}
+
+bool StratumServerGroup::setupServers(const int32_t threads, HandoffReader *r) {
+  // each thread has a part of the up sessions and the session ids
+  const uint32_t span = (AGENT_MAX_SESSION_ID + 1) / threads;
+
+  for (int32_t i = 0; i < threads; i++) {
+    StratumServer *server = new StratumServer(listenIP_, listenPort_);
+    servers_.push_back(server);
+
+    // the admission limits are in total as well
+    AgentConf threadConf = conf_;
+    threadConf.acceptRatePerSec_       = splitLimit(conf_.acceptRatePerSec_, threads, i);
+    threadConf.maxHandshakingSessions_ = splitLimit(conf_.maxHandshakingSessions_, threads, i);
+    threadConf.registerRatePerSec_     = splitLimit(conf_.registerRatePerSec_, threads, i);
+
+    const int8_t upSessionCount = splitUpSessions(conf_.upSessions_, threads, i);
+    server->setAgentConf(threadConf);
+    server->setUpSessionCount(upSessionCount);
+    if (conf_.upSessionsAuto_)
+      server->setMaxUpSessionCount(splitUpSessions(conf_.upSessionsMax_, threads, i));
+
+    if (threads > 1) {
+      const uint32_t minId = i * span;
+      const uint32_t maxId = (i == threads - 1) ? AGENT_MAX_SESSION_ID : (i + 1) * span - 1;
+      server->setSessionIdRange((uint16_t)minId, (uint16_t)maxId);
+      server->setReusePort(true);
+
+      LOG(INFO) << "thread[" << i << "] session ids: [" << minId << ", "
+      << maxId << "], up sessions: " << (int32_t)upSessionCount << std::endl;
+    }
+
+    for (size_t j = 0; j < pools_.size(); j++) {
+      server->addUpPool(pools_[j].host_, pools_[j].port_, pools_[j].upPoolUserName_);
+    }
+    if (!(r != NULL ? server->setupFromHandoff(*r) : server->setup()))
+      return false;
+  }
+
+  stats_.resize(servers_.size());
+  return true;
+}
+
+void StratumServerGroup::run() {
+  if (servers_.size() == 1) {
+    servers_[0]->run();
+    return;
+  }
+
+#ifndef _WIN32
+  // only the main thread handles the signals, see stop()
+  sigset_t blocked, old;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  sigaddset(&blocked, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &blocked, &old);
+
+  threads_.resize(servers_.size());
+  threadArgs_.resize(servers_.size());
+  for (size_t i = 0; i < servers_.size(); i++) {
+    threadArgs_[i].group_ = this;
+    threadArgs_[i].idx_   = i;
+    pthread_create(&threads_[i], NULL, StratumServerGroup::threadMain, &threadArgs_[i]);
+    if (conf_.cpuAffinity_)
+      pinThread(i);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  time_t lastStatsTime = time(NULL);
+  while (running_) {
+    usleep(100 * 1000);
+    collectStats();
+
+    const time_t now = time(NULL);
+    if (now - lastStatsTime >= kStatsInterval_) {
+      logStats();
+      lastStatsTime = now;
+      for (size_t i = 0; i < servers_.size(); i++) {
+        servers_[i]->postCommand(SERVER_CMD_STATS);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < servers_.size(); i++) {
+    servers_[i]->postCommand(SERVER_CMD_STOP);
+  }
+  for (size_t i = 0; i < threads_.size(); i++) {
+    pthread_join(threads_[i], NULL);
+  }
+#endif
+}
+
+#ifndef _WIN32
+void *StratumServerGroup::threadMain(void *ptr) {
+  ThreadArg *arg = static_cast<ThreadArg *>(ptr);
+  StratumServerGroup *group = arg->group_;
+
+  group->servers_[arg->idx_]->run();
+
+  // one of them exits, stop all, as the single thread mode
+  group->running_ = 0;
+  return NULL;
+}
+
+void StratumServerGroup::pinThread(size_t idx) {
+#if defined(__linux__)
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus <= 0)
+    return;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(idx % cpus, &set);
+  if (pthread_setaffinity_np(threads_[idx], sizeof(set), &set) != 0) {
+    LOG(WARNING) << "pin thread[" << idx << "] to cpu failure" << std::endl;
+  }
+#endif
+}
+#endif
+
+void StratumServerGroup::stop() {
+  running_ = 0;
+
+  // the main thread runs it, wake it up. in multi-thread mode, the main
+  // thread posts the stop commands when it sees running_ is cleared.
+  if (servers_.size() == 1)
+    servers_[0]->postCommand(SERVER_CMD_STOP);
+}
+
+void StratumServerGroup::upgrade() {
+  isUpgrading_ = 1;
+  stop();
+}
+
+void StratumServerGroup::exportState(HandoffWriter &w) {
+  w.putUint32(HANDOFF_MAGIC);
+  w.putUint32(HANDOFF_VERSION);
+  w.putUint32((uint32_t)servers_.size());
+  for (size_t i = 0; i < servers_.size(); i++) {
+    servers_[i]->exportState(w);
+  }
+}
+
+#ifndef _WIN32
+bool StratumServerGroup::hotUpgrade(char *const argv[]) {
+  isUpgrading_ = 0;
+
+  evutil_socket_t sv[2];
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    LOG(ERROR) << "hot upgrade: cannot create socketpair" << std::endl;
+    running_ = 1;
+    return false;
+  }
+
+  const pid_t pid = fork();
+  if (pid < 0) {
+    LOG(ERROR) << "hot upgrade: fork failure, errno: " << errno << std::endl;
+    evutil_closesocket(sv[0]);
+    evutil_closesocket(sv[1]);
+    running_ = 1;
+    return false;
+  }
+
+  if (pid == 0) {
+    // the copy of the old process, the sockets stay open until the new
+    // process has received them and closed its end
+    evutil_closesocket(sv[1]);
+    HandoffWriter w;
+    exportState(w);
+    const bool ok = sendHandoff(sv[0], w.getData(), w.getFds());
+    char c;
+    while (recv(sv[0], &c, 1, 0) > 0) {
+    }
+    _exit(ok ? 0 : 1);
+  }
+  evutil_closesocket(sv[0]);
+
+  // the new binary gets nothing else
+  struct rlimit rl;
+  int maxFd = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    maxFd = (int)rl.rlim_cur;
+  for (int fd = 3; fd < maxFd; fd++) {
+    if (fd != sv[1])
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+
+  setenv(HANDOFF_FD_ENV, Strings::Format("%d", sv[1]).c_str(), 1);
+  LOG(INFO) << "hot upgrade: exec " << argv[0] << std::endl;
+  execv(argv[0], argv);
+
+  // still the old one, go on serving
+  LOG(ERROR) << "hot upgrade: exec failure, errno: " << errno << std::endl;
+  unsetenv(HANDOFF_FD_ENV);
+  evutil_closesocket(sv[1]);
+  waitpid(pid, NULL, 0);
+  running_ = 1;
+  return false;
+}
+
+bool StratumServerGroup::setupFromHandoff(evutil_socket_t sock) {
+  string data;
+  vector<evutil_socket_t> fds;
+  HandoffReader r(data, fds);  // closes the fds which are not taken
+
+  if (!recvHandoff(sock, &data, &fds)) {
+    LOG(ERROR) << "hot upgrade: receive the snapshot failure" << std::endl;
+    return false;
+  }
+  if (r.getUint32() != HANDOFF_MAGIC || r.getUint32() != HANDOFF_VERSION) {
+    LOG(ERROR) << "hot upgrade: unknown snapshot" << std::endl;
+    return false;
+  }
+
+  // the session id ranges and the listeners belong to the threads
+  const int32_t threads = (int32_t)r.getUint32();
+  if (!r.isValid() || threads < 1 || threads > kMaxThreads_)
+    return false;
+  if (threads != conf_.threads_) {
+    LOG(WARNING) << "hot upgrade: keep the " << threads << " threads of the old process"
+    << std::endl;
+  }
+
+  if (!setupServers(threads, &r) || !r.isEnd()) {
+    LOG(ERROR) << "hot upgrade: take over the servers failure" << std::endl;
+    clearServers();
+    return false;
+  }
+  LOG(INFO) << "hot upgrade: took over " << fds.size() << " sockets" << std::endl;
+  return true;
+}
+#endif
+
+void StratumServerGroup::collectStats() {
+  for (size_t i = 0; i < servers_.size(); i++) {
+    ServerStats stats;
+    while (servers_[i]->popStats(&stats)) {
+      stats_[i] = stats;
+    }
+  }
+}
+
+void StratumServerGroup::logStats() {
+  ServerStats sum;
+  for (size_t i = 0; i < stats_.size(); i++) {
+    sum.downSessionCount_ += stats_[i].downSessionCount_;
+    sum.downWriteCount_   += stats_[i].downWriteCount_;
+    sum.downFlushCount_   += stats_[i].downFlushCount_;
+    sum.shareCount_       += stats_[i].shareCount_;
+    sum.shareBytes_       += stats_[i].shareBytes_;
+    sum.shareNoTimeCount_ += stats_[i].shareNoTimeCount_;
+    sum.shareBytesSaved_  += stats_[i].shareBytesSaved_;
+    sum.shareRejects_.add(stats_[i].shareRejects_);
+    sum.upRttMaxUs_        = std::max(sum.upRttMaxUs_, stats_[i].upRttMaxUs_);
+  }
+
+  LOG(INFO) << "threads: " << servers_.size() << ", miners: " << sum.downSessionCount_
+  << ", shares: " << (sum.shareCount_ - lastShareCount_) / kStatsInterval_ << "/s"
+  << ", rejected shares: " << sum.shareRejects_.total()
+  << ", shares without nTime: " << sum.shareNoTimeCount_
+  << ", bytes saved by the job history: " << sum.shareBytesSaved_
+  << ", bytes/share: " << (sum.shareCount_ > 0 ? (double)sum.shareBytes_ / sum.shareCount_ : 0.0)
+  << ", down writes: " << sum.downWriteCount_
+  << ", down flushes: " << sum.downFlushCount_
+  << ", up rtt max: " << sum.upRttMaxUs_ << " us" << std::endl;
+  lastShareCount_ = sum.shareCount_;
+}
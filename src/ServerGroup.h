@@ -0,0 +1,119 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SERVER_GROUP_H_
+#define SERVER_GROUP_H_
+
+#include "Utils.h"
+#include "Server.h"
+
+#include <signal.h>
+
+#ifndef _WIN32
+ #include <pthread.h>
+#endif
+
+////////////////////////////// StratumServerGroup //////////////////////////////
+//
+// N event loop threads, each one runs a StratumServer: its own event base,
+// SO_REUSEPORT listener, up sessions and a disjoint range of session ids, so
+// nothing is shared between them. the other threads talk to them only by the
+// lock-free command queues of StratumServer.
+//
+// with one thread (or without SO_REUSEPORT / pthread, e.g. Windows) the
+// server runs in the caller's thread, as before.
+//
+// hot upgrade (POSIX only): upgrade() stops the event loops, then
+// hotUpgrade() forks a copy of this process which sends the snapshot of
+// all the servers and their sockets over a unix socket, while this process
+// execs the new binary in place, so the supervisor sees the same pid. the
+// new one calls setupFromHandoff() instead of setup().
+//
+class StratumServerGroup {
+  static const int32_t kMaxThreads_ = 64;
+  static const int32_t kMaxUpSessionCount_ = 127;  // in total
+  static const int32_t kStatsInterval_ = 15;  // seconds
+
+  string   listenIP_;
+  uint16_t listenPort_;
+  AgentConf conf_;
+  vector<PoolConf> pools_;
+
+  vector<StratumServer *> servers_;
+#ifndef _WIN32
+  struct ThreadArg {
+    StratumServerGroup *group_;
+    size_t idx_;
+  };
+  vector<pthread_t> threads_;
+  vector<ThreadArg> threadArgs_;
+  static void *threadMain(void *ptr);
+  void pinThread(size_t idx);
+#endif
+
+  // cleared by stop() (may be in a signal handler) or an event loop exits
+  volatile sig_atomic_t running_;
+  volatile sig_atomic_t isUpgrading_;
+
+  // the latest replies of SERVER_CMD_STATS
+  vector<ServerStats> stats_;
+  uint64_t lastShareCount_;
+
+  // AgentConf::upSessions_ is in total, each thread has a part of it.
+  // the first (count % threads) ones take one more.
+  static int8_t splitUpSessions(int32_t count, const int32_t threads,
+                                const int32_t idx);
+  static int32_t splitLimit(const int32_t limit, const int32_t threads,
+                            const int32_t idx);
+  // setup() or setupFromHandoff() of each server
+  bool setupServers(const int32_t threads, HandoffReader *r);
+  // the partially built ones of a failed setup
+  void clearServers();
+  void exportState(HandoffWriter &w);
+  void collectStats();
+  void logStats();
+
+public:
+  StratumServerGroup(const string &listenIP, const uint16_t listenPort,
+                     const AgentConf &conf);
+  ~StratumServerGroup();
+
+  void addUpPool(const string &host, const uint16_t port,
+                 const string &upPoolUserName);
+
+  bool setup();
+  void run();
+  void stop();
+
+  // stop the event loops for a hot upgrade, async-signal-safe
+  void upgrade();
+  inline bool isUpgrading() const { return isUpgrading_ != 0; }
+#ifndef _WIN32
+  // after run() returns. it doesn't return if the new binary is exec'd,
+  // otherwise the servers are still there and could run() again
+  bool hotUpgrade(char *const argv[]);
+  // take over the servers from the old process, HANDOFF_FD_ENV. if it
+  // fails nothing is left, the caller could setup() from scratch.
+  bool setupFromHandoff(evutil_socket_t sock);
+#endif
+
+  inline size_t getServerCount() const { return servers_.size(); }
+  inline StratumServer *getServer(size_t i) { return servers_[i]; }
+};
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Sha256.h"
+
+#include <algorithm>
+
+//
+// SHA-NI needs no -msha, the function is compiled for it by the target
+// attribute and only called if cpuid says so. the embedded (MIPS) and the
+// MSVC builds have the generic one only.
+//
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+  #include <cpuid.h>
+  #include <immintrin.h>
+  #define AGENT_USE_SHA_NI
+#endif
+
+static const uint32_t kSha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t kSha256Init[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t readUint32BE(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8)  | (uint32_t)p[3];
+}
+
+static inline void writeUint32BE(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+void sha256TransformGeneric(uint32_t state[8], const uint8_t *blocks, size_t count) {
+  uint32_t w[64];
+
+  for (; count > 0; count--, blocks += 64) {
+    for (int i = 0; i < 16; i++) {
+      w[i] = readUint32BE(blocks + i * 4);
+    }
+    for (int i = 16; i < 64; i++) {
+      const uint32_t s0 = rotr32(w[i-15], 7) ^ rotr32(w[i-15], 18) ^ (w[i-15] >> 3);
+      const uint32_t s1 = rotr32(w[i-2], 17) ^ rotr32(w[i-2],  19) ^ (w[i-2] >> 10);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      const uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+      const uint32_t ch = (e & f) ^ (~e & g);
+      const uint32_t t1 = h + s1 + ch + kSha256K[i] + w[i];
+      const uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+      const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      const uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#ifdef AGENT_USE_SHA_NI
+static bool isSha256NiSupported() {
+  unsigned int eax, ebx, ecx, edx;
+  // SSSE3 and SSE4.1 for the shuffles and the blend
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+      (ecx & (1u << 9)) == 0 || (ecx & (1u << 19)) == 0)
+    return false;
+  if (__get_cpuid_max(0, NULL) < 7)
+    return false;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1u << 29)) != 0;
+}
+
+//
+// 4 rounds by two sha256rnds2, the message schedule of the later groups is
+// interleaved: sha256msg1 three groups ahead, sha256msg2 one group ahead.
+//
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha256TransformNi(uint32_t state[8], const uint8_t *blocks, size_t count) {
+  const __m128i kMask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  // ABEF and CDGH, the order of sha256rnds2
+  __m128i tmp    = _mm_loadu_si128((const __m128i *)&state[0]);
+  __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  tmp    = _mm_shuffle_epi32(tmp, 0xB1);           // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);        // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);     // CDGH
+
+  for (; count > 0; count--, blocks += 64) {
+    const __m128i abefSave = state0;
+    const __m128i cdghSave = state1;
+    __m128i m[4];
+
+    for (int g = 0; g < 16; g++) {
+      if (g < 4) {
+        m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + g * 16)), kMask);
+      }
+      __m128i msg = _mm_add_epi32(m[g & 3], _mm_loadu_si128((const __m128i *)&kSha256K[g * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if (g >= 3 && g <= 14) {
+        const __m128i t = _mm_alignr_epi8(m[g & 3], m[(g - 1) & 3], 4);
+        m[(g + 1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(m[(g + 1) & 3], t), m[g & 3]);
+      }
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+      if (g >= 1 && g <= 12) {
+        m[(g - 1) & 3] = _mm_sha256msg1_epu32(m[(g - 1) & 3], m[g & 3]);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abefSave);
+    state1 = _mm_add_epi32(state1, cdghSave);
+  }
+
+  tmp    = _mm_shuffle_epi32(state0, 0x1B);        // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);        // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);     // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);        // HGFE
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+static Sha256Impl detectSha256Impl() {
+#ifdef AGENT_USE_SHA_NI
+  if (isSha256NiSupported())
+    return SHA256_NI;
+#endif
+  return SHA256_GENERIC;
+}
+
+static Sha256Impl gSha256Impl = detectSha256Impl();
+
+static inline void sha256Transform(uint32_t state[8], const uint8_t *blocks, size_t count) {
+#ifdef AGENT_USE_SHA_NI
+  if (gSha256Impl == SHA256_NI) {
+    sha256TransformNi(state, blocks, count);
+    return;
+  }
+#endif
+  sha256TransformGeneric(state, blocks, count);
+}
+
+Sha256Impl getSha256Impl() {
+  return gSha256Impl;
+}
+
+const char *getSha256ImplName(Sha256Impl impl) {
+  return (impl == SHA256_NI) ? "sha-ni" : "generic";
+}
+
+bool setSha256Impl(Sha256Impl impl) {
+  if (impl == SHA256_NI && detectSha256Impl() != SHA256_NI)
+    return false;
+  gSha256Impl = impl;
+  return true;
+}
+
+
+/////////////////////////////////// Sha256 /////////////////////////////////////
+Sha256::Sha256() {
+  reset();
+}
+
+void Sha256::reset() {
+  memcpy(state_, kSha256Init, sizeof(state_));
+  len_ = 0;
+}
+
+void Sha256::update(const uint8_t *data, size_t len) {
+  size_t used = (size_t)(len_ % 64);
+  len_ += len;
+
+  if (used > 0) {
+    const size_t n = std::min(len, 64 - used);
+    memcpy(buf_ + used, data, n);
+    data += n;
+    len  -= n;
+    if (used + n < 64)
+      return;
+    sha256Transform(state_, buf_, 1);
+  }
+
+  // the whole blocks from the input directly
+  if (len >= 64) {
+    sha256Transform(state_, data, len / 64);
+    data += len & ~(size_t)63;
+    len  &= 63;
+  }
+  if (len > 0)
+    memcpy(buf_, data, len);
+}
+
+void Sha256::final(uint8_t hash[32]) {
+  const size_t used = (size_t)(len_ % 64);
+  const uint64_t bits = len_ * 8;
+
+  // 0x80, zeros, then the length in bits (big endian), one or two blocks
+  uint8_t pad[128];
+  const size_t padLen = (used < 56) ? (64 - used) : (128 - used);
+  memset(pad, 0, padLen);
+  pad[0] = 0x80;
+  writeUint32BE(pad + padLen - 8, (uint32_t)(bits >> 32));
+  writeUint32BE(pad + padLen - 4, (uint32_t)bits);
+  update(pad, padLen);
+
+  for (int i = 0; i < 8; i++) {
+    writeUint32BE(hash + i * 4, state_[i]);
+  }
+}
+
+void sha256d(const uint8_t *data, size_t len, uint8_t hash[32]) {
+  uint8_t first[32];
+  Sha256 h1;
+  h1.update(data, len);
+  h1.final(first);
+
+  Sha256 h2;
+  h2.update(first, 32);
+  h2.final(hash);
+}
@@ -0,0 +1,67 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include "Utils.h"
+
+//
+// the compression function is picked at runtime: the x86 SHA extensions
+// (SHA-NI) if the cpu has them, otherwise the portable one.
+//
+enum Sha256Impl {
+  SHA256_GENERIC = 0,
+  SHA256_NI      = 1
+};
+
+// `count` blocks of 64 bytes
+void sha256TransformGeneric(uint32_t state[8], const uint8_t *blocks, size_t count);
+
+Sha256Impl getSha256Impl();
+const char *getSha256ImplName(Sha256Impl impl);
+// false if the cpu (or the compiler) doesn't support it, for the tests and
+// the benchmark. not thread-safe, call it before the event loops run.
+bool setSha256Impl(Sha256Impl impl);
+
+
+/////////////////////////////////// Sha256 /////////////////////////////////////
+//
+// the object could be copied, e.g. keep the state after the common prefix
+// of many messages (the midstate) and finish each one from a copy.
+//
+class Sha256 {
+  uint32_t state_[8];
+  uint8_t  buf_[64];
+  uint64_t len_;  // bytes
+
+public:
+  Sha256();
+
+  void reset();
+  void update(const uint8_t *data, size_t len);
+  inline void update(const string &data) {
+    update((const uint8_t *)data.data(), data.size());
+  }
+  void final(uint8_t hash[32]);
+};
+
+// SHA256(SHA256(data))
+void sha256d(const uint8_t *data, size_t len, uint8_t hash[32]);
+
+#endif
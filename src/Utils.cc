@@ -20,6 +20,14 @@
 
 #include <stdarg.h>
 
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define AGENT_USE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define AGENT_USE_SSE2
+#endif
+
 #include <algorithm>
 #include <iostream>
 #include <iomanip>
@@ -89,6 +97,97 @@ void Strings::Append(string & dest, const char * fmt, ...) {
   }
 }
 
+const char *findLineFeed(const char *p, size_t len) {
+  const char *end = p + len;
+
+#if defined(AGENT_USE_AVX2)
+  const __m256i lf32 = _mm256_set1_epi8('\n');
+  for (; p + 32 <= end; p += 32) {
+    const __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, lf32));
+    if (mask != 0)
+      return p + countTrailingZeros32(mask);
+  }
+#endif
+
+#if defined(AGENT_USE_AVX2) || defined(AGENT_USE_SSE2)
+  const __m128i lf16 = _mm_set1_epi8('\n');
+  for (; p + 16 <= end; p += 16) {
+    const __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    const uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf16));
+    if (mask != 0)
+      return p + countTrailingZeros32(mask);
+  }
+#endif
+
+  // scalar, the tail or no SIMD
+  for (; p < end; p++) {
+    if (*p == '\n')
+      return p;
+  }
+  return NULL;
+}
+
+// hex value of the char, -1 if it's not a hex char
+static const int8_t kHexTable[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+size_t decodeHex32(const char *p, size_t len, uint32_t *value) {
+  uint32_t v = 0;
+  size_t i = 0;
+  for (; i < len; i++) {
+    const int8_t h = kHexTable[(uint8_t)p[i]];
+    if (h < 0)
+      break;
+    v = (v << 4) | (uint32_t)h;
+  }
+  *value = v;
+  return i;
+}
+
+size_t decodeDec32(const char *p, size_t len, uint32_t *value) {
+  uint32_t v = 0;
+  size_t i = 0;
+  for (; i < len; i++) {
+    const uint32_t d = (uint32_t)(uint8_t)p[i] - '0';
+    if (d > 9)
+      break;
+    v = v * 10 + d;
+  }
+  *value = v;
+  return i;
+}
+
+bool decodeHex(const char *p, size_t len, string *bin) {
+  if (len % 2 != 0)
+    return false;
+  bin->resize(len / 2);
+  for (size_t i = 0; i < len; i += 2) {
+    const int8_t h = kHexTable[(uint8_t)p[i]];
+    const int8_t l = kHexTable[(uint8_t)p[i + 1]];
+    if (h < 0 || l < 0)
+      return false;
+    (*bin)[i / 2] = (char)((h << 4) | l);
+  }
+  return true;
+}
+
 string getJsonStr(const char *c,const jsmntok_t *t) {
   if (t == NULL || t->end <= t->start)
     return "";
@@ -108,9 +207,16 @@ int jsoneq(const char *json, jsmntok_t *tok, const char *s) {
 bool parseConfJson(const string &jsonStr,
                    string &listenIP, string &listenPort,
                    std::vector<PoolConf> &poolConfs) {
+  AgentConf agentConf;
+  return parseConfJson(jsonStr, listenIP, listenPort, poolConfs, agentConf);
+}
+
+bool parseConfJson(const string &jsonStr,
+                   string &listenIP, string &listenPort,
+                   std::vector<PoolConf> &poolConfs, AgentConf &agentConf) {
   jsmn_parser p;
   jsmn_init(&p);
-  jsmntok_t t[64]; // we expect no more than 64 tokens
+  jsmntok_t t[256]; // we expect no more than 256 tokens
   int r;
   const char *c = jsonStr.c_str();
 
@@ -132,6 +238,98 @@ bool parseConfJson(const string &jsonStr,
       listenPort = getJsonStr(c, &t[i+1]);
       i++;
     }
+    else if (jsoneq(c, &t[i], "down_flush_delay_ms") == 0) {
+      agentConf.downFlushDelayMs_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_share_batch_delay_ms") == 0) {
+      agentConf.upShareBatchDelayMs_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_share_batch_bytes") == 0) {
+      agentConf.upShareBatchBytes_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "threads") == 0) {
+      agentConf.threads_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "cpu_affinity") == 0) {
+      agentConf.cpuAffinity_ = (getJsonStr(c, &t[i+1]) == "true");
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "pool_probe_interval_ms") == 0) {
+      agentConf.poolProbeIntervalMs_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_sessions") == 0) {
+      agentConf.upSessions_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_sessions_auto") == 0) {
+      agentConf.upSessionsAuto_ = (getJsonStr(c, &t[i+1]) == "true");
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_sessions_max") == 0) {
+      agentConf.upSessionsMax_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_session_max_miners") == 0) {
+      agentConf.upSessionMaxMiners_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_session_max_bytes_per_sec") == 0) {
+      agentConf.upSessionMaxBytesPerSec_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "accept_rate_per_sec") == 0) {
+      agentConf.acceptRatePerSec_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "max_handshaking_sessions") == 0) {
+      agentConf.maxHandshakingSessions_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "accept_overflow_reconnect") == 0) {
+      agentConf.acceptOverflowReconnect_ = (getJsonStr(c, &t[i+1]) == "true");
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "reconnect_max_wait_sec") == 0) {
+      agentConf.reconnectMaxWaitSec_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "register_rate_per_sec") == 0) {
+      agentConf.registerRatePerSec_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_pipelined_handshake") == 0) {
+      agentConf.upPipelinedHandshake_ = (getJsonStr(c, &t[i+1]) == "true");
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_tcp_fastopen") == 0) {
+      agentConf.upTcpFastOpen_ = (getJsonStr(c, &t[i+1]) == "true");
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_heartbeat_interval_ms") == 0) {
+      agentConf.upHeartbeatIntervalMs_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_dead_timeout_ms") == 0) {
+      agentConf.upDeadTimeoutMs_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "share_validation") == 0) {
+      agentConf.shareValidation_ = (getJsonStr(c, &t[i+1]) == "true");
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "job_history_depth") == 0) {
+      agentConf.jobHistoryDepth_ = atoi(getJsonStr(c, &t[i+1]).c_str());
+      i++;
+    }
+    else if (jsoneq(c, &t[i], "up_shares_batch") == 0) {
+      agentConf.upSharesBatch_ = (getJsonStr(c, &t[i+1]) == "true");
+      i++;
+    }
     else if (jsoneq(c, &t[i], "pools") == 0) {
       //
       // "pools": [
@@ -171,18 +369,133 @@ bool parseConfJson(const string &jsonStr,
   return false;
 }
 
+Histogram::Histogram() {
+  reset();
+}
+
+void Histogram::reset() {
+  memset(buckets_, 0, sizeof(buckets_));
+  count_ = sum_ = max_ = 0;
+}
+
+void Histogram::add(uint64_t value) {
+  // bucket i holds [2^(i-1), 2^i - 1], bucket 0 holds 0
+  int32_t idx = 0;
+  uint64_t v = value;
+  while (v != 0) {
+    v >>= 1;
+    idx++;
+  }
+  if (idx >= kBuckets_)
+    idx = kBuckets_ - 1;
+
+  buckets_[idx]++;
+  count_++;
+  sum_ += value;
+  if (value > max_)
+    max_ = value;
+}
+
+double Histogram::mean() const {
+  return count_ == 0 ? 0.0 : (double)sum_ / count_;
+}
+
+uint64_t Histogram::percentile(double p) const {
+  if (count_ == 0)
+    return 0;
+
+  const uint64_t rank = (uint64_t)ceil(p * count_);
+  uint64_t n = 0;
+  for (int32_t i = 0; i < kBuckets_; i++) {
+    n += buckets_[i];
+    if (n >= rank && n > 0) {
+      const uint64_t upper = (i == 0) ? 0 : ((uint64_t)1 << i) - 1;
+      return upper < max_ ? upper : max_;
+    }
+  }
+  return max_;
+}
+
+string Histogram::toString() const {
+  return Strings::Format("count: %" PRIu64 ", mean: %.1f, p50: %" PRIu64
+                         ", p99: %" PRIu64 ", max: %" PRIu64,
+                         count_, mean(), percentile(0.5), percentile(0.99), max_);
+}
+
+void RttEstimator::addSample(int64_t rttUs) {
+  if (samples_ == 0) {
+    srttUs_   = rttUs;
+    rttVarUs_ = rttUs / 2;
+  } else {
+    // rttvar = 3/4 * rttvar + 1/4 * |srtt - r|, srtt = 7/8 * srtt + 1/8 * r
+    const int64_t delta = srttUs_ > rttUs ? srttUs_ - rttUs : rttUs - srttUs_;
+    rttVarUs_ = (3 * rttVarUs_ + delta) / 4;
+    srttUs_   = (7 * srttUs_ + rttUs) / 8;
+  }
+  samples_++;
+  successes_++;
+  failures_ = 0;
+}
+
+void RttEstimator::addFailure() {
+  successes_ = 0;
+  failures_++;
+}
+
+void TokenBucket::setRate(const double rate, const double burst) {
+  rate_   = rate;
+  burst_  = burst < 1 ? 1 : burst;
+  tokens_ = burst_;
+  lastUs_ = 0;
+}
+
+void TokenBucket::refill(const int64_t nowUs) {
+  if (lastUs_ != 0 && nowUs > lastUs_) {
+    tokens_ += (nowUs - lastUs_) * rate_ / 1000000;
+    if (tokens_ > burst_)
+      tokens_ = burst_;
+  }
+  lastUs_ = nowUs;
+}
+
+bool TokenBucket::consume(const int64_t nowUs) {
+  if (rate_ <= 0)
+    return true;
+
+  refill(nowUs);
+  if (tokens_ < 1)
+    return false;
+  tokens_ -= 1;
+  return true;
+}
+
+int64_t TokenBucket::getWaitUs(const int64_t nowUs) {
+  if (rate_ <= 0)
+    return 0;
+
+  refill(nowUs);
+  if (tokens_ >= 1)
+    return 0;
+  return (int64_t)ceil((1 - tokens_) * 1000000 / rate_);
+}
+
 const char *splitNotify(const string &line) {
-  const char *pch = strchr(line.c_str(), '"');
+  return splitNotify(line.data(), line.size());
+}
+
+const char *splitNotify(const char *line, size_t len) {
+  const char *end = line + len;
+  const char *pch = (const char *)memchr(line, '"', len);
   int i = 1;
   while (pch != NULL) {
-    pch = strchr(pch + 1, '"');
+    pch = (const char *)memchr(pch + 1, '"', end - (pch + 1));
     i++;
     if (pch != NULL && i == 14) {
       break;
     }
   }
   if (pch == NULL) {
-    LOG(ERROR) << "invalid mining.notify: " << line << std::endl;
+    LOG(ERROR) << "invalid mining.notify: " << string(line, len) << std::endl;
     return NULL;
   }
   return pch;
@@ -44,6 +44,10 @@
 
 #include "jsmn.h"
 
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
 #if defined(SUPPORT_GLOG)
   #include <glog/logging.h>
 #else
@@ -83,6 +87,22 @@ public:
 };
 #endif
 
+// a non-owning reference to a part of a string or a buffer
+class StringRef {
+public:
+  const char *data_;
+  size_t size_;
+
+  StringRef(): data_(NULL), size_(0) {}
+  StringRef(const char *data, size_t size): data_(data), size_(size) {}
+
+  inline bool empty() const { return size_ == 0; }
+  inline bool equals(const char *s) const {
+    return strlen(s) == size_ && memcmp(data_, s, size_) == 0;
+  }
+  inline string toString() const { return string(data_, size_); }
+};
+
 class Strings {
 public:
   static string Format(const char * fmt, ...);
@@ -104,13 +124,269 @@ public:
   }
 };
 
+// count trailing zero bits, x MUST NOT be zero
+inline int32_t countTrailingZeros32(uint32_t x) {
+  assert(x != 0);
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#elif defined(_MSC_VER)
+  unsigned long idx;
+  _BitScanForward(&idx, x);
+  return (int32_t)idx;
+#else
+  int32_t n = 0;
+  while ((x & 1u) == 0) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+inline int32_t countTrailingZeros64(uint64_t x) {
+  assert(x != 0);
+#if defined(__GNUC__)
+  return __builtin_ctzll(x);
+#else
+  const uint32_t low = (uint32_t)x;
+  if (low != 0)
+    return countTrailingZeros32(low);
+  return 32 + countTrailingZeros32((uint32_t)(x >> 32));
+#endif
+}
+
+// find the first '\n', SSE2/AVX2 if available. NULL if not found.
+const char *findLineFeed(const char *p, size_t len);
+
+// table-driven decoding, stop at the first invalid char like strtoul().
+// return the count of the decoded chars.
+size_t decodeHex32(const char *p, size_t len, uint32_t *value);
+size_t decodeDec32(const char *p, size_t len, uint32_t *value);
+// the whole string, false if it has an odd length or a non-hex char
+bool decodeHex(const char *p, size_t len, string *bin);
+
+// optional settings of the agent, use the default values if absent
+class AgentConf {
+public:
+  // max delay of coalescing the writes to miners, 0 means flush at the end
+  // of the event loop iteration
+  int32_t downFlushDelayMs_;
+
+  // shares to the pool are batched, flushed when the bytes reach the
+  // threshold or the first share has waited for the delay
+  int32_t upShareBatchDelayMs_;
+  int32_t upShareBatchBytes_;
+
+  // event loop threads, each one has its own listener (SO_REUSEPORT), up
+  // sessions and range of session ids. pin thread i to cpu i if cpuAffinity_.
+  int32_t threads_;
+  bool    cpuAffinity_;
+
+  // probe the RTT of every pool, move the up sessions to the best one. 0
+  // (default) means never probe and stay on the pool connected first.
+  int32_t poolProbeIntervalMs_;
+
+  // up sessions (the TCP connections to the pool), at most 127. in auto
+  // mode it's the minimum, more are opened (up to upSessionsMax_) to keep
+  // the miners and the bytes per up session below the targets, and the
+  // extra ones are retired when the load goes down.
+  int32_t upSessions_;
+  bool    upSessionsAuto_;
+  int32_t upSessionsMax_;
+  int32_t upSessionMaxMiners_;
+  int32_t upSessionMaxBytesPerSec_;
+
+  // admission control for the reconnect storms, 0 (default) means no limit. new
+  // connections are accepted at acceptRatePerSec_, and at most
+  // maxHandshakingSessions_ are between accepted and registered to the pool.
+  // the others wait in the kernel backlog, or are sent client.reconnect with
+  // a random wait in [1, reconnectMaxWaitSec_] if acceptOverflowReconnect_.
+  // the register frames to the pool are paced by registerRatePerSec_.
+  int32_t acceptRatePerSec_;
+  int32_t maxHandshakingSessions_;
+  bool    acceptOverflowReconnect_;
+  int32_t reconnectMaxWaitSec_;
+  int32_t registerRatePerSec_;
+
+  // send mining.subscribe and mining.authorize together instead of waiting
+  // for the subscribe result, one round trip less. with upTcpFastOpen_ they
+  // go in the SYN (Linux 4.11+), it implies the pipelined handshake.
+  bool    upPipelinedHandshake_;
+  bool    upTcpFastOpen_;
+
+  // CMD_PING every upHeartbeatIntervalMs_, an up session is dead if nothing
+  // arrives in upDeadTimeoutMs_ (if the pool answers the pings), it's the
+  // TCP keepalive and TCP_USER_TIMEOUT as well. 0 disables them, the ping
+  // is off by default as not every pool knows it.
+  int32_t upHeartbeatIntervalMs_;
+  int32_t upDeadTimeoutMs_;
+
+  // check each share locally: its job is not stale, its nTime is in the
+  // window, and the block header rebuilt is of the miner's difficulty. the
+  // bad ones are rejected instead of being sent to the pool.
+  bool    shareValidation_;
+
+  // the latest jobs of each up session whose shares could be sent without
+  // the nTime, by the 8 bits job id, at most 256. the shares of the older
+  // ones are stale with shareValidation_
+  int32_t jobHistoryDepth_;
+
+  // ask the pool for CMD_SUBMIT_SHARES_BATCH (by mining.configure), then the
+  // shares of a batch are in one frame, delta encoded. the pools which
+  // don't support it get a frame of each share.
+  bool    upSharesBatch_;
+
+  AgentConf(): downFlushDelayMs_(0), upShareBatchDelayMs_(5),
+  upShareBatchBytes_(1400), threads_(1), cpuAffinity_(false),
+  poolProbeIntervalMs_(0), upSessions_(5), upSessionsAuto_(false),
+  upSessionsMax_(127), upSessionMaxMiners_(1000),
+  upSessionMaxBytesPerSec_(256 * 1024), acceptRatePerSec_(0),
+  maxHandshakingSessions_(0), acceptOverflowReconnect_(false),
+  reconnectMaxWaitSec_(10), registerRatePerSec_(0),
+  upPipelinedHandshake_(false), upTcpFastOpen_(false),
+  upHeartbeatIntervalMs_(0), upDeadTimeoutMs_(5000),
+  shareValidation_(false), jobHistoryDepth_(16),
+  upSharesBatch_(false) {}
+};
+
+// full memory barrier
+inline void memoryBarrier() {
+#if defined(__GNUC__)
+  __sync_synchronize();
+#elif defined(_MSC_VER)
+  _ReadWriteBarrier();
+  _mm_mfence();
+#endif
+}
+
+//
+// lock-free ring buffer for exactly one producer thread and one consumer
+// thread. N MUST be a power of 2.
+//
+template <typename T, uint32_t N>
+class SpscQueue {
+  T items_[N];
+  volatile uint32_t head_;  // only the consumer writes it
+  volatile uint32_t tail_;  // only the producer writes it
+
+public:
+  SpscQueue(): items_(), head_(0), tail_(0) {}
+
+  // false if it's full
+  bool push(const T &item) {
+    const uint32_t tail = tail_;
+    if (tail - head_ == N)
+      return false;
+
+    items_[tail & (N - 1)] = item;
+    memoryBarrier();  // the item is visible before the new tail
+    tail_ = tail + 1;
+    return true;
+  }
+
+  // false if it's empty
+  bool pop(T *item) {
+    const uint32_t head = head_;
+    if (head == tail_)
+      return false;
+
+    memoryBarrier();  // read the item after seeing the tail
+    *item = items_[head & (N - 1)];
+    memoryBarrier();  // finish reading before the producer reuses the slot
+    head_ = head + 1;
+    return true;
+  }
+};
+
+//
+// log2 buckets: [0], [1], [2,3], [4,7], ... cheap enough for the hot path.
+// percentiles are the upper bounds of the buckets.
+//
+class Histogram {
+  static const int32_t kBuckets_ = 64;
+  uint64_t buckets_[kBuckets_];
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t max_;
+
+public:
+  Histogram();
+
+  void add(uint64_t value);
+  void reset();
+
+  inline uint64_t count() const { return count_; }
+  inline uint64_t max() const { return max_; }
+  double mean() const;
+  uint64_t percentile(double p) const;
+
+  // "count: 10, mean: 2.5, p50: 3, p99: 7, max: 5"
+  string toString() const;
+};
+
+//
+// smoothed RTT and jitter of the probes to a pool, like TCP's SRTT and
+// RTTVAR (RFC 6298). a pool is healthy after kHealthyProbes_ successful
+// probes in a row.
+//
+class RttEstimator {
+  static const uint32_t kHealthyProbes_ = 2;
+
+  int64_t  srttUs_;
+  int64_t  rttVarUs_;
+  uint32_t samples_;
+  uint32_t successes_;  // in a row
+  uint32_t failures_;   // in a row
+
+public:
+  RttEstimator(): srttUs_(0), rttVarUs_(0), samples_(0), successes_(0),
+  failures_(0) {}
+
+  void addSample(int64_t rttUs);
+  void addFailure();
+
+  inline bool isHealthy() const { return successes_ >= kHealthyProbes_; }
+  inline int64_t getSrtt() const { return srttUs_; }
+  inline int64_t getJitter() const { return rttVarUs_; }
+  inline uint32_t getFailures() const { return failures_; }
+  // the lower the better
+  inline int64_t getScore() const { return srttUs_ + 4 * rttVarUs_; }
+};
+
+//
+// rate tokens per second, at most burst of them are saved up. a rate of 0
+// means no limit.
+//
+class TokenBucket {
+  double  rate_;
+  double  burst_;
+  double  tokens_;
+  int64_t lastUs_;
+
+  void refill(const int64_t nowUs);
+
+public:
+  TokenBucket(): rate_(0), burst_(0), tokens_(0), lastUs_(0) {}
+
+  // full at first
+  void setRate(const double rate, const double burst);
+
+  bool consume(const int64_t nowUs);
+  // until the next token, 0 if there is one
+  int64_t getWaitUs(const int64_t nowUs);
+};
+
 string getJsonStr(const char *c,const jsmntok_t *t);
 bool parseConfJson(const string &jsonStr,
                    string &listenIP, string &listenPort,
                    std::vector<PoolConf> &poolConfs);
+bool parseConfJson(const string &jsonStr,
+                   string &listenIP, string &listenPort,
+                   std::vector<PoolConf> &poolConfs, AgentConf &agentConf);
 
 // slite stratum 'mining.notify'
 const char *splitNotify(const string &line);
+const char *splitNotify(const char *line, size_t len);
 
 string str2lower(const string &str);
 
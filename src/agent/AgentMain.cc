@@ -23,16 +23,25 @@
 #include "Utils.h"
 
 #include "Server.h"
+#include "ServerGroup.h"
 
 #ifdef _WIN32
  #include "win32/getopt/getopt.h"
+#else
+ #include <sys/wait.h>
 #endif
 
-StratumServer *gStratumServer = NULL;
+StratumServerGroup *gServerGroup = NULL;
 
 void handler(int sig) {
-  if (gStratumServer) {
-    gStratumServer->stop();
+  if (gServerGroup) {
+    gServerGroup->stop();
+  }
+}
+
+void upgradeHandler(int sig) {
+  if (gServerGroup) {
+    gServerGroup->upgrade();
   }
 }
 
@@ -93,35 +102,72 @@ int main(int argc, char **argv) {
 
   signal(SIGTERM, handler);
   signal(SIGINT,  handler);
+#ifndef _WIN32
+  // hot upgrade: replace the binary, then kill -USR2
+  signal(SIGUSR2, upgradeHandler);
+#endif
 
+  int exitCode = 0;
   try {
     string listenIP, listenPort;
     std::vector<PoolConf> poolConfs;
+    AgentConf conf;
 
     // get conf json string
     std::ifstream agentConf(optConf);
     string agentJsonStr((std::istreambuf_iterator<char>(agentConf)),
                         std::istreambuf_iterator<char>());
-    if (!parseConfJson(agentJsonStr, listenIP, listenPort, poolConfs)) {
+    if (!parseConfJson(agentJsonStr, listenIP, listenPort, poolConfs, conf)) {
       LOG(ERROR) << "parse json config file failure" << std::endl;
       return false;
     }
 
-    gStratumServer = new StratumServer(listenIP, atoi(listenPort.c_str()));
+    gServerGroup = new StratumServerGroup(listenIP, atoi(listenPort.c_str()), conf);
 
     // add pools
     for (size_t i = 0; i < poolConfs.size(); i++) {
-      gStratumServer->addUpPool(poolConfs[i].host_,
-                                poolConfs[i].port_,
-                                poolConfs[i].upPoolUserName_);
+      gServerGroup->addUpPool(poolConfs[i].host_,
+                              poolConfs[i].port_,
+                              poolConfs[i].upPoolUserName_);
     }
 
-    if (!gStratumServer->setup()) {
+    bool isSetup = false;
+#ifndef _WIN32
+    // exec'd by the old process, see StratumServerGroup::hotUpgrade()
+    const char *handoffFd = getenv(HANDOFF_FD_ENV);
+    if (handoffFd != NULL) {
+      const evutil_socket_t sock = atoi(handoffFd);
+      unsetenv(HANDOFF_FD_ENV);
+      isSetup = gServerGroup->setupFromHandoff(sock);
+      evutil_closesocket(sock);
+      waitpid(-1, NULL, 0);  // the sender exits then
+
+      // the old process is gone, start from scratch. its sockets are
+      // closed with the sender, so the port is free again.
+      if (!isSetup) {
+        LOG(ERROR) << "hot upgrade: take over failure, setup again" << std::endl;
+        isSetup = gServerGroup->setup();
+      }
+    } else {
+      isSetup = gServerGroup->setup();
+    }
+#else
+    isSetup = gServerGroup->setup();
+#endif
+
+    if (!isSetup) {
       LOG(ERROR) << "setup failure" << std::endl;
+      exitCode = 1;
     } else {
-      gStratumServer->run();
+      gServerGroup->run();
+#ifndef _WIN32
+      // goes on if the new binary can't be exec'd
+      while (gServerGroup->isUpgrading() && !gServerGroup->hotUpgrade(argv)) {
+        gServerGroup->run();
+      }
+#endif
     }
-    delete gStratumServer;
+    delete gServerGroup;
   }
   catch (std::exception & e) {
     LOG(FATAL) << "exception: " << e.what() << std::endl;
@@ -131,5 +177,5 @@ int main(int argc, char **argv) {
 #if defined(SUPPORT_GLOG)
   google::ShutdownGoogleLogging();
 #endif
-  return 0;
+  return exitCode;
 }
@@ -0,0 +1,544 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "LocalPool.h"
+#include "ExMessage.h"
+#include "Server.h"
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <event2/util.h>
+
+#include <algorithm>
+
+
+//////////////////////////////// LocalPool /////////////////////////////////
+LocalPool::LocalPool(): running_(false), port_(0), base_(NULL), listener_(NULL),
+cmdTimer_(NULL), connectionCount_(0), badBatchCount_(0), jobId_(0), isSilent_(false), silentAfter_(0), latencyMs_(0),
+isPongEnabled_(true), isSharesBatchEnabled_(false), isSubscribeError_(false),
+pendingNotify_(0),
+pendingNotifyClean_(false), pendingCloseAll_(false)
+{
+  pthread_mutex_init(&lock_, NULL);
+}
+
+LocalPool::~LocalPool() {
+  stop();
+  pthread_mutex_destroy(&lock_);
+}
+
+bool LocalPool::start() {
+  base_ = event_base_new();
+  if (base_ == NULL)
+    return false;
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port   = 0;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listener_ = evconnlistener_new_bind(base_, LocalPool::listenerCallback, this,
+                                      LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE,
+                                      -1, (struct sockaddr *)&sin, sizeof(sin));
+  if (listener_ == NULL)
+    return false;
+
+  socklen_t len = sizeof(sin);
+  getsockname(evconnlistener_get_fd(listener_), (struct sockaddr *)&sin, &len);
+  port_ = ntohs(sin.sin_port);
+
+  cmdTimer_ = event_new(base_, -1, EV_PERSIST, LocalPool::cmdCallback, this);
+  struct timeval tv = {0, 5000};
+  event_add(cmdTimer_, &tv);
+
+  running_ = true;
+  if (pthread_create(&thread_, NULL, LocalPool::threadMain, this) != 0) {
+    running_ = false;
+    return false;
+  }
+  return true;
+}
+
+void LocalPool::stop() {
+  if (running_) {
+    event_base_loopexit(base_, NULL);
+    pthread_join(thread_, NULL);
+    running_ = false;
+  }
+
+  for (size_t i = 0; i < connections_.size(); i++) {
+    bufferevent_free(connections_[i]->bev_);
+    delete connections_[i];
+  }
+  connections_.clear();
+
+  if (cmdTimer_) {
+    event_free(cmdTimer_);
+    cmdTimer_ = NULL;
+  }
+  if (listener_) {
+    evconnlistener_free(listener_);
+    listener_ = NULL;
+  }
+  if (base_) {
+    event_base_free(base_);
+    base_ = NULL;
+  }
+}
+
+void *LocalPool::threadMain(void *ptr) {
+  LocalPool *pool = static_cast<LocalPool *>(ptr);
+  event_base_dispatch(pool->base_);
+  return NULL;
+}
+
+void LocalPool::listenerCallback(struct evconnlistener *listener,
+                                 evutil_socket_t fd, struct sockaddr *saddr,
+                                 int socklen, void *ptr) {
+  LocalPool *pool = static_cast<LocalPool *>(ptr);
+
+  Connection *conn = new Connection();
+  conn->pool_ = pool;
+  conn->bev_  = bufferevent_socket_new(pool->base_, fd, BEV_OPT_CLOSE_ON_FREE);
+  conn->authorized_ = false;
+
+  bufferevent_setcb(conn->bev_, LocalPool::readCallback, NULL,
+                    LocalPool::eventCallback, conn);
+  bufferevent_enable(conn->bev_, EV_READ|EV_WRITE);
+
+  pthread_mutex_lock(&pool->lock_);
+  conn->extraNonce1_ = ++pool->connectionCount_;
+  pool->connections_.push_back(conn);
+  pthread_mutex_unlock(&pool->lock_);
+}
+
+void LocalPool::readCallback(struct bufferevent *bev, void *ptr) {
+  Connection *conn = static_cast<Connection *>(ptr);
+  LocalPool *pool = conn->pool_;
+  struct evbuffer *inBuf = bufferevent_get_input(bev);
+
+  while (evbuffer_get_length(inBuf) >= 4) {
+    uint8_t head[4];
+    evbuffer_copyout(inBuf, head, 4);
+
+    if (head[0] == CMD_MAGIC_NUMBER) {
+      const uint16_t len = readUint16LE(head + 2);
+      if (len < EX_MESSAGE_HEADER_LEN || evbuffer_get_length(inBuf) < len)
+        return;
+
+      string exMessage;
+      exMessage.resize(len);
+      evbuffer_remove(inBuf, (char *)exMessage.data(), len);
+
+      vector<ExBatchedShare> shares;
+      const bool isBadBatch = (head[1] == CMD_SUBMIT_SHARES_BATCH &&
+        !ExSubmitSharesBatch::decode(ExMessageReader((const uint8_t *)exMessage.data(),
+                                                     exMessage.size()), &shares));
+
+      pthread_mutex_lock(&pool->lock_);
+      pool->exMessages_.push_back(exMessage);
+      pool->batchedShares_.insert(pool->batchedShares_.end(), shares.begin(), shares.end());
+      if (isBadBatch)
+        pool->badBatchCount_++;
+      const bool isSilent = pool->isSilent_ || !pool->isPongEnabled_;
+      pthread_mutex_unlock(&pool->lock_);
+
+      // echo the ping
+      if (head[1] == CMD_PING && !isSilent) {
+        exMessage[1] = (char)CMD_PONG;
+        pool->sendLine(conn, exMessage);
+      }
+      continue;
+    }
+
+    size_t lineLen = 0;
+    char *line = evbuffer_readln(inBuf, &lineLen, EVBUFFER_EOL_LF);
+    if (line == NULL)
+      return;
+    pool->handleLine(conn, string(line, lineLen));
+    free(line);
+  }
+}
+
+void LocalPool::eventCallback(struct bufferevent *bev, short events, void *ptr) {
+  if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+    Connection *conn = static_cast<Connection *>(ptr);
+    conn->pool_->removeConnection(conn);
+  }
+}
+
+void LocalPool::removeConnection(Connection *conn) {
+  pthread_mutex_lock(&lock_);
+  for (size_t i = 0; i < connections_.size(); i++) {
+    if (connections_[i] == conn) {
+      connections_.erase(connections_.begin() + i);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock_);
+
+  bufferevent_free(conn->bev_);
+  delete conn;
+}
+
+void LocalPool::cmdCallback(evutil_socket_t fd, short events, void *ptr) {
+  LocalPool *pool = static_cast<LocalPool *>(ptr);
+
+  pthread_mutex_lock(&pool->lock_);
+  const uint32_t notifyCount = pool->pendingNotify_;
+  const bool isClean  = pool->pendingNotifyClean_;
+  const bool closeAll = pool->pendingCloseAll_;
+  vector<uint32_t> closeList;
+  closeList.swap(pool->pendingClose_);
+  pool->pendingNotify_ = 0;
+  pool->pendingNotifyClean_ = false;
+  pool->pendingCloseAll_ = false;
+  vector<Connection *> connections = pool->connections_;
+  pthread_mutex_unlock(&pool->lock_);
+
+  for (size_t i = 0; i < connections.size(); i++) {
+    pool->sendDelayedLines(connections[i]);
+  }
+
+  for (uint32_t n = 0; n < notifyCount; n++) {
+    for (size_t i = 0; i < connections.size(); i++) {
+      if (connections[i]->authorized_)
+        pool->sendNotify(connections[i], isClean);
+    }
+  }
+
+  if (closeAll) {
+    for (size_t i = 0; i < connections.size(); i++) {
+      pool->removeConnection(connections[i]);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < connections.size(); i++) {
+    if (std::find(closeList.begin(), closeList.end(),
+                  connections[i]->extraNonce1_) != closeList.end())
+      pool->removeConnection(connections[i]);
+  }
+}
+
+void LocalPool::sendLine(Connection *conn, const string &line) {
+  pthread_mutex_lock(&lock_);
+  const int32_t latencyMs = latencyMs_;
+  pthread_mutex_unlock(&lock_);
+
+  if (latencyMs > 0) {
+    conn->delayed_.push_back(std::make_pair(nowMillis() + latencyMs, line));
+    return;
+  }
+  bufferevent_write(conn->bev_, line.data(), line.size());
+}
+
+void LocalPool::sendDelayedLines(Connection *conn) {
+  const int64_t now = nowMillis();
+  size_t n = 0;
+  for (; n < conn->delayed_.size() && conn->delayed_[n].first <= now; n++) {
+    bufferevent_write(conn->bev_, conn->delayed_[n].second.data(),
+                      conn->delayed_[n].second.size());
+  }
+  conn->delayed_.erase(conn->delayed_.begin(), conn->delayed_.begin() + n);
+}
+
+void LocalPool::sendNotify(Connection *conn, bool isClean) {
+  // the agent expects the job id in [0, 9]
+  const uint32_t jobId = (jobId_++) % 10;
+  sendLine(conn, Strings::Format("{\"id\":null,\"method\":\"mining.notify\",\"params\":"
+                                 "[\"%u\",\"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\","
+                                 "\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\","
+                                 "\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\","
+                                 "[],\"00000002\",\"1c2ac4af\",\"%08x\",%s]}\n",
+                                 jobId, (uint32_t)time(NULL),
+                                 isClean ? "true" : "false"));
+}
+
+void LocalPool::handleLine(Connection *conn, const string &line) {
+  pthread_mutex_lock(&lock_);
+  const bool isSilent = isSilent_ ||
+                        (silentAfter_ != 0 && conn->extraNonce1_ > silentAfter_);
+  pthread_mutex_unlock(&lock_);
+  if (isSilent)
+    return;
+
+  if (line.find("mining.configure") != string::npos) {
+    pthread_mutex_lock(&lock_);
+    const bool isEnabled = isSharesBatchEnabled_;
+    pthread_mutex_unlock(&lock_);
+    if (isEnabled)
+      sendLine(conn, "{\"id\":3,\"result\":{\"" EX_SHARES_BATCH_EXTENSION "\":true},\"error\":null}\n");
+    else
+      sendLine(conn, "{\"id\":3,\"result\":null,\"error\":[20,\"Unknown method\",null]}\n");
+  }
+  else if (line.find("mining.subscribe") != string::npos) {
+    pthread_mutex_lock(&lock_);
+    const bool isError = isSubscribeError_;
+    pthread_mutex_unlock(&lock_);
+    if (isError) {
+      sendLine(conn, "{\"id\":1,\"result\":null,\"error\":[20,\"Other/Unknown\",null]}\n");
+      return;
+    }
+    sendLine(conn, Strings::Format("{\"id\":1,\"result\":[[[\"mining.set_difficulty\",\"01000002\"],"
+                                   "[\"mining.notify\",\"01000002\"]],\"%08x\",8],\"error\":null}\n",
+                                   conn->extraNonce1_));
+  }
+  else if (line.find("mining.authorize") != string::npos) {
+    sendLine(conn, "{\"id\":1,\"result\":true,\"error\":null}\n");
+    sendLine(conn, "{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[1024]}\n");
+    conn->authorized_ = true;
+    sendNotify(conn, true);
+  }
+}
+
+void LocalPool::sendNotifyToAll(bool isClean) {
+  pthread_mutex_lock(&lock_);
+  pendingNotify_++;
+  pendingNotifyClean_ = pendingNotifyClean_ || isClean;
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::closeAll() {
+  pthread_mutex_lock(&lock_);
+  pendingCloseAll_ = true;
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::closeConnection(uint32_t extraNonce1) {
+  pthread_mutex_lock(&lock_);
+  pendingClose_.push_back(extraNonce1);
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::setSilent(bool isSilent) {
+  pthread_mutex_lock(&lock_);
+  isSilent_ = isSilent;
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::setSilentAfter(uint32_t count) {
+  pthread_mutex_lock(&lock_);
+  silentAfter_ = count;
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::setLatencyMs(int32_t ms) {
+  pthread_mutex_lock(&lock_);
+  latencyMs_ = ms;
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::setPongEnabled(bool isEnabled) {
+  pthread_mutex_lock(&lock_);
+  isPongEnabled_ = isEnabled;
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::setSharesBatchEnabled(bool isEnabled) {
+  pthread_mutex_lock(&lock_);
+  isSharesBatchEnabled_ = isEnabled;
+  pthread_mutex_unlock(&lock_);
+}
+
+void LocalPool::setSubscribeError(bool isError) {
+  pthread_mutex_lock(&lock_);
+  isSubscribeError_ = isError;
+  pthread_mutex_unlock(&lock_);
+}
+
+uint32_t LocalPool::getAcceptCount() {
+  pthread_mutex_lock(&lock_);
+  const uint32_t count = connectionCount_;
+  pthread_mutex_unlock(&lock_);
+  return count;
+}
+
+uint32_t LocalPool::getConnectionCount() {
+  pthread_mutex_lock(&lock_);
+  const uint32_t count = (uint32_t)connections_.size();
+  pthread_mutex_unlock(&lock_);
+  return count;
+}
+
+vector<string> LocalPool::getExMessages() {
+  pthread_mutex_lock(&lock_);
+  vector<string> exMessages = exMessages_;
+  pthread_mutex_unlock(&lock_);
+  return exMessages;
+}
+
+size_t LocalPool::countExMessages(uint8_t cmd) {
+  size_t count = 0;
+  pthread_mutex_lock(&lock_);
+  for (size_t i = 0; i < exMessages_.size(); i++) {
+    if ((uint8_t)exMessages_[i][1] == cmd)
+      count++;
+  }
+  pthread_mutex_unlock(&lock_);
+  return count;
+}
+
+vector<ExBatchedShare> LocalPool::getBatchedShares() {
+  pthread_mutex_lock(&lock_);
+  vector<ExBatchedShare> shares = batchedShares_;
+  pthread_mutex_unlock(&lock_);
+  return shares;
+}
+
+uint32_t LocalPool::getBadBatchCount() {
+  pthread_mutex_lock(&lock_);
+  const uint32_t count = badBatchCount_;
+  pthread_mutex_unlock(&lock_);
+  return count;
+}
+
+size_t LocalPool::getShareBytes() {
+  size_t bytes = 0;
+  pthread_mutex_lock(&lock_);
+  for (size_t i = 0; i < exMessages_.size(); i++) {
+    const uint8_t cmd = (uint8_t)exMessages_[i][1];
+    if (cmd == CMD_SUBMIT_SHARE || cmd == CMD_SUBMIT_SHARE_WITH_TIME ||
+        cmd == CMD_SUBMIT_SHARES_BATCH)
+      bytes += exMessages_[i].size();
+  }
+  pthread_mutex_unlock(&lock_);
+  return bytes;
+}
+
+
+///////////////////////////////// LocalMiner /////////////////////////////////
+LocalMiner::LocalMiner(): fd_(-1), isClosedByPeer_(false) {
+}
+
+LocalMiner::~LocalMiner() {
+  close();
+}
+
+bool LocalMiner::connect(uint16_t port) {
+  fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd_ < 0)
+    return false;
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port   = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // the agent accepts it in the event loop, the kernel finishes the handshake
+  if (::connect(fd_, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    close();
+    return false;
+  }
+  evutil_make_socket_nonblocking(fd_);
+  return true;
+}
+
+void LocalMiner::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool LocalMiner::send(const string &data) {
+  return ::send(fd_, data.data(), data.size(), 0) == (ssize_t)data.size();
+}
+
+const string &LocalMiner::recv() {
+  char buf[4096];
+  ssize_t n;
+  while ((n = ::recv(fd_, buf, sizeof(buf), 0)) > 0) {
+    recvBuf_.append(buf, n);
+  }
+  if (n == 0)
+    isClosedByPeer_ = true;
+  return recvBuf_;
+}
+
+size_t LocalMiner::countLines(const char *needle) {
+  recv();
+
+  size_t count = 0;
+  size_t begin = 0, end;
+  while ((end = recvBuf_.find('\n', begin)) != string::npos) {
+    if (recvBuf_.substr(begin, end - begin).find(needle) != string::npos)
+      count++;
+    begin = end + 1;
+  }
+  return count;
+}
+
+
+//////////////////////////////// helpers /////////////////////////////////
+void pumpEvents(struct event_base *base, int32_t ms) {
+  struct timeval tv;
+  tv.tv_sec  = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  event_base_loopexit(base, &tv);
+  event_base_dispatch(base);
+}
+
+uint16_t getFreePort() {
+  evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port   = 0;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+
+  socklen_t len = sizeof(sin);
+  getsockname(fd, (struct sockaddr *)&sin, &len);
+  ::close(fd);
+
+  return ntohs(sin.sin_port);
+}
+
+int64_t nowMillis() {
+  struct timeval tv;
+  evutil_gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static bool isAllUpSessionsAvailable(StratumServer &server) {
+  for (int8_t i = 0; i < server.getUpSessionCount(); i++) {
+    if (server.getUpSession(i) == NULL || !server.getUpSession(i)->isAvailable())
+      return false;
+  }
+  return true;
+}
+
+int64_t waitUpSessionsAvailable(StratumServer &server) {
+  const int64_t begin = nowMillis();
+  for (int i = 0; i < 600 && !isAllUpSessionsAvailable(server); i++) {
+    pumpEvents(server.getEventBase(), 5);
+  }
+  return nowMillis() - begin;
+}
+
+#endif  // _WIN32
@@ -0,0 +1,182 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LOCAL_POOL_H_
+#define LOCAL_POOL_H_
+
+//
+// a stand-in pool and miners for the end to end tests, POSIX only.
+//
+#ifndef _WIN32
+
+#include "Utils.h"
+#include "ExMessage.h"
+
+#include <pthread.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+//////////////////////////////// LocalPool /////////////////////////////////
+//
+// speaks the agent side stratum protocol (configure, subscribe, authorize,
+// notify, set_difficulty), records the ex-messages, decodes the
+// CMD_SUBMIT_SHARES_BATCH and answers CMD_PING. it runs in
+// its own thread with its own event base, because StratumServer::setup()
+// blocks until an up session is ready.
+//
+class LocalPool {
+  struct Connection {
+    LocalPool *pool_;
+    struct bufferevent *bev_;
+    uint32_t extraNonce1_;
+    bool authorized_;
+    // the replies held by the latency, (due time, line)
+    vector<std::pair<int64_t, string> > delayed_;
+  };
+
+  pthread_t thread_;
+  bool running_;
+  uint16_t port_;
+
+  struct event_base *base_;
+  struct evconnlistener *listener_;
+  struct event *cmdTimer_;
+
+  // guards everything below
+  pthread_mutex_t lock_;
+
+  vector<Connection *> connections_;
+  uint32_t connectionCount_;
+  vector<string> exMessages_;   // all the ex-messages from the agent
+  vector<ExBatchedShare> batchedShares_;  // of CMD_SUBMIT_SHARES_BATCH
+  uint32_t badBatchCount_;      // the frames which can't be decoded
+  uint32_t jobId_;
+  bool isSilent_;
+  uint32_t silentAfter_;  // 0 means none
+  int32_t latencyMs_;
+  bool isPongEnabled_;
+  bool isSharesBatchEnabled_;
+  bool isSubscribeError_;
+
+  // commands from the test thread, run in the pool's thread
+  uint32_t pendingNotify_;
+  bool pendingNotifyClean_;
+  bool pendingCloseAll_;
+  vector<uint32_t> pendingClose_;  // by extraNonce1
+
+  static void *threadMain(void *ptr);
+  static void listenerCallback(struct evconnlistener *listener,
+                               evutil_socket_t fd, struct sockaddr *saddr,
+                               int socklen, void *ptr);
+  static void readCallback(struct bufferevent *bev, void *ptr);
+  static void eventCallback(struct bufferevent *bev, short events, void *ptr);
+  static void cmdCallback(evutil_socket_t fd, short events, void *ptr);
+
+  void handleLine(Connection *conn, const string &line);
+  void sendLine(Connection *conn, const string &line);
+  void sendDelayedLines(Connection *conn);
+  void sendNotify(Connection *conn, bool isClean);
+  void removeConnection(Connection *conn);
+
+public:
+  LocalPool();
+  ~LocalPool();
+
+  // listen on 127.0.0.1 with a random port, start the thread
+  bool start();
+  void stop();
+  uint16_t getPort() const { return port_; }
+
+  // send a new job to all the authorized connections
+  void sendNotifyToAll(bool isClean);
+  // close all the connections from the agent
+  void closeAll();
+  // close the one which is given this extraNonce1
+  void closeConnection(uint32_t extraNonce1);
+  // accept the connections but never reply, like a blackholed pool
+  void setSilent(bool isSilent);
+  // only the first count connections are replied to, 0 turns it off
+  void setSilentAfter(uint32_t count);
+  // hold every line to the agent for ms, like a link of this RTT (the TCP
+  // handshake is not delayed). it's checked every 5 ms
+  void setLatencyMs(int32_t ms);
+  // CMD_PING is echoed by CMD_PONG, unless it's off or silent
+  void setPongEnabled(bool isEnabled);
+  // agree to CMD_SUBMIT_SHARES_BATCH by mining.configure, or answer an
+  // error like the old pools
+  void setSharesBatchEnabled(bool isEnabled);
+  // answer mining.subscribe with an error, like a broken pool
+  void setSubscribeError(bool isError);
+
+  uint32_t getConnectionCount();  // the alive ones
+  uint32_t getAcceptCount();      // all the accepted ones
+  vector<string> getExMessages();
+  size_t countExMessages(uint8_t cmd);
+  vector<ExBatchedShare> getBatchedShares();
+  uint32_t getBadBatchCount();
+  // the bytes of all the submit frames
+  size_t getShareBytes();
+};
+
+
+///////////////////////////////// LocalMiner /////////////////////////////////
+//
+// a blocking socket miner, used in the test thread. the agent's event base
+// runs in the same thread, so pump it between sending and reading.
+//
+class LocalMiner {
+  evutil_socket_t fd_;
+  string recvBuf_;
+  bool isClosedByPeer_;
+
+public:
+  LocalMiner();
+  ~LocalMiner();
+
+  bool connect(uint16_t port);
+  void close();
+  bool send(const string &data);
+
+  // read all the available data, non-blocking
+  const string &recv();
+  size_t countLines(const char *needle);
+  void clear() { recvBuf_.clear(); }
+  // the agent closed the connection, see recv()
+  bool isClosedByPeer() const { return isClosedByPeer_; }
+};
+
+// run the event base for some milliseconds
+void pumpEvents(struct event_base *base, int32_t ms);
+
+// a free tcp port on 127.0.0.1
+uint16_t getFreePort();
+
+// milliseconds, for the timing in the tests
+int64_t nowMillis();
+
+// setup() returns once one up session is ready, wait for all of them.
+// returns the milliseconds it took
+class StratumServer;
+int64_t waitUpSessionsAvailable(StratumServer &server);
+
+#endif  // _WIN32
+
+#endif
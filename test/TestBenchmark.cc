@@ -0,0 +1,875 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gtest/gtest.h"
+#include "Utils.h"
+#include "Server.h"
+#include "ServerGroup.h"
+#include "LocalPool.h"
+#include "Sha256.h"
+
+#include <algorithm>
+#include <bitset>
+
+#ifndef _WIN32
+ #include <sys/time.h>
+ #include <sys/resource.h>
+ #include <sys/wait.h>
+#endif
+
+//
+// micro benchmarks, the results are printed to stdout.
+//   ./unittest Benchmark\*
+//
+
+static int64_t nowMicros() {
+  struct timeval tv;
+  evutil_gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void fanOutShared(vector<struct evbuffer *> &outBufs, const string &notify) {
+  SharedBuffer *buf = SharedBuffer::create(notify);
+  for (size_t i = 0; i < outBufs.size(); i++) {
+    buf->addToEvbuffer(outBufs[i]);
+  }
+  buf->release();
+}
+
+static void fanOutCopy(vector<struct evbuffer *> &outBufs, const string &notify) {
+  for (size_t i = 0; i < outBufs.size(); i++) {
+    evbuffer_add(outBufs[i], notify.data(), notify.size());
+  }
+}
+
+typedef void (*FanOutFunc)(vector<struct evbuffer *> &, const string &);
+
+static void benchFanOut(const char *name, FanOutFunc fanOut, const size_t kMiners) {
+  const string notify(1536, 'a');  // 1.5 KB, with merkle branches
+
+  vector<struct evbuffer *> outBufs(kMiners);
+  for (size_t i = 0; i < kMiners; i++) {
+    outBufs[i] = evbuffer_new();
+  }
+
+  const int64_t begin = nowMicros();
+  fanOut(outBufs, notify);
+  const int64_t end = nowMicros();
+  printf("notify fan-out to %d miners, %s: %6" PRId64 " us\n",
+         (int32_t)kMiners, name, end - begin);
+
+  for (size_t i = 0; i < kMiners; i++) {
+    assert(evbuffer_get_length(outBufs[i]) == notify.size());
+    evbuffer_free(outBufs[i]);
+  }
+}
+
+#ifndef _WIN32
+// run in a child process, so the peak RSS isn't polluted by others
+static void benchFanOutPeakRSS(const char *name, FanOutFunc fanOut,
+                               const size_t kMiners) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    benchFanOut(name, fanOut, kMiners);
+    _exit(0);
+  }
+  int status = 0;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  printf("notify fan-out to %d miners, %s: peak RSS %ld KB\n",
+         (int32_t)kMiners, name, usage.ru_maxrss);
+}
+#endif
+
+TEST(Benchmark, MiningNotifyFanOut) {
+  const size_t kMiners = 20000;
+
+  benchFanOut("shared", fanOutShared, kMiners);
+  benchFanOut("copy  ", fanOutCopy,   kMiners);
+
+#ifndef _WIN32
+  benchFanOutPeakRSS("shared", fanOutShared, kMiners);
+  benchFanOutPeakRSS("copy  ", fanOutCopy,   kMiners);
+#endif
+}
+
+// the previous one, walks the bitset one by one
+class LinearSessionIDManager {
+  std::bitset<AGENT_MAX_SESSION_ID + 1> sessionIds_;
+  int32_t count_;
+  uint32_t allocIdx_;
+
+public:
+  LinearSessionIDManager(): count_(0), allocIdx_(0) {}
+
+  bool allocSessionId(uint16_t *id) {
+    if (count_ >= (int32_t)(AGENT_MAX_SESSION_ID + 1))
+      return false;
+
+    while (sessionIds_.test(allocIdx_) == true) {
+      allocIdx_++;
+      if (allocIdx_ > AGENT_MAX_SESSION_ID) {
+        allocIdx_ = 0;
+      }
+    }
+    sessionIds_.set(allocIdx_, true);
+    count_++;
+    *id = (uint16_t)allocIdx_;
+    return true;
+  }
+
+  void freeSessionId(const uint16_t sessionId) {
+    sessionIds_.set(sessionId, false);
+    count_--;
+  }
+};
+
+template <typename T>
+static void benchSessionIDManager(const char *name, const double occupancy) {
+  const int32_t kTotal = AGENT_MAX_SESSION_ID + 1;
+  const int32_t kLoops = 100000;
+  T *m = new T();
+  uint16_t id;
+
+  // fill all, then free random ids until reach the occupancy
+  vector<uint16_t> used;
+  for (int32_t i = 0; i < kTotal; i++) {
+    m->allocSessionId(&id);
+    used.push_back(id);
+  }
+  srand(1);
+  const size_t target = (size_t)(kTotal * occupancy);
+  while (used.size() > target) {
+    const size_t i = rand() % used.size();
+    m->freeSessionId(used[i]);
+    used[i] = used.back();
+    used.pop_back();
+  }
+
+  // free a random one and alloc one, keep the occupancy
+  const int64_t begin = nowMicros();
+  for (int32_t i = 0; i < kLoops; i++) {
+    const size_t j = rand() % used.size();
+    m->freeSessionId(used[j]);
+    m->allocSessionId(&used[j]);
+  }
+  const int64_t end = nowMicros();
+
+  printf("session id free+alloc, %s, occupancy %5.1f%%: %8.1f ns/op\n",
+         name, occupancy * 100, (end - begin) * 1000.0 / kLoops);
+  delete m;
+}
+
+TEST(Benchmark, SessionIDManager) {
+  const double occupancies[] = {0.1, 0.9, 0.999};
+  for (size_t i = 0; i < sizeof(occupancies) / sizeof(occupancies[0]); i++) {
+    benchSessionIDManager<SessionIDManager>("bitmap", occupancies[i]);
+    benchSessionIDManager<LinearSessionIDManager>("linear", occupancies[i]);
+  }
+}
+
+TEST(Benchmark, MiningSubmitParser) {
+  const int32_t kLoops = 200000;
+  const string line = "{\"params\": [\"btccom.kevin\", \"9\", \"00000001\", \"504e86ed\", \"b2957c02\"], \"id\": 4, \"method\": \"mining.submit\"}\n";
+  uint32_t sum = 0u;
+
+  {
+    const int64_t begin = nowMicros();
+    for (int32_t i = 0; i < kLoops; i++) {
+      Share share;
+      StringRef id;
+      StratumMessage::parseMiningSubmitFast(line.data(), line.size(), &share, &id);
+      sum += share.nonce_;
+    }
+    const int64_t end = nowMicros();
+    printf("mining.submit parser, fast:    %8.1f ns/op\n", (end - begin) * 1000.0 / kLoops);
+  }
+
+  {
+    const int64_t begin = nowMicros();
+    for (int32_t i = 0; i < kLoops; i++) {
+      StratumMessage smsg(line);
+      Share share;
+      smsg.parseMiningSubmit(share);
+      sum += share.nonce_;
+    }
+    const int64_t end = nowMicros();
+    printf("mining.submit parser, generic: %8.1f ns/op\n", (end - begin) * 1000.0 / kLoops);
+  }
+
+  ASSERT_EQ(sum, 0xb2957c02u * kLoops * 2);
+}
+
+// one thread, i.e. per core
+static void benchShareCheck(Sha256Impl impl) {
+  if (!setSha256Impl(impl)) {
+    printf("sha256 %-7s: not supported\n", getSha256ImplName(impl));
+    return;
+  }
+  const int32_t kLoops = 200000;
+  uint8_t header[80];
+  uint8_t hash[32];
+  memset(header, 0x5a, sizeof(header));
+  uint32_t sum = 0u;
+
+  {
+    const int64_t begin = nowMicros();
+    for (int32_t i = 0; i < kLoops; i++) {
+      writeUint32LE(header + 76, (uint32_t)i);
+      sha256d(header, sizeof(header), hash);
+      sum += hash[0];
+    }
+    const int64_t end = nowMicros();
+    printf("sha256 %-7s: %8.0f header hashes/sec\n", getSha256ImplName(impl),
+           kLoops * 1e6 / (end - begin));
+  }
+
+  // a job of a big block: a 200 bytes coinbase and 12 merkle branches
+  StratumJob sjob;
+  sjob.prevHash_  = string(64, '1');
+  sjob.coinbase1_ = string(2 * 100, 'a');
+  sjob.coinbase2_ = string(2 * 88, 'b');
+  sjob.merkleBranches_.resize(12, string(64, 'c'));
+  JobTemplate job;
+  job.init(sjob, 0x12345678u);
+
+  {
+    Share share;
+    const int64_t begin = nowMicros();
+    for (int32_t i = 0; i < kLoops / 10; i++) {
+      share.nonce_ = (uint32_t)i;
+      job.getHeaderHash(1, share, hash);
+      sum += JobTemplate::isHashBelowTarget(hash, 1024) ? 1 : 0;
+    }
+    const int64_t end = nowMicros();
+    printf("sha256 %-7s: %8.0f shares checked/sec\n", getSha256ImplName(impl),
+           kLoops / 10 * 1e6 / (end - begin));
+  }
+  (void)sum;
+}
+
+TEST(Benchmark, Sha256) {
+  const Sha256Impl impl = getSha256Impl();
+  benchShareCheck(SHA256_GENERIC);
+  benchShareCheck(SHA256_NI);
+  setSha256Impl(impl);
+}
+
+TEST(Benchmark, DuplicateShareFilter) {
+  // 10k miners, 60 shares of each per clean job
+  const size_t kMiners = 10000;
+  const uint32_t kShares = 60;
+  vector<DuplicateShareFilter> filters(kMiners);
+
+  Share share;
+  size_t dups = 0;
+  for (int round = 0; round < 2; round++) {
+    const int64_t begin = nowMicros();
+    for (uint32_t i = 0; i < kShares; i++) {
+      share.nonce_ = i;
+      for (size_t j = 0; j < kMiners; j++) {
+        share.extraNonce2_ = (uint32_t)j;
+        if (!filters[j].insert(DuplicateShareFilter::hashShare(1, share)))
+          dups++;
+      }
+    }
+    const int64_t elapsed = nowMicros() - begin;
+    printf("duplicate share filter, %s: %5.1f ns/share\n",
+           round == 0 ? "insert   " : "duplicate",
+           elapsed * 1000.0 / (kMiners * kShares));
+  }
+  ASSERT_EQ(dups, kMiners * kShares);
+
+  size_t memory = 0;
+  for (size_t j = 0; j < kMiners; j++) {
+    memory += filters[j].getMemorySize();
+  }
+  printf("duplicate share filter, %d miners x %u shares: %.1f MB\n",
+         (int32_t)kMiners, kShares, memory / 1048576.0);
+}
+
+//
+// an hour of a pool: a job every 30 seconds, a block (clean job) every 10
+// minutes on average, 1000 miners with a share every 10 seconds on average.
+// most of them switch to each new job (a second later), the sticky ones
+// (30%) keep the job until the next clean job like some old firmwares do.
+//
+static void benchJobHistory(const uint32_t depth) {
+  const uint32_t kMiners = 1000;
+  const uint32_t kSeconds = 3600;
+  uint32_t seed = 12345;  // LCG, the same shares for each depth
+
+  JobTimeRing ring(depth);
+  uint8_t  jobId = 0;
+  uint32_t latestJob = 0, cleanJob = 0;   // job ids
+  uint32_t latestJobTime = 0;
+  vector<uint32_t> jobTimes(256, 0);
+
+  uint64_t shares = 0, bytes = 0;
+  for (uint32_t now = 1; now <= kSeconds; now++) {
+    seed = seed * 1103515245 + 12345;
+    const bool isBlock = ((seed >> 8) % 600) == 0;
+    if (now % 30 == 0 || isBlock) {
+      latestJob = jobId++;
+      latestJobTime = now;
+      jobTimes[latestJob] = now;
+      if (isBlock)
+        cleanJob = latestJob;
+      ring.add((uint8_t)latestJob, now);
+    }
+
+    for (uint32_t i = 0; i < kMiners; i++) {
+      seed = seed * 1103515245 + 12345;
+      if (((seed >> 8) % 10) != 0)
+        continue;
+      const bool isSticky = (i % 10) < 3;
+      uint32_t job = latestJob;
+      if (isSticky)
+        job = cleanJob;
+      else if (latestJobTime == now && latestJob != cleanJob)
+        job = (uint8_t)(latestJob - 1);  // hasn't switched yet
+
+      uint32_t time = 0;
+      shares++;
+      bytes += (ring.find((uint8_t)job, &time) != -1 && time == jobTimes[job]) ? 15 : 19;
+    }
+  }
+  printf("job history depth %3u: %.2f bytes/share, %.1f KB/hour of 1000 miners\n",
+         depth, (double)bytes / shares, bytes / 1024.0);
+}
+
+TEST(Benchmark, JobHistory) {
+  benchJobHistory(3);
+  benchJobHistory(8);
+  benchJobHistory(16);
+  benchJobHistory(64);
+}
+
+// the old way: a std::string per frame, then copied into the evbuffer
+static void encodeShareString(struct evbuffer *out, const ExSubmitShare &s) {
+  const uint16_t len = s.hasTime_ ? 19 : 15;
+  string buf;
+  buf.resize(len);
+  uint8_t *p = (uint8_t *)buf.data();
+  *p++ = CMD_MAGIC_NUMBER;
+  *p++ = s.hasTime_ ? CMD_SUBMIT_SHARE_WITH_TIME : CMD_SUBMIT_SHARE;
+  *(uint16_t *)p = len;             p += 2;
+  *p++ = s.jobId_;
+  *(uint16_t *)p = s.sessionId_;    p += 2;
+  *(uint32_t *)p = s.extraNonce2_;  p += 4;
+  *(uint32_t *)p = s.nonce_;        p += 4;
+  if (s.hasTime_) {
+    *(uint32_t *)p = s.time_;       p += 4;
+  }
+  evbuffer_add(out, buf.data(), buf.size());
+}
+
+TEST(Benchmark, ExMessageCodec) {
+  const int kCount = 2000000;
+  struct evbuffer *out = evbuffer_new();
+
+  ExSubmitShare s;
+  s.hasTime_ = true;
+
+  for (int round = 0; round < 2; round++) {
+    const int64_t begin = nowMicros();
+    for (int i = 0; i < kCount; i++) {
+      s.nonce_ = (uint32_t)i;
+      if (round == 0)
+        s.encode(out);
+      else
+        encodeShareString(out, s);
+
+      // like a flush, keep the buffer small
+      if ((i & 63) == 63)
+        evbuffer_drain(out, evbuffer_get_length(out));
+    }
+    const int64_t elapsed = nowMicros() - begin;
+    printf("ex-message submit encode, %s: %6.1f ns/op\n",
+           round == 0 ? "reserve space" : "std::string  ",
+           elapsed * 1000.0 / kCount);
+  }
+
+  // decode in place
+  ASSERT_EQ(s.encode(out), true);
+  string frame;
+  frame.resize(evbuffer_get_length(out));
+  evbuffer_remove(out, (void *)frame.data(), frame.size());
+
+  uint64_t sum = 0;
+  const int64_t begin = nowMicros();
+  for (int i = 0; i < kCount; i++) {
+    ExSubmitShare d;
+    d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size()));
+    sum += d.nonce_;
+  }
+  const int64_t elapsed = nowMicros() - begin;
+  printf("ex-message submit decode, in place:     %6.1f ns/op (%u)\n",
+         elapsed * 1000.0 / kCount, (uint32_t)(sum & 1));
+
+  evbuffer_free(out);
+}
+
+#ifndef _WIN32
+//
+// synthetic load: each miner sends a burst of submits in every round, the
+// responses of one event loop iteration are written once per session.
+//
+TEST(Benchmark, CoalescedFlush) {
+  const size_t kMiners = 200;
+  const size_t kRounds = 20;
+  const size_t kSubmitsPerRound = 8;
+
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  vector<LocalMiner *> miners;
+  for (size_t i = 0; i < kMiners; i++) {
+    LocalMiner *miner = new LocalMiner();
+    ASSERT_EQ(miner->connect(port), true);
+    miners.push_back(miner);
+
+    // let the agent accept them, don't overflow the listen backlog
+    if (i % 32 == 31)
+      pumpEvents(server.getEventBase(), 5);
+  }
+  pumpEvents(server.getEventBase(), 50);
+
+  for (size_t i = 0; i < kMiners; i++) {
+    miners[i]->send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                    "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  }
+  pumpEvents(server.getEventBase(), 100);
+
+  string submits;
+  for (size_t i = 0; i < kSubmitsPerRound; i++) {
+    submits += Strings::Format("{\"id\":%d,\"method\":\"mining.submit\",\"params\":"
+                               "[\"a.b\",\"0\",\"00000000\",\"504e86b9\",\"%08x\"]}\n",
+                               (int)(100 + i), (uint32_t)i);
+  }
+
+  const uint64_t writes  = server.getDownWriteCount();
+  const uint64_t flushes = server.getDownFlushCount();
+  const int64_t begin = nowMicros();
+  for (size_t r = 0; r < kRounds; r++) {
+    for (size_t i = 0; i < kMiners; i++) {
+      miners[i]->send(submits);
+    }
+    pumpEvents(server.getEventBase(), 10);
+    for (size_t i = 0; i < kMiners; i++) {
+      miners[i]->clear();
+      miners[i]->recv();
+    }
+  }
+  const double seconds = (nowMicros() - begin) / 1000000.0;
+
+  const uint64_t w = server.getDownWriteCount() - writes;
+  const uint64_t f = server.getDownFlushCount() - flushes;
+  printf("coalesced flush, %u miners: %llu writes, %llu flushes, "
+         "syscalls saved: %.0f/s\n", (uint32_t)kMiners,
+         (unsigned long long)w, (unsigned long long)f, (w - f) / seconds);
+
+  for (size_t i = 0; i < kMiners; i++) {
+    delete miners[i];
+  }
+}
+#endif
+
+#ifndef _WIN32
+static void stallTickCallback(evutil_socket_t fd, short events, void *ptr) {
+  int64_t *ticks = static_cast<int64_t *>(ptr);  // [0]: last tick, [1]: max gap
+  const int64_t now = nowMicros();
+  if (now - ticks[0] > ticks[1])
+    ticks[1] = now - ticks[0];
+  ticks[0] = now;
+}
+
+//
+// all the miners connect at once, like after a power blip of the farm.
+// time-to-all-mining: until every one has its first job. the longest stall
+// of the event loop shows how responsive it stays meanwhile.
+//
+static void benchConnectStorm(const char *name, const AgentConf &conf,
+                              const size_t kMiners) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setAgentConf(conf);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  int64_t ticks[2] = {nowMicros(), 0};
+  struct event *tick = event_new(server.getEventBase(), -1, EV_PERSIST,
+                                 stallTickCallback, ticks);
+  struct timeval tv = {0, 1000};
+  event_add(tick, &tv);
+
+  // they wait in the listen backlog until the agent accepts them
+  const int64_t begin = nowMicros();
+  vector<LocalMiner *> miners;
+  for (size_t i = 0; i < kMiners; i++) {
+    LocalMiner *miner = new LocalMiner();
+    ASSERT_EQ(miner->connect(port), true);
+    miner->send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+    miners.push_back(miner);
+  }
+  ticks[0] = nowMicros();
+  ticks[1] = 0;
+
+  size_t mining = 0;
+  vector<bool> isMining(kMiners, false);
+  for (int i = 0; i < 2000 && mining < kMiners; i++) {
+    pumpEvents(server.getEventBase(), 5);
+    for (size_t j = 0; j < kMiners; j++) {
+      if (!isMining[j] && miners[j]->countLines("\"method\":\"mining.notify\"") > 0) {
+        isMining[j] = true;
+        mining++;
+      }
+    }
+  }
+  const int64_t elapsed = nowMicros() - begin;
+  ASSERT_EQ(mining, kMiners);
+
+  printf("connect storm, %u miners, %s: all mining in %5.0f ms, "
+         "longest loop stall %5.1f ms\n", (uint32_t)kMiners, name,
+         elapsed / 1000.0, ticks[1] / 1000.0);
+
+  event_free(tick);
+  for (size_t i = 0; i < kMiners; i++) {
+    delete miners[i];
+  }
+}
+
+TEST(Benchmark, ConnectStorm) {
+  const size_t kMiners = 400;
+
+  AgentConf unlimited;
+  unlimited.acceptRatePerSec_ = 0;
+  unlimited.maxHandshakingSessions_ = 0;
+  unlimited.registerRatePerSec_ = 0;
+  benchConnectStorm("no limit", unlimited, kMiners);
+
+  AgentConf paced;
+  paced.acceptRatePerSec_ = 200;
+  paced.maxHandshakingSessions_ = 50;
+  paced.registerRatePerSec_ = 200;
+  benchConnectStorm("paced   ", paced, kMiners);
+}
+#endif
+
+#ifndef _WIN32
+//
+// the upstream bytes of the shares, the frame of each share vs.
+// CMD_SUBMIT_SHARES_BATCH. the miners of one up session submit at about the
+// same time, one in 4 shares has a rolled nTime.
+//
+static void benchSharesBatch(const bool isEnabled, const size_t kMiners,
+                             const int kRounds) {
+  LocalPool pool;
+  pool.setSharesBatchEnabled(isEnabled);
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  AgentConf conf;
+  conf.upSharesBatch_ = true;
+  server.setAgentConf(conf);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  vector<LocalMiner *> miners;
+  for (size_t i = 0; i < kMiners; i++) {
+    LocalMiner *miner = new LocalMiner();
+    ASSERT_EQ(miner->connect(port), true);
+    miner->send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+    miners.push_back(miner);
+  }
+  for (int i = 0; i < 200 && pool.countExMessages(CMD_REGISTER_WORKER) < kMiners; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(pool.countExMessages(CMD_REGISTER_WORKER), kMiners);
+
+  UpStratumClient *up = server.getUpSession(0);
+  const uint8_t  jobId   = up->jobTimes_.getLatestJobId();
+  const uint32_t jobTime = up->jobTimes_.getLatestTime();
+  for (int round = 0; round < kRounds; round++) {
+    for (size_t i = 0; i < kMiners; i++) {
+      miners[i]->send(Strings::Format("{\"id\":10,\"method\":\"mining.submit\",\"params\":"
+                                      "[\"a.b\",\"%u\",\"%08x\",\"%08x\",\"%08x\"]}\n",
+                                      jobId, round, jobTime + (i % 4 == 0 ? round + 1 : 0),
+                                      (uint32_t)i));
+    }
+    pumpEvents(server.getEventBase(), 20);
+  }
+
+  const size_t total = kMiners * kRounds;
+  size_t received = 0;
+  for (int i = 0; i < 200 && received < total; i++) {
+    pumpEvents(server.getEventBase(), 10);
+    received = pool.getBatchedShares().size() + pool.countExMessages(CMD_SUBMIT_SHARE) +
+               pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME);
+  }
+  ASSERT_EQ(received, total);
+
+  const size_t frames = pool.countExMessages(CMD_SUBMIT_SHARES_BATCH) +
+                        pool.countExMessages(CMD_SUBMIT_SHARE) +
+                        pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME);
+  printf("shares to the pool, %u miners, %s: %5.2f bytes/share, %u frames\n",
+         (uint32_t)kMiners, isEnabled ? "batch frame  " : "frame a share",
+         (double)pool.getShareBytes() / total, (uint32_t)frames);
+
+  for (size_t i = 0; i < kMiners; i++) {
+    delete miners[i];
+  }
+}
+
+TEST(Benchmark, SharesBatch) {
+  benchSharesBatch(false, 500, 4);
+  benchSharesBatch(true,  500, 4);
+  benchSharesBatch(true,  20,  4);
+}
+#endif
+
+#ifndef _WIN32
+//
+// time-to-first-accept: from setup() until the first miner gets its job,
+// the listener opens once one up session is ready. the slow case has only
+// one up session answered by the pool, the others hang in the handshake.
+//
+static void benchStartup(const char *name, const uint32_t answered) {
+  const int8_t kUpSessions = 5;
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+  pool.setSilentAfter(answered);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(kUpSessions);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  const int64_t begin = nowMicros();
+  ASSERT_EQ(server.setup(), true);
+  const int64_t listening = nowMicros() - begin;
+
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  for (int i = 0; i < 1000 && miner.countLines("\"method\":\"mining.notify\"") == 0; i++) {
+    pumpEvents(server.getEventBase(), 1);
+  }
+  const int64_t firstJob = nowMicros() - begin;
+  ASSERT_EQ(miner.countLines("\"method\":\"mining.notify\""), 1u);
+
+  int8_t ready = 0;
+  if (answered == 0) {
+    waitUpSessionsAvailable(server);
+  }
+  for (int8_t i = 0; i < kUpSessions; i++) {
+    if (server.getUpSession(i) != NULL && server.getUpSession(i)->isAvailable())
+      ready++;
+  }
+  printf("startup, %s: listening in %5.1f ms, first job in %5.1f ms, "
+         "%d of %d up sessions ready in %5.1f ms\n", name,
+         listening / 1000.0, firstJob / 1000.0, (int32_t)ready,
+         (int32_t)kUpSessions, (nowMicros() - begin) / 1000.0);
+}
+
+TEST(Benchmark, Startup) {
+  benchStartup("all handshakes", 0);
+  benchStartup("4 of 5 hang   ", 1);
+}
+#endif
+
+#ifndef _WIN32
+//
+// reconnect time of an up session over a 200 ms RTT link, from the new
+// connection until it has the job. the RTT is simulated by the pool holding
+// its replies, the TCP handshake on loopback is not delayed, so fast open
+// shows no gain over the pipelined one here.
+//
+static void benchReconnect(const char *name, const AgentConf &conf) {
+  const int kRounds = 3;
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+  pool.setLatencyMs(200);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setAgentConf(conf);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+
+  int64_t total = 0;
+  for (int i = 0; i < kRounds; i++) {
+    const int64_t begin = nowMicros();
+    server.removeUpConnection(server.getUpSession(0));
+    ASSERT_EQ(server.createUpSession(0), true);
+    waitUpSessionsAvailable(server);
+    ASSERT_EQ(server.getUpSession(0)->isAvailable(), true);
+    total += nowMicros() - begin;
+  }
+  printf("reconnect over 200 ms RTT, %s: %5.1f ms\n", name,
+         total / kRounds / 1000.0);
+}
+
+TEST(Benchmark, Reconnect) {
+  AgentConf conf;
+  conf.poolProbeIntervalMs_ = 0;
+  benchReconnect("sequential", conf);
+
+  conf.upPipelinedHandshake_ = true;
+  benchReconnect("pipelined ", conf);
+
+  conf.upPipelinedHandshake_ = false;
+  conf.upTcpFastOpen_ = true;
+  benchReconnect("fast open ", conf);
+}
+#endif
+
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+//
+// submit throughput of the multi-thread mode, one load thread per agent
+// thread. it scales only if the machine has enough cores for both.
+//
+struct LoadClient {
+  uint16_t port_;
+  size_t miners_;
+  volatile bool *stop_;
+  uint64_t responses_;
+};
+
+static void *runLoadClient(void *ptr) {
+  LoadClient *client = static_cast<LoadClient *>(ptr);
+  const size_t kBurst = 16;
+
+  vector<LocalMiner *> miners;
+  for (size_t i = 0; i < client->miners_; i++) {
+    LocalMiner *miner = new LocalMiner();
+    if (!miner->connect(client->port_)) {
+      delete miner;
+      continue;
+    }
+    miner->send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+    miners.push_back(miner);
+  }
+  for (size_t i = 0; i < miners.size(); i++) {
+    while (miners[i]->countLines("\"method\":\"mining.notify\"") == 0) {
+      sched_yield();
+    }
+    miners[i]->clear();
+  }
+
+  string burst;
+  for (size_t i = 0; i < kBurst; i++) {
+    burst += Strings::Format("{\"id\":%d,\"method\":\"mining.submit\",\"params\":"
+                             "[\"a.b\",\"0\",\"00000000\",\"504e86b9\",\"%08x\"]}\n",
+                             (int)(100 + i), (uint32_t)i);
+  }
+
+  while (!*client->stop_) {
+    for (size_t i = 0; i < miners.size(); i++) {
+      miners[i]->send(burst);
+    }
+    for (size_t i = 0; i < miners.size(); i++) {
+      size_t lines = 0;
+      while (lines < kBurst && !*client->stop_) {
+        const string &r = miners[i]->recv();
+        lines = std::count(r.begin(), r.end(), '\n');
+        if (lines < kBurst)
+          sched_yield();
+      }
+      miners[i]->clear();
+      client->responses_ += lines;
+    }
+  }
+
+  for (size_t i = 0; i < miners.size(); i++) {
+    delete miners[i];
+  }
+  return NULL;
+}
+
+static void *runGroup(void *ptr) {
+  static_cast<StratumServerGroup *>(ptr)->run();
+  return NULL;
+}
+
+TEST(Benchmark, ServerGroupScaling) {
+  const int32_t threadCounts[] = {1, 2, 4};
+
+  for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+    const int32_t threads = threadCounts[t];
+
+    LocalPool pool;
+    ASSERT_EQ(pool.start(), true);
+
+    AgentConf conf;
+    conf.threads_ = threads;
+    const uint16_t port = getFreePort();
+    StratumServerGroup group("127.0.0.1", port, conf);
+    group.addUpPool("127.0.0.1", pool.getPort(), "test");
+    ASSERT_EQ(group.setup(), true);
+
+    pthread_t groupThread;
+    pthread_create(&groupThread, NULL, runGroup, &group);
+
+    volatile bool stop = false;
+    vector<LoadClient> clients(threads);
+    vector<pthread_t> clientThreads(threads);
+    for (int32_t i = 0; i < threads; i++) {
+      clients[i].port_   = port;
+      clients[i].miners_ = 32;
+      clients[i].stop_   = &stop;
+      clients[i].responses_ = 0;
+      pthread_create(&clientThreads[i], NULL, runLoadClient, &clients[i]);
+    }
+
+    const int64_t begin = nowMicros();
+    usleep(1000 * 1000);
+    stop = true;
+    uint64_t responses = 0;
+    for (int32_t i = 0; i < threads; i++) {
+      pthread_join(clientThreads[i], NULL);
+      responses += clients[i].responses_;
+    }
+    const double seconds = (nowMicros() - begin) / 1000000.0;
+
+    printf("server group, %d thread(s), %ld cpu(s): %8.0f submits/s\n",
+           threads, sysconf(_SC_NPROCESSORS_ONLN), responses / seconds);
+
+    group.stop();
+    pthread_join(groupThread, NULL);
+  }
+}
+#endif
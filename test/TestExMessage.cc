@@ -0,0 +1,352 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gtest/gtest.h"
+#include "Utils.h"
+#include "ExMessage.h"
+
+static string removeAll(struct evbuffer *buf) {
+  string s;
+  s.resize(evbuffer_get_length(buf));
+  evbuffer_remove(buf, (void *)s.data(), s.size());
+  return s;
+}
+
+TEST(ExMessage, SubmitShare) {
+  struct evbuffer *buf = evbuffer_new();
+
+  ExSubmitShare s;
+  s.jobId_       = 9;
+  s.sessionId_   = 0xABCD;
+  s.extraNonce2_ = 0x01020304u;
+  s.nonce_       = 0xA0B0C0D0u;
+  ASSERT_EQ(s.encode(buf), true);
+
+  // same bytes as the old native little endian layout
+  const uint8_t expected[15] = {
+    0x7F, 0x02, 15, 0, 9, 0xCD, 0xAB, 0x04, 0x03, 0x02, 0x01,
+    0xD0, 0xC0, 0xB0, 0xA0
+  };
+  string frame = removeAll(buf);
+  ASSERT_EQ(frame, string((const char *)expected, sizeof(expected)));
+
+  ExSubmitShare d;
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+  ASSERT_EQ(d.jobId_, 9);
+  ASSERT_EQ(d.sessionId_, 0xABCD);
+  ASSERT_EQ(d.extraNonce2_, 0x01020304u);
+  ASSERT_EQ(d.nonce_, 0xA0B0C0D0u);
+  ASSERT_EQ(d.hasTime_, false);
+
+  // with nTime
+  s.hasTime_ = true;
+  s.time_    = 0x504e86b9u;
+  ASSERT_EQ(s.encode(buf), true);
+  frame = removeAll(buf);
+  ASSERT_EQ(frame.size(), 19u);
+  ASSERT_EQ((uint8_t)frame[1], CMD_SUBMIT_SHARE_WITH_TIME);
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+  ASSERT_EQ(d.hasTime_, true);
+  ASSERT_EQ(d.time_, 0x504e86b9u);
+
+  // truncated
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size() - 1)), false);
+
+  evbuffer_free(buf);
+}
+
+TEST(ExMessage, RegisterWorker) {
+  struct evbuffer *buf = evbuffer_new();
+
+  ExRegisterWorker s;
+  s.sessionId_  = 7;
+  s.minerAgent_ = StringRef("cgminer/4.9.0", 13);
+  s.workerName_ = StringRef("kevin.s9", 8);
+  ASSERT_EQ(s.encode(buf), true);
+
+  string frame = removeAll(buf);
+  ASSERT_EQ(frame.size(), 6u + 14u + 9u);
+  ASSERT_EQ(frame.substr(6), string("cgminer/4.9.0\0kevin.s9\0", 23));
+
+  ExRegisterWorker d;
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+  ASSERT_EQ(d.sessionId_, 7);
+  ASSERT_EQ(d.minerAgent_.toString(), "cgminer/4.9.0");
+  ASSERT_EQ(d.workerName_.toString(), "kevin.s9");
+
+  // empty miner agent
+  s.minerAgent_ = StringRef();
+  ASSERT_EQ(s.encode(buf), true);
+  frame = removeAll(buf);
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+  ASSERT_EQ(d.minerAgent_.empty(), true);
+  ASSERT_EQ(d.workerName_.toString(), "kevin.s9");
+
+  // the worker name is not terminated
+  frame[frame.size() - 1] = 'x';
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), false);
+
+  // too long
+  string longName(0xFFFF, 'a');
+  s.workerName_ = StringRef(longName.data(), longName.size());
+  ASSERT_EQ(s.encode(buf), false);
+  ASSERT_EQ(evbuffer_get_length(buf), 0u);
+
+  evbuffer_free(buf);
+}
+
+TEST(ExMessage, UnregisterWorker) {
+  struct evbuffer *buf = evbuffer_new();
+
+  ExUnregisterWorker s;
+  s.sessionId_ = 0xFFFE;
+  ASSERT_EQ(s.encode(buf), true);
+  string frame = removeAll(buf);
+  ASSERT_EQ(frame.size(), 6u);
+
+  ExUnregisterWorker d;
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+  ASSERT_EQ(d.sessionId_, 0xFFFE);
+
+  // wrong cmd
+  ExSubmitShare share;
+  ASSERT_EQ(share.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), false);
+
+  evbuffer_free(buf);
+}
+
+TEST(ExMessage, MiningSetDiff) {
+  struct evbuffer *buf = evbuffer_new();
+
+  const uint16_t ids[] = {1, 300, 0xFFFE};
+  ASSERT_EQ(ExMiningSetDiff::encode(buf, 12, ids, 3), true);
+  string frame = removeAll(buf);
+  ASSERT_EQ(frame.size(), 7u + 6u);
+
+  ExMiningSetDiff d;
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+  ASSERT_EQ(d.diff2Exp_, 12);
+  ASSERT_EQ(d.count_, 3);
+  ASSERT_EQ(d.getSessionId(0), 1);
+  ASSERT_EQ(d.getSessionId(1), 300);
+  ASSERT_EQ(d.getSessionId(2), 0xFFFE);
+
+  // the count doesn't match the length
+  frame[5] = 4;
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), false);
+
+  evbuffer_free(buf);
+}
+
+TEST(ExMessage, Ping) {
+  struct evbuffer *buf = evbuffer_new();
+
+  ExPing s;
+  s.isPong_ = true;
+  s.id_     = 0x12345678u;
+  ASSERT_EQ(s.encode(buf), true);
+  string frame = removeAll(buf);
+  ASSERT_EQ(frame.size(), 8u);
+  ASSERT_EQ((uint8_t)frame[1], CMD_PONG);
+
+  ExPing d;
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+  ASSERT_EQ(d.isPong_, true);
+  ASSERT_EQ(d.id_, 0x12345678u);
+
+  // too long
+  frame.push_back(0);
+  frame[2] = 9;
+  ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), false);
+
+  evbuffer_free(buf);
+}
+
+TEST(ExMessage, SubmitSharesBatch) {
+  struct evbuffer *buf = evbuffer_new();
+
+  // two jobs, the session 300 has two shares
+  const uint8_t  jobIds[5]     = {7, 3, 7, 7, 3};
+  const uint16_t sessionIds[5] = {300, 0xFFFF, 5, 300, 1};
+  const int32_t  offsets[5]    = {0, -1, 63, 64, -700};
+  vector<ExBatchedShare> shares;
+  for (int i = 0; i < 5; i++) {
+    ExBatchedShare s;
+    s.jobId_       = jobIds[i];
+    s.sessionId_   = sessionIds[i];
+    s.extraNonce2_ = 0x01020304u + i;
+    s.nonce_       = 0xA0B0C0D0u + i;
+    s.timeOffset_  = offsets[i];
+    shares.push_back(s);
+  }
+  ASSERT_EQ(ExSubmitSharesBatch::encode(buf, shares), true);
+
+  // sorted, the 300 ones in the order
+  ASSERT_EQ(shares[0].sessionId_, 1);
+  ASSERT_EQ(shares[1].sessionId_, 0xFFFF);
+  ASSERT_EQ(shares[2].sessionId_, 5);
+  ASSERT_EQ(shares[3].nonce_, 0xA0B0C0D0u);
+  ASSERT_EQ(shares[4].nonce_, 0xA0B0C0D3u);
+
+  // header 4, 2 groups of 2 bytes. the shares: the session id deltas of
+  // 1, 3, 1, 2, 1 bytes, 8 bytes each, the offsets of 2, 1, 1, 1, 2 bytes
+  const string frame = removeAll(buf);
+  ASSERT_EQ(frame.size(), 4u + 2 * 2 + 8 + 40 + 7);
+  ASSERT_EQ((uint8_t)frame[1], CMD_SUBMIT_SHARES_BATCH);
+  ASSERT_EQ((uint8_t)frame[4], 3);
+  ASSERT_EQ((uint8_t)frame[5], 2);
+
+  vector<ExBatchedShare> d;
+  ASSERT_EQ(ExSubmitSharesBatch::decode(ExMessageReader((const uint8_t *)frame.data(),
+                                                        frame.size()), &d), true);
+  ASSERT_EQ(d.size(), 5u);
+  for (size_t i = 0; i < d.size(); i++) {
+    ASSERT_EQ(d[i].jobId_,       shares[i].jobId_);
+    ASSERT_EQ(d[i].sessionId_,   shares[i].sessionId_);
+    ASSERT_EQ(d[i].extraNonce2_, shares[i].extraNonce2_);
+    ASSERT_EQ(d[i].nonce_,       shares[i].nonce_);
+    ASSERT_EQ(d[i].timeOffset_,  shares[i].timeOffset_);
+  }
+
+  // truncated, or a count over the shares. the first group is 25 bytes,
+  // it's a frame by itself.
+  for (size_t len = 4; len < frame.size(); len++) {
+    string part = frame.substr(0, len);
+    writeUint16LE((uint8_t *)part.data() + 2, (uint16_t)len);
+    d.clear();
+    ASSERT_EQ(ExSubmitSharesBatch::decode(ExMessageReader((const uint8_t *)part.data(),
+                                                          part.size()), &d), len == 29);
+    ASSERT_EQ(d.size(), len == 29 ? 2u : 0u);  // nothing if it's bad
+  }
+  string bad = frame;
+  bad[5] = 3;
+  ASSERT_EQ(ExSubmitSharesBatch::decode(ExMessageReader((const uint8_t *)bad.data(),
+                                                        bad.size()), &d), false);
+
+  // the zigzag and the varint at the edges
+  ASSERT_EQ(ExSubmitSharesBatch::unzigzag(ExSubmitSharesBatch::zigzag(-2147483647 - 1)),
+            -2147483647 - 1);
+  ASSERT_EQ(ExSubmitSharesBatch::zigzag(-1), 1u);
+  ASSERT_EQ(ExSubmitSharesBatch::getVarintLen(127), 1u);
+  ASSERT_EQ(ExSubmitSharesBatch::getVarintLen(128), 2u);
+  ASSERT_EQ(ExSubmitSharesBatch::getVarintLen(0xFFFFFFFFu), 5u);
+
+  // empty, or too many
+  shares.clear();
+  ASSERT_EQ(ExSubmitSharesBatch::encode(buf, shares), false);
+  shares.resize(ExSubmitSharesBatch::kMaxShares_);
+  for (size_t i = 0; i < shares.size(); i++) {
+    shares[i].jobId_      = (uint8_t)i;
+    shares[i].timeOffset_ = -2147483647 - 1;  // 5 bytes
+  }
+  ASSERT_EQ(ExSubmitSharesBatch::encode(buf, shares), true);
+  ASSERT_LT(evbuffer_get_length(buf), 65536u);
+  removeAll(buf);
+  shares.resize(ExSubmitSharesBatch::kMaxShares_ + 1);
+  ASSERT_EQ(ExSubmitSharesBatch::encode(buf, shares), false);
+
+  evbuffer_free(buf);
+}
+
+TEST(ExMessage, Layouts) {
+  ASSERT_EQ(findExMessageLayout(0x00) == NULL, true);
+  ASSERT_EQ(findExMessageLayout(0x09) == NULL, true);
+  ASSERT_EQ(findExMessageLayout(CMD_SUBMIT_SHARE)->minLen_, 15);
+  ASSERT_EQ(findExMessageLayout(CMD_SUBMIT_SHARE_WITH_TIME)->maxLen_, 19);
+  ASSERT_EQ(findExMessageLayout(CMD_UNREGISTER_WORKER)->minLen_, 6);
+
+  const uint8_t tooShort[3] = {0x7F, 0x02, 3};
+  ASSERT_EQ(ExMessageReader(tooShort, sizeof(tooShort)).isValid(), false);
+
+  // the length field doesn't match
+  const uint8_t badLen[6] = {0x7F, 0x04, 7, 0, 1, 0};
+  ASSERT_EQ(ExMessageReader(badLen, sizeof(badLen)).isValid(), false);
+
+  const uint8_t badMagic[6] = {0x7E, 0x04, 6, 0, 1, 0};
+  ASSERT_EQ(ExMessageReader(badMagic, sizeof(badMagic)).isValid(), false);
+}
+
+TEST(ExMessage, Fuzz) {
+  // random frames must be rejected or decoded, never read out of bounds
+  srand(20161017);
+  uint8_t data[64];
+  size_t decoded = 0;
+
+  for (int n = 0; n < 200000; n++) {
+    const size_t len = rand() % sizeof(data);
+    for (size_t i = 0; i < len; i++) {
+      data[i] = (uint8_t)rand();
+    }
+    // make a valid header more often
+    if (len >= 4 && (n & 1)) {
+      data[0] = CMD_MAGIC_NUMBER;
+      data[1] = (uint8_t)(1 + rand() % 8);
+      writeUint16LE(data + 2, (uint16_t)len);
+    }
+
+    // copy to a heap block of the exact size, so the sanitizers could
+    // catch the overflows
+    uint8_t *p = (uint8_t *)malloc(len + 1);
+    memcpy(p, data, len);
+    ExMessageReader r(p, len);
+
+    ExSubmitShare s;
+    ExRegisterWorker rw;
+    ExUnregisterWorker uw;
+    ExMiningSetDiff sd;
+    ExPing ping;
+    vector<ExBatchedShare> shares;
+    if (ExSubmitSharesBatch::decode(r, &shares)) decoded++;
+    if (s.decode(r))  decoded++;
+    if (ping.decode(r)) decoded++;
+    if (rw.decode(r)) decoded++;
+    if (uw.decode(r)) decoded++;
+    if (sd.decode(r)) {
+      for (uint16_t i = 0; i < sd.count_; i++) {
+        sd.getSessionId(i);
+      }
+      decoded++;
+    }
+    free(p);
+  }
+  ASSERT_GT(decoded, 0u);
+
+  // round trip of random shares
+  struct evbuffer *buf = evbuffer_new();
+  for (int n = 0; n < 10000; n++) {
+    ExSubmitShare s;
+    s.jobId_       = (uint8_t)rand();
+    s.sessionId_   = (uint16_t)rand();
+    s.extraNonce2_ = (uint32_t)rand() * 65599u;
+    s.nonce_       = (uint32_t)rand() * 31u;
+    s.hasTime_     = (rand() & 1) != 0;
+    s.time_        = s.hasTime_ ? (uint32_t)rand() : 0;
+    ASSERT_EQ(s.encode(buf), true);
+
+    const string frame = removeAll(buf);
+    ExSubmitShare d;
+    ASSERT_EQ(d.decode(ExMessageReader((const uint8_t *)frame.data(), frame.size())), true);
+    ASSERT_EQ(d.jobId_, s.jobId_);
+    ASSERT_EQ(d.sessionId_, s.sessionId_);
+    ASSERT_EQ(d.extraNonce2_, s.extraNonce2_);
+    ASSERT_EQ(d.nonce_, s.nonce_);
+    ASSERT_EQ(d.hasTime_, s.hasTime_);
+    ASSERT_EQ(d.time_, s.time_);
+  }
+  evbuffer_free(buf);
+}
@@ -0,0 +1,128 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gtest/gtest.h"
+#include "Utils.h"
+#include "Handoff.h"
+
+#ifndef _WIN32
+ #include <sys/socket.h>
+#endif
+
+TEST(Handoff, WriterReader) {
+  struct evbuffer *buf1 = evbuffer_new();
+  struct evbuffer *buf2 = evbuffer_new();
+  evbuffer_add(buf1, "abc", 3);
+  evbuffer_add(buf2, "de", 2);
+
+  HandoffWriter w;
+  w.putUint8(0xAB);
+  w.putUint16(0xABCD);
+  w.putUint32(0x01020304u);
+  w.putUint64(0x1122334455667788ull);
+  w.putString("hello");
+  w.putEvbuffers(buf1, buf2);
+  w.putEvbuffers(NULL, NULL);
+  w.putFd(7);
+
+  // not drained
+  ASSERT_EQ(evbuffer_get_length(buf1), 3u);
+  ASSERT_EQ(evbuffer_get_length(buf2), 2u);
+  evbuffer_free(buf1);
+  evbuffer_free(buf2);
+  ASSERT_EQ(w.getFds().size(), 1u);
+
+  vector<evutil_socket_t> fds(1, -1);  // nothing to close
+  {
+    HandoffReader r(w.getData(), fds);
+    ASSERT_EQ(r.getUint8(), 0xAB);
+    ASSERT_EQ(r.getUint16(), 0xABCD);
+    ASSERT_EQ(r.getUint32(), 0x01020304u);
+    ASSERT_EQ(r.getUint64(), 0x1122334455667788ull);
+    ASSERT_EQ(r.getString(), "hello");
+    ASSERT_EQ(r.getString(), "abcde");
+    ASSERT_EQ(r.getString(), "");
+    ASSERT_EQ(r.isValid(), true);
+    ASSERT_EQ(r.isEnd(), false);
+
+    // the fd isn't there
+    ASSERT_EQ(r.getFd(), -1);
+    ASSERT_EQ(r.isValid(), false);
+    ASSERT_EQ(r.isEnd(), true);
+  }
+
+  // truncated
+  const string part = w.getData().substr(0, 10);
+  vector<evutil_socket_t> none;
+  HandoffReader r(part, none);
+  r.getUint8();
+  r.getUint16();
+  r.getUint32();
+  ASSERT_EQ(r.isValid(), true);
+  ASSERT_EQ(r.getUint64(), 0u);
+  ASSERT_EQ(r.isValid(), false);
+  ASSERT_EQ(r.getString(), "");
+}
+
+#ifndef _WIN32
+TEST(Handoff, sendRecv) {
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+  // more than one batch of SCM_RIGHTS
+  const size_t kFds = 300;
+  int pipeFds[2];
+  ASSERT_EQ(pipe(pipeFds), 0);
+  vector<evutil_socket_t> fds;
+  for (size_t i = 0; i < kFds; i++) {
+    fds.push_back(dup(pipeFds[1]));
+  }
+
+  const string data(100000, 'x');
+  ASSERT_EQ(sendHandoff(sv[0], data, fds), true);
+  for (size_t i = 0; i < kFds; i++) {
+    close(fds[i]);
+  }
+
+  string recvData;
+  vector<evutil_socket_t> recvFds;
+  ASSERT_EQ(recvHandoff(sv[1], &recvData, &recvFds), true);
+  ASSERT_EQ(recvData, data);
+  ASSERT_EQ(recvFds.size(), kFds);
+
+  // the same pipe
+  ASSERT_EQ(write(recvFds[kFds - 1], "z", 1), 1);
+  char c = 0;
+  ASSERT_EQ(read(pipeFds[0], &c, 1), 1);
+  ASSERT_EQ(c, 'z');
+
+  // the unused ones are closed by the reader
+  {
+    HandoffReader r(recvData, recvFds);
+  }
+  ASSERT_EQ(recvFds[0], -1);
+  ASSERT_EQ(recvFds[kFds - 1], -1);
+
+  // the peer is gone
+  close(sv[0]);
+  ASSERT_EQ(recvHandoff(sv[1], &recvData, &recvFds), false);
+  close(sv[1]);
+  close(pipeFds[0]);
+  close(pipeFds[1]);
+}
+#endif
@@ -0,0 +1,276 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gtest/gtest.h"
+#include "Utils.h"
+#include "Resolver.h"
+#include "LocalPool.h"
+
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+
+TEST(Resolver, SockAddr) {
+  SockAddr a, b;
+  ASSERT_EQ(SockAddr::parse("1.2.3.4", 3333, &a), true);
+  ASSERT_EQ(a.getFamily(), AF_INET);
+  ASSERT_EQ(a.getPort(), 3333);
+  ASSERT_EQ(a.toString(), "1.2.3.4:3333");
+
+  ASSERT_EQ(SockAddr::parse("::1", 0, &b), true);
+  ASSERT_EQ(b.getFamily(), AF_INET6);
+  b.setPort(1800);
+  ASSERT_EQ(b.toString(), "[::1]:1800");
+  ASSERT_EQ(a == b, false);
+
+  SockAddr c;
+  ASSERT_EQ(SockAddr::parse("1.2.3.4", 1, &c), true);
+  ASSERT_EQ(a == c, false);
+  c.setPort(3333);
+  ASSERT_EQ(a == c, true);
+
+  ASSERT_EQ(SockAddr::parse("cn.ss.btc.com", 3333, &c), false);
+  ASSERT_EQ(SockAddr::parse("1.2.3", 3333, &c), false);
+}
+
+#ifndef _WIN32
+
+//
+// a nameserver on 127.0.0.1 in the same event base, answers "pool.test"
+// with two A and one AAAA records, maybe after a delay.
+//
+class LocalNameserver {
+  struct Reply {
+    LocalNameserver *server_;
+    struct evdns_server_request *req_;
+  };
+
+  evutil_socket_t fd_;
+  struct evdns_server_port *port_;
+  struct event_base *base_;
+
+  static void requestCallback(struct evdns_server_request *req, void *ptr) {
+    LocalNameserver *server = static_cast<LocalNameserver *>(ptr);
+    server->questionCount_ += req->nquestions;
+
+    if (server->delayMs_ == 0) {
+      server->respond(req);
+      return;
+    }
+    Reply *r = new Reply();
+    r->server_ = server;
+    r->req_    = req;
+    struct timeval tv = {server->delayMs_ / 1000, (server->delayMs_ % 1000) * 1000};
+    event_base_once(server->base_, -1, EV_TIMEOUT, delayCallback, r, &tv);
+  }
+
+  static void delayCallback(evutil_socket_t fd, short events, void *ptr) {
+    Reply *r = static_cast<Reply *>(ptr);
+    r->server_->respond(r->req_);
+    delete r;
+  }
+
+  void respond(struct evdns_server_request *req) {
+    for (int i = 0; i < req->nquestions; i++) {
+      const struct evdns_server_question *q = req->questions[i];
+      // the client randomizes the case of the name
+      if (isFailing_ || evutil_ascii_strcasecmp(q->name, "pool.test") != 0) {
+        evdns_server_request_respond(req, DNS_ERR_NOTEXIST);
+        return;
+      }
+
+      if (q->type == EVDNS_TYPE_A) {
+        const uint8_t ips[8] = {127, 0, 0, 2, 127, 0, 0, 3};
+        evdns_server_request_add_a_reply(req, q->name, 2, ips, ttl_);
+      } else if (q->type == EVDNS_TYPE_AAAA) {
+        uint8_t ip6[16] = {0};
+        ip6[15] = 1;
+        evdns_server_request_add_aaaa_reply(req, q->name, 1, ip6, ttl_);
+      }
+    }
+    evdns_server_request_respond(req, 0);
+  }
+
+public:
+  int32_t questionCount_;
+  int32_t delayMs_;
+  int32_t ttl_;
+  bool isFailing_;
+
+  LocalNameserver(struct event_base *base)
+  : fd_(-1), port_(NULL), base_(base), questionCount_(0), delayMs_(0), ttl_(60),
+  isFailing_(false) {}
+
+  ~LocalNameserver() {
+    if (port_ != NULL)
+      evdns_close_server_port(port_);
+    if (fd_ != -1)
+      evutil_closesocket(fd_);
+  }
+
+  // "127.0.0.1:port"
+  string start() {
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    evutil_make_socket_nonblocking(fd_);
+    bind(fd_, (struct sockaddr *)&sin, sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, (struct sockaddr *)&sin, &len);
+
+    port_ = evdns_add_server_port_with_base(base_, fd_, 0, requestCallback, this);
+    return Strings::Format("127.0.0.1:%u", (uint32_t)ntohs(sin.sin_port));
+  }
+};
+
+class ResolveResult {
+public:
+  int32_t count_;
+  vector<SockAddr> addrs_;
+
+  ResolveResult(): count_(0) {}
+
+  static void callback(const string &host, const vector<SockAddr> &addrs, void *ptr) {
+    ResolveResult *r = static_cast<ResolveResult *>(ptr);
+    r->count_++;
+    r->addrs_ = addrs;
+  }
+
+  void wait(struct event_base *base) {
+    for (int i = 0; i < 200 && count_ == 0; i++)
+      pumpEvents(base, 10);
+  }
+};
+
+TEST(Resolver, DnsResolver_numeric) {
+  struct event_base *base = event_base_new();
+  LocalNameserver ns(base);
+  {
+    DnsResolver resolver(base, vector<string>(1, ns.start()));
+
+    // answered at once, without a query
+    ResolveResult r;
+    resolver.resolve("10.0.0.1", ResolveResult::callback, &r);
+    ASSERT_EQ(r.count_, 1);
+    ASSERT_EQ(r.addrs_.size(), 1u);
+    ASSERT_EQ(r.addrs_[0].toString(), "10.0.0.1:0");
+    ASSERT_EQ(resolver.getQueryCount(), 0u);
+    ASSERT_EQ(ns.questionCount_, 0);
+  }
+  event_base_free(base);
+}
+
+TEST(Resolver, DnsResolver_cache) {
+  struct event_base *base = event_base_new();
+  LocalNameserver ns(base);
+  {
+    DnsResolver resolver(base, vector<string>(1, ns.start()));
+    resolver.setTtlRange(1, 60);
+    ns.ttl_ = 1;
+
+    // all the records, IPv4 first
+    ResolveResult r1;
+    resolver.resolve("pool.test", ResolveResult::callback, &r1);
+    ASSERT_EQ(r1.count_, 0);
+    r1.wait(base);
+    ASSERT_EQ(r1.count_, 1);
+    ASSERT_EQ(r1.addrs_.size(), 3u);
+    ASSERT_EQ(r1.addrs_[0].toString(), "127.0.0.2:0");
+    ASSERT_EQ(r1.addrs_[1].toString(), "127.0.0.3:0");
+    ASSERT_EQ(r1.addrs_[2].toString(), "[::1]:0");
+    ASSERT_EQ(ns.questionCount_, 2);  // A & AAAA
+
+    // cached
+    ResolveResult r2;
+    resolver.resolve("pool.test", ResolveResult::callback, &r2);
+    ASSERT_EQ(r2.count_, 1);
+    ASSERT_EQ(r2.addrs_.size(), 3u);
+    ASSERT_EQ(ns.questionCount_, 2);
+    ASSERT_EQ(resolver.getQueryCount(), 1u);
+
+    // the TTL is expired, the nameserver fails, use the last addresses
+    usleep(1100 * 1000);
+    ns.isFailing_ = true;
+    ResolveResult r3;
+    resolver.resolve("pool.test", ResolveResult::callback, &r3);
+    ASSERT_EQ(r3.count_, 0);
+    r3.wait(base);
+    ASSERT_EQ(r3.count_, 1);
+    ASSERT_EQ(r3.addrs_.size(), 3u);
+    ASSERT_EQ(ns.questionCount_, 4);
+
+    // unknown host
+    ResolveResult r4;
+    resolver.resolve("nx.test", ResolveResult::callback, &r4);
+    r4.wait(base);
+    ASSERT_EQ(r4.count_, 1);
+    ASSERT_EQ(r4.addrs_.size(), 0u);
+  }
+  event_base_free(base);
+}
+
+static void tickCallback(evutil_socket_t fd, short events, void *ptr) {
+  int64_t *ticks = static_cast<int64_t *>(ptr);  // [0]: last tick, [1]: max gap
+  const int64_t now = nowMillis();
+  if (now - ticks[0] > ticks[1])
+    ticks[1] = now - ticks[0];
+  ticks[0] = now;
+}
+
+TEST(Resolver, DnsResolver_slowNameserver) {
+  struct event_base *base = event_base_new();
+  LocalNameserver ns(base);
+  {
+    DnsResolver resolver(base, vector<string>(1, ns.start()));
+    ns.delayMs_ = 500;
+
+    // the event loop goes on while resolving
+    int64_t ticks[2] = {nowMillis(), 0};
+    struct event *tick = event_new(base, -1, EV_PERSIST, tickCallback, ticks);
+    struct timeval tv = {0, 10 * 1000};
+    event_add(tick, &tv);
+
+    ResolveResult r1, r2;
+    const int64_t begin = nowMillis();
+    resolver.resolve("pool.test", ResolveResult::callback, &r1);
+    resolver.resolve("pool.test", ResolveResult::callback, &r2);  // joins the first
+    ASSERT_LT(nowMillis() - begin, 50);
+
+    r1.wait(base);
+    ASSERT_GE(nowMillis() - begin, 450);
+    ASSERT_EQ(r1.addrs_.size(), 3u);
+    ASSERT_EQ(r2.count_, 1);
+    ASSERT_EQ(r2.addrs_.size(), 3u);
+    ASSERT_EQ(ns.questionCount_, 2);
+    ASSERT_LT(ticks[1], 100);
+
+    // cancelled, never called back
+    ResolveResult r3;
+    resolver.resolve("nx.test", ResolveResult::callback, &r3);
+    resolver.cancel(&r3);
+    pumpEvents(base, 700);
+    ASSERT_EQ(r3.count_, 0);
+
+    event_free(tick);
+  }
+  event_base_free(base);
+}
+
+#endif  // _WIN32
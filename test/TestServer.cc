@@ -19,6 +19,10 @@
 #include "gtest/gtest.h"
 #include "Utils.h"
 #include "Server.h"
+#include "ServerGroup.h"
+#include "LocalPool.h"
+
+#include <algorithm>
 
 
 TEST(Server, SessionIDManager) {
@@ -54,6 +58,65 @@ TEST(Server, SessionIDManager) {
   ASSERT_EQ(m.ifFull(), true);
 }
 
+TEST(Server, SessionIDManager_roundRobin) {
+  SessionIDManager m;
+  uint16_t id;
+
+  for (uint32_t i = 0; i < 10; i++) {
+    ASSERT_EQ(m.allocSessionId(&id), true);
+    ASSERT_EQ(id, i);
+  }
+
+  // the recently freed one should not be handed out straight away
+  m.freeSessionId(3);
+  ASSERT_EQ(m.allocSessionId(&id), true);
+  ASSERT_EQ(id, 10);
+
+  // fill the rest, the last free one is 3
+  for (uint32_t i = 11; i <= AGENT_MAX_SESSION_ID; i++) {
+    ASSERT_EQ(m.allocSessionId(&id), true);
+    ASSERT_EQ(id, i);
+  }
+  ASSERT_EQ(m.allocSessionId(&id), true);
+  ASSERT_EQ(id, 3);
+  ASSERT_EQ(m.ifFull(), true);
+
+  // free some ids in different words, should be found after wrap around
+  m.freeSessionId(1000);
+  m.freeSessionId(64);
+  ASSERT_EQ(m.allocSessionId(&id), true);
+  ASSERT_EQ(id, 64);
+  ASSERT_EQ(m.allocSessionId(&id), true);
+  ASSERT_EQ(id, 1000);
+  ASSERT_EQ(m.allocSessionId(&id), false);
+}
+
+TEST(Server, SessionIDManager_setRange) {
+  SessionIDManager m;
+  m.setRange(100, 199);
+
+  uint16_t id;
+  for (uint32_t i = 100; i <= 199; i++) {
+    ASSERT_EQ(m.allocSessionId(&id), true);
+    ASSERT_EQ(id, i);
+  }
+  ASSERT_EQ(m.ifFull(), true);
+  ASSERT_EQ(m.allocSessionId(&id), false);
+
+  m.freeSessionId(150);
+  ASSERT_EQ(m.allocSessionId(&id), true);
+  ASSERT_EQ(id, 150);
+
+  // the last range
+  SessionIDManager last;
+  last.setRange(0xFF00, AGENT_MAX_SESSION_ID);
+  for (uint32_t i = 0xFF00; i <= AGENT_MAX_SESSION_ID; i++) {
+    ASSERT_EQ(last.allocSessionId(&id), true);
+    ASSERT_EQ(id, i);
+  }
+  ASSERT_EQ(last.ifFull(), true);
+}
+
 TEST(Server, StratumMessage_isValid) {
   {
     string line;
@@ -121,9 +184,15 @@ TEST(Server, StratumMessage_parseMiningNotify) {
 
     ASSERT_EQ(sjob.jobId_, 1);
     ASSERT_EQ(sjob.prevHash_, "4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000");
+    ASSERT_EQ(sjob.coinbase1_, "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008");
+    ASSERT_EQ(sjob.coinbase2_, "072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000");
+    ASSERT_EQ(sjob.merkleBranches_.size(), 2u);
+    ASSERT_EQ(sjob.merkleBranches_[1], "942d192aa135fc4efdc09166877468d7d199753f35095b10fbce656f7c14561d");
     ASSERT_EQ(sjob.version_, 0x00000002u);
+    ASSERT_EQ(sjob.nBits_, 0x1c2ac4afu);
     ASSERT_EQ(sjob.time_, 0x504e86b9u);
     ASSERT_EQ(sjob.isClean_, false);
+    ASSERT_EQ(line.substr(sjob.cleanPos_, sjob.cleanLen_), "false");
   }
 
   {
@@ -139,10 +208,26 @@ TEST(Server, StratumMessage_parseMiningNotify) {
 
     ASSERT_EQ(sjob.jobId_, 0);
     ASSERT_EQ(sjob.prevHash_, "4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000");
+    ASSERT_EQ(sjob.merkleBranches_.size(), 0u);
     ASSERT_EQ(sjob.version_, 0x02000000u);
     ASSERT_EQ(sjob.time_, 0x504e86b9u);
     ASSERT_EQ(sjob.isClean_, true);
   }
+
+  {
+    // clean_jobs as 0 with the spaces, or not a primitive
+    const string head = "{\"params\": [\"3\", \"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\",\"01\",\"02\", [],\"02000000\", \"1c2ac4af\", \"504e86b9\",";
+    string line = head + "  0 ], \"id\": null, \"method\": \"mining.notify\"}";
+    StratumJob sjob;
+    ASSERT_EQ(StratumMessage(line).parseMiningNotify(sjob), true);
+    ASSERT_EQ(sjob.isClean_, false);
+    ASSERT_EQ(line.substr(sjob.cleanPos_, sjob.cleanLen_), "0");
+
+    line = head + "\"false\"], \"id\": null, \"method\": \"mining.notify\"}";
+    StratumJob sjob2;
+    ASSERT_EQ(StratumMessage(line).parseMiningNotify(sjob2), true);
+    ASSERT_EQ(sjob2.cleanPos_, -1);
+  }
 }
 
 TEST(Server, StratumMessage_parseMiningSubmit) {
@@ -159,6 +244,67 @@ TEST(Server, StratumMessage_parseMiningSubmit) {
   ASSERT_EQ(share.nonce_, 0xb2957c02u);
 }
 
+TEST(Server, StratumMessage_parseMiningSubmitFast) {
+  {
+    string line = "{\"params\": [\"slush.miner1\", \"9\", \"00000001\", \"504e86ed\", \"b2957c02\"], \"id\": 4, \"method\": \"mining.submit\"}\n";
+    Share share;
+    StringRef id;
+    ASSERT_EQ(StratumMessage::parseMiningSubmitFast(line.data(), line.size(), &share, &id), true);
+    ASSERT_EQ(share.jobId_, 9u);
+    ASSERT_EQ(share.time_, 0x504e86edu);
+    ASSERT_EQ(share.extraNonce2_, 0x00000001u);
+    ASSERT_EQ(share.nonce_, 0xb2957c02u);
+    ASSERT_EQ(id.toString(), "4");
+  }
+
+  {
+    // string id, other keys and without spaces
+    string line = "{\"id\":\"a1\",\"jsonrpc\":\"2.0\",\"method\":\"mining.submit\",\"params\":[\"btccom.kevin\",\"123\",\"DEADBEEF\",\"57be5b49\",\"1\"]}";
+    Share share;
+    StringRef id;
+    ASSERT_EQ(StratumMessage::parseMiningSubmitFast(line.data(), line.size(), &share, &id), true);
+    ASSERT_EQ(share.jobId_, 123u);
+    ASSERT_EQ(share.extraNonce2_, 0xdeadbeefu);
+    ASSERT_EQ(share.time_, 0x57be5b49u);
+    ASSERT_EQ(share.nonce_, 0x1u);
+    ASSERT_EQ(id.toString(), "\"a1\"");
+  }
+
+  {
+    // without id
+    string line = "{\"method\":\"mining.submit\",\"params\":[\"a\",\"1\",\"00000001\",\"57be5b49\",\"00000002\"]}";
+    Share share;
+    StringRef id;
+    ASSERT_EQ(StratumMessage::parseMiningSubmitFast(line.data(), line.size(), &share, &id), true);
+    ASSERT_EQ(id.toString(), "null");
+  }
+
+  // unusual ones, should fallback to the generic parser
+  const char *lines[] = {
+    // other method
+    "{\"id\": 2, \"method\": \"mining.authorize\", \"params\": [\"a\", \"b\"]}",
+    // 6 params, eg. version rolling
+    "{\"id\": 2, \"method\": \"mining.submit\", \"params\": [\"a\", \"1\", \"00000001\", \"57be5b49\", \"00000002\", \"20000000\"]}",
+    // escaped string
+    "{\"id\": 2, \"method\": \"mining.submit\", \"params\": [\"a\\\"b\", \"1\", \"00000001\", \"57be5b49\", \"00000002\"]}",
+    // invalid hex
+    "{\"id\": 2, \"method\": \"mining.submit\", \"params\": [\"a\", \"1\", \"0000000x\", \"57be5b49\", \"00000002\"]}",
+    // too long hex
+    "{\"id\": 2, \"method\": \"mining.submit\", \"params\": [\"a\", \"1\", \"000000001\", \"57be5b49\", \"00000002\"]}",
+    // nested object
+    "{\"id\": {}, \"method\": \"mining.submit\", \"params\": [\"a\", \"1\", \"00000001\", \"57be5b49\", \"00000002\"]}",
+    // truncated
+    "{\"id\": 2, \"method\": \"mining.submit\", \"params\": [\"a\", \"1\", \"00000001\", \"57be5b49\", \"00000002\"]",
+    "{\"id\": 2, \"method\": \"mining.submit\", \"params\": [\"a\", \"1\", \"00000001\", \"57be5b49\", \"00000002\"]} x",
+    "",
+  };
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    Share share;
+    StringRef id;
+    ASSERT_EQ(StratumMessage::parseMiningSubmitFast(lines[i], strlen(lines[i]), &share, &id), false);
+  }
+}
+
 TEST(Server, StratumMessage_getResultBoolean) {
   {
     string line = "{\"error\": null, \"id\": 4, \"result\": true}";
@@ -190,3 +336,1600 @@ TEST(Server, StratumMessage_getId_isStringId) {
     ASSERT_EQ(smsg.isStringId(), true);
   }
 }
+
+TEST(Server, StratumMessage_view) {
+  // parse over a part of the buffer, which isn't null-terminated
+  const string buf = "{\"params\": [\"btccom.kevin\", \"password\"], \"id\": \"x1\", \"method\": \"mining.authorize\"}\n"
+                     "{\"id\": 3, \"method\": \"mining.subscribe\", \"params\": []}\n";
+  const size_t len = buf.find('\n') + 1;
+
+  StratumMessage smsg(buf.data(), len);
+  ASSERT_EQ(smsg.isValid(), true);
+  ASSERT_EQ(smsg.getMethod(), METHOD_MINING_AUTHORIZE);
+  ASSERT_EQ(smsg.getIdJson().toString(), "\"x1\"");
+  ASSERT_EQ(smsg.getId(), "x1");
+
+  string workerName;
+  ASSERT_EQ(smsg.parseMiningAuthorize(workerName), true);
+  ASSERT_EQ(workerName, "btccom.kevin");
+
+  StratumMessage smsg2(buf.data() + len, buf.size() - len);
+  ASSERT_EQ(smsg2.isValid(), true);
+  ASSERT_EQ(smsg2.getMethod(), METHOD_MINING_SUBSCRIBE);
+  ASSERT_EQ(smsg2.getIdJson().toString(), "3");
+
+  // absent "id"
+  const string line = "{\"method\": \"mining.subscribe\", \"params\": []}";
+  StratumMessage smsg3(line);
+  ASSERT_EQ(smsg3.getIdJson().toString(), "null");
+}
+
+TEST(Server, SharedBuffer) {
+  const string notify = "{\"id\":null,\"method\":\"mining.notify\",\"params\":[]}\n";
+  SharedBuffer *buf = SharedBuffer::create(notify);
+
+  struct evbuffer *evbufs[3];
+  for (size_t i = 0; i < 3; i++) {
+    evbufs[i] = evbuffer_new();
+    ASSERT_EQ(buf->addToEvbuffer(evbufs[i]), true);
+  }
+  // the owner releases it, evbuffers still hold references
+  buf->release();
+
+  for (size_t i = 0; i < 3; i++) {
+    string s;
+    s.resize(evbuffer_get_length(evbufs[i]));
+    evbuffer_remove(evbufs[i], (void *)s.data(), s.size());
+    ASSERT_EQ(s, notify);
+    evbuffer_free(evbufs[i]);
+  }
+}
+
+TEST(Server, DuplicateShareFilter) {
+  DuplicateShareFilter filter;
+  ASSERT_EQ(filter.getMemorySize(), 0u);
+
+  Share share;
+  share.jobId_ = 3;
+  for (uint32_t i = 0; i < 1000; i++) {
+    share.nonce_ = i;
+    ASSERT_EQ(filter.insert(DuplicateShareFilter::hashShare(1, share)), true);
+  }
+  ASSERT_EQ(filter.size(), 1000u);
+  ASSERT_EQ(filter.getMemorySize(), 2048 * sizeof(uint64_t));
+
+  // the same, or another job
+  for (uint32_t i = 0; i < 1000; i++) {
+    share.nonce_ = i;
+    ASSERT_EQ(filter.insert(DuplicateShareFilter::hashShare(1, share)), false);
+  }
+  share.nonce_ = 0;
+  ASSERT_EQ(filter.insert(DuplicateShareFilter::hashShare(2, share)), true);
+  share.extraNonce2_ = 1;
+  ASSERT_EQ(filter.insert(DuplicateShareFilter::hashShare(1, share)), true);
+  share.time_ = 1;
+  ASSERT_EQ(filter.insert(DuplicateShareFilter::hashShare(1, share)), true);
+  ASSERT_EQ(filter.size(), 1003u);
+
+  // full, it starts over but keeps the memory
+  for (uint32_t i = 0; i < 30; i++) {
+    share.nonce_ = 5000 + i;
+    filter.insert(DuplicateShareFilter::hashShare(1, share));
+  }
+  ASSERT_LT(filter.size(), 30u);
+  ASSERT_EQ(filter.getMemorySize(), 2048 * sizeof(uint64_t));
+
+  filter.clear();
+  ASSERT_EQ(filter.size(), 0u);
+  share.nonce_ = 0;
+  ASSERT_EQ(filter.insert(DuplicateShareFilter::hashShare(2, share)), true);
+}
+
+TEST(Server, JobTimeRing) {
+  JobTimeRing ring(4);
+  uint32_t time = 0;
+  ASSERT_EQ(ring.find(0, &time), -1);
+
+  for (uint32_t i = 0; i < 6; i++) {
+    ring.add((uint8_t)(i * 10), 1000 + i);
+  }
+  ASSERT_EQ(ring.getLatestJobId(), 50);
+  ASSERT_EQ(ring.getLatestTime(), 1005u);
+  ASSERT_EQ(ring.find(50, &time), 0);
+  ASSERT_EQ(time, 1005u);
+  ASSERT_EQ(ring.find(20, &time), 3);
+  ASSERT_EQ(time, 1002u);
+  ASSERT_EQ(ring.find(10, &time), -1);  // too old
+  ASSERT_EQ(ring.find(1, &time), -1);
+
+  // the id is reused, the older job is gone
+  ring.add(30, 2000);
+  ASSERT_EQ(ring.find(30, &time), 0);
+  ASSERT_EQ(time, 2000u);
+  ASSERT_EQ(ring.find(40, &time), 2);
+  ASSERT_EQ(ring.find(20, &time), -1);
+
+  // the depth is of the new one
+  HandoffWriter w;
+  ring.exportState(w);
+  vector<evutil_socket_t> fds;
+  HandoffReader r(w.getData(), fds);
+  JobTimeRing ring2(2);
+  ASSERT_EQ(ring2.importState(r), true);
+  ASSERT_EQ(ring2.getLatestJobId(), 30);
+  ASSERT_EQ(ring2.find(50, &time), 1);
+  ASSERT_EQ(time, 1005u);
+  ASSERT_EQ(ring2.find(40, &time), -1);
+  ring2.add(7, 3000);
+  ASSERT_EQ(ring2.find(30, &time), 1);
+  ASSERT_EQ(ring2.find(50, &time), -1);
+
+  // at most 256, i.e. all the ids
+  JobTimeRing ring3(1000);
+  ASSERT_EQ(ring3.getDepth(), 256u);
+  for (uint32_t i = 0; i < 256; i++) {
+    ring3.add((uint8_t)i, i);
+  }
+  ASSERT_EQ(ring3.find(0, &time), 255);
+
+  // the templates are of the same depth
+  JobTimeRing ring4(16);
+  ASSERT_EQ(ring4.findTemplate(0) == NULL, true);
+  for (uint32_t i = 0; i < 12; i++) {
+    ring4.add((uint8_t)i, 1000 + i);
+    if (i != 5) {
+      JobTemplate job;
+      job.jobId_ = (uint8_t)i;
+      job.time_  = 1000 + i;
+      ring4.addTemplate(job);
+    }
+  }
+  ASSERT_EQ(ring4.findTemplate(1) != NULL, true);  // 10 jobs ago
+  ASSERT_EQ(ring4.findTemplate(1)->time_, 1001u);
+  ASSERT_EQ(ring4.findTemplate(5) == NULL, true);  // no template
+  ASSERT_EQ(ring4.findTemplate(20) == NULL, true);
+
+  // the jobs before a clean one are stale, for the templates only
+  ring4.add(12, 2000, true);
+  ASSERT_EQ(ring4.findTemplate(11) == NULL, true);
+  ASSERT_EQ(ring4.find(11, &time), 1);
+  ASSERT_EQ(ring4.getCleanSeq(), 13u);
+}
+
+TEST(Server, splitLines) {
+  // each piece is a separate chunk of the evbuffer
+  const char *pieces[] = {
+    "line1\nline2\nli",
+    "ne3\n",
+    "line4\nline",
+    "5\npartial"
+  };
+  struct evbuffer *buf = evbuffer_new();
+  for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+    evbuffer_add_reference(buf, pieces[i], strlen(pieces[i]), NULL, NULL);
+  }
+
+  StringRef lines[8];
+  size_t bytes = 0;
+  ASSERT_EQ(splitLines(buf, lines, 8, &bytes), 5u);
+  ASSERT_EQ(lines[0].toString(), "line1\n");
+  ASSERT_EQ(lines[1].toString(), "line2\n");
+  ASSERT_EQ(lines[2].toString(), "line3\n");
+  ASSERT_EQ(lines[3].toString(), "line4\n");
+  ASSERT_EQ(lines[4].toString(), "line5\n");
+  ASSERT_EQ(bytes, 30u);
+  evbuffer_drain(buf, bytes);
+
+  // only the incomplete one is left
+  ASSERT_EQ(splitLines(buf, lines, 8, &bytes), 0u);
+  ASSERT_EQ(evbuffer_get_length(buf), strlen("partial"));
+
+  // batch size is limited
+  evbuffer_add(buf, "\na\nb\nc\n", 7);
+  ASSERT_EQ(splitLines(buf, lines, 2, &bytes), 2u);
+  ASSERT_EQ(lines[0].toString(), "partial\n");
+  ASSERT_EQ(lines[1].toString(), "a\n");
+  evbuffer_drain(buf, bytes);
+  ASSERT_EQ(splitLines(buf, lines, 8, &bytes), 2u);
+  ASSERT_EQ(lines[0].toString(), "b\n");
+  ASSERT_EQ(lines[1].toString(), "c\n");
+
+  evbuffer_free(buf);
+}
+
+#ifndef _WIN32
+TEST(Server, StratumServer_coalescedFlush) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+
+  // subscribe & authorize: four responses, should be one write
+  uint64_t writes  = server.getDownWriteCount();
+  uint64_t flushes = server.getDownFlushCount();
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  pumpEvents(server.getEventBase(), 50);
+
+  ASSERT_EQ(miner.countLines("\"id\":1"), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":2"), 1u);
+  ASSERT_EQ(miner.countLines("\"method\":\"mining.set_difficulty\""), 1u);
+  ASSERT_EQ(miner.countLines("\"method\":\"mining.notify\""), 1u);
+  ASSERT_EQ(server.getDownWriteCount() - writes, 4u);
+  ASSERT_EQ(server.getDownFlushCount() - flushes, 1u);
+
+  // a batch of submits, one write for all the responses
+  writes  = server.getDownWriteCount();
+  flushes = server.getDownFlushCount();
+  string submits;
+  for (int i = 0; i < 10; i++) {
+    submits += Strings::Format("{\"id\":%d,\"method\":\"mining.submit\",\"params\":"
+                               "[\"a.b\",\"0\",\"00000000\",\"504e86b9\",\"%08x\"]}\n",
+                               100 + i, i);
+  }
+  miner.send(submits);
+  pumpEvents(server.getEventBase(), 50);
+
+  ASSERT_EQ(miner.countLines("\"id\":10"), 10u);
+  ASSERT_EQ(server.getDownWriteCount() - writes, 10u);
+  ASSERT_EQ(server.getDownFlushCount() - flushes, 1u);
+}
+
+TEST(Server, StratumServer_flushDelay) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.downFlushDelayMs_ = 200;
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n");
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(miner.countLines("\"id\":1"), 0u);  // held back
+
+  pumpEvents(server.getEventBase(), 250);
+  ASSERT_EQ(miner.countLines("\"id\":1"), 1u);
+}
+
+//
+// a stand-in resolver, answers any host with ips_ after delayMs_, in the
+// server's event loop
+//
+class SlowResolver : public Resolver {
+  struct Pending {
+    SlowResolver *resolver_;
+    string host_;
+    ResolveCallback cb_;  // NULL if cancelled
+    void *ptr_;
+  };
+  vector<Pending *> pendings_;
+
+  static void timeoutCallback(evutil_socket_t fd, short events, void *ptr) {
+    Pending *p = static_cast<Pending *>(ptr);
+    vector<Pending *> &pendings = p->resolver_->pendings_;
+    pendings.erase(std::find(pendings.begin(), pendings.end(), p));
+
+    if (p->cb_ != NULL) {
+      vector<SockAddr> addrs(p->resolver_->ips_.size());
+      for (size_t i = 0; i < addrs.size(); i++)
+        SockAddr::parse(p->resolver_->ips_[i], 0, &addrs[i]);
+      p->cb_(p->host_, addrs, p->ptr_);
+    }
+    delete p;
+  }
+
+public:
+  StratumServer *server_;
+  int32_t delayMs_;
+  vector<string> ips_;
+
+  SlowResolver(): server_(NULL), delayMs_(0), ips_(1, "127.0.0.1") {}
+  ~SlowResolver() {
+    for (size_t i = 0; i < pendings_.size(); i++)
+      delete pendings_[i];
+  }
+
+  virtual void resolve(const string &host, ResolveCallback cb, void *ptr) {
+    Pending *p = new Pending();
+    p->resolver_ = this;
+    p->host_ = host;
+    p->cb_   = cb;
+    p->ptr_  = ptr;
+    pendings_.push_back(p);
+
+    struct timeval tv = {delayMs_ / 1000, (delayMs_ % 1000) * 1000};
+    event_base_once(server_->getEventBase(), -1, EV_TIMEOUT, timeoutCallback, p, &tv);
+  }
+
+  virtual void cancel(void *ptr) {
+    for (size_t i = 0; i < pendings_.size(); i++) {
+      if (pendings_[i]->ptr_ == ptr)
+        pendings_[i]->cb_ = NULL;
+    }
+  }
+
+  inline size_t getPendingCount() const { return pendings_.size(); }
+};
+
+TEST(Server, StratumServer_asyncResolve) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  SlowResolver resolver;
+  resolver.delayMs_ = 200;
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  resolver.server_ = &server;
+  server.setResolver(&resolver);
+  server.setUpSessionCount(2);
+  server.addUpPool("pool.test", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+  ASSERT_EQ(pool.getConnectionCount(), 2u);
+
+  // one miner on each up session
+  LocalMiner miners[2];
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+    pumpEvents(server.getEventBase(), 20);
+    miners[i].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                   "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+    pumpEvents(server.getEventBase(), 50);
+    ASSERT_EQ(miners[i].countLines("\"id\":2"), 1u);
+  }
+
+  // lost the first up session, the new one waits for a very slow resolver
+  resolver.delayMs_ = 1000;
+  server.removeUpConnection(server.getUpSession(0));
+
+  const int64_t begin = nowMillis();
+  ASSERT_EQ(server.createUpSession(0), true);
+  ASSERT_LT(nowMillis() - begin, 50);
+  ASSERT_EQ(server.isUpSessionPending(0), true);
+  ASSERT_EQ(server.createUpSession(0), false);  // in progress
+  ASSERT_EQ(resolver.getPendingCount(), 1u);
+
+  // the other miner is still served meanwhile
+  miners[1].clear();
+  pool.sendNotifyToAll(false);
+  for (int i = 0; i < 30 && miners[1].countLines("\"method\":\"mining.notify\"") == 0; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(miners[1].countLines("\"method\":\"mining.notify\""), 1u);
+  ASSERT_EQ(server.isUpSessionPending(0), true);
+  ASSERT_LT(nowMillis() - begin, 1000);
+
+  // connected after resolved
+  for (int i = 0; i < 200 && (server.getUpSession(0) == NULL ||
+                              !server.getUpSession(0)->isAvailable()); i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_NE(server.getUpSession(0), (UpStratumClient *)NULL);
+  ASSERT_EQ(server.getUpSession(0)->isAvailable(), true);
+  ASSERT_EQ(server.isUpSessionPending(0), false);
+  ASSERT_GE(nowMillis() - begin, 950);
+}
+
+static int64_t waitUpSession(StratumServer &server, int8_t idx) {
+  const int64_t begin = nowMillis();
+  for (int i = 0; i < 300 && server.getUpSession(idx) == NULL; i++) {
+    pumpEvents(server.getEventBase(), 5);
+  }
+  return nowMillis() - begin;
+}
+
+TEST(Server, StratumServer_connectRace) {
+  // the primary accepts the connections but never replies
+  LocalPool silentPool, pool;
+  ASSERT_EQ(silentPool.start(), true);
+  ASSERT_EQ(pool.start(), true);
+  silentPool.setSilent(true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(2);
+  server.addUpPool("127.0.0.1", silentPool.getPort(), "test");
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.poolProbeIntervalMs_ = 0;  // count the races' connections only
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  // both tried, the backup won, the primary's are closed
+  ASSERT_EQ(silentPool.getAcceptCount(), 2u);
+  for (int8_t i = 0; i < 2; i++) {
+    ASSERT_EQ(server.getUpSession(i)->poolIdx_, 1u);
+  }
+  for (int i = 0; i < 50 && silentPool.getConnectionCount() > 0; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(silentPool.getConnectionCount(), 0u);
+  ASSERT_EQ(pool.getConnectionCount(), 2u);
+
+  // failover in about one stagger, not a timeout
+  server.removeUpConnection(server.getUpSession(0));
+  ASSERT_EQ(server.createUpSession(0), true);
+  ASSERT_LT(waitUpSession(server, 0), 600);
+  ASSERT_EQ(server.getUpSession(0)->poolIdx_, 1u);
+  ASSERT_EQ(silentPool.getAcceptCount(), 3u);
+}
+
+TEST(Server, StratumServer_connectRacePrimary) {
+  LocalPool primary, backup;
+  ASSERT_EQ(primary.start(), true);
+  ASSERT_EQ(backup.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(2);
+  server.addUpPool("127.0.0.1", primary.getPort(), "test");
+  server.addUpPool("127.0.0.1", backup.getPort(), "test");
+
+  AgentConf conf;
+  conf.poolProbeIntervalMs_ = 0;
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  // the primary answers within the stagger, the backup is never tried
+  ASSERT_EQ(server.getUpSession(0)->poolIdx_, 0u);
+  ASSERT_EQ(server.getUpSession(1)->poolIdx_, 0u);
+  ASSERT_EQ(backup.getAcceptCount(), 0u);
+}
+
+TEST(Server, StratumServer_connectRaceRefused) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  // nothing listens on 127.0.0.2, the next address is tried at once
+  SlowResolver resolver;
+  resolver.ips_.insert(resolver.ips_.begin(), "127.0.0.2");
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  resolver.server_ = &server;
+  server.setResolver(&resolver);
+  server.setUpSessionCount(1);
+  server.addUpPool("pool.test", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+  ASSERT_EQ(server.getUpSession(0)->poolAddr_.toString(),
+            Strings::Format("127.0.0.1:%u", (uint32_t)pool.getPort()));
+
+  server.removeUpConnection(server.getUpSession(0));
+  ASSERT_EQ(server.createUpSession(0), true);
+  ASSERT_LT(waitUpSession(server, 0), 200);
+}
+
+TEST(Server, StratumServer_progressiveStartup) {
+  // only the first connection gets the job, the others hang in the handshake
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+  pool.setSilentAfter(1);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(3);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  const int64_t begin = nowMillis();
+  ASSERT_EQ(server.setup(), true);
+  ASSERT_LT(nowMillis() - begin, 500);
+  ASSERT_EQ(server.getUpSession(0)->isAvailable(), true);
+  ASSERT_EQ(server.getUpSession(1) == NULL && server.isUpSessionPending(1), true);
+  ASSERT_EQ(server.getUpSession(2) == NULL && server.isUpSessionPending(2), true);
+
+  // the miner goes to the ready one
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  for (int i = 0; i < 100 && miner.countLines("\"method\":\"mining.notify\"") == 0; i++) {
+    pumpEvents(server.getEventBase(), 5);
+  }
+  ASSERT_EQ(miner.countLines("\"method\":\"mining.notify\""), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":2,\"result\":true"), 1u);
+}
+
+TEST(Server, StratumServer_startupFailure) {
+  // nothing listens there
+  const uint16_t poolPort = getFreePort();
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(2);
+  server.addUpPool("127.0.0.1", poolPort, "test");
+
+  const int64_t begin = nowMillis();
+  ASSERT_EQ(server.setup(), false);
+  ASSERT_LT(nowMillis() - begin, 500);
+}
+
+static int64_t measureHandshake(LocalPool &pool, const AgentConf &conf) {
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setAgentConf(conf);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  const int64_t begin = nowMillis();
+  if (!server.setup())
+    return -1;
+  return nowMillis() - begin;
+}
+
+TEST(Server, StratumServer_pipelinedHandshake) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+  pool.setLatencyMs(100);
+
+  AgentConf conf;
+  conf.poolProbeIntervalMs_ = 0;
+
+  // subscribe, then authorize: two round trips
+  ASSERT_GE(measureHandshake(pool, conf), 200);
+
+  // together, all the results arrive in one read
+  conf.upPipelinedHandshake_ = true;
+  const int64_t pipelined = measureHandshake(pool, conf);
+  ASSERT_GE(pipelined, 100);
+  ASSERT_LT(pipelined, 180);
+
+  // falls back to the normal connect if the kernel can't
+  conf.upPipelinedHandshake_ = false;
+  conf.upTcpFastOpen_ = true;
+  const int64_t fastOpen = measureHandshake(pool, conf);
+  ASSERT_GE(fastOpen, 100);
+  ASSERT_LT(fastOpen, 180);
+}
+
+TEST(Server, StratumServer_heartbeat) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  AgentConf conf;
+  conf.upHeartbeatIntervalMs_ = 100;
+  conf.upDeadTimeoutMs_       = 500;
+  server.setAgentConf(conf);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+
+  UpStratumClient *up = server.getUpSession(0);
+  pumpEvents(server.getEventBase(), 300);
+  ASSERT_EQ(up->isPongSupported_, true);
+  ASSERT_GT(up->heartbeatRtt_.getSrtt(), 0);
+  ASSERT_GE(pool.countExMessages(CMD_PING), 2u);
+
+  // the connection is still there, but the pool hangs
+  pool.setSilent(true);
+  const int64_t begin = nowMillis();
+  for (int i = 0; i < 300 && server.getUpSession(0) == up; i++) {
+    pumpEvents(server.getEventBase(), 5);
+  }
+  const int64_t elapsed = nowMillis() - begin;
+  ASSERT_EQ(server.getUpSession(0) == up, false);
+  ASSERT_GE(elapsed, 400);
+  ASSERT_LT(elapsed, 900);
+
+  // reconnecting at once
+  ASSERT_EQ(server.isUpSessionPending(0), true);
+}
+
+TEST(Server, StratumServer_heartbeatUnsupported) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+  pool.setPongEnabled(false);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  AgentConf conf;
+  conf.upHeartbeatIntervalMs_ = 100;
+  conf.upDeadTimeoutMs_       = 300;
+  server.setAgentConf(conf);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+
+  // it's kept, and the pings stop
+  UpStratumClient *up = server.getUpSession(0);
+  pumpEvents(server.getEventBase(), 800);
+  ASSERT_EQ(server.getUpSession(0) == up, true);
+  ASSERT_EQ(up->isPongSupported_, false);
+  ASSERT_EQ(up->isPingDisabled_, true);
+  ASSERT_EQ(pool.countExMessages(CMD_PING), 1u);
+}
+
+TEST(Server, StratumServer_heartbeatOff) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  // off by default, nothing the pool doesn't ask for
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+
+  waitUpSessionsAvailable(server);
+  pumpEvents(server.getEventBase(), 200);
+  ASSERT_EQ(pool.countExMessages(CMD_PING), 0u);
+  ASSERT_EQ(server.getUpSession(0)->isPongSupported_, false);
+}
+
+static RttEstimator makeRtt(int64_t rttUs, uint32_t samples) {
+  RttEstimator rtt;
+  for (uint32_t i = 0; i < samples; i++)
+    rtt.addSample(rttUs);
+  return rtt;
+}
+
+TEST(Server, StratumServer_selectPreferredPool) {
+  vector<RttEstimator> rtts;
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), -1);
+
+  // none is healthy yet
+  rtts.push_back(makeRtt(20000, 1));
+  rtts.push_back(makeRtt(10000, 1));
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), -1);
+
+  // the backup is much faster
+  rtts[0] = makeRtt(100000, 20);
+  rtts[1] = makeRtt(10000, 20);
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), 1);
+
+  // the primary is a bit slower, keep it
+  rtts[0] = makeRtt(11000, 20);
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), 0);
+
+  // the primary is down
+  rtts[0].addFailure();
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), 1);
+
+  // and it's back, fail back to it
+  rtts[0].addSample(11000);
+  rtts[0].addSample(11000);
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), 0);
+
+  // the third one is the best, the second one is close enough
+  rtts.push_back(makeRtt(1000, 20));
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), 2);
+  rtts[1] = makeRtt(5000, 20);
+  ASSERT_EQ(StratumServer::selectPreferredPool(rtts), 1);
+}
+
+TEST(Server, StratumServer_poolFailback) {
+  // the primary doesn't answer at first, the up sessions go to the backup
+  LocalPool primary, backup;
+  ASSERT_EQ(primary.start(), true);
+  ASSERT_EQ(backup.start(), true);
+  primary.setSilent(true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(2);
+  server.addUpPool("127.0.0.1", primary.getPort(), "test");
+  server.addUpPool("127.0.0.1", backup.getPort(), "test");
+
+  AgentConf conf;
+  conf.poolProbeIntervalMs_ = 100;
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+  ASSERT_EQ(server.getUpSession(0)->poolIdx_, 1u);
+  ASSERT_EQ(server.getUpSession(1)->poolIdx_, 1u);
+
+  pumpEvents(server.getEventBase(), 300);
+  ASSERT_EQ(server.getPoolRtt(0).isHealthy(), false);
+  ASSERT_EQ(server.getPoolRtt(1).isHealthy(), true);
+  ASSERT_EQ(server.getUpSession(0)->poolIdx_, 1u);
+
+  // a miner of each slot
+  LocalMiner miners[2];
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+    pumpEvents(server.getEventBase(), 10);
+    miners[i].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                   "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  }
+  pumpEvents(server.getEventBase(), 50);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(miners[i].countLines("\"id\":2"), 1u);
+    miners[i].clear();
+  }
+
+  // the primary is back, the up sessions move to it one by one. each one
+  // takes over the slot once it's available
+  primary.setSilent(false);
+  int64_t movedMs[2] = {0, 0};
+  uint32_t extraNonce1[2] = {0, 0};
+  for (int i = 0; i < 600 && (movedMs[0] == 0 || movedMs[1] == 0); i++) {
+    pumpEvents(server.getEventBase(), 5);
+    for (int8_t j = 0; j < 2; j++) {
+      UpStratumClient *up = server.getUpSession(j);
+      if (movedMs[j] == 0 && up != NULL && up->poolIdx_ == 0) {
+        ASSERT_EQ(up->isAvailable(), true);
+        movedMs[j] = nowMillis();
+        extraNonce1[j] = up->extraNonce1_;
+      }
+    }
+  }
+  ASSERT_NE(movedMs[0], 0);
+  ASSERT_NE(movedMs[1], 0);
+  ASSERT_GE(llabs(movedMs[0] - movedMs[1]), 50);
+  ASSERT_EQ(server.getPoolRtt(0).isHealthy(), true);
+
+  // the miners got the difficulty and the job of the new pool
+  pumpEvents(server.getEventBase(), 20);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(miners[i].countLines("\"params\":[0]"), 0u);
+    ASSERT_GE(miners[i].countLines("mining.set_difficulty"), 1u);
+    ASSERT_EQ(miners[i].countLines(Strings::Format("5008%08x\"", extraNonce1[0]).c_str()) +
+              miners[i].countLines(Strings::Format("5008%08x\"", extraNonce1[1]).c_str()), 1u);
+  }
+
+  // the backup's up sessions are closed, only the probes are left
+  for (int i = 0; i < 50 && backup.getConnectionCount() > 0; i++) {
+    pumpEvents(server.getEventBase(), 5);
+  }
+  ASSERT_LE(backup.getConnectionCount(), 1u);
+}
+
+TEST(Server, StratumServer_autoScale) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(1);
+  server.setMaxUpSessionCount(4);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.upSessionsAuto_ = true;
+  conf.upSessionMaxMiners_ = 2;
+  conf.upSessionMaxBytesPerSec_ = 0;
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+  ASSERT_EQ(server.getUpSessionCount(), 1);
+
+  const size_t kMiners = 5;
+  LocalMiner miners[kMiners];
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+    pumpEvents(server.getEventBase(), 10);
+  }
+
+  // 5 miners, 2 per up session
+  server.autoScaleUpSessions();
+  ASSERT_EQ(server.getUpSessionCount(), 3);
+  ASSERT_EQ(server.getActiveUpSessionCount(), 3);
+  for (int8_t i = 0; i < 3; i++) {
+    waitUpSession(server, i);
+    ASSERT_NE(server.getUpSession(i), (UpStratumClient *)NULL);
+  }
+  ASSERT_EQ(pool.getConnectionCount(), 3u);
+  ASSERT_EQ(server.findUpSessionIdx(), 1);  // new miners go to the new ones
+
+  // capped by the max
+  conf.upSessionMaxMiners_ = 1;
+  server.setAgentConf(conf);
+  server.autoScaleUpSessions();
+  ASSERT_EQ(server.getUpSessionCount(), 4);
+
+  // the miners are gone, shrink one at a time
+  for (size_t i = 0; i < kMiners; i++) {
+    miners[i].close();
+  }
+  pumpEvents(server.getEventBase(), 50);
+  server.autoScaleUpSessions();
+  ASSERT_EQ(server.getUpSessionCount(), 3);
+  server.autoScaleUpSessions();
+  server.autoScaleUpSessions();
+  server.autoScaleUpSessions();
+  ASSERT_EQ(server.getUpSessionCount(), 1);  // the minimum
+
+  for (int i = 0; i < 50 && pool.getConnectionCount() > 1; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(pool.getConnectionCount(), 1u);
+}
+
+TEST(Server, StratumServer_autoScaleBytes) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(1);
+  server.setMaxUpSessionCount(2);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.upSessionsAuto_ = true;
+  conf.upSessionMaxMiners_ = 0;
+  conf.upSessionMaxBytesPerSec_ = 100;
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  // the bytes sent to the pool are over the target
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(miner.countLines("\"id\":2"), 1u);  // registered to up session 0
+
+  server.autoScaleUpSessions();
+  ASSERT_EQ(server.getUpSessionCount(), 2);
+  waitUpSession(server, 1);
+  ASSERT_NE(server.getUpSession(1), (UpStratumClient *)NULL);
+
+  // goes to the new one
+  LocalMiner miner2;
+  ASSERT_EQ(miner2.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+
+  // the load is down, the last one drains: no new miners, but it's kept
+  // for its miner
+  conf.upSessionMaxBytesPerSec_ = 1000000;
+  server.setAgentConf(conf);
+  server.autoScaleUpSessions();
+  ASSERT_EQ(server.getActiveUpSessionCount(), 1);
+  ASSERT_EQ(server.getUpSessionCount(), 2);
+  ASSERT_NE(server.getUpSession(1), (UpStratumClient *)NULL);
+  ASSERT_EQ(server.findUpSessionIdx(), 0);
+
+  // closed when its miner is gone
+  miner2.close();
+  pumpEvents(server.getEventBase(), 50);
+  server.autoScaleUpSessions();
+  ASSERT_EQ(server.getUpSessionCount(), 1);
+  ASSERT_NE(server.getUpSession(0), (UpStratumClient *)NULL);
+}
+
+TEST(Server, StratumServer_migrateDownSessions) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(3);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  // two miners on each up session
+  const size_t kMiners = 6;
+  LocalMiner miners[kMiners];
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+    pumpEvents(server.getEventBase(), 10);
+    miners[i].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                   "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+    pumpEvents(server.getEventBase(), 20);
+    ASSERT_EQ(miners[i].countLines("\"id\":2"), 1u);
+    miners[i].clear();
+  }
+  ASSERT_EQ(pool.countExMessages(CMD_REGISTER_WORKER), kMiners);
+
+  // the pool drops up session 0
+  const uint32_t extraNonce1[3] = {server.getUpSession(0)->extraNonce1_,
+                                   server.getUpSession(1)->extraNonce1_,
+                                   server.getUpSession(2)->extraNonce1_};
+  pool.closeConnection(extraNonce1[0]);
+  for (int i = 0; i < 100 && server.getUpSession(0) != NULL; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(server.getUpSession(0), (UpStratumClient *)NULL);
+  pumpEvents(server.getEventBase(), 50);
+
+  // its miners are registered again, restart with the new extraNonce1
+  ASSERT_EQ(pool.countExMessages(CMD_REGISTER_WORKER), kMiners + 2);
+  ASSERT_EQ(pool.countExMessages(CMD_UNREGISTER_WORKER), 0u);
+
+  size_t moved = 0;
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].countLines("\"method\":\"mining.notify\""),
+              miners[i].countLines("mining.set_difficulty"));
+    if (miners[i].countLines("\"method\":\"mining.notify\"") == 0)
+      continue;
+
+    moved++;
+    ASSERT_EQ(miners[i].countLines("true]"), 1u);  // clean_jobs
+    // at the end of coinb1
+    ASSERT_EQ(miners[i].countLines(Strings::Format("5008%08x\"", extraNonce1[1]).c_str()) +
+              miners[i].countLines(Strings::Format("5008%08x\"", extraNonce1[2]).c_str()), 1u);
+  }
+  ASSERT_EQ(moved, 2u);
+
+  // none is disconnected, all of them go on submitting
+  for (size_t i = 0; i < kMiners; i++) {
+    miners[i].send("{\"params\":[\"a.b\",\"1\",\"00000000\",\"5f0d8a1c\",\"12345678\"],"
+                   "\"id\":3,\"method\":\"mining.submit\"}\n");
+  }
+  pumpEvents(server.getEventBase(), 50);
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].countLines("\"id\":3,\"result\":true"), 1u);
+    ASSERT_EQ(miners[i].isClosedByPeer(), false);
+  }
+  for (int i = 0; i < 20 && pool.countExMessages(CMD_SUBMIT_SHARE) +
+                            pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME) < kMiners; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(pool.countExMessages(CMD_SUBMIT_SHARE) +
+            pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME), kMiners);
+}
+
+TEST(Server, StratumServer_handoff) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer *oldServer = new StratumServer("127.0.0.1", port);
+  oldServer->setUpSessionCount(2);
+  oldServer->addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(oldServer->setup(), true);
+  waitUpSessionsAvailable(*oldServer);
+
+  const size_t kMiners = 4;
+  LocalMiner miners[kMiners];
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+    pumpEvents(oldServer->getEventBase(), 10);
+    miners[i].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                   "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+    pumpEvents(oldServer->getEventBase(), 20);
+    ASSERT_EQ(miners[i].countLines("\"id\":2"), 1u);
+    miners[i].clear();
+  }
+  const uint32_t extraNonce1[2] = {oldServer->getUpSession(0)->extraNonce1_,
+                                   oldServer->getUpSession(1)->extraNonce1_};
+
+  // half of a submit is read by the old one
+  const string submit = "{\"params\":[\"a.b\",\"1\",\"00000000\",\"5f0d8a1c\",\"12345678\"],"
+                        "\"id\":3,\"method\":\"mining.submit\"}\n";
+  miners[0].send(submit.substr(0, 20));
+  pumpEvents(oldServer->getEventBase(), 20);
+
+  // the snapshot goes through SCM_RIGHTS, then the old one is gone
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  {
+    HandoffWriter w;
+    oldServer->exportState(w);
+    ASSERT_EQ(sendHandoff(sv[0], w.getData(), w.getFds()), true);
+  }
+  delete oldServer;
+
+  string data;
+  vector<evutil_socket_t> fds;
+  ASSERT_EQ(recvHandoff(sv[1], &data, &fds), true);
+  close(sv[0]);
+  close(sv[1]);
+
+  StratumServer server("127.0.0.1", port);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+  {
+    HandoffReader r(data, fds);
+    ASSERT_EQ(server.setupFromHandoff(r), true);
+    ASSERT_EQ(r.isEnd(), true);
+  }
+  ASSERT_EQ(server.getUpSessionCount(), 2);
+  ASSERT_EQ(server.getUpSession(0)->extraNonce1_, extraNonce1[0]);
+  ASSERT_EQ(server.getUpSession(1)->extraNonce1_, extraNonce1[1]);
+  ASSERT_EQ(server.getUpSession(0)->isAvailable(), true);
+
+  // the rest of the line
+  miners[0].send(submit.substr(20));
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(miners[0].countLines("\"id\":3,\"result\":true"), 1u);
+
+  // the jobs go on without resubscribing
+  pool.sendNotifyToAll(false);
+  for (int i = 0; i < 20 && miners[kMiners - 1].countLines("\"method\":\"mining.notify\"") == 0; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  for (size_t i = 1; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].countLines("\"method\":\"mining.notify\""), 1u);
+    ASSERT_EQ(miners[i].countLines("mining.set_difficulty"), 0u);
+    miners[i].send(submit);
+  }
+  pumpEvents(server.getEventBase(), 50);
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].countLines("\"id\":3,\"result\":true"), 1u);
+    ASSERT_EQ(miners[i].isClosedByPeer(), false);
+  }
+  for (int i = 0; i < 20 && pool.countExMessages(CMD_SUBMIT_SHARE) +
+                            pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME) < kMiners; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(pool.countExMessages(CMD_SUBMIT_SHARE) +
+            pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME), kMiners);
+
+  // the pool saw nothing
+  ASSERT_EQ(pool.getAcceptCount(), 2u);
+  ASSERT_EQ(pool.getConnectionCount(), 2u);
+  ASSERT_EQ(pool.countExMessages(CMD_REGISTER_WORKER), kMiners);
+  ASSERT_EQ(pool.countExMessages(CMD_UNREGISTER_WORKER), 0u);
+
+  // the listener is taken over, the new ids don't collide
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  pumpEvents(server.getEventBase(), 10);
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.c\",\"\"]}\n");
+  pumpEvents(server.getEventBase(), 20);
+  ASSERT_EQ(miner.countLines("\"id\":2,\"result\":true"), 1u);
+  ASSERT_EQ(miner.countLines("\"method\":\"mining.notify\""), 1u);
+  ASSERT_EQ(pool.countExMessages(CMD_REGISTER_WORKER), kMiners + 1);
+}
+
+TEST(Server, StratumServer_admissionRate) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.acceptRatePerSec_ = 10;  // burst 10 as well
+  conf.registerRatePerSec_ = 10;
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  // the first 10 at once, the others wait in the backlog
+  const size_t kMiners = 13;
+  LocalMiner miners[kMiners];
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+  }
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(server.getStats().downSessionCount_, 10u);
+  ASSERT_EQ(server.getHandshakingCount(), 10);
+
+  // about one per 100 ms
+  const int64_t begin = nowMillis();
+  for (int i = 0; i < 100 && server.getStats().downSessionCount_ < kMiners; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(server.getStats().downSessionCount_, kMiners);
+  ASSERT_GE(nowMillis() - begin, 200);
+
+  // the registers are paced too, the job is sent after the register
+  for (size_t i = 0; i < 12; i++) {
+    miners[i].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                   "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  }
+  pumpEvents(server.getEventBase(), 20);
+  size_t mining = 0;
+  for (size_t i = 0; i < 12; i++) {
+    ASSERT_EQ(miners[i].countLines("\"id\":2"), 1u);
+    mining += miners[i].countLines("\"method\":\"mining.notify\"");
+  }
+  ASSERT_EQ(mining, 10u);
+  ASSERT_EQ(server.getHandshakingCount(), (int32_t)kMiners - 10);
+
+  for (int i = 0; i < 50 && pool.countExMessages(CMD_REGISTER_WORKER) < 12; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  ASSERT_EQ(pool.countExMessages(CMD_REGISTER_WORKER), 12u);
+  for (size_t i = 0; i < 12; i++) {
+    ASSERT_EQ(miners[i].countLines("\"method\":\"mining.notify\""), 1u);
+  }
+  ASSERT_EQ(server.getHandshakingCount(), (int32_t)kMiners - 12);
+}
+
+TEST(Server, StratumServer_admissionHandshakes) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.maxHandshakingSessions_ = 2;
+  conf.acceptOverflowReconnect_ = true;
+  conf.reconnectMaxWaitSec_ = 5;
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  LocalMiner miners[3];
+  for (size_t i = 0; i < 3; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+    pumpEvents(server.getEventBase(), 20);
+  }
+  ASSERT_EQ(server.getStats().downSessionCount_, 2u);
+
+  // the third one is told to come back later, and closed
+  ASSERT_EQ(server.getReconnectCount(), 1u);
+  ASSERT_EQ(miners[2].countLines(Strings::Format("\"client.reconnect\",\"params\":"
+                                                 "[\"127.0.0.1\",%u,", (uint32_t)port).c_str()), 1u);
+  const string &r = miners[2].recv();
+  const int wait = atoi(r.c_str() + r.rfind(',') + 1);
+  ASSERT_GE(wait, 1);
+  ASSERT_LE(wait, 5);
+  ASSERT_EQ(miners[2].isClosedByPeer(), true);
+
+  // a slot is free once the first one is mining
+  miners[0].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                 "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  pumpEvents(server.getEventBase(), 20);
+  ASSERT_EQ(server.getHandshakingCount(), 1);
+
+  LocalMiner again;
+  ASSERT_EQ(again.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+  ASSERT_EQ(server.getStats().downSessionCount_, 3u);
+  ASSERT_EQ(server.getReconnectCount(), 1u);
+}
+
+static bool sendGroupSnapshot(StratumServer *oldServer, const uint32_t version,
+                              const size_t cut, StratumServerGroup &group) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    return false;
+  {
+    HandoffWriter w;
+    w.putUint32(HANDOFF_MAGIC);
+    w.putUint32(version);
+    w.putUint32(1);
+    oldServer->exportState(w);
+    const string &data = w.getData();
+    sendHandoff(sv[0], data.substr(0, data.size() - cut), w.getFds());
+  }
+  close(sv[0]);
+  const bool res = group.setupFromHandoff(sv[1]);
+  close(sv[1]);
+  return res;
+}
+
+TEST(Server, StratumServerGroup_handoffFallback) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer *oldServer = new StratumServer("127.0.0.1", port);
+  oldServer->setUpSessionCount(2);
+  oldServer->addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(oldServer->setup(), true);
+  waitUpSessionsAvailable(*oldServer);
+
+  AgentConf conf;
+  conf.threads_ = 1;
+  StratumServerGroup group("127.0.0.1", port, conf);
+  group.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  // a snapshot of another version is refused at once
+  ASSERT_EQ(sendGroupSnapshot(oldServer, HANDOFF_VERSION + 1, 0, group), false);
+  ASSERT_EQ(group.getServerCount(), 0u);
+
+  // a broken one leaves nothing behind, not even the taken listener
+  ASSERT_EQ(sendGroupSnapshot(oldServer, HANDOFF_VERSION, 3, group), false);
+  ASSERT_EQ(group.getServerCount(), 0u);
+  delete oldServer;
+
+  // so it could start from scratch on the same port
+  ASSERT_EQ(group.setup(), true);
+  ASSERT_EQ(group.getServerCount(), 1u);
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+}
+
+#if defined(SO_REUSEPORT)
+static void *runServerGroup(void *ptr) {
+  static_cast<StratumServerGroup *>(ptr)->run();
+  return NULL;
+}
+
+TEST(Server, StratumServerGroup_threads) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  AgentConf conf;
+  conf.threads_ = 2;
+  const uint16_t port = getFreePort();
+  StratumServerGroup group("127.0.0.1", port, conf);
+  group.addUpPool("127.0.0.1", pool.getPort(), "test");
+  ASSERT_EQ(group.setup(), true);
+  ASSERT_EQ(group.getServerCount(), 2u);
+  // 5 up sessions in total, 3 + 2, the others are still connecting
+  for (int i = 0; i < 100 && pool.getConnectionCount() < 5u; i++) {
+    usleep(10 * 1000);
+  }
+  usleep(50 * 1000);
+  ASSERT_EQ(pool.getConnectionCount(), 5u);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, runServerGroup, &group);
+
+  // the kernel balances the connections between the listeners
+  const size_t kMiners = 16;
+  LocalMiner miners[kMiners];
+  for (size_t i = 0; i < kMiners; i++) {
+    ASSERT_EQ(miners[i].connect(port), true);
+    miners[i].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n");
+  }
+
+  // the session id (extraNonce1) tells which thread serves it
+  size_t perThread[2] = {0, 0};
+  for (size_t i = 0; i < kMiners; i++) {
+    for (int n = 0; n < 100 && miners[i].countLines("\"id\":1") == 0; n++) {
+      usleep(10 * 1000);
+    }
+    const string &r = miners[i].recv();
+    const size_t pos = r.find("]],\"");
+    ASSERT_NE(pos, string::npos);
+    const uint32_t sessionId = strtoul(r.substr(pos + 4, 8).c_str(), NULL, 16);
+    perThread[sessionId < (AGENT_MAX_SESSION_ID + 1) / 2 ? 0 : 1]++;
+  }
+  ASSERT_EQ(perThread[0] + perThread[1], kMiners);
+  ASSERT_GT(perThread[0], 0u);
+  ASSERT_GT(perThread[1], 0u);
+
+  group.stop();
+  pthread_join(thread, NULL);
+}
+#endif
+
+static size_t waitExMessages(LocalPool &pool, StratumServer &server,
+                             uint8_t cmd, size_t count) {
+  // the pool runs in another thread, give it some time
+  for (int i = 0; i < 50 && pool.countExMessages(cmd) < count; i++) {
+    pumpEvents(server.getEventBase(), 10);
+  }
+  return pool.countExMessages(cmd);
+}
+
+TEST(Server, StratumServer_shareBatching) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.upShareBatchDelayMs_ = 300;
+  conf.upShareBatchBytes_   = 19 * 8;  // 8 shares with nTime
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(waitExMessages(pool, server, CMD_REGISTER_WORKER, 1), 1u);
+
+  // 3 shares, held back until the deadline
+  string submits;
+  for (int i = 0; i < 3; i++) {
+    submits += Strings::Format("{\"id\":%d,\"method\":\"mining.submit\",\"params\":"
+                               "[\"a.b\",\"0\",\"00000000\",\"504e86b9\",\"%08x\"]}\n",
+                               100 + i, i);
+  }
+  miner.send(submits);
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME), 0u);
+  ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE_WITH_TIME, 3), 3u);
+
+  // reach the byte threshold, flushed at once
+  submits.clear();
+  for (int i = 0; i < 8; i++) {
+    submits += Strings::Format("{\"id\":%d,\"method\":\"mining.submit\",\"params\":"
+                               "[\"a.b\",\"0\",\"00000000\",\"504e86b9\",\"%08x\"]}\n",
+                               200 + i, i);
+  }
+  miner.send(submits);
+  pumpEvents(server.getEventBase(), 20);
+  ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE_WITH_TIME, 11), 11u);
+
+  // only the miner's up session has batches
+  uint64_t batches = 0, maxSize = 0, maxLatency = 0;
+  for (int8_t i = 0; i < 5; i++) {
+    const UpStratumClient *up = server.getUpSession(i);
+    if (up->shareBatchSizeHist_.count() == 0)
+      continue;
+    batches    = up->shareBatchSizeHist_.count();
+    maxSize    = up->shareBatchSizeHist_.max();
+    maxLatency = up->shareBatchLatencyHist_.max();
+  }
+  ASSERT_EQ(batches, 2u);
+  ASSERT_EQ(maxSize, 8u);
+  ASSERT_GE(maxLatency, 250000u);  // the first batch waited for the deadline
+}
+
+static string makeSubmit(int id, uint32_t jobId, uint32_t nTime) {
+  return Strings::Format("{\"id\":%d,\"method\":\"mining.submit\",\"params\":"
+                         "[\"a.b\",\"%u\",\"00000000\",\"%08x\",\"00000001\"]}\n",
+                         id, jobId, nTime);
+}
+
+TEST(Server, StratumServer_jobHistory) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.upShareBatchDelayMs_ = 0;
+  server.setAgentConf(conf);
+  server.setUpSessionCount(1);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(waitExMessages(pool, server, CMD_REGISTER_WORKER, 1), 1u);
+
+  UpStratumClient *up = server.getUpSession(0);
+  const uint8_t  jobId   = up->jobTimes_.getLatestJobId();
+  const uint32_t jobTime = up->jobTimes_.getLatestTime();
+
+  // 5 jobs later, it's still known
+  for (int i = 0; i < 5; i++) {
+    pool.sendNotifyToAll(false);
+  }
+  for (int i = 0; i < 20 && up->jobTimes_.getLatestJobId() != (jobId + 5) % 10; i++) {
+    pumpEvents(server.getEventBase(), 20);
+  }
+  ASSERT_EQ(up->jobTimes_.getLatestJobId(), (jobId + 5) % 10);
+
+  miner.send(makeSubmit(10, jobId, jobTime) + makeSubmit(11, jobId, jobTime + 1));
+  ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE, 1), 1u);
+  ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE_WITH_TIME, 1), 1u);
+
+  const ServerStats stats = server.getStats();
+  ASSERT_EQ(stats.shareCount_, 2u);
+  ASSERT_EQ(stats.shareNoTimeCount_, 1u);
+  ASSERT_EQ(stats.shareBytesSaved_, 4u);
+}
+
+TEST(Server, StratumServer_subscribeError) {
+  // the primary answers an error, the agent goes on with the backup
+  LocalPool primary, backup;
+  ASSERT_EQ(primary.start(), true);
+  ASSERT_EQ(backup.start(), true);
+  primary.setSubscribeError(true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.setUpSessionCount(1);
+  server.addUpPool("127.0.0.1", primary.getPort(), "test");
+  server.addUpPool("127.0.0.1", backup.getPort(), "test");
+
+  AgentConf conf;
+  conf.upSharesBatch_ = true;  // the configure error comes first
+  server.setAgentConf(conf);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  ASSERT_EQ(server.getUpSession(0)->poolIdx_, 1u);
+  ASSERT_GE(primary.getAcceptCount(), 1u);
+  for (int i = 0; i < 50 && primary.getConnectionCount() > 0; i++) {
+    pumpEvents(server.getEventBase(), 5);
+  }
+  ASSERT_EQ(primary.getConnectionCount(), 0u);
+}
+
+TEST(Server, StratumServer_sharesBatch) {
+  for (int enabled = 0; enabled < 2; enabled++) {
+    LocalPool pool;
+    pool.setSharesBatchEnabled(enabled != 0);
+    ASSERT_EQ(pool.start(), true);
+
+    const uint16_t port = getFreePort();
+    StratumServer server("127.0.0.1", port);
+    server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+    AgentConf conf;
+    conf.upSharesBatch_       = true;
+    conf.upShareBatchDelayMs_ = 100;
+    server.setAgentConf(conf);
+    server.setUpSessionCount(1);
+    ASSERT_EQ(server.setup(), true);
+    waitUpSessionsAvailable(server);
+    UpStratumClient *up = server.getUpSession(0);
+    ASSERT_EQ(up->isSharesBatchSupported_, enabled != 0);
+    ASSERT_EQ(up->isConfigurePending_, false);
+
+    // a later reply of id 3 is not the result of mining.configure
+    struct evbuffer *stray = evbuffer_new();
+    evbuffer_add_printf(stray, "{\"id\":3,\"result\":{\"" EX_SHARES_BATCH_EXTENSION
+                        "\":%s},\"error\":null}\n", enabled != 0 ? "false" : "true");
+    up->recvData(stray);
+    evbuffer_free(stray);
+    ASSERT_EQ(up->isSharesBatchSupported_, enabled != 0);
+
+    LocalMiner miners[2];
+    for (int i = 0; i < 2; i++) {
+      ASSERT_EQ(miners[i].connect(port), true);
+      pumpEvents(server.getEventBase(), 20);
+      miners[i].send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                     "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+    }
+    pumpEvents(server.getEventBase(), 50);
+    ASSERT_EQ(waitExMessages(pool, server, CMD_REGISTER_WORKER, 2), 2u);
+
+    // the nTime of the job and after it, and a share of an unknown job
+    const uint8_t  jobId   = up->jobTimes_.getLatestJobId();
+    const uint32_t jobTime = up->jobTimes_.getLatestTime();
+    for (int i = 1; i >= 0; i--) {
+      miners[i].send(Strings::Format("{\"id\":10,\"method\":\"mining.submit\",\"params\":"
+                                     "[\"a.b\",\"%u\",\"%08x\",\"%08x\",\"00000001\"]}\n"
+                                     "{\"id\":11,\"method\":\"mining.submit\",\"params\":"
+                                     "[\"a.b\",\"%u\",\"%08x\",\"%08x\",\"00000002\"]}\n",
+                                     jobId, i, jobTime, jobId, i, jobTime + 5));
+    }
+    // one of an unknown job in between, then a batched one again
+    miners[0].send(makeSubmit(12, 200, jobTime));
+    miners[0].send(Strings::Format("{\"id\":13,\"method\":\"mining.submit\",\"params\":"
+                                   "[\"a.b\",\"%u\",\"00000000\",\"%08x\",\"00000003\"]}\n",
+                                   jobId, jobTime));
+    pumpEvents(server.getEventBase(), 20);
+
+    if (enabled) {
+      ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARES_BATCH, 2), 2u);
+      ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE_WITH_TIME, 1), 1u);
+      ASSERT_EQ(pool.countExMessages(CMD_SUBMIT_SHARE), 0u);
+      ASSERT_EQ(pool.getBadBatchCount(), 0u);
+
+      // the frames are in the order of the shares
+      string order;
+      const vector<string> exMessages = pool.getExMessages();
+      for (size_t i = 0; i < exMessages.size(); i++) {
+        if (exMessages[i][1] == (char)CMD_SUBMIT_SHARES_BATCH)
+          order += "b";
+        else if (exMessages[i][1] == (char)CMD_SUBMIT_SHARE_WITH_TIME)
+          order += "t";
+      }
+      ASSERT_EQ(order, "btb");
+
+      // by the session id, the order of each miner is kept
+      const vector<ExBatchedShare> shares = pool.getBatchedShares();
+      ASSERT_EQ(shares.size(), 5u);
+      ASSERT_EQ(shares[4].nonce_, 3u);
+      for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(shares[i].jobId_, jobId);
+        ASSERT_EQ(shares[i].extraNonce2_, (uint32_t)(i / 2));
+        ASSERT_EQ(shares[i].nonce_, (uint32_t)(i % 2 + 1));
+        ASSERT_EQ(shares[i].timeOffset_, (int32_t)(i % 2 * 5));
+      }
+      ASSERT_LT(shares[0].sessionId_, shares[2].sessionId_);
+      ASSERT_EQ(shares[0].sessionId_, shares[1].sessionId_);
+    } else {
+      ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE, 3), 3u);
+      ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE_WITH_TIME, 3), 3u);
+      ASSERT_EQ(pool.countExMessages(CMD_SUBMIT_SHARES_BATCH), 0u);
+    }
+
+    // what the agent sent is what the pool got
+    const ServerStats stats = server.getStats();
+    ASSERT_EQ(stats.shareCount_, 6u);
+    ASSERT_EQ(stats.shareBytes_, pool.getShareBytes());
+  }
+}
+
+TEST(Server, StratumServer_shareValidation) {
+  LocalPool pool;
+  ASSERT_EQ(pool.start(), true);
+
+  const uint16_t port = getFreePort();
+  StratumServer server("127.0.0.1", port);
+  server.addUpPool("127.0.0.1", pool.getPort(), "test");
+
+  AgentConf conf;
+  conf.shareValidation_ = true;
+  server.setAgentConf(conf);
+  server.setUpSessionCount(1);
+  ASSERT_EQ(server.setup(), true);
+  waitUpSessionsAvailable(server);
+
+  LocalMiner miner;
+  ASSERT_EQ(miner.connect(port), true);
+  pumpEvents(server.getEventBase(), 20);
+  miner.send("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+             "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"a.b\",\"\"]}\n");
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(waitExMessages(pool, server, CMD_REGISTER_WORKER, 1), 1u);
+
+  UpStratumClient *up = server.getUpSession(0);
+  const uint8_t  jobId   = up->jobTimes_.getLatestJobId();
+  const uint32_t jobTime = up->jobTimes_.getLatestTime();
+  const uint32_t otherJobId = (jobId + 5) % 10;
+
+  // a random share of the job is far below the difficulty 1024, the others
+  // are out of the job window or the nTime window
+  miner.send(makeSubmit(10, jobId, jobTime) +
+             makeSubmit(11, otherJobId, jobTime) +
+             makeSubmit(12, jobId, jobTime - 3600) +
+             makeSubmit(13, jobId, jobTime + 3600) +
+             makeSubmit(14, jobId, jobTime + 60));
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(miner.countLines("\"id\":10,\"result\":null,\"error\":[23,"), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":11,\"result\":null,\"error\":[21,"), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":12,\"result\":null,\"error\":[31,"), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":13,\"result\":null,\"error\":[32,"), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":14,\"result\":null,\"error\":[23,"), 1u);
+
+  // not a clean job, the old one is still there, and so is its share
+  pool.sendNotifyToAll(false);
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_NE(up->jobTimes_.getLatestJobId(), jobId);
+  miner.send(makeSubmit(20, jobId, jobTime));
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(miner.countLines("\"id\":20,\"result\":null,\"error\":[22,"), 1u);
+
+  // a clean job, the old ones are stale
+  pool.sendNotifyToAll(true);
+  pumpEvents(server.getEventBase(), 50);
+  miner.send(makeSubmit(21, jobId, jobTime));
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(miner.countLines("\"id\":21,\"result\":null,\"error\":[21,"), 1u);
+
+  // the duplicates of the new job
+  const uint8_t newJobId = up->jobTimes_.getLatestJobId();
+  miner.send(makeSubmit(22, newJobId, jobTime) + makeSubmit(23, newJobId, jobTime));
+  pumpEvents(server.getEventBase(), 50);
+  ASSERT_EQ(miner.countLines("\"id\":22,\"result\":null,\"error\":[23,"), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":23,\"result\":null,\"error\":[22,"), 1u);
+
+  // nothing is sent to the pool
+  ASSERT_EQ(pool.countExMessages(CMD_SUBMIT_SHARE), 0u);
+  ASSERT_EQ(pool.countExMessages(CMD_SUBMIT_SHARE_WITH_TIME), 0u);
+
+  // the jobs before a hot upgrade are unknown, it's left to the pool
+  up->isJobWindowComplete_ = false;
+  miner.send(makeSubmit(30, jobId, jobTime));
+  ASSERT_EQ(waitExMessages(pool, server, CMD_SUBMIT_SHARE, 1), 1u);
+  ASSERT_EQ(miner.countLines("\"id\":30,\"result\":true"), 1u);
+
+  const ShareRejects rejects = server.getStats().shareRejects_;
+  ASSERT_EQ(rejects.jobNotFound_,   2u);
+  ASSERT_EQ(rejects.timeTooOld_,    1u);
+  ASSERT_EQ(rejects.timeTooNew_,    1u);
+  ASSERT_EQ(rejects.duplicate_,     2u);
+  ASSERT_EQ(rejects.lowDifficulty_, 3u);
+}
+#endif
@@ -0,0 +1,204 @@
+/*
+ Mining Pool Agent
+
+ Copyright (C) 2016  BTC.COM
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gtest/gtest.h"
+#include "Utils.h"
+#include "Sha256.h"
+#include "Server.h"
+
+#include <stdlib.h>
+
+static string toHex(const uint8_t *p, size_t len) {
+  string s;
+  for (size_t i = 0; i < len; i++) {
+    s.append(Strings::Format("%02x", p[i]));
+  }
+  return s;
+}
+
+// the display order of bitcoin, i.e. reversed
+static string toHexReversed(const uint8_t hash[32]) {
+  uint8_t r[32];
+  for (int i = 0; i < 32; i++) {
+    r[i] = hash[31 - i];
+  }
+  return toHex(r, 32);
+}
+
+static string sha256Hex(const string &data) {
+  uint8_t hash[32];
+  Sha256 h;
+  h.update(data);
+  h.final(hash);
+  return toHex(hash, 32);
+}
+
+TEST(Sha256, Vectors) {
+  ASSERT_EQ(sha256Hex(""),
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  ASSERT_EQ(sha256Hex("abc"),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  ASSERT_EQ(sha256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+  // in pieces which cross the blocks
+  const string a(1000000, 'a');
+  uint8_t hash[32];
+  Sha256 h;
+  for (size_t i = 0; i < a.size(); i += 37) {
+    h.update((const uint8_t *)a.data() + i, std::min((size_t)37, a.size() - i));
+  }
+  h.final(hash);
+  ASSERT_EQ(toHex(hash, 32),
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST(Sha256, Impls) {
+  const Sha256Impl impl = getSha256Impl();
+
+  // the same as the generic one, all the lengths around the padding
+  string data;
+  for (size_t i = 0; i < 300; i++) {
+    data.push_back((char)(rand() & 0xFF));
+  }
+  for (size_t len = 0; len <= data.size(); len++) {
+    ASSERT_EQ(setSha256Impl(SHA256_GENERIC), true);
+    const string expected = sha256Hex(data.substr(0, len));
+    if (setSha256Impl(SHA256_NI)) {
+      ASSERT_EQ(sha256Hex(data.substr(0, len)), expected);
+    }
+  }
+  setSha256Impl(impl);
+}
+
+TEST(Sha256, Midstate) {
+  const string prefix(100, 'x');
+  Sha256 head;
+  head.update(prefix);
+
+  for (int i = 0; i < 3; i++) {
+    const string tail(i * 30, 'y');
+    Sha256 h = head;
+    h.update(tail);
+    uint8_t hash[32];
+    h.final(hash);
+    ASSERT_EQ(toHex(hash, 32), sha256Hex(prefix + tail));
+  }
+
+  uint8_t hash[32];
+  sha256d((const uint8_t *)"abc", 3, hash);
+  ASSERT_EQ(toHex(hash, 32),
+            "4f8b42c22dd3729b519ba6f68d2da7cc5b2d606d05daed5ad5128cc03e6c6358");
+}
+
+TEST(JobTemplate, Genesis) {
+  //
+  // the coinbase of the genesis block, the extraNonce1 of the up session and
+  // the session id are the zeros of its prevout hash, the extraNonce2 is the
+  // prevout index.
+  //
+  StratumJob sjob;
+  sjob.jobId_     = 5;
+  sjob.prevHash_  = string(64, '0');
+  sjob.coinbase1_ = "0100000001000000000000000000000000000000000000000000000000";
+  sjob.coinbase2_ = "4d04ffff001d0104455468652054696d65732030332f4a616e2f32303039204368616e63656c6c6f72206f6e206272696e6b206f66207365636f6e64206261696c6f757420666f722062616e6b73ffffffff0100f2052a01000000434104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac00000000";
+  sjob.version_   = 1;
+  sjob.nBits_     = 0x1d00ffffu;
+
+  JobTemplate job;
+  ASSERT_EQ(job.init(sjob, 0u), true);
+  ASSERT_EQ(job.jobId_, 5);
+
+  Share share;
+  share.jobId_       = 5;
+  share.extraNonce2_ = 0xffffffffu;
+  share.time_        = 0x495fab29u;
+  share.nonce_       = 0x7c2bac1du;
+
+  uint8_t hash[32];
+  job.getHeaderHash(0, share, hash);
+  ASSERT_EQ(toHexReversed(hash),
+            "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
+
+  // its difficulty is 2536.4
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 1),    true);
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 2536), true);
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 2537), false);
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 0xFFFFFFFFFFFFFFFFull), false);
+
+  share.nonce_++;
+  job.getHeaderHash(0, share, hash);
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 1), false);
+
+  // not hex
+  sjob.coinbase2_ += "z";
+  ASSERT_EQ(job.init(sjob, 0u), false);
+}
+
+TEST(JobTemplate, MerkleBranches) {
+  StratumJob sjob;
+  sjob.prevHash_  = "0372555fd235f11829fb388c22e44cb637f01210c3707a90b405420fb169779e";
+  sjob.coinbase1_ = "38b4e652e44da7f2370d9e260e27136550a4a3a6d07f5c0c332f8b1224083fd22b902f8911e81818f8c99d5d5d9831957504d90e945de2e8f54ee781";
+  sjob.coinbase2_ = "cc75f636d85099095aa300165a67036f9b540d6b8f0be21124179c3dd9f73817ce6e118d264aad6cb6dd210faf94acd3cf92c190237cb11f5d108cf25930263938b370a1b5769fa0f1483f95a90d9df2f130d60fcf04bd93e695";
+  sjob.merkleBranches_.push_back("14da8c659ce2b10cccdaebf990d19838b0d7ec0b3e97818ecb96c4dbadbe1722");
+  sjob.merkleBranches_.push_back("96d5234a42b24c6ba4e6ed24ec636a8ac0a1271e5866279238aaf84e58056d8f");
+  sjob.merkleBranches_.push_back("2fa8edd094ba97ae8b15442ee2db611a91bfe39469733a9247d58fa3c5501830");
+  sjob.version_   = 0x20000000;
+  sjob.nBits_     = 0x1a0ffff0u;
+
+  JobTemplate job;
+  ASSERT_EQ(job.init(sjob, 0x12345678u), true);
+
+  Share share;
+  share.extraNonce2_ = 0xdeadbeefu;
+  share.time_        = 0x5a0b0c0du;
+  share.nonce_       = 0x01020304u;
+
+  uint8_t hash[32];
+  job.getHeaderHash(0x0102, share, hash);
+  ASSERT_EQ(toHex(hash, 32),
+            "9d06715ea5c66efd03396a13752c561c64b060785758abe0f22fea70006d1747");
+
+  // a branch isn't 32 bytes
+  sjob.merkleBranches_.push_back("00");
+  ASSERT_EQ(job.init(sjob, 0x12345678u), false);
+}
+
+TEST(JobTemplate, isHashBelowTarget) {
+  // the target of difficulty 1: 0xFFFF * 2^208
+  uint8_t hash[32];
+  memset(hash, 0, sizeof(hash));
+  hash[26] = 0xFF;
+  hash[27] = 0xFF;
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 1), true);
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 2), false);
+  hash[0] = 1;
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 1), false);
+
+  // half of it
+  memset(hash, 0, sizeof(hash));
+  hash[26] = 0xFF;
+  hash[27] = 0x7F;
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 2), true);
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 3), false);
+
+  memset(hash, 0, sizeof(hash));
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 0xFFFFFFFFFFFFFFFFull), true);
+  memset(hash, 0xFF, sizeof(hash));
+  ASSERT_EQ(JobTemplate::isHashBelowTarget(hash, 1), false);
+}
@@ -19,6 +19,11 @@
 #include "gtest/gtest.h"
 #include "Utils.h"
 
+#ifndef _WIN32
+ #include <pthread.h>
+ #include <sched.h>
+#endif
+
 TEST(Utils, Strings_Format) {
   for (int i = 1; i < 1024; i++) {
     string s;
@@ -42,6 +47,38 @@ TEST(Utils, Strings_Append) {
   }
 }
 
+TEST(Utils, decodeHex32_decodeDec32) {
+  uint32_t v = 0u;
+  ASSERT_EQ(decodeHex32("504e86ed", 8, &v), 8u);
+  ASSERT_EQ(v, 0x504e86edu);
+  ASSERT_EQ(decodeHex32("DEADbeef", 8, &v), 8u);
+  ASSERT_EQ(v, 0xdeadbeefu);
+  ASSERT_EQ(decodeHex32("1f\"", 3, &v), 2u);
+  ASSERT_EQ(v, 0x1fu);
+  ASSERT_EQ(decodeHex32("", 0, &v), 0u);
+  ASSERT_EQ(v, 0u);
+
+  ASSERT_EQ(decodeDec32("1800", 4, &v), 4u);
+  ASSERT_EQ(v, 1800u);
+  ASSERT_EQ(decodeDec32("12a", 3, &v), 2u);
+  ASSERT_EQ(v, 12u);
+}
+
+TEST(Utils, findLineFeed) {
+  // cover the SIMD blocks and the scalar tail
+  for (size_t len = 0; len < 100; len++) {
+    for (size_t pos = 0; pos < len; pos++) {
+      string s(len, 'a');
+      s[pos] = '\n';
+      if (pos + 1 < len)
+        s[len - 1] = '\n';  // the first one should be found
+      ASSERT_EQ(findLineFeed(s.data(), s.size()), s.data() + pos);
+    }
+    string s(len, 'a');
+    ASSERT_EQ(findLineFeed(s.data(), s.size()), (const char *)NULL);
+  }
+}
+
 TEST(Utils, splitNotify) {
   string l1 = "{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"0\",\"c4c401368c24e20edc18932587dd724bd6a54a0a00e2b0a40000000000000000\",\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff19030083062f4254432e434f4d2f";
   string l2 = "\",\"ffffffff01ff58294d0000000017a914134468158139c8613c7677e7289443dc5b9426578700000000\",[\"e4998740e0cdbaf1e7962066261d169f43336c8844a5e1c966df22078eaf2bd7\",\"ecd413ea949531b5c7fb9cd2ffeadbacdb56ba91a66c8c30b2bfdfaf86618601\",\"83ab2807fcb97987376ba0e56f83982099b5e2c71a2b3235b6fab7ed33cf37ee\",\"90fa17b455f61fc3903b4960051388bd2cba12a45193957cff04fd32c62a1dc9\",\"ba1c74f0e4ec71327f9076fc5f8a1fa57f932b5e016a6ad8415b39f84fa13cf9\",\"82a103c8b201942d6e9ea771ee9200aec60be8ced29442b183089e5348499c96\",\"4792e27547c65fedb3b2ae83ae823df7d566c249d88df109639b88459806f939\",\"88184a3ad97590ede0af268f03b9b731005680c2715edc91f42fee9b73d54a09\",\"2681b734a05f5fcf472bc015899b52ed29fc96186a2650837a27ff02d8ce53ab\",\"33f33d7cb90cbaa99c7be7f2f9ad8f3f1e255210bac02eafa8566819bbaef95b\",\"96e6444b6b93ed0f18f46f1ca99d3a43caffb906176d22c0c56ffcfa8da6688b\"],\"20000000\",\"18050edc\",\"57be5b49\",false]}";
@@ -87,3 +124,202 @@ TEST(Utils, Strings_parseConfJson) {
     ASSERT_EQ(poolConfs[1].upPoolUserName_, "kevinus");
   }
 }
+
+TEST(Utils, Strings_parseConfJson_AgentConf) {
+  {
+    // default values
+    string listenIP, listenPort;
+    std::vector<PoolConf> poolConfs;
+    AgentConf conf;
+    string line = "{\"agent_listen_ip\": \"0.0.0.0\",\"agent_listen_port\": 3333,\"pools\": [[\"cn.ss.btc.com\", 1800, \"kevin\"]]}";
+    ASSERT_EQ(parseConfJson(line, listenIP, listenPort, poolConfs, conf), true);
+    ASSERT_EQ(conf.downFlushDelayMs_, 0);
+    ASSERT_EQ(conf.upShareBatchDelayMs_, 5);
+    ASSERT_EQ(conf.upShareBatchBytes_, 1400);
+    ASSERT_EQ(conf.poolProbeIntervalMs_, 0);
+    ASSERT_EQ(conf.upSessions_, 5);
+    ASSERT_EQ(conf.upSessionsAuto_, false);
+    ASSERT_EQ(conf.acceptRatePerSec_, 0);
+    ASSERT_EQ(conf.maxHandshakingSessions_, 0);
+    ASSERT_EQ(conf.registerRatePerSec_, 0);
+    ASSERT_EQ(conf.acceptOverflowReconnect_, false);
+    ASSERT_EQ(conf.upPipelinedHandshake_, false);
+    ASSERT_EQ(conf.upTcpFastOpen_, false);
+    ASSERT_EQ(conf.upHeartbeatIntervalMs_, 0);
+    ASSERT_EQ(conf.upDeadTimeoutMs_, 5000);
+    ASSERT_EQ(conf.shareValidation_, false);
+    ASSERT_EQ(conf.jobHistoryDepth_, 16);
+    ASSERT_EQ(conf.upSharesBatch_, false);
+  }
+
+  {
+    string listenIP, listenPort;
+    std::vector<PoolConf> poolConfs;
+    AgentConf conf;
+    string line = "{\"agent_listen_ip\": \"0.0.0.0\",\"agent_listen_port\": 3333,\"pools\": [[\"cn.ss.btc.com\", 1800, \"kevin\"]],"
+                  "\"down_flush_delay_ms\": 5, \"up_share_batch_delay_ms\": 10, \"up_share_batch_bytes\": 500,"
+                  "\"pool_probe_interval_ms\": 30000, \"up_sessions\": 2, \"up_sessions_auto\": true,"
+                  "\"up_sessions_max\": 20, \"up_session_max_miners\": 300,"
+                  "\"up_session_max_bytes_per_sec\": 65536, \"accept_rate_per_sec\": 100,"
+                  "\"max_handshaking_sessions\": 50, \"accept_overflow_reconnect\": true,"
+                  "\"reconnect_max_wait_sec\": 30, \"register_rate_per_sec\": 200,"
+                  "\"up_pipelined_handshake\": true, \"up_tcp_fastopen\": true,"
+                  "\"up_heartbeat_interval_ms\": 500, \"up_dead_timeout_ms\": 3000,"
+                  "\"share_validation\": true, \"job_history_depth\": 64,"
+                  "\"up_shares_batch\": true}";
+    ASSERT_EQ(parseConfJson(line, listenIP, listenPort, poolConfs, conf), true);
+    ASSERT_EQ(poolConfs.size(), 1u);
+    ASSERT_EQ(conf.downFlushDelayMs_, 5);
+    ASSERT_EQ(conf.upShareBatchDelayMs_, 10);
+    ASSERT_EQ(conf.upShareBatchBytes_, 500);
+    ASSERT_EQ(conf.poolProbeIntervalMs_, 30000);
+    ASSERT_EQ(conf.upSessions_, 2);
+    ASSERT_EQ(conf.upSessionsAuto_, true);
+    ASSERT_EQ(conf.upSessionsMax_, 20);
+    ASSERT_EQ(conf.upSessionMaxMiners_, 300);
+    ASSERT_EQ(conf.upSessionMaxBytesPerSec_, 65536);
+    ASSERT_EQ(conf.acceptRatePerSec_, 100);
+    ASSERT_EQ(conf.maxHandshakingSessions_, 50);
+    ASSERT_EQ(conf.acceptOverflowReconnect_, true);
+    ASSERT_EQ(conf.reconnectMaxWaitSec_, 30);
+    ASSERT_EQ(conf.registerRatePerSec_, 200);
+    ASSERT_EQ(conf.upPipelinedHandshake_, true);
+    ASSERT_EQ(conf.upTcpFastOpen_, true);
+    ASSERT_EQ(conf.upHeartbeatIntervalMs_, 500);
+    ASSERT_EQ(conf.upDeadTimeoutMs_, 3000);
+    ASSERT_EQ(conf.shareValidation_, true);
+    ASSERT_EQ(conf.jobHistoryDepth_, 64);
+    ASSERT_EQ(conf.upSharesBatch_, true);
+  }
+}
+
+TEST(Utils, Histogram) {
+  Histogram h;
+  ASSERT_EQ(h.count(), 0u);
+  ASSERT_EQ(h.percentile(0.5), 0u);
+
+  for (uint64_t i = 1; i <= 100; i++) {
+    h.add(i);
+  }
+  ASSERT_EQ(h.count(), 100u);
+  ASSERT_EQ(h.max(), 100u);
+  ASSERT_EQ(h.mean(), 50.5);
+  ASSERT_EQ(h.percentile(0.5), 63u);   // in [32, 63]
+  ASSERT_EQ(h.percentile(0.99), 100u); // capped by max
+  ASSERT_EQ(h.percentile(0.01), 1u);
+
+  h.add(0);
+  ASSERT_EQ(h.percentile(0.0), 0u);
+
+  h.reset();
+  ASSERT_EQ(h.count(), 0u);
+  ASSERT_EQ(h.max(), 0u);
+}
+
+TEST(Utils, RttEstimator) {
+  RttEstimator rtt;
+  ASSERT_EQ(rtt.isHealthy(), false);
+
+  rtt.addSample(8000);
+  ASSERT_EQ(rtt.getSrtt(), 8000);
+  ASSERT_EQ(rtt.getJitter(), 4000);
+  ASSERT_EQ(rtt.isHealthy(), false);
+
+  rtt.addSample(16000);
+  ASSERT_EQ(rtt.getSrtt(), 9000);     // 7/8 * 8000 + 1/8 * 16000
+  ASSERT_EQ(rtt.getJitter(), 5000);   // 3/4 * 4000 + 1/4 * 8000
+  ASSERT_EQ(rtt.getScore(), 29000);
+  ASSERT_EQ(rtt.isHealthy(), true);
+
+  // unhealthy at once, healthy again after 2 probes
+  rtt.addFailure();
+  ASSERT_EQ(rtt.isHealthy(), false);
+  ASSERT_EQ(rtt.getFailures(), 1u);
+  rtt.addSample(9000);
+  ASSERT_EQ(rtt.isHealthy(), false);
+  ASSERT_EQ(rtt.getFailures(), 0u);
+  rtt.addSample(9000);
+  ASSERT_EQ(rtt.isHealthy(), true);
+}
+
+TEST(Utils, TokenBucket) {
+  // no limit
+  TokenBucket unlimited;
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(unlimited.consume(0), true);
+  }
+  ASSERT_EQ(unlimited.getWaitUs(0), 0);
+
+  TokenBucket b;
+  b.setRate(10, 2);  // one per 100 ms, burst 2
+  const int64_t t = 1000000;
+  ASSERT_EQ(b.consume(t), true);
+  ASSERT_EQ(b.consume(t), true);
+  ASSERT_EQ(b.consume(t), false);
+  ASSERT_EQ(b.getWaitUs(t), 100000);
+  ASSERT_EQ(b.getWaitUs(t + 40000), 60000);
+  ASSERT_EQ(b.consume(t + 100000), true);
+  ASSERT_EQ(b.consume(t + 100000), false);
+
+  // saved up to the burst only
+  ASSERT_EQ(b.consume(t + 10000000), true);
+  ASSERT_EQ(b.consume(t + 10000000), true);
+  ASSERT_EQ(b.consume(t + 10000000), false);
+}
+
+TEST(Utils, SpscQueue) {
+  SpscQueue<int32_t, 4> q;
+  int32_t v = 0;
+  ASSERT_EQ(q.pop(&v), false);
+
+  for (int32_t i = 0; i < 4; i++) {
+    ASSERT_EQ(q.push(i), true);
+  }
+  ASSERT_EQ(q.push(4), false);  // full
+
+  for (int32_t i = 0; i < 4; i++) {
+    ASSERT_EQ(q.pop(&v), true);
+    ASSERT_EQ(v, i);
+  }
+  ASSERT_EQ(q.pop(&v), false);
+
+  // wrap around
+  for (int32_t i = 0; i < 10; i++) {
+    ASSERT_EQ(q.push(i), true);
+    ASSERT_EQ(q.pop(&v), true);
+    ASSERT_EQ(v, i);
+  }
+}
+
+#ifndef _WIN32
+static const uint32_t kSpscItems = 200000;
+
+static void *spscProducer(void *ptr) {
+  SpscQueue<uint32_t, 64> *q = static_cast<SpscQueue<uint32_t, 64> *>(ptr);
+  for (uint32_t i = 0; i < kSpscItems; i++) {
+    while (!q->push(i)) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+TEST(Utils, SpscQueue_threads) {
+  SpscQueue<uint32_t, 64> q;
+  pthread_t producer;
+  pthread_create(&producer, NULL, spscProducer, &q);
+
+  // in order, nothing lost
+  uint32_t expected = 0, v;
+  while (expected < kSpscItems) {
+    if (!q.pop(&v)) {
+      sched_yield();
+      continue;
+    }
+    ASSERT_EQ(v, expected);
+    expected++;
+  }
+  pthread_join(producer, NULL);
+  ASSERT_EQ(q.pop(&v), false);
+}
+#endif